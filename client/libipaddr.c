@@ -49,6 +49,8 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  *
  *  - set the local host name (using env var MN_LOCALHOST).  not required.
  *  - emulate a private dns (using env var HOSTS).    not required.
+ *  - slow down the clock by the emulator's time dilation factor
+ *    (using env var MN_TDF, see below).   not required.
  *
  * We need to allow some traffic to external network services, like yp,
  * dns, etc., or Java, chord, ps, ls -l, and other programs will not work.
@@ -102,12 +104,16 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #include <ctype.h>
 #include <sys/time.h>
 #include <sys/types.h>
+#include <sys/select.h>
+#include <time.h>
+#include <poll.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <netdb.h>
 #include <unistd.h>
 #include <assert.h>
+#include <limits.h>
 #ifdef linux
 #include <linux/limits.h>
 #define RET_TYPE ssize_t
@@ -175,6 +181,30 @@ static void (*f_freeaddrinfo)(struct addrinfo *);
 
 /* misc */
 
+/* time */
+
+#if defined(__GLIBC__) && __GLIBC_PREREQ(2,31)
+#define TZ_ARG_TYPE void *
+#else
+#define TZ_ARG_TYPE struct timezone *
+#endif
+
+static int (*f_gettimeofday)(struct timeval *, TZ_ARG_TYPE);
+static int (*f_clock_gettime)(clockid_t, struct timespec *);
+static time_t (*f_time)(time_t *);
+static int (*f_nanosleep)(const struct timespec *, struct timespec *);
+static int (*f_usleep)(useconds_t);
+static unsigned int (*f_sleep)(unsigned int);
+static int (*f_poll)(struct pollfd *, nfds_t, int);
+static int (*f_select)(int, fd_set *, fd_set *, fd_set *, struct timeval *);
+
+/* the time calls can come before init(), from another library's
+ * constructor, so they look up what they wrap on first use */
+#define F_LAZY(sym) do {						\
+    if (f_##sym == NULL)						\
+	f_##sym = dlsym(RTLD_NEXT, #sym);				\
+    } while (0)
+
 
 /*
  * Other candidates:
@@ -191,6 +221,19 @@ static int mn_debug;
 static int mn_keep_dstip;
 static char localvname[256];
 
+/*
+ * Time dilation.  When the emulator runs with a time dilation factor
+ * (/proc/sys/modelnet/tdf), MN_TDF must be set to the same value on the
+ * edge hosts.  Clocks read through libc then advance tdf times slower
+ * than real time from the moment the library was loaded, and sleeps and
+ * poll/select timeouts last tdf times longer, so the application sees
+ * the undilated network.  Timers inside the kernel (TCP retransmission,
+ * delayed acks) are not dilated.
+ */
+static long long mn_tdf = 1;
+static long long tdf_base_real;	/* CLOCK_REALTIME at load, ns */
+static long long tdf_base_mono;	/* CLOCK_MONOTONIC at load, ns */
+
 /* NOTE: the use of fd_set limits the number of sockets to FD_SETSIZE-1 */
 fd_set mn_unbound_sockets;	/* not yet bound */
 fd_set mn_modelnet_sockets;	/* bound to 10.x.x.x */
@@ -301,6 +344,15 @@ init(void)
 
     GET_SYM(gethostname);
 
+    GET_SYM(gettimeofday);
+    GET_SYM(clock_gettime);
+    GET_SYM(time);
+    GET_SYM(nanosleep);
+    GET_SYM(usleep);
+    GET_SYM(sleep);
+    GET_SYM(poll);
+    GET_SYM(select);
+
 #undef GET_SYM
 
     /* get the modelnet environment variables */
@@ -314,6 +366,16 @@ init(void)
 	}
     mn_keep_dstip = getenv("KEEP_DSTIP")?1:0;
 
+    s = getenv("MN_TDF");
+    if (s && atoi(s) > 1 && f_clock_gettime) {
+	struct timespec ts;
+	mn_tdf = atoi(s);
+	f_clock_gettime(CLOCK_REALTIME, &ts);
+	tdf_base_real = ts.tv_sec * 1000000000LL + ts.tv_nsec;
+	f_clock_gettime(CLOCK_MONOTONIC, &ts);
+	tdf_base_mono = ts.tv_sec * 1000000000LL + ts.tv_nsec;
+	}
+
     init_hostname_cache();
 
     if (!mn_localhost && mn_localip && hostsfile) {
@@ -330,6 +392,8 @@ init(void)
 	    fprintf(stderr, "mn: using local host: %s\n", mn_localhost);
 	if (hostsfile)
 	    fprintf(stderr, "mn: using mdb: %s\n", hostsfile);
+	if (mn_tdf > 1)
+	    fprintf(stderr, "mn: time dilation factor %lld\n", mn_tdf);
 	if (mn_keep_dstip)
 	    fprintf(stderr, "mn: keep dst IP as set by app. Do not force to forwarder\n");
 	else
@@ -1031,3 +1095,154 @@ int gethostname(char *name, int namelen)
 /* int getaddrinfo(const char *node, const char *service,
 		const struct addrinfo *hints, struct addrinfo **res); */
 
+
+/* time dilation */
+
+/* map a real time (ns) to the dilated time seen by the application */
+static long long dilate_ns(long long base, long long real)
+{
+    return base + (real - base) / mn_tdf;
+}
+
+int clock_gettime(clockid_t clk, struct timespec *tp)
+{
+    long long ns;
+    int ret;
+
+    F_LAZY(clock_gettime);
+    ret = f_clock_gettime(clk, tp);
+
+    if (ret || mn_tdf <= 1)
+	return ret;
+
+    ns = tp->tv_sec * 1000000000LL + tp->tv_nsec;
+    switch (clk) {
+    case CLOCK_REALTIME:
+	ns = dilate_ns(tdf_base_real, ns);
+	break;
+    case CLOCK_MONOTONIC:
+#ifdef CLOCK_MONOTONIC_RAW
+    case CLOCK_MONOTONIC_RAW:
+#endif
+	ns = dilate_ns(tdf_base_mono, ns);
+	break;
+    default:		/* cpu time clocks are left alone */
+	return ret;
+    }
+    tp->tv_sec = ns / 1000000000LL;
+    tp->tv_nsec = ns % 1000000000LL;
+    return ret;
+}
+
+int gettimeofday(struct timeval *tv, TZ_ARG_TYPE tz)
+{
+    /* glibc declares tv nonnull, which would let the check go */
+    struct timeval *volatile tvp = tv;
+    struct timespec ts;
+
+    F_LAZY(gettimeofday);
+    if (mn_tdf <= 1 || !tvp)
+	return f_gettimeofday(tv, tz);
+
+    if (tz)
+	f_gettimeofday(NULL, tz);
+    clock_gettime(CLOCK_REALTIME, &ts);
+    tv->tv_sec = ts.tv_sec;
+    tv->tv_usec = ts.tv_nsec / 1000;
+    return 0;
+}
+
+time_t time(time_t *t)
+{
+    struct timespec ts;
+
+    F_LAZY(time);
+    if (mn_tdf <= 1)
+	return f_time(t);
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    if (t)
+	*t = ts.tv_sec;
+    return ts.tv_sec;
+}
+
+int nanosleep(const struct timespec *req, struct timespec *rem)
+{
+    struct timespec real, left;
+    long long ns;
+    int ret;
+
+    F_LAZY(nanosleep);
+    if (mn_tdf <= 1 || !req)
+	return f_nanosleep(req, rem);
+
+    ns = (req->tv_sec * 1000000000LL + req->tv_nsec) * mn_tdf;
+    real.tv_sec = ns / 1000000000LL;
+    real.tv_nsec = ns % 1000000000LL;
+    ret = f_nanosleep(&real, &left);
+    if (ret && rem) {
+	ns = (left.tv_sec * 1000000000LL + left.tv_nsec) / mn_tdf;
+	rem->tv_sec = ns / 1000000000LL;
+	rem->tv_nsec = ns % 1000000000LL;
+    }
+    return ret;
+}
+
+int usleep(useconds_t usec)
+{
+    struct timespec req;
+
+    F_LAZY(usleep);
+    if (mn_tdf <= 1)
+	return f_usleep(usec);
+
+    req.tv_sec = usec / 1000000;
+    req.tv_nsec = (usec % 1000000) * 1000;
+    return nanosleep(&req, NULL);
+}
+
+unsigned int sleep(unsigned int seconds)
+{
+    struct timespec req, rem;
+
+    F_LAZY(sleep);
+    if (mn_tdf <= 1)
+	return f_sleep(seconds);
+
+    req.tv_sec = seconds;
+    req.tv_nsec = 0;
+    if (nanosleep(&req, &rem))
+	return rem.tv_sec + (rem.tv_nsec ? 1 : 0);
+    return 0;
+}
+
+int poll(struct pollfd *fds, nfds_t nfds, int timeout)
+{
+    F_LAZY(poll);
+    if (mn_tdf > 1 && timeout > 0)
+	timeout = timeout > INT_MAX / mn_tdf ? INT_MAX : timeout * mn_tdf;
+    return f_poll(fds, nfds, timeout);
+}
+
+int select(int nfds, fd_set *readfds, fd_set *writefds,
+	   fd_set *exceptfds, struct timeval *timeout)
+{
+    struct timeval real;
+    long long us;
+    int ret;
+
+    F_LAZY(select);
+    if (mn_tdf <= 1 || !timeout)
+	return f_select(nfds, readfds, writefds, exceptfds, timeout);
+
+    us = (timeout->tv_sec * 1000000LL + timeout->tv_usec) * mn_tdf;
+    real.tv_sec = us / 1000000;
+    real.tv_usec = us % 1000000;
+    ret = f_select(nfds, readfds, writefds, exceptfds, &real);
+
+    /* linux reports the time left, keep doing that in dilated time */
+    us = (real.tv_sec * 1000000LL + real.tv_usec) / mn_tdf;
+    timeout->tv_sec = us / 1000000;
+    timeout->tv_usec = us % 1000000;
+    return ret;
+}
@@ -0,0 +1,546 @@
+/*
+ * modelnet  mnbench.c
+ *
+ *     microbenchmark of the emulation core (libmnemu)
+ *
+ * Copyright (c) 2006
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in
+ *      the documentation and/or other materials provided with the
+ *      distribution.
+ *    * Neither the names of Duke University nor The University of
+ *      California, San Diego, nor the names of the authors or contributors
+ *      may be used to endorse or promote products derived from
+ *      this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE
+ * USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+
+/*
+ * Usage: mnbench [-j] [-c] [-S] [-t threads] [-H hops] [-l pathlen]
+ *                [-q qsize] [-p plr] [-N nodes] [-r rate] [-T ticks]
+ *                [-b bits/s] [-d delay_ms] [-s size] [-z hz]
+ *
+ * Drives the emulation core with synthetic packets, with no kernel and
+ * no network, to measure what a packet costs per hop.  -t, -H, -l, -q
+ * and -p take comma separated lists and every combination is run; one
+ * CSV line (or JSON object with -j) is written per run.
+ *
+ * Each thread injects rate packets per calendar tick between random
+ * pairs of nodes, looked up with mn_model_lookup(), and drains its own
+ * calendar tick by tick with mn_hop_admit() and mn_hop_enqueue() like
+ * the module's hopclock.  Time is virtual: a run is ticks ticks, done
+ * as fast as the cpu allows.  By default the hops are split evenly
+ * among the threads, each with a model of its own over the same nodes,
+ * so threads share nothing.  With -S all threads share one model and
+ * contend for the hop locks, as in the module; each thread still has
+ * its own clock, so queueing is only roughly right then, and a thread
+ * running ahead makes queues look full to the others.
+ *
+ * Reported per run: packets injected per second of wall time (pps),
+ * ns, cycles and cache misses per hop crossed, the last two from
+ * perf_event_open() (empty when perf events are not permitted, see
+ * /proc/sys/kernel/perf_event_paranoid), and, measured apart, ns per
+ * route lookup and per calendar insert and drain.
+ */
+
+#define _GNU_SOURCE             /* cpu affinity */
+#include "mn_core.h"
+
+#include <unistd.h>
+#include <time.h>
+#include <sched.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#define MAXLIST         32
+#define POOL            (1 << 16)       /* packets per thread */
+#define LOOKUPS         (1 << 20)
+#define CAL_OPS         (1 << 20)
+#define CAL_SPREAD      1024            /* ticks ahead calendar ops go */
+
+struct desc {
+    struct list_head list;
+    struct hop    **path;
+    unsigned int    len;
+};
+
+struct worker {
+    pthread_t       tid;
+    int             idx;
+    struct mn_calendar cal;
+    struct desc    *pool;
+    struct list_head free;
+    struct mn_model *model;
+    u_int64_t       rng;
+
+    /* results */
+    u_int64_t       pkts;       /* injected */
+    u_int64_t       delivered;  /* made it through their path */
+    u_int64_t       drops;
+    u_int64_t       stalls;     /* injections skipped, pool empty */
+    u_int64_t       hops;       /* hops crossed */
+    u_int64_t       ns;
+    u_int64_t       cycles, misses;
+    int             perf;       /* cycles and misses are valid */
+};
+
+static int      opt_json, opt_pin, opt_shared, opt_nodes = 64, opt_rate = 32;
+static int      opt_ticks = 10000, opt_delay = 1, opt_size = 1000;
+static u_int64_t opt_bps = 1000000000ULL;
+
+static struct mn_model *models;
+static struct hop **volatile lookup_sink;
+static pthread_barrier_t start_line;
+static int      rows;
+
+static void
+usage(const char *prog)
+{
+    fprintf(stderr, "usage: %s [-j] [-c] [-S] [-t threads] [-H hops] "
+	    "[-l pathlen] [-q qsize] [-p plr]\n"
+	    "\t[-N nodes] [-r rate] [-T ticks] [-b bits/s] [-d delay_ms] "
+	    "[-s size] [-z hz]\n"
+	    "-t, -H, -l, -q and -p take comma separated lists\n", prog);
+    exit(1);
+}
+
+static int
+parse_list(const char *arg, double *vals)
+{
+    char           *end;
+    int             n = 0;
+
+    do {
+	if (n == MAXLIST)
+	    return -1;
+	vals[n++] = strtod(arg, &end);
+	if (end == arg)
+	    return -1;
+	arg = end + 1;
+    } while (*end == ',');
+    return *end ? -1 : n;
+}
+
+static inline u_int64_t
+rnd(u_int64_t *state)
+{
+    return mn_mix64(*state += 0x9e3779b97f4a7c15ULL);
+}
+
+static u_int64_t
+ns_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static in_addr_t
+node_addr(int node)
+{
+    return htonl(0x0a000000 | (node + 1));
+}
+
+/*
+ * A model of hops hops and opt_nodes nodes, with a path of pathlen
+ * random hops between every two nodes.
+ */
+static int
+build_model(struct mn_model *model, int hops, int pathlen, int qsize,
+	    double plr, u_int64_t rng)
+{
+    struct sysctl_hop *sh;
+    int            *path;
+    int             i, s, d, err;
+
+    sh = calloc(hops, sizeof(*sh));
+    path = calloc(pathlen, sizeof(*path));
+    if (!sh || !path)
+	return -ENOMEM;
+    for (i = 0; i < hops; ++i) {
+	sh[i].bandwidth = opt_bps;
+	sh[i].delay = opt_delay;
+	sh[i].plr = (int)(plr * 0x7fffffff);
+	sh[i].qsize = qsize;
+    }
+    err = mn_model_set_hops(model, sh, hops, 42);
+    if (!err)
+	err = mn_model_set_nodecount(model, opt_nodes);
+    for (i = 0; i <= NODEMASK; ++i)
+	model->nodetable[i] = -1;
+    for (s = 0; s < opt_nodes; ++s)
+	model->nodetable[ntohl(node_addr(s)) & NODEMASK] = s;
+    for (s = 0; !err && s < opt_nodes; ++s)
+	for (d = 0; !err && d < opt_nodes; ++d) {
+	    if (s == d)
+		continue;
+	    for (i = 0; i < pathlen; ++i)
+		path[i] = rnd(&rng) % hops;
+	    err = mn_model_set_path(model, s, d, path, pathlen);
+	}
+    free(sh);
+    free(path);
+    return err;
+}
+
+/* take the packet across its next hop, or retire it */
+static inline void
+step(struct worker *w, struct desc *d, unsigned long tick)
+{
+    struct hop     *hop = *d->path;
+    unsigned long   exit;
+
+    if (!hop) {
+	w->delivered++;
+	list_add(&d->list, &w->free);
+	return;
+    }
+    mn_lock(&hop->lock);
+    if (mn_hop_admit(hop, tick)) {
+	mn_unlock(&hop->lock);
+	w->drops++;
+	list_add(&d->list, &w->free);
+	return;
+    }
+    exit = mn_hop_enqueue(hop, d->len, tick) + hop->delay;
+    mn_unlock(&hop->lock);
+    w->hops++;
+    d->path++;
+    mn_calendar_insert(&w->cal, &d->list, exit);
+}
+
+static int
+perf_open(u_int64_t config, int group)
+{
+    struct perf_event_attr attr;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = config;
+    attr.disabled = group == -1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    attr.read_format = PERF_FORMAT_GROUP;
+    return syscall(__NR_perf_event_open, &attr, 0, -1, group, 0);
+}
+
+static void *
+run_worker(void *arg)
+{
+    struct worker  *w = arg;
+    struct desc    *d;
+    struct list_head *slot;
+    unsigned long   tick;
+    u_int64_t       start, src, dst;
+    struct { u_int64_t nr, val[2]; } counts;
+    int             i, cyc, miss = -1;
+
+    if (opt_pin) {
+	cpu_set_t set;
+
+	CPU_ZERO(&set);
+	CPU_SET(w->idx, &set);
+	pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    }
+    cyc = perf_open(PERF_COUNT_HW_CPU_CYCLES, -1);
+    if (cyc >= 0)
+	miss = perf_open(PERF_COUNT_HW_CACHE_MISSES, cyc);
+
+    pthread_barrier_wait(&start_line);
+    if (miss >= 0)
+	ioctl(cyc, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+    start = ns_now();
+
+    for (tick = 0; tick < opt_ticks; ++tick) {
+	for (i = 0; i < opt_rate; ++i) {
+	    if (list_empty(&w->free)) {
+		w->stalls++;
+		break;
+	    }
+	    d = list_first_entry(&w->free, struct desc, list);
+	    list_del(&d->list);
+	    src = rnd(&w->rng) % opt_nodes;
+	    dst = rnd(&w->rng) % (opt_nodes - 1);
+	    if (dst >= src)
+		dst++;
+	    d->path = mn_model_lookup(w->model, node_addr(src),
+				      node_addr(dst));
+	    d->len = opt_size;
+	    w->pkts++;
+	    step(w, d, tick);
+	}
+	/* as mn_drain: a packet due again this tick is taken right away */
+	slot = mn_calendar_slot(&w->cal, tick);
+	while (!list_empty(slot)) {
+	    d = list_first_entry(slot, struct desc, list);
+	    list_del(&d->list);
+	    step(w, d, tick);
+	}
+    }
+
+    w->ns = ns_now() - start;
+    if (miss >= 0) {
+	ioctl(cyc, PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+	if (read(cyc, &counts, sizeof(counts)) == sizeof(counts) &&
+	    counts.nr == 2) {
+	    w->cycles = counts.val[0];
+	    w->misses = counts.val[1];
+	    w->perf = 1;
+	}
+    }
+    if (miss >= 0)
+	close(miss);
+    if (cyc >= 0)
+	close(cyc);
+    return NULL;
+}
+
+/* ns per route lookup, one thread */
+static double
+time_lookup(void)
+{
+    u_int64_t       rng = 7, start, src, dst;
+    int             i;
+
+    start = ns_now();
+    for (i = 0; i < LOOKUPS; ++i) {
+	src = rnd(&rng) % opt_nodes;
+	dst = (src + 1 + rnd(&rng) % (opt_nodes - 1)) % opt_nodes;
+	lookup_sink = mn_model_lookup(models, node_addr(src), node_addr(dst));
+    }
+    start = ns_now() - start;
+    return (double)start / LOOKUPS;
+}
+
+/* ns per calendar insert and drain, one thread */
+static double
+time_calendar(void)
+{
+    struct mn_calendar cal;
+    struct desc    *pool;
+    struct list_head *slot;
+    u_int64_t       rng = 11, start;
+    unsigned long   tick;
+    int             i;
+
+    pool = calloc(CAL_OPS, sizeof(*pool));
+    if (!pool || mn_calendar_init(&cal, 0)) {
+	free(pool);
+	return -1;
+    }
+    start = ns_now();
+    for (i = 0; i < CAL_OPS; ++i)
+	mn_calendar_insert(&cal, &pool[i].list, rnd(&rng) % CAL_SPREAD);
+    for (tick = 0; tick < CAL_SPREAD; ++tick) {
+	slot = mn_calendar_slot(&cal, tick);
+	while (!list_empty(slot))
+	    list_del(slot->next);
+    }
+    start = ns_now() - start;
+    mn_calendar_uninit(&cal);
+    free(pool);
+    return (double)start / CAL_OPS;
+}
+
+static int
+run(int threads, int hops, int pathlen, int qsize, double plr)
+{
+    struct worker  *w;
+    u_int64_t       pkts = 0, delivered = 0, drops = 0, stalls = 0;
+    u_int64_t       hopped = 0, ns = 0, cycles = 0, misses = 0;
+    double          secs, lookup_ns, cal_ns;
+    int             i, j, perf = 1, err = 0;
+    int             nmodels = opt_shared ? 1 : threads;
+
+    if (hops < nmodels) {
+	fprintf(stderr, "mnbench: fewer hops than threads\n");
+	return -EINVAL;
+    }
+    for (i = 0; !err && i < nmodels; ++i)
+	err = build_model(models + i, hops / nmodels, pathlen, qsize, plr,
+			  i + 1);
+    if (err) {
+	fprintf(stderr, "mnbench: cannot build the model: %s\n",
+		strerror(-err));
+	return err;
+    }
+    lookup_ns = time_lookup();
+    cal_ns = time_calendar();
+
+    w = calloc(threads, sizeof(*w));
+    if (!w)
+	return -ENOMEM;
+    pthread_barrier_init(&start_line, NULL, threads);
+    for (i = 0; i < threads; ++i) {
+	w[i].idx = i;
+	w[i].model = models + (opt_shared ? 0 : i);
+	w[i].rng = 1000 + i;
+	w[i].pool = calloc(POOL, sizeof(*w[i].pool));
+	if (!w[i].pool || mn_calendar_init(&w[i].cal, 0))
+	    return -ENOMEM;
+	INIT_LIST_HEAD(&w[i].free);
+	for (j = 0; j < POOL; ++j)
+	    list_add_tail(&w[i].pool[j].list, &w[i].free);
+    }
+    for (i = 0; i < threads; ++i)
+	pthread_create(&w[i].tid, NULL, run_worker, w + i);
+    for (i = 0; i < threads; ++i) {
+	pthread_join(w[i].tid, NULL);
+	pkts += w[i].pkts;
+	delivered += w[i].delivered;
+	drops += w[i].drops;
+	stalls += w[i].stalls;
+	hopped += w[i].hops;
+	ns = max(ns, w[i].ns);
+	cycles += w[i].cycles;
+	misses += w[i].misses;
+	perf &= w[i].perf;
+	mn_calendar_uninit(&w[i].cal);
+	free(w[i].pool);
+    }
+    pthread_barrier_destroy(&start_line);
+    free(w);
+    for (i = 0; i < nmodels; ++i)
+	mn_model_free_hops(models + i);
+
+    secs = ns / 1e9;
+    if (!hopped)
+	hopped = 1;
+    if (opt_json) {
+	printf("%s  {\"threads\": %d, \"hops\": %d, \"pathlen\": %d, "
+	       "\"qsize\": %d, \"plr\": %g, \"pkts\": %llu, "
+	       "\"delivered\": %llu, \"drops\": %llu, \"stalls\": %llu, "
+	       "\"hops_crossed\": %llu, \"secs\": %.6f, \"pps\": %.0f, "
+	       "\"ns_per_hop\": %.2f, ",
+	       rows ? ",\n" : "[\n", threads, hops, pathlen, qsize, plr,
+	       (unsigned long long)pkts, (unsigned long long)delivered,
+	       (unsigned long long)drops, (unsigned long long)stalls,
+	       (unsigned long long)hopped, secs, pkts / secs,
+	       (double)ns * threads / hopped);
+	if (perf)
+	    printf("\"cycles_per_hop\": %.2f, \"misses_per_hop\": %.4f, ",
+		   (double)cycles / hopped, (double)misses / hopped);
+	else
+	    printf("\"cycles_per_hop\": null, \"misses_per_hop\": null, ");
+	printf("\"lookup_ns\": %.2f, \"calendar_ns\": %.2f}",
+	       lookup_ns, cal_ns);
+    } else {
+	if (!rows)
+	    printf("threads,hops,pathlen,qsize,plr,pkts,delivered,drops,"
+		   "stalls,hops_crossed,secs,pps,ns_per_hop,cycles_per_hop,"
+		   "misses_per_hop,lookup_ns,calendar_ns\n");
+	printf("%d,%d,%d,%d,%g,%llu,%llu,%llu,%llu,%llu,%.6f,%.0f,%.2f,",
+	       threads, hops, pathlen, qsize, plr,
+	       (unsigned long long)pkts, (unsigned long long)delivered,
+	       (unsigned long long)drops, (unsigned long long)stalls,
+	       (unsigned long long)hopped, secs, pkts / secs,
+	       (double)ns * threads / hopped);
+	if (perf)
+	    printf("%.2f,%.4f,", (double)cycles / hopped,
+		   (double)misses / hopped);
+	else
+	    printf(",,");
+	printf("%.2f,%.2f\n", lookup_ns, cal_ns);
+    }
+    fflush(stdout);
+    rows++;
+    return 0;
+}
+
+int
+main(int argc, char **argv)
+{
+    double          threads[MAXLIST] = { 1 }, hops[MAXLIST] = { 1000 };
+    double          pathlen[MAXLIST] = { 4 }, qsize[MAXLIST] = { 64 };
+    double          plr[MAXLIST] = { 0 };
+    int             nt = 1, nh = 1, nl = 1, nq = 1, np = 1;
+    int             a, b, c, d, e, maxthreads = 1;
+
+    while ((c = getopt(argc, argv, "jcSt:H:l:q:p:N:r:T:b:d:s:z:")) != -1) {
+	switch (c) {
+	case 'j': opt_json = 1; break;
+	case 'c': opt_pin = 1; break;
+	case 'S': opt_shared = 1; break;
+	case 't': nt = parse_list(optarg, threads); break;
+	case 'H': nh = parse_list(optarg, hops); break;
+	case 'l': nl = parse_list(optarg, pathlen); break;
+	case 'q': nq = parse_list(optarg, qsize); break;
+	case 'p': np = parse_list(optarg, plr); break;
+	case 'N': opt_nodes = atoi(optarg); break;
+	case 'r': opt_rate = atoi(optarg); break;
+	case 'T': opt_ticks = atoi(optarg); break;
+	case 'b': opt_bps = strtoull(optarg, NULL, 0); break;
+	case 'd': opt_delay = atoi(optarg); break;
+	case 's': opt_size = atoi(optarg); break;
+	case 'z': mn_hz = atoi(optarg); break;
+	default: usage(argv[0]);
+	}
+    }
+    if (optind != argc || nt <= 0 || nh <= 0 || nl <= 0 || nq <= 0 ||
+	np <= 0 || opt_nodes < 2 || opt_nodes > NODEMASK || opt_rate <= 0 ||
+	opt_ticks <= 0 || opt_size <= 0 || opt_delay < 0)
+	usage(argv[0]);
+    for (a = 0; a < nt; ++a)
+	if (threads[a] < 1)
+	    usage(argv[0]);
+	else if (threads[a] > maxthreads)
+	    maxthreads = threads[a];
+    for (a = 0; a < nh; ++a)
+	if (hops[a] < 1)
+	    usage(argv[0]);
+    for (a = 0; a < nl; ++a)
+	if (pathlen[a] < 1)
+	    usage(argv[0]);
+    for (a = 0; a < nq; ++a)
+	if (qsize[a] < 1)
+	    usage(argv[0]);
+    for (a = 0; a < np; ++a)
+	if (plr[a] < 0 || plr[a] > 1)
+	    usage(argv[0]);
+    if (mn_core_init())
+	return 1;
+    /* one model per thread, or one for all with -S */
+    models = calloc(maxthreads, sizeof(*models));
+    if (!models)
+	return 1;
+    for (a = 0; a < maxthreads; ++a)
+	if (mn_model_init(models + a))
+	    return 1;
+
+    for (a = 0; a < nt; ++a)
+	for (b = 0; b < nh; ++b)
+	    for (c = 0; c < nl; ++c)
+		for (d = 0; d < nq; ++d)
+		    for (e = 0; e < np; ++e)
+			if (run(threads[a], hops[b], pathlen[c], qsize[d],
+				plr[e]))
+			    return 1;
+    if (opt_json)
+	printf("%s]\n", rows ? "\n" : "[");
+    for (a = 0; a < maxthreads; ++a)
+	mn_model_uninit(models + a);
+    free(models);
+    return 0;
+}
@@ -0,0 +1,352 @@
+/*
+ * modelnet  mntest.c
+ *
+ *     unit tests of the emulation core (libmnemu), run by make check
+ *
+ * Copyright (c) 2006
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in
+ *      the documentation and/or other materials provided with the
+ *      distribution.
+ *    * Neither the names of Duke University nor The University of
+ *      California, San Diego, nor the names of the authors or contributors
+ *      may be used to endorse or promote products derived from
+ *      this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE
+ * USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+
+/*
+ * Usage: mntest
+ *
+ * Checks what the rest of the emulator takes for granted of the core:
+ * that a hop paces packets at exactly its bit rate, carrying the
+ * sub-tick remainder from packet to packet; that mn_hop_admit() drops
+ * at the queue size, counting the slots background traffic holds
+ * while it is on; that the calendar keeps its order when the tick
+ * wraps; and that a seed fixes every random draw and drop, which
+ * deterministic mode (see ../module/mn_replay.c) relies on.  Time is
+ * virtual, mn_hz is 1000.  Prints what failed and exits 1, or exits 0.
+ */
+
+#include "mn_core.h"
+
+#include <limits.h>
+
+#define SEED            0x5eedULL
+
+static int      failed;
+
+#define CHECK(cond, ...) do {						\
+	if (!(cond)) {							\
+	    fprintf(stderr, "%s:%d: ", __func__, __LINE__);		\
+	    fprintf(stderr, __VA_ARGS__);				\
+	    fputc('\n', stderr);					\
+	    ++failed;							\
+	}								\
+    } while (0)
+
+static void
+hop_make(struct hop *hop, int id, u_int64_t bps, int qsize, double plr,
+	 u_int64_t seed)
+{
+    struct sysctl_hop sh;
+
+    memset(hop, 0, sizeof(*hop));
+    memset(&sh, 0, sizeof(sh));
+    sh.bandwidth = bps;
+    sh.qsize = qsize;
+    sh.plr = plr * 0x7fffffff;
+    if (mn_hop_init(hop, id, &sh, seed)) {
+	mn_hop_uninit(hop);
+	fprintf(stderr, "out of memory\n");
+	exit(1);
+    }
+}
+
+/*
+ * n back to back packets of len bytes at tick 0 must leave at
+ * floor(k * len * 8 * mn_hz / bps) for the kth.  At 1.024 Mbit/s a
+ * byte takes exactly 1/128 tick, so that holds to the tick; at
+ * 7 Mbit/s tpb is rounded down and a packet may leave one tick early,
+ * never more, however many went before it.
+ */
+static void
+check_pacing(void)
+{
+    static const struct {
+	u_int64_t       bps;
+	unsigned int    len;
+	int             exact;
+    } rates[] = {
+	{ 1024000, 1000, 1 },
+	{ 7000000, 1500, 0 },
+	{ 7000000, 41, 0 },
+    };
+    struct hop      hop;
+    unsigned long   exit, want;
+    unsigned int    i;
+    int             k, n = 10000;
+
+    for (i = 0; i < sizeof(rates) / sizeof(rates[0]); ++i) {
+	hop_make(&hop, 0, rates[i].bps, n, 0, SEED);
+	for (k = 1; k <= n; ++k) {
+	    exit = mn_hop_enqueue(&hop, rates[i].len, 0);
+	    want = (u_int64_t)k * rates[i].len * 8 * mn_hz / rates[i].bps;
+	    if (exit != want && (rates[i].exact || exit + 1 != want)) {
+		CHECK(0, "%llu bit/s, %u bytes: packet %d leaves at %lu, "
+		      "not %lu", (unsigned long long)rates[i].bps,
+		      rates[i].len, k, exit, want);
+		break;
+	    }
+	}
+	mn_hop_uninit(&hop);
+    }
+
+    /* an idle link starts from now and forgets the remainder */
+    hop_make(&hop, 0, 1024000, 8, 0, SEED);
+    mn_hop_enqueue(&hop, 1000, 0);
+    CHECK(hop.tailfrac != 0, "7.8125 ticks left no remainder");
+    CHECK(mn_hop_admit(&hop, 100) == 0, "idle hop dropped");
+    CHECK(hop.slotdepth == 0, "queue not drained by tick 100");
+    exit = mn_hop_enqueue(&hop, 1000, 100);
+    CHECK(exit == 107, "packet on an idle link leaves at %lu, not 107", exit);
+    mn_hop_uninit(&hop);
+}
+
+/*
+ * A hop of qsize slots takes qsize packets at once and drops the
+ * next.  With background at half the link rate on, each packet queued
+ * stands for two slots; while it is off the hop takes qsize again.
+ */
+static void
+admit_burst(struct hop *hop, unsigned long now, int want)
+{
+    int             k, verdict;
+
+    for (k = 0; k < hop->qsize + 1; ++k) {
+	verdict = mn_hop_admit(hop, now);
+	if (verdict) {
+	    CHECK(verdict == MN_HOP_QDROP, "verdict %d", verdict);
+	    break;
+	}
+	mn_hop_enqueue(hop, 1500, now);
+    }
+    CHECK(k == want, "%d admitted at tick %lu, not %d", k, now, want);
+}
+
+static void
+check_admit(void)
+{
+    struct hop      hop;
+    int             qdrops;
+
+    hop_make(&hop, 0, 1000000, 8, 0, SEED);
+    admit_burst(&hop, 0, 8);
+    CHECK(hop.qdrops == 1, "%d queue drops, not 1", hop.qdrops);
+
+    /* once the head has left there is one slot again */
+    CHECK(mn_hop_admit(&hop, 12) == 0, "no room after the head left");
+    CHECK(hop.slotdepth == 7, "%d slots after one left", hop.slotdepth);
+    mn_hop_uninit(&hop);
+
+    /* no limit, no queue */
+    hop_make(&hop, 0, 0, 1, 0, SEED);
+    CHECK(mn_hop_admit(&hop, 0) == 0 && mn_hop_admit(&hop, 0) == 0,
+	  "a hop without bw limit dropped");
+    mn_hop_uninit(&hop);
+
+    /* background on for 100 ms, then off for 100 ms */
+    hop_make(&hop, 0, 1000000, 8, 0, SEED);
+    CHECK(hop_set_background(&hop, 500000, 100, 100, 0) == 0,
+	  "background refused");
+    CHECK(hop.bg_on, "background not on");
+    admit_burst(&hop, 0, 4);
+    qdrops = hop.qdrops;
+    CHECK(qdrops == 1, "%d queue drops, not 1", qdrops);
+
+    /* 4 packets at half the rate take 96 ticks, gone by 150 */
+    admit_burst(&hop, 150, 8);
+    CHECK(!hop.bg_on, "background still on at tick 150");
+    CHECK(hop.qdrops == qdrops + 1, "%d queue drops, not %d",
+	  hop.qdrops, qdrops + 1);
+
+    /* too much background */
+    CHECK(hop_set_background(&hop, 999999, 100, 0, 0) == -EINVAL,
+	  "background above 15/16 of the link taken");
+    mn_hop_uninit(&hop);
+}
+
+/*
+ * Entries due at ticks on both sides of the wrap of the tick counter,
+ * and of the slot array (start is 20 ticks short of both), come off
+ * at the tick they are due, and all of them within one lap.
+ */
+struct entry {
+    struct list_head list;
+    unsigned long   due;
+};
+
+static void
+check_calendar(void)
+{
+    struct mn_calendar cal;
+    struct entry    e[64];
+    struct list_head *pos, *q;
+    unsigned long   start = ULONG_MAX - 20, tick;
+    int             i, n = 0;
+
+    if (mn_calendar_init(&cal, start)) {
+	fprintf(stderr, "out of memory\n");
+	exit(1);
+    }
+    CHECK(mn_calendar_slot(&cal, start) ==
+	  mn_calendar_slot(&cal, start + cal.mask + 1),
+	  "ticks a calendar apart in different slots");
+
+    /* every 3rd tick from start on, and some just short of a lap */
+    for (i = 0; i < 48; ++i)
+	e[i].due = start + 3 * i;
+    for (; i < 64; ++i)
+	e[i].due = start + cal.mask - (i - 48);
+    for (i = 63; i >= 0; --i)
+	mn_calendar_insert(&cal, &e[i].list, e[i].due);
+
+    for (tick = start; time_before(tick, start + cal.mask + 1); ++tick) {
+	list_for_each_safe(pos, q, mn_calendar_slot(&cal, tick)) {
+	    struct entry   *p = list_entry(pos, struct entry, list);
+
+	    CHECK(p->due == tick, "entry due at %lu drained at %lu",
+		  p->due, tick);
+	    list_del(pos);
+	    ++n;
+	}
+    }
+    CHECK(n == 64, "%d entries drained, not 64", n);
+    mn_calendar_uninit(&cal);
+}
+
+/*
+ * One run: a path of hops with loss and short queues, fed a fixed
+ * arrival pattern.  Records every hop's first draws and every verdict.
+ */
+#define DET_HOPS        4
+#define DET_DRAWS       256
+#define DET_PKTS        4096
+
+struct run {
+    u_int32_t       draws[DET_HOPS][DET_DRAWS];
+    u_int8_t        verdicts[DET_PKTS][DET_HOPS];
+};
+
+static void
+run_model(struct run *r, u_int64_t seed)
+{
+    struct sysctl_hop sh[DET_HOPS];
+    struct mn_model m;
+    struct hop     *hop;
+    unsigned long   now;
+    int             h, k;
+
+    memset(sh, 0, sizeof(sh));
+    for (h = 0; h < DET_HOPS; ++h) {
+	sh[h].bandwidth = 1000000 * (h + 1);
+	sh[h].qsize = 4 + h;
+	sh[h].plr = 0x7fffffff / (h + 2);
+    }
+    if (mn_model_init(&m) || mn_model_set_hops(&m, sh, DET_HOPS, seed)) {
+	fprintf(stderr, "out of memory\n");
+	exit(1);
+    }
+
+    for (h = 0; h < DET_HOPS; ++h) {
+	hop = m.hoptable + h;
+	for (k = 0; k < DET_DRAWS; ++k)
+	    r->draws[h][k] = mn_hop_random(hop);
+	mn_hop_rekey(hop, seed);
+    }
+
+    /* bursts of 3 every 5 ticks, each packet through every hop */
+    for (k = 0; k < DET_PKTS; ++k) {
+	now = k / 3 * 5;
+	for (h = 0; h < DET_HOPS; ++h) {
+	    hop = m.hoptable + h;
+	    r->verdicts[k][h] = mn_hop_admit(hop, now);
+	    if (!r->verdicts[k][h])
+		mn_hop_enqueue(hop, 1500, now);
+	}
+    }
+    mn_model_uninit(&m);
+}
+
+static void
+check_seed(void)
+{
+    static struct run a, b, c;
+    int             h, k, drops = 0, kept = 0;
+
+    run_model(&a, SEED);
+    run_model(&b, SEED);
+    run_model(&c, SEED + 1);
+
+    CHECK(!memcmp(a.draws, b.draws, sizeof(a.draws)),
+	  "same seed, different draws");
+    CHECK(!memcmp(a.verdicts, b.verdicts, sizeof(a.verdicts)),
+	  "same seed, different drops");
+    CHECK(memcmp(a.draws, c.draws, sizeof(a.draws)),
+	  "another seed, same draws");
+    CHECK(memcmp(a.verdicts, c.verdicts, sizeof(a.verdicts)),
+	  "another seed, same drops");
+
+    /* the pattern must exercise both kinds of drop, and no drop */
+    for (k = 0; k < DET_PKTS; ++k)
+	for (h = 0; h < DET_HOPS; ++h) {
+	    drops |= a.verdicts[k][h];
+	    kept += !a.verdicts[k][h];
+	}
+    CHECK(drops == (MN_HOP_PLRDROP | MN_HOP_QDROP) && kept,
+	  "drops seen %d, %d kept", drops, kept);
+
+    /* every hop has a stream of its own */
+    for (h = 1; h < DET_HOPS; ++h)
+	CHECK(memcmp(a.draws[0], a.draws[h], sizeof(a.draws[0])),
+	      "hops 0 and %d draw the same", h);
+}
+
+int
+main(int argc, char **argv)
+{
+    mn_hz = 1000;
+    if (mn_core_init())
+	return 1;
+
+    check_pacing();
+    check_admit();
+    check_calendar();
+    check_seed();
+
+    if (failed) {
+	fprintf(stderr, "%s: %d checks failed\n", argv[0], failed);
+	return 1;
+    }
+    printf("%s: all checks passed\n", argv[0]);
+    return 0;
+}
@@ -0,0 +1,424 @@
+/*
+ * modelnet  mn_io.c
+ *
+ *     packet capture and reinjection for mnemud, TUN/TAP and AF_PACKET
+ *
+ * Copyright (c) 2006
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in
+ *      the documentation and/or other materials provided with the
+ *      distribution.
+ *    * Neither the names of Duke University nor The University of
+ *      California, San Diego, nor the names of the authors or contributors
+ *      may be used to endorse or promote products derived from
+ *      this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE
+ * USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+
+/*
+ * Packets come in on one of
+ *
+ *   tun:NAME     a tun device the 10/8 routes point at.  Carries bare
+ *                IP packets.  With several workers it is opened
+ *                multiqueue, one queue per worker, and the kernel
+ *                spreads flows over the queues.
+ *   tap:NAME     the same for a tap device, which carries ethernet
+ *                frames; anything but IPv4 is ignored.
+ *   xdp:NAME     an AF_XDP socket per worker on the nic's queues, see
+ *                mn_xdp.c; xdpgeneric:NAME forces generic XDP, as
+ *                for testing on veth.
+ *   packet:NAME  an AF_PACKET socket on a nic, with a TPACKET_V3 ring
+ *                the kernel fills a block at a time, so one wakeup
+ *                hands over many packets.  With several workers each
+ *                has its own socket and ring in a PACKET_FANOUT_HASH
+ *                group, which keeps a flow on one worker.  The kernel
+ *                still sees these packets too: turn ip_forward off (or
+ *                drop 10/8 in FORWARD) so it does not forward them
+ *                unemulated.
+ *
+ * and leave through a raw IP socket, which the kernel routes like any
+ * local packet.  mn_io_send() only queues; mn_io_flush() sends the
+ * batch with one sendmmsg().  SO_MARK on that socket lets policy
+ * routing send the packets on to the edge nodes rather than back into
+ * a tun device.
+ */
+
+#include "mnemud.h"
+
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <net/if.h>
+#include <netinet/ip.h>
+#include <linux/if_ether.h>
+#include <linux/if_packet.h>
+#include <linux/if_tun.h>
+
+#define RING_BLOCK_SIZE (1 << 20)
+#define RING_BLOCK_NR   32
+#define RING_FRAME_SIZE 2048
+#define RING_TIMEOUT_MS 1       /* kernel hands over a partial block */
+
+static int
+open_tun(struct mn_io *io, const char *name, int nqueues)
+{
+    struct ifreq    ifr;
+
+    io->fd = open("/dev/net/tun", O_RDWR | O_NONBLOCK);
+    if (io->fd < 0)
+	return -errno;
+    memset(&ifr, 0, sizeof(ifr));
+    ifr.ifr_flags = (io->type == MN_IO_TAP ? IFF_TAP : IFF_TUN) | IFF_NO_PI;
+    if (nqueues > 1)
+	ifr.ifr_flags |= IFF_MULTI_QUEUE;
+    strncpy(ifr.ifr_name, name, IFNAMSIZ - 1);
+    if (ioctl(io->fd, TUNSETIFF, &ifr) < 0)
+	return -errno;
+    return 0;
+}
+
+static int
+open_packet(struct mn_io *io, const char *name, int nqueues)
+{
+    struct tpacket_req3 req;
+    struct sockaddr_ll sll;
+    int             val;
+
+    io->fd = socket(AF_PACKET, SOCK_RAW, htons(ETH_P_IP));
+    if (io->fd < 0)
+	return -errno;
+    val = TPACKET_V3;
+    if (setsockopt(io->fd, SOL_PACKET, PACKET_VERSION, &val, sizeof(val)))
+	return -errno;
+#ifdef PACKET_IGNORE_OUTGOING
+    /* not our own reinjections; older kernels are filtered in recv */
+    val = 1;
+    setsockopt(io->fd, SOL_PACKET, PACKET_IGNORE_OUTGOING, &val, sizeof(val));
+#endif
+
+    memset(&req, 0, sizeof(req));
+    req.tp_block_size = RING_BLOCK_SIZE;
+    req.tp_block_nr = RING_BLOCK_NR;
+    req.tp_frame_size = RING_FRAME_SIZE;
+    req.tp_frame_nr = RING_BLOCK_SIZE / RING_FRAME_SIZE * RING_BLOCK_NR;
+    req.tp_retire_blk_tov = RING_TIMEOUT_MS;
+    if (setsockopt(io->fd, SOL_PACKET, PACKET_RX_RING, &req, sizeof(req)))
+	return -errno;
+    io->block_size = RING_BLOCK_SIZE;
+    io->block_nr = RING_BLOCK_NR;
+    io->ringlen = (size_t)RING_BLOCK_SIZE * RING_BLOCK_NR;
+    io->ring = mmap(NULL, io->ringlen, PROT_READ | PROT_WRITE, MAP_SHARED,
+		    io->fd, 0);
+    if (io->ring == MAP_FAILED) {
+	io->ring = NULL;
+	return -errno;
+    }
+
+    memset(&sll, 0, sizeof(sll));
+    sll.sll_family = AF_PACKET;
+    sll.sll_protocol = htons(ETH_P_IP);
+    sll.sll_ifindex = if_nametoindex(name);
+    if (!sll.sll_ifindex)
+	return -ENODEV;
+    if (bind(io->fd, (struct sockaddr *)&sll, sizeof(sll)))
+	return -errno;
+
+    if (nqueues > 1) {
+	val = (getpid() & 0xffff) | (PACKET_FANOUT_HASH << 16);
+	if (setsockopt(io->fd, SOL_PACKET, PACKET_FANOUT, &val, sizeof(val)))
+	    return -errno;
+    }
+    return 0;
+}
+
+/*
+ * [mn_io_open] Open queue queue of nqueues on iface, and a socket to
+ * reinject through.  Returns 0 or -errno; mn_io_close() either way.
+ */
+int
+mn_io_open(struct mn_io *io, const char *iface, int queue, int nqueues,
+	   int mark)
+{
+    int             err;
+
+    memset(io, 0, sizeof(*io));
+    io->fd = io->txfd = -1;
+    if (!strncmp(iface, "tun:", 4)) {
+	io->type = MN_IO_TUN;
+	err = open_tun(io, iface + 4, nqueues);
+    } else if (!strncmp(iface, "tap:", 4)) {
+	io->type = MN_IO_TAP;
+	err = open_tun(io, iface + 4, nqueues);
+    } else if (!strncmp(iface, "packet:", 7)) {
+	io->type = MN_IO_PACKET;
+	err = open_packet(io, iface + 7, nqueues);
+    } else if (!strncmp(iface, "xdp:", 4)) {
+	io->type = MN_IO_XDP;
+	err = mn_xdp_open(io, iface + 4, queue, nqueues, 0);
+    } else if (!strncmp(iface, "xdpgeneric:", 11)) {
+	io->type = MN_IO_XDP;
+	err = mn_xdp_open(io, iface + 11, queue, nqueues, 1);
+    } else
+	return -EINVAL;
+    if (err)
+	return err;
+
+    /* IPPROTO_RAW implies IP_HDRINCL; the kernel fills in the checksum */
+    io->txfd = socket(AF_INET, SOCK_RAW, IPPROTO_RAW);
+    if (io->txfd < 0)
+	return -errno;
+    if (mark && setsockopt(io->txfd, SOL_SOCKET, SO_MARK, &mark,
+			   sizeof(mark)))
+	return -errno;
+    return 0;
+}
+
+void
+mn_io_close(struct mn_io *io)
+{
+    if (io->xsk)
+	mn_xdp_close(io);
+    free(io->descs);
+    io->descs = NULL;
+    if (io->ring)
+	munmap(io->ring, io->ringlen);
+    if (io->fd >= 0)
+	close(io->fd);
+    if (io->txfd >= 0)
+	close(io->txfd);
+    io->ring = NULL;
+    io->fd = io->txfd = -1;
+}
+
+/*
+ * [mn_io_pool] Allocate n descriptors and put them on pool.  They hold
+ * their own MN_MTU bytes, or for AF_XDP one UMEM frame each.
+ */
+int
+mn_io_pool(struct mn_io *io, struct list_head *pool, int n)
+{
+    struct mn_desc *d;
+    int             i;
+
+    if (io->type == MN_IO_XDP)
+	return mn_xdp_pool(io, pool, n);
+
+    io->desc_size = (sizeof(struct mn_desc) + MN_MTU + 7) & ~7UL;
+    io->descs = calloc(n, io->desc_size);
+    if (!io->descs)
+	return -ENOMEM;
+    io->ndescs = n;
+    for (i = 0; i < n; ++i) {
+	d = (struct mn_desc *)(io->descs + i * io->desc_size);
+	d->data = d->buf;
+	list_add_tail(&d->list, pool);
+    }
+    return 0;
+}
+
+/* copy an IPv4 packet into a free descriptor and put it on got */
+static int
+take(struct mn_io *io, struct list_head *pool, struct list_head *got,
+     const unsigned char *ip, unsigned int len)
+{
+    struct mn_desc *d;
+
+    if (len < sizeof(struct iphdr) || len > MN_MTU || (ip[0] >> 4) != 4)
+	return 0;
+    /* trim ethernet padding, the raw socket sends len bytes */
+    if (ntohs(((const struct iphdr *)ip)->tot_len) < len)
+	len = ntohs(((const struct iphdr *)ip)->tot_len);
+    if (list_empty(pool)) {
+	io->rx_nodesc++;
+	return 0;
+    }
+    d = list_first_entry(pool, struct mn_desc, list);
+    list_del(&d->list);
+    memcpy(d->data, ip, len);
+    d->len = len;
+    d->path = NULL;
+    list_add_tail(&d->list, got);
+    io->rx++;
+    return 1;
+}
+
+static int
+recv_tun(struct mn_io *io, struct list_head *pool, struct list_head *got,
+	 int max)
+{
+    unsigned char   buf[MN_MTU + ETH_HLEN];
+    ssize_t         len;
+    int             n = 0, tries;
+
+    /* a packet read is a packet gone, so stop at max */
+    for (tries = 0; tries < max; ++tries) {
+	len = read(io->fd, buf, sizeof(buf));
+	if (len <= 0)
+	    break;
+	if (io->type == MN_IO_TAP) {
+	    if (len < ETH_HLEN ||
+		((struct ethhdr *)buf)->h_proto != htons(ETH_P_IP))
+		continue;
+	    n += take(io, pool, got, buf + ETH_HLEN, len - ETH_HLEN);
+	} else
+	    n += take(io, pool, got, buf, len);
+    }
+    return n;
+}
+
+static int
+recv_packet(struct mn_io *io, struct list_head *pool, struct list_head *got,
+	    int max)
+{
+    struct tpacket_block_desc *bd;
+    struct tpacket3_hdr *ppd;
+    struct sockaddr_ll *sll;
+    unsigned int    i;
+    int             n = 0;
+
+    /* whole blocks at a time, so max is only a hint */
+    for (;;) {
+	bd = (struct tpacket_block_desc *)(io->ring +
+					   (size_t)io->block * io->block_size);
+	if (!(bd->hdr.bh1.block_status & TP_STATUS_USER) || n >= max)
+	    break;
+	ppd = (struct tpacket3_hdr *)((unsigned char *)bd +
+				      bd->hdr.bh1.offset_to_first_pkt);
+	for (i = 0; i < bd->hdr.bh1.num_pkts; ++i) {
+	    sll = (struct sockaddr_ll *)((unsigned char *)ppd +
+					 TPACKET_ALIGN(sizeof(*ppd)));
+	    if (sll->sll_pkttype != PACKET_OUTGOING &&
+		ppd->tp_snaplen > ppd->tp_net - ppd->tp_mac)
+		n += take(io, pool, got, (unsigned char *)ppd + ppd->tp_net,
+			  ppd->tp_snaplen - (ppd->tp_net - ppd->tp_mac));
+	    ppd = (struct tpacket3_hdr *)((unsigned char *)ppd +
+					  ppd->tp_next_offset);
+	}
+	__sync_synchronize();
+	bd->hdr.bh1.block_status = TP_STATUS_KERNEL;
+	io->block = (io->block + 1) % io->block_nr;
+    }
+    return n;
+}
+
+static int
+recv_any(struct mn_io *io, struct list_head *pool, struct list_head *got, int max)
+{
+    switch (io->type) {
+    case MN_IO_PACKET:
+	return recv_packet(io, pool, got, max);
+    case MN_IO_XDP:
+	return mn_xdp_recv(io, pool, got, max);
+    default:
+	return recv_tun(io, pool, got, max);
+    }
+}
+
+/*
+ * [mn_io_recv] Move up to max captured IPv4 packets into descriptors
+ * from pool, onto got.  Waits up to timeout_ms for the first one.
+ * Returns the number taken.
+ */
+int
+mn_io_recv(struct mn_io *io, struct list_head *pool, struct list_head *got,
+	   int max, int timeout_ms)
+{
+    struct pollfd   pfd;
+    int             n;
+
+    n = recv_any(io, pool, got, max);
+    if (n || !timeout_ms)
+	return n;
+
+    pfd.fd = io->type == MN_IO_XDP ? mn_xdp_fd(io) : io->fd;
+    pfd.events = POLLIN;
+    if (poll(&pfd, 1, timeout_ms) <= 0)
+	return 0;
+    return recv_any(io, pool, got, max);
+}
+
+/* [mn_io_sendraw] send n packets out the raw socket, not freeing them */
+void
+mn_io_sendraw(struct mn_io *io, struct mn_desc **d, int n)
+{
+    struct mmsghdr  msgs[MN_BATCH];
+    struct iovec    iov[MN_BATCH];
+    struct sockaddr_in to[MN_BATCH];
+    int             i, done = 0, r;
+
+    if (!n)
+	return;
+    memset(msgs, 0, sizeof(*msgs) * n);
+    for (i = 0; i < n; ++i) {
+	struct iphdr   *ip = (struct iphdr *)d[i]->data;
+
+	memset(&to[i], 0, sizeof(to[i]));
+	to[i].sin_family = AF_INET;
+	to[i].sin_addr.s_addr = ip->daddr;
+	iov[i].iov_base = d[i]->data;
+	iov[i].iov_len = d[i]->len;
+	msgs[i].msg_hdr.msg_name = &to[i];
+	msgs[i].msg_hdr.msg_namelen = sizeof(to[i]);
+	msgs[i].msg_hdr.msg_iov = &iov[i];
+	msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+    while (done < n) {
+	r = sendmmsg(io->txfd, msgs + done, n - done, 0);
+	if (r <= 0) {
+	    /* skip the one that failed, e.g. no route to it */
+	    io->tx_errs++;
+	    r = 1;
+	} else
+	    io->tx_pkts += r;
+	done += r;
+    }
+}
+
+/* [mn_io_flush] send what mn_io_send() queued, and free it to pool */
+void
+mn_io_flush(struct mn_io *io, struct list_head *pool)
+{
+    int             i;
+
+    if (!io->ntx)
+	return;
+    if (io->type == MN_IO_XDP) {
+	mn_xdp_flush(io, pool);
+	return;
+    }
+    mn_io_sendraw(io, io->tx, io->ntx);
+    for (i = 0; i < io->ntx; ++i)
+	list_add(&io->tx[i]->list, pool);
+    io->ntx = 0;
+}
+
+/* [mn_io_send] queue d for reinjection, sending a full batch */
+void
+mn_io_send(struct mn_io *io, struct mn_desc *d, struct list_head *pool)
+{
+    io->tx[io->ntx++] = d;
+    if (io->ntx == MN_BATCH)
+	mn_io_flush(io, pool);
+}
@@ -0,0 +1,413 @@
+/*
+ * modelnet  mn_modelfile.c
+ *
+ *     reads .model and .route files into a struct mn_model
+ *
+ * Copyright (c) 2006
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in
+ *      the documentation and/or other materials provided with the
+ *      distribution.
+ *    * Neither the names of Duke University nor The University of
+ *      California, San Diego, nor the names of the authors or contributors
+ *      may be used to endorse or promote products derived from
+ *      this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE
+ * USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+
+/*
+ * mnemud loads the same files modelload does, without perl: the .model
+ * for the hops and virtual nodes, the .route for the paths.  Both are
+ * flat enough that elements and attributes are all we need, so this is
+ * a tokenizer rather than an XML parser; text, comments and the like
+ * are skipped.  Hop attributes are filled in from their specs as in
+ * modelload, and the model is built with the same calls the proc
+ * handlers use.  Hops are all emulated here, int_xtq and distill are
+ * ignored; int_emul, the emulator mkmodel gave the hop, is passed on
+ * for partitioning the hops among workers (mn_sched.c).
+ */
+
+#include "mnemud.h"
+
+#include <ctype.h>
+
+#define MAXATTRS 16
+
+struct element {
+    char           *name;
+    int             close;      /* </name> */
+    int             empty;      /* <name/> */
+    int             nattrs;
+    char           *attr[MAXATTRS], *value[MAXATTRS];
+};
+
+/* the hop and spec attributes mnemud uses */
+struct hopattrs {
+    double          kbps, plr, bgkbps;
+    int             delayms, qlen, bgonms, bgoffms;
+};
+
+struct spec {
+    char           *name;
+    struct element  e;
+};
+
+static char *
+slurp(const char *file)
+{
+    FILE           *f;
+    char           *buf = NULL;
+    long            len;
+
+    f = fopen(file, "r");
+    if (!f)
+	return NULL;
+    if (fseek(f, 0, SEEK_END) == 0 && (len = ftell(f)) >= 0 &&
+	fseek(f, 0, SEEK_SET) == 0 && (buf = malloc(len + 1))) {
+	if (fread(buf, 1, len, f) != (size_t)len) {
+	    free(buf);
+	    buf = NULL;
+	} else
+	    buf[len] = '\0';
+    }
+    fclose(f);
+    return buf;
+}
+
+/*
+ * Next element at or after *p, cutting the buffer up in place: names
+ * and values are NUL terminated where they lie.  Returns 0 at the end.
+ */
+static int
+next_element(char **p, struct element *e)
+{
+    char           *s = *p, *name;
+    char            q;
+
+    for (;;) {
+	s = strchr(s, '<');
+	if (!s)
+	    return 0;
+	if (!strncmp(s, "<!--", 4)) {
+	    s = strstr(s, "-->");
+	    if (!s)
+		return 0;
+	} else if (s[1] == '?' || s[1] == '!')
+	    s = strchr(s, '>');
+	else
+	    break;
+	if (!s)
+	    return 0;
+    }
+
+    memset(e, 0, sizeof(*e));
+    s++;
+    if (*s == '/') {
+	e->close = 1;
+	s++;
+    }
+    e->name = s;
+    while (*s && !isspace((unsigned char)*s) && *s != '>' && *s != '/')
+	s++;
+
+    for (;;) {
+	while (isspace((unsigned char)*s))
+	    *s++ = '\0';
+	if (*s == '/') {
+	    e->empty = 1;
+	    *s++ = '\0';
+	    continue;
+	}
+	if (*s == '>' || !*s)
+	    break;
+	name = s;
+	while (*s && *s != '=' && !isspace((unsigned char)*s) && *s != '>')
+	    s++;
+	if (*s != '=')
+	    continue;           /* bare word, skip it */
+	*s++ = '\0';
+	q = *s;
+	if (q != '"' && q != '\'')
+	    return -EINVAL;
+	*s++ = '\0';
+	if (e->nattrs < MAXATTRS) {
+	    e->attr[e->nattrs] = name;
+	    e->value[e->nattrs++] = s;
+	}
+	s = strchr(s, q);
+	if (!s)
+	    return -EINVAL;
+	*s++ = '\0';
+    }
+    if (*s)
+	*s++ = '\0';
+    *p = s;
+    return 1;
+}
+
+static const char *
+attr(const struct element *e, const char *name)
+{
+    int             i;
+
+    for (i = 0; i < e->nattrs; ++i)
+	if (!strcmp(e->attr[i], name))
+	    return e->value[i];
+    return NULL;
+}
+
+/* attribute name of the hop, or else of its spec, or NULL */
+static const char *
+hopattr(const struct element *hop, const struct element *spec,
+	const char *name)
+{
+    const char     *v = attr(hop, name);
+
+    return v || !spec ? v : attr(spec, name);
+}
+
+static void
+get_hopattrs(const struct element *hop, const struct element *spec,
+	     struct hopattrs *h)
+{
+    const char     *v;
+
+#define GET(field, name, conv) \
+    if ((v = hopattr(hop, spec, name))) h->field = conv(v)
+    memset(h, 0, sizeof(*h));
+    GET(kbps, "dbl_kbps", atof);
+    GET(plr, "dbl_plr", atof);
+    GET(delayms, "int_delayms", atoi);
+    GET(qlen, "int_qlen", atoi);
+    GET(bgkbps, "dbl_bgkbps", atof);
+    GET(bgonms, "int_bgonms", atoi);
+    GET(bgoffms, "int_bgoffms", atoi);
+#undef GET
+}
+
+/* grow *array of *n elements of size to hold index i */
+static int
+grow(void **array, int *n, size_t size, int i)
+{
+    void           *a;
+    int             len = *n ? *n : 16;
+
+    if (i < *n)
+	return 0;
+    while (len <= i)
+	len *= 2;
+    a = realloc(*array, len * size);
+    if (!a)
+	return -ENOMEM;
+    memset((char *)a + *n * size, 0, (len - *n) * size);
+    *array = a;
+    *n = len;
+    return 0;
+}
+
+static int
+load_hops(struct mn_model *m, char *buf, u_int64_t seed, int **emul)
+{
+    struct element  e, *hops = NULL;
+    struct spec    *specs = NULL;
+    struct sysctl_hop *table = NULL;
+    struct hopattrs *ha = NULL;
+    int             nhops = 0, nspecs = 0, maxhop = -1, emuls = 0;
+    int             nvn = 0, in_specs = 0, depth = 0, specs_depth = 0;
+    int             i, j, r, err = 0;
+    const char     *v;
+    char           *p = buf;
+
+    for (i = 0; i <= NODEMASK; ++i)
+	m->nodetable[i] = -1;
+
+    while ((r = next_element(&p, &e)) > 0) {
+	if (e.close) {
+	    if (--depth == specs_depth)
+		in_specs = 0;
+	    continue;
+	}
+	if (in_specs && depth == specs_depth + 1) {
+	    if ((err = grow((void **)&specs, &nspecs, sizeof(*specs), nspecs)))
+		goto out;
+	    for (j = 0; j < nspecs && specs[j].name; ++j);
+	    specs[j].name = e.name;
+	    specs[j].e = e;
+	} else if (!strcmp(e.name, "specs")) {
+	    in_specs = 1;
+	    specs_depth = depth;
+	} else if (!strcmp(e.name, "emul"))
+	    emuls++;
+	else if (!strcmp(e.name, "virtnode")) {
+	    struct in_addr  vip;
+
+	    v = attr(&e, "vip");
+	    if (!v || !inet_aton(v, &vip) || !attr(&e, "int_vn")) {
+		mn_log("mnemud: virtnode without vip or int_vn\n");
+		err = -EINVAL;
+		goto out;
+	    }
+	    m->nodetable[ntohl(vip.s_addr) & NODEMASK] =
+		atoi(attr(&e, "int_vn"));
+	    nvn++;
+	} else if (!strcmp(e.name, "hop")) {
+	    v = attr(&e, "int_idx");
+	    i = v ? atoi(v) : -1;
+	    if (i < 0) {
+		mn_log("mnemud: hop without int_idx\n");
+		err = -EINVAL;
+		goto out;
+	    }
+	    if ((err = grow((void **)&hops, &nhops, sizeof(*hops), i)))
+		goto out;
+	    hops[i] = e;
+	    if (i > maxhop)
+		maxhop = i;
+	}
+	if (!e.empty)
+	    depth++;
+    }
+    if (r < 0) {
+	err = r;
+	goto out;
+    }
+    if (emuls > 1 && !emul)
+	mn_log("mnemud: %d emulators in the model, emulating all hops here\n",
+	       emuls);
+
+    table = calloc(maxhop + 1, sizeof(*table));
+    ha = calloc(maxhop + 1, sizeof(*ha));
+    if (emul)
+	*emul = calloc(maxhop + 1, sizeof(**emul));
+    if (!table || !ha || (emul && !*emul)) {
+	err = -ENOMEM;
+	goto out;
+    }
+    for (i = 0; i <= maxhop; ++i) {
+	struct element *spec = NULL;
+
+	if (!hops[i].name) {
+	    mn_log("mnemud: no hop %d in the model\n", i);
+	    err = -EINVAL;
+	    goto out;
+	}
+	if ((v = attr(&hops[i], "specs")))
+	    for (j = 0; j < nspecs && specs[j].name; ++j)
+		if (!strcmp(specs[j].name, v))
+		    spec = &specs[j].e;
+	get_hopattrs(&hops[i], spec, &ha[i]);
+	table[i].bandwidth = (u_int64_t)(1000 * ha[i].kbps + 0.5);
+	table[i].delay = ha[i].delayms;
+	table[i].plr = (int)(0x7fffffff * ha[i].plr);
+	table[i].qsize = ha[i].qlen;
+	if (emul && (v = attr(&hops[i], "int_emul")))
+	    (*emul)[i] = atoi(v);
+    }
+
+    if ((err = mn_model_set_hops(m, table, maxhop + 1, seed)))
+	goto out;
+    for (i = 0; i <= maxhop; ++i)
+	if (ha[i].bgkbps > 0 &&
+	    (err = hop_set_background(&m->hoptable[i],
+				      (u_int64_t)(1000 * ha[i].bgkbps + 0.5),
+				      ha[i].bgonms, ha[i].bgoffms, 0)))
+	    goto out;
+    err = mn_model_set_nodecount(m, nvn);
+  out:
+    free(hops);
+    free(specs);
+    free(table);
+    free(ha);
+    return err;
+}
+
+static int
+load_paths(struct mn_model *m, char *buf)
+{
+    struct element  e;
+    int             hops[256];
+    const char     *s, *d, *h;
+    char           *end, *p = buf;
+    int             len, r, err;
+
+    while ((r = next_element(&p, &e)) > 0) {
+	if (e.close || strcmp(e.name, "path"))
+	    continue;
+	s = attr(&e, "int_vnsrc");
+	d = attr(&e, "int_vndst");
+	h = attr(&e, "hops");
+	if (!s || !d || !h)
+	    return -EINVAL;
+	for (len = 0;; ++len) {
+	    long            hop = strtol(h, &end, 10);
+
+	    if (end == h)
+		break;
+	    if (len == sizeof(hops) / sizeof(*hops))
+		return -E2BIG;
+	    hops[len] = hop;
+	    h = end;
+	}
+	err = mn_model_set_path(m, atoi(s), atoi(d), hops, len);
+	if (err) {
+	    mn_log("mnemud: bad path %s -> %s\n", s, d);
+	    return err;
+	}
+    }
+    return r;
+}
+
+/*
+ * [mn_load_model] Load the model and route files into m, which must
+ * not be loaded yet, keying the hops' random streams with seed.  If
+ * emul is not NULL, *emul is set to a malloc'ed array of the int_emul
+ * of every hop.  Returns 0 or -errno, with m then left for
+ * mn_model_uninit().
+ */
+int
+mn_load_model(struct mn_model *m, const char *model, const char *route,
+	      u_int64_t seed, int **emul)
+{
+    char           *buf;
+    int             err;
+
+    if (emul)
+	*emul = NULL;
+    err = mn_model_init(m);
+    if (err)
+	return err;
+
+    buf = slurp(model);
+    if (!buf)
+	return -errno;
+    err = load_hops(m, buf, seed, emul);
+    free(buf);
+    if (err)
+	return err;
+
+    buf = slurp(route);
+    if (!buf)
+	return -errno;
+    err = load_paths(m, buf);
+    free(buf);
+    return err;
+}
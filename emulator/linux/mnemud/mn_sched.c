@@ -0,0 +1,374 @@
+/*
+ * modelnet  mn_sched.c
+ *
+ *     conservative parallel scheduling of hop partitions for mnemud
+ *
+ * Copyright (c) 2006
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in
+ *      the documentation and/or other materials provided with the
+ *      distribution.
+ *    * Neither the names of Duke University nor The University of
+ *      California, San Diego, nor the names of the authors or contributors
+ *      may be used to endorse or promote products derived from
+ *      this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE
+ * USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+
+/*
+ * With -p the workers own the hops rather than share them: worker i
+ * gets the hops the model puts on emulator i (int_emul modulo the
+ * number of workers), and only it ever touches them, so they go
+ * unlocked.  A packet whose next hop another worker owns is handed to
+ * that worker through a ring, and goes back to the worker it came in
+ * on, which owns its descriptor, to be sent or freed.
+ *
+ * Each worker runs its own calendar, so the workers have to agree on
+ * time.  The scheduler is conservative: a worker runs tick t only when
+ * nothing can still be handed to it for t or earlier.  What another
+ * worker j can hand over comes from two places:
+ *
+ *   - its hops.  A packet leaving j's hop h for a hop of ours at tick
+ *     t was on h since t - delay(h) at the latest, so once j has run
+ *     every tick before done_j, it can hand us nothing due before
+ *     done_j + la(j), la(j) being the least delay of a hop of j's that
+ *     leads to one of ours on some path.  This is the lookahead.
+ *   - its capture queue.  Packets are stamped with the clock read when
+ *     they are received, so nothing is due before the last reading,
+ *     seen_j.
+ *
+ * done_j and seen_j, published by j after what they cover is on the
+ * rings, play the part of null messages: a worker runs the ticks
+ * before min over j of (done_j + la(j), seen_j) and its own clock,
+ * with no lock or barrier.  A worker that falls behind holds back only
+ * the workers it feeds, and those only as far as its lookahead.
+ *
+ * A hop of delay 0 leading into another partition gives no lookahead;
+ * it is taken as a tick, and a packet handed over after its tick is
+ * run counts as late and goes on at once.
+ */
+
+#include "mnemud.h"
+
+#include <limits.h>
+
+#define MN_SCHED_BUDGET 1024    /* packets run per loop, at tick grain */
+
+static struct mn_worker *workers;
+static int      nworkers;
+static int     *owner;          /* of every hop, by hop->id */
+static unsigned long *la;       /* la[from * nworkers + to], in ticks */
+
+/*
+ * [mn_sched_init] Partition the hops of m over the n workers by emul,
+ * the int_emul of every hop, and work out the lookahead between them.
+ */
+int
+mn_sched_init(struct mn_worker *w, int n, struct mn_model *m,
+	      const int *emul)
+{
+    struct hop    **path;
+    unsigned long   least = ULONG_MAX;
+    int             i, j, s, d, *count, emuls = 0;
+
+    workers = w;
+    nworkers = n;
+    owner = calloc(m->hopcount, sizeof(*owner));
+    la = calloc((size_t)n * n, sizeof(*la));
+    count = calloc(n, sizeof(*count));
+    if (!owner || !la || !count)
+	return -ENOMEM;
+
+    for (i = 0; i < m->hopcount; ++i) {
+	owner[i] = emul[i] % n;
+	count[owner[i]]++;
+	if (emul[i] >= emuls)
+	    emuls = emul[i] + 1;
+    }
+    if (emuls != n)
+	fprintf(stderr, "mnemud: the model has %d emulators for %d workers\n",
+		emuls, n);
+
+    /* no path between two partitions, the lookahead covers the calendar */
+    for (i = 0; i < n * n; ++i)
+	la[i] = mn_calendar_len;
+    for (s = 0; s < m->nodecount; ++s)
+	for (d = 0; m->pathtable[s] && d < m->nodecount; ++d)
+	    for (path = m->pathtable[s][d]; path && path[0] && path[1];
+		 ++path) {
+		i = owner[path[0]->id];
+		j = owner[path[1]->id];
+		if (i != j && (unsigned long)path[0]->delay < la[i * n + j])
+		    la[i * n + j] = path[0]->delay;
+		if (i != j && la[i * n + j] < least)
+		    least = la[i * n + j];
+	    }
+    for (i = 0; i < n * n; ++i)
+	if (!la[i])
+	    la[i] = 1;
+
+    for (i = 0; i < n; ++i) {
+	w[i].in = aligned_alloc(64, n * sizeof(*w[i].in));
+	w[i].backlog = calloc(n, sizeof(*w[i].backlog));
+	if (!w[i].in || !w[i].backlog)
+	    return -ENOMEM;
+	memset(w[i].in, 0, n * sizeof(*w[i].in));
+	for (j = 0; j < n; ++j) {
+	    INIT_LIST_HEAD(&w[i].backlog[j]);
+	    w[i].in[j].descs = calloc(MN_RING_SIZE, sizeof(struct mn_desc *));
+	    if (!w[i].in[j].descs)
+		return -ENOMEM;
+	}
+    }
+
+    fprintf(stderr, "mnemud: hops per worker");
+    for (i = 0; i < n; ++i)
+	fprintf(stderr, " %d", count[i]);
+    if (least == ULONG_MAX)
+	fprintf(stderr, ", no hop leads from one to another\n");
+    else
+	fprintf(stderr, ", least lookahead %lu ticks\n", least ? least : 1);
+    free(count);
+    return 0;
+}
+
+void
+mn_sched_uninit(struct mn_worker *w, int n)
+{
+    int             i, j;
+
+    for (i = 0; i < n; ++i) {
+	for (j = 0; w[i].in && j < n; ++j)
+	    free(w[i].in[j].descs);
+	free(w[i].in);
+	free(w[i].backlog);
+	w[i].in = NULL;
+	w[i].backlog = NULL;
+    }
+    free(owner);
+    free(la);
+    owner = NULL;
+    la = NULL;
+}
+
+static int
+ring_put(struct mn_ring *r, struct mn_desc *d)
+{
+    unsigned int    tail = r->tail;
+
+    if (tail - __atomic_load_n(&r->head, __ATOMIC_ACQUIRE) == MN_RING_SIZE)
+	return 0;
+    r->descs[tail & (MN_RING_SIZE - 1)] = d;
+    __atomic_store_n(&r->tail, tail + 1, __ATOMIC_RELEASE);
+    return 1;
+}
+
+static struct mn_desc *
+ring_get(struct mn_ring *r)
+{
+    unsigned int    head = r->head;
+    struct mn_desc *d;
+
+    if (head == __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE))
+	return NULL;
+    d = r->descs[head & (MN_RING_SIZE - 1)];
+    __atomic_store_n(&r->head, head + 1, __ATOMIC_RELEASE);
+    return d;
+}
+
+/* hand d to worker to, in order behind anything backlogged for it */
+static void
+post(struct mn_worker *w, int to, struct mn_desc *d)
+{
+    if (!list_empty(&w->backlog[to]) ||
+	!ring_put(&workers[to].in[w->id], d))
+	list_add_tail(&d->list, &w->backlog[to]);
+}
+
+/* returns 1 if everything backlogged is on the rings now */
+static int
+post_backlog(struct mn_worker *w)
+{
+    struct mn_desc *d;
+    int             i, clear = 1;
+
+    for (i = 0; i < nworkers; ++i)
+	while (!list_empty(&w->backlog[i])) {
+	    d = list_first_entry(&w->backlog[i], struct mn_desc, list);
+	    if (!ring_put(&workers[i].in[w->id], d)) {
+		clear = 0;
+		break;
+	    }
+	    list_del(&d->list);
+	}
+    return clear;
+}
+
+/* d is done with, sent if msg is MN_MSG_SEND: by its home worker */
+static void
+release(struct mn_worker *w, struct mn_desc *d, int msg)
+{
+    if (d->home != w->id) {
+	d->msg = msg;
+	post(w, d->home, d);
+    } else if (msg == MN_MSG_SEND)
+	mn_io_send(&w->io, d, &w->pool);
+    else
+	list_add(&d->list, &w->pool);
+}
+
+/*
+ * As step() in mnemud.c, but over our own hops only, unlocked: on to
+ * the calendar, or to the owner of the next hop, due when it gets there.
+ */
+static void
+sched_step(struct mn_worker *w, struct mn_desc *d, unsigned long now)
+{
+    struct hop     *hop, *next;
+    unsigned long   exit;
+
+    while ((hop = *d->path)) {
+	if (mn_hop_admit(hop, now)) {
+	    w->drops++;
+	    release(w, d, MN_MSG_FREE);
+	    return;
+	}
+	exit = mn_hop_enqueue(hop, d->len, now) + hop->delay;
+	next = *++d->path;
+	if (next && owner[next->id] != w->id) {
+	    d->ts = exit;
+	    d->msg = MN_MSG_HOP;
+	    post(w, owner[next->id], d);
+	    return;
+	}
+	if (time_after(exit, now)) {
+	    mn_calendar_insert(&w->cal, &d->list, exit);
+	    return;
+	}
+    }
+    w->pkts++;
+    release(w, d, MN_MSG_SEND);
+}
+
+/* take d, from worker from, for its next hop or back home */
+static void
+take(struct mn_worker *w, struct mn_desc *d, int from)
+{
+    switch (d->msg) {
+    case MN_MSG_SEND:
+	mn_io_send(&w->io, d, &w->pool);
+	break;
+    case MN_MSG_FREE:
+	list_add(&d->list, &w->pool);
+	break;
+    default:
+	if (time_before(d->ts, w->cal.tick)) {
+	    /* our own captures may arrive in a tick we have run */
+	    if (from != w->id)
+		w->late++;
+	    sched_step(w, d, w->cal.tick - 1);
+	} else
+	    mn_calendar_insert(&w->cal, &d->list, d->ts);
+    }
+}
+
+/* the ticks before this are safe to run */
+static unsigned long
+horizon(struct mn_worker *w, unsigned long now)
+{
+    unsigned long   limit = now + 1, t;
+    int             i;
+
+    for (i = 0; i < nworkers; ++i) {
+	if (i == w->id)
+	    continue;
+	t = __atomic_load_n(&workers[i].done, __ATOMIC_ACQUIRE) +
+	    la[i * nworkers + w->id];
+	if (time_before(t, limit))
+	    limit = t;
+	t = __atomic_load_n(&workers[i].seen, __ATOMIC_ACQUIRE);
+	if (time_before(t, limit))
+	    limit = t;
+    }
+    return limit;
+}
+
+/* [mn_sched_main] a worker of a partitioned model, see above */
+void *
+mn_sched_main(void *arg)
+{
+    struct mn_worker *w = arg;
+    struct list_head got, due, *l, *n;
+    struct mn_desc *d;
+    struct hop    **path;
+    unsigned long   now, limit;
+    int             i, budget;
+
+    mn_worker_pin(w);
+    while (!mn_stop) {
+	INIT_LIST_HEAD(&got);
+	mn_io_recv(&w->io, &w->pool, &got, MN_BATCH,
+		   mnemud_cfg.busy ? 0 : 1);
+	now = mn_now_tick();
+	list_for_each_safe(l, n, &got) {
+	    list_del(l);
+	    d = list_entry(l, struct mn_desc, list);
+	    if (!(path = mn_arrive(w, d)))
+		continue;
+	    d->path = path;
+	    d->ts = now;
+	    d->msg = MN_MSG_HOP;
+	    if (owner[path[0]->id] == w->id)
+		take(w, d, w->id);
+	    else
+		post(w, owner[path[0]->id], d);
+	}
+	/* seen covers what we captured, so not while some is held back */
+	if (post_backlog(w))
+	    __atomic_store_n(&w->seen, now, __ATOMIC_RELEASE);
+
+	/* what the others published, then what they handed over by then */
+	limit = horizon(w, now);
+	for (i = 0; i < nworkers; ++i)
+	    while ((d = ring_get(&w->in[i])))
+		take(w, d, i);
+
+	for (budget = MN_SCHED_BUDGET;
+	     budget > 0 && time_before(w->cal.tick, limit); w->cal.tick++) {
+	    INIT_LIST_HEAD(&due);
+	    list_splice_tail_init(mn_calendar_slot(&w->cal, w->cal.tick),
+				  &due);
+	    list_for_each_safe(l, n, &due) {
+		list_del(l);
+		sched_step(w, list_entry(l, struct mn_desc, list),
+			   w->cal.tick);
+		budget--;
+	    }
+	}
+
+	/* done covers what we handed over, so not while some is held back */
+	if (post_backlog(w))
+	    __atomic_store_n(&w->done, w->cal.tick, __ATOMIC_RELEASE);
+	mn_io_flush(&w->io, &w->pool);
+    }
+    return NULL;
+}
@@ -0,0 +1,629 @@
+/*
+ * modelnet  mn_xdp.c
+ *
+ *     AF_XDP capture and transmit for mnemud, on a UMEM its workers share
+ *
+ * Copyright (c) 2006
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in
+ *      the documentation and/or other materials provided with the
+ *      distribution.
+ *    * Neither the names of Duke University nor The University of
+ *      California, San Diego, nor the names of the authors or contributors
+ *      may be used to endorse or promote products derived from
+ *      this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE
+ * USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+
+/*
+ * With xdp:NIC every worker has an AF_XDP socket on its own queue of
+ * the nic (worker i, queue i), and a small XDP program hands those
+ * sockets what is 10/8 to 10/8, passing the rest to the kernel.  All
+ * sockets share one UMEM, a frame per descriptor, each worker owning
+ * the frames of its own pool: a packet lives in the frame it arrived
+ * in while it crosses its hops, and leaves by the same socket's TX
+ * ring from that frame.  Nothing is copied and no skb is made, except
+ * in the copy mode generic XDP and some drivers fall back to.
+ *
+ * The emulator is a one-armed router: the edge nodes route 10/8 to
+ * it, and it sends each packet to the MAC of its destination.  MACs
+ * come from the kernel's neighbour table; a packet to an address not
+ * yet in it goes by the raw socket, which makes the kernel resolve it.
+ *
+ * Sockets are opened from one thread, before the workers start.  Needs
+ * linux 5.10, for BPF links and a UMEM shared across queues.
+ */
+
+#include "mnemud.h"
+
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <net/if.h>
+#include <netinet/ip.h>
+#include <linux/bpf.h>
+#include <linux/if_ether.h>
+#include <linux/if_link.h>
+#include <linux/if_xdp.h>
+
+#ifndef AF_XDP
+#define AF_XDP          44
+#endif
+#ifndef SOL_XDP
+#define SOL_XDP         283
+#endif
+
+#define XSK_FRAME       2048    /* UMEM chunk, one packet */
+#define XSK_FILL_SIZE   4096    /* ring entries, powers of 2 */
+#define XSK_COMP_SIZE   4096
+#define XSK_RX_SIZE     2048
+#define XSK_TX_SIZE     2048
+
+#define NEIGH_SIZE      4096    /* a power of 2 */
+#define NEIGH_REREAD_NS (100 * NSEC_PER_MSEC)
+
+#ifndef NSEC_PER_MSEC
+#define NSEC_PER_MSEC   1000000L
+#endif
+
+/* one of the four rings an AF_XDP socket shares with the kernel */
+struct xsk_ring {
+    u32            *producer, *consumer;
+    void           *ring;
+    u32             mask;
+    u32             head;       /* our producer or consumer index */
+    void           *map;
+    size_t          maplen;
+};
+
+struct mn_neigh {
+    in_addr_t       ip;         /* 0 for a free entry */
+    unsigned char   mac[ETH_ALEN];
+};
+
+struct mn_xsk {
+    int             fd;
+    struct xsk_ring fill, comp, rx, tx;
+    u_int64_t       base;       /* first frame of this queue's pool */
+    char            ifname[IFNAMSIZ];
+    unsigned char   mac[ETH_ALEN];
+    struct mn_neigh neigh[NEIGH_SIZE];
+    u_int64_t       neigh_read;
+    struct mn_desc *slow[MN_BATCH];
+};
+
+/* what the sockets share */
+static struct {
+    unsigned char  *area;
+    size_t          len;
+    int             owner;      /* socket the UMEM is registered on */
+    int             map_fd, prog_fd, link_fd;
+} umem = {.owner = -1, .map_fd = -1, .prog_fd = -1, .link_fd = -1 };
+
+static int
+sys_bpf(int cmd, union bpf_attr *attr)
+{
+    return syscall(__NR_bpf, cmd, attr, sizeof(*attr));
+}
+
+#define INSN(c, d, s, o, i) \
+    ((struct bpf_insn){ .code = (c), .dst_reg = (d), .src_reg = (s), \
+                        .off = (o), .imm = (i) })
+
+/*
+ * The XDP program:
+ *
+ *	if (eth + ip > data_end || ethertype != IPv4 ||
+ *	    saddr >> 24 != 10 || daddr >> 24 != 10)
+ *		return XDP_PASS;
+ *	return bpf_redirect_map(&xsks, rx_queue_index, XDP_PASS);
+ */
+static int
+load_prog(int map_fd)
+{
+    struct bpf_insn prog[] = {
+	INSN(BPF_ALU64 | BPF_MOV | BPF_X, 6, 1, 0, 0),
+	INSN(BPF_LDX | BPF_W | BPF_MEM, 2, 1,
+	     offsetof(struct xdp_md, data), 0),
+	INSN(BPF_LDX | BPF_W | BPF_MEM, 3, 1,
+	     offsetof(struct xdp_md, data_end), 0),
+	INSN(BPF_ALU64 | BPF_MOV | BPF_X, 4, 2, 0, 0),
+	INSN(BPF_ALU64 | BPF_ADD | BPF_K, 4, 0, 0,
+	     ETH_HLEN + sizeof(struct iphdr)),
+	INSN(BPF_JMP | BPF_JGT | BPF_X, 4, 3, 12, 0),
+	INSN(BPF_LDX | BPF_H | BPF_MEM, 4, 2,
+	     offsetof(struct ethhdr, h_proto), 0),
+	INSN(BPF_JMP | BPF_JNE | BPF_K, 4, 0, 10, htons(ETH_P_IP)),
+	INSN(BPF_LDX | BPF_B | BPF_MEM, 4, 2,
+	     ETH_HLEN + offsetof(struct iphdr, saddr), 0),
+	INSN(BPF_JMP | BPF_JNE | BPF_K, 4, 0, 8, 10),
+	INSN(BPF_LDX | BPF_B | BPF_MEM, 4, 2,
+	     ETH_HLEN + offsetof(struct iphdr, daddr), 0),
+	INSN(BPF_JMP | BPF_JNE | BPF_K, 4, 0, 6, 10),
+	INSN(BPF_LDX | BPF_W | BPF_MEM, 2, 6,
+	     offsetof(struct xdp_md, rx_queue_index), 0),
+	INSN(BPF_LD | BPF_DW | BPF_IMM, 1, BPF_PSEUDO_MAP_FD, 0, map_fd),
+	INSN(0, 0, 0, 0, 0),
+	INSN(BPF_ALU64 | BPF_MOV | BPF_K, 3, 0, 0, XDP_PASS),
+	INSN(BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_redirect_map),
+	INSN(BPF_JMP | BPF_EXIT, 0, 0, 0, 0),
+	INSN(BPF_ALU64 | BPF_MOV | BPF_K, 0, 0, 0, XDP_PASS),
+	INSN(BPF_JMP | BPF_EXIT, 0, 0, 0, 0),
+    };
+    static char     log[4096];
+    union bpf_attr  attr;
+    int             fd;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.prog_type = BPF_PROG_TYPE_XDP;
+    attr.expected_attach_type = BPF_XDP;
+    attr.insns = (unsigned long)prog;
+    attr.insn_cnt = sizeof(prog) / sizeof(*prog);
+    attr.license = (unsigned long)"Dual BSD/GPL";
+    attr.log_buf = (unsigned long)log;
+    attr.log_size = sizeof(log);
+    attr.log_level = 1;
+    fd = sys_bpf(BPF_PROG_LOAD, &attr);
+    if (fd < 0) {
+	fd = -errno;
+	mn_log("mnemud: XDP program rejected:\n%s", log);
+    }
+    return fd;
+}
+
+/* create the socket map, load the program and attach it to ifindex */
+static int
+attach_prog(int ifindex, int nqueues, int generic)
+{
+    union bpf_attr  attr;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.map_type = BPF_MAP_TYPE_XSKMAP;
+    attr.key_size = sizeof(int);
+    attr.value_size = sizeof(int);
+    attr.max_entries = nqueues;
+    umem.map_fd = sys_bpf(BPF_MAP_CREATE, &attr);
+    if (umem.map_fd < 0)
+	return -errno;
+
+    umem.prog_fd = load_prog(umem.map_fd);
+    if (umem.prog_fd < 0)
+	return umem.prog_fd;
+
+    /* a link goes away with us, the program with it */
+    memset(&attr, 0, sizeof(attr));
+    attr.link_create.prog_fd = umem.prog_fd;
+    attr.link_create.target_ifindex = ifindex;
+    attr.link_create.attach_type = BPF_XDP;
+    if (!generic) {
+	attr.link_create.flags = XDP_FLAGS_DRV_MODE;
+	umem.link_fd = sys_bpf(BPF_LINK_CREATE, &attr);
+	if (umem.link_fd >= 0)
+	    return 0;
+	mn_log("mnemud: no native XDP, using generic\n");
+    }
+    attr.link_create.flags = XDP_FLAGS_SKB_MODE;
+    umem.link_fd = sys_bpf(BPF_LINK_CREATE, &attr);
+    return umem.link_fd < 0 ? -errno : 0;
+}
+
+static int
+map_ring(int fd, struct xsk_ring *r, u32 size,
+	 const struct xdp_ring_offset *off, size_t entry, off_t pgoff)
+{
+    r->maplen = off->desc + size * entry;
+    r->map = mmap(NULL, r->maplen, PROT_READ | PROT_WRITE,
+		  MAP_SHARED | MAP_POPULATE, fd, pgoff);
+    if (r->map == MAP_FAILED) {
+	r->map = NULL;
+	return -errno;
+    }
+    r->producer = (u32 *)((char *)r->map + off->producer);
+    r->consumer = (u32 *)((char *)r->map + off->consumer);
+    r->ring = (char *)r->map + off->desc;
+    r->mask = size - 1;
+    return 0;
+}
+
+static int
+open_rings(struct mn_xsk *x)
+{
+    struct xdp_mmap_offsets off;
+    socklen_t       len = sizeof(off);
+    int             err;
+
+    /* size all rings, then map them */
+    if (setsockopt(x->fd, SOL_XDP, XDP_RX_RING, &(int){ XSK_RX_SIZE },
+		   sizeof(int)) ||
+	setsockopt(x->fd, SOL_XDP, XDP_TX_RING, &(int){ XSK_TX_SIZE },
+		   sizeof(int)) ||
+	setsockopt(x->fd, SOL_XDP, XDP_UMEM_FILL_RING,
+		   &(int){ XSK_FILL_SIZE }, sizeof(int)) ||
+	setsockopt(x->fd, SOL_XDP, XDP_UMEM_COMPLETION_RING,
+		   &(int){ XSK_COMP_SIZE }, sizeof(int)))
+	return -errno;
+    if (getsockopt(x->fd, SOL_XDP, XDP_MMAP_OFFSETS, &off, &len))
+	return -errno;
+
+    if ((err = map_ring(x->fd, &x->rx, XSK_RX_SIZE, &off.rx,
+			sizeof(struct xdp_desc), XDP_PGOFF_RX_RING)) ||
+	(err = map_ring(x->fd, &x->tx, XSK_TX_SIZE, &off.tx,
+			sizeof(struct xdp_desc), XDP_PGOFF_TX_RING)) ||
+	(err = map_ring(x->fd, &x->fill, XSK_FILL_SIZE,
+			&off.fr, sizeof(u_int64_t),
+			XDP_UMEM_PGOFF_FILL_RING)) ||
+	(err = map_ring(x->fd, &x->comp, XSK_COMP_SIZE, &off.cr, sizeof(u_int64_t),
+			XDP_UMEM_PGOFF_COMPLETION_RING)))
+	return err;
+
+    /* we produce on fill and tx, from where the kernel left them */
+    x->fill.head = *x->fill.producer;
+    x->tx.head = *x->tx.producer;
+    x->rx.head = *x->rx.consumer;
+    x->comp.head = *x->comp.consumer;
+    return 0;
+}
+
+/*
+ * [mn_xdp_open] Open the AF_XDP socket of queue queue on iface.  The
+ * first call sets up the UMEM for all nqueues, and the XDP program.
+ */
+int
+mn_xdp_open(struct mn_io *io, const char *iface, int queue, int nqueues,
+	    int generic)
+{
+    struct sockaddr_xdp sxdp;
+    struct mn_xsk  *x;
+    struct ifreq    ifr;
+    union bpf_attr  attr;
+    int             ifindex, fd, err;
+
+    ifindex = if_nametoindex(iface);
+    if (!ifindex)
+	return -ENODEV;
+
+    x = calloc(1, sizeof(*x));
+    if (!x)
+	return -ENOMEM;
+    io->xsk = x;
+    x->base = (u_int64_t)queue * mnemud_cfg.pool * XSK_FRAME;
+    strncpy(x->ifname, iface, IFNAMSIZ - 1);
+    x->fd = socket(AF_XDP, SOCK_RAW, 0);
+    if (x->fd < 0)
+	return -errno;
+
+    /* AF_XDP sockets take no ioctls */
+    fd = socket(AF_INET, SOCK_DGRAM, 0);
+    memset(&ifr, 0, sizeof(ifr));
+    strncpy(ifr.ifr_name, iface, IFNAMSIZ - 1);
+    err = fd < 0 || ioctl(fd, SIOCGIFHWADDR, &ifr) ? -errno : 0;
+    if (fd >= 0)
+	close(fd);
+    if (err)
+	return err;
+    memcpy(x->mac, ifr.ifr_hwaddr.sa_data, ETH_ALEN);
+
+    if (!umem.area) {
+	struct xdp_umem_reg mr;
+
+	umem.len = (size_t)nqueues * mnemud_cfg.pool * XSK_FRAME;
+	umem.area = mmap(NULL, umem.len, PROT_READ | PROT_WRITE,
+			 MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+	if (umem.area == MAP_FAILED) {
+	    umem.area = NULL;
+	    return -errno;
+	}
+	memset(&mr, 0, sizeof(mr));
+	mr.addr = (unsigned long)umem.area;
+	mr.len = umem.len;
+	mr.chunk_size = XSK_FRAME;
+	if (setsockopt(x->fd, SOL_XDP, XDP_UMEM_REG, &mr, sizeof(mr)))
+	    return -errno;
+	umem.owner = x->fd;
+	if ((err = attach_prog(ifindex, nqueues, generic)))
+	    return err;
+    }
+    if ((err = open_rings(x)))
+	return err;
+
+    memset(&sxdp, 0, sizeof(sxdp));
+    sxdp.sxdp_family = AF_XDP;
+    sxdp.sxdp_ifindex = ifindex;
+    sxdp.sxdp_queue_id = queue;
+    if (x->fd != umem.owner) {
+	sxdp.sxdp_flags = XDP_SHARED_UMEM;
+	sxdp.sxdp_shared_umem_fd = umem.owner;
+	err = bind(x->fd, (struct sockaddr *)&sxdp, sizeof(sxdp));
+    } else {
+	sxdp.sxdp_flags = XDP_ZEROCOPY;
+	err = generic ? -1 : bind(x->fd, (struct sockaddr *)&sxdp,
+				  sizeof(sxdp));
+	if (err) {
+	    sxdp.sxdp_flags = XDP_COPY;
+	    err = bind(x->fd, (struct sockaddr *)&sxdp, sizeof(sxdp));
+	    if (!err)
+		mn_log("mnemud: %s queue %d in AF_XDP copy mode\n",
+		       iface, queue);
+	}
+    }
+    if (err)
+	return -errno;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.map_fd = umem.map_fd;
+    attr.key = (unsigned long)&queue;
+    attr.value = (unsigned long)&x->fd;
+    if (sys_bpf(BPF_MAP_UPDATE_ELEM, &attr))
+	return -errno;
+    return 0;
+}
+
+static void
+unmap_ring(struct xsk_ring *r)
+{
+    if (r->map)
+	munmap(r->map, r->maplen);
+    r->map = NULL;
+}
+
+void
+mn_xdp_close(struct mn_io *io)
+{
+    struct mn_xsk  *x = io->xsk;
+    int             fd = x->fd;
+
+    unmap_ring(&x->rx);
+    unmap_ring(&x->tx);
+    unmap_ring(&x->fill);
+    unmap_ring(&x->comp);
+    free(x);
+    io->xsk = NULL;
+    if (fd >= 0 && fd != umem.owner)
+	close(fd);
+
+    /* the UMEM goes with the socket it is registered on, closed last */
+    if (fd >= 0 && fd == umem.owner) {
+	if (umem.link_fd >= 0)
+	    close(umem.link_fd);
+	if (umem.prog_fd >= 0)
+	    close(umem.prog_fd);
+	if (umem.map_fd >= 0)
+	    close(umem.map_fd);
+	close(umem.owner);
+	munmap(umem.area, umem.len);
+	umem.area = NULL;
+	umem.owner = umem.link_fd = umem.prog_fd = umem.map_fd = -1;
+    }
+}
+
+int
+mn_xdp_fd(struct mn_io *io)
+{
+    return io->xsk->fd;
+}
+
+/* [mn_xdp_pool] n descriptors, one per frame of this queue's share */
+int
+mn_xdp_pool(struct mn_io *io, struct list_head *pool, int n)
+{
+    struct mn_desc *d;
+    int             i;
+
+    io->desc_size = sizeof(struct mn_desc);
+    io->descs = calloc(n, io->desc_size);
+    if (!io->descs)
+	return -ENOMEM;
+    io->ndescs = n;
+    for (i = 0; i < n; ++i) {
+	d = (struct mn_desc *)(io->descs + i * io->desc_size);
+	d->addr = io->xsk->base + (u_int64_t)i * XSK_FRAME;
+	list_add_tail(&d->list, pool);
+    }
+    return 0;
+}
+
+static struct mn_desc *
+frame_desc(struct mn_io *io, u_int64_t addr)
+{
+    u_int64_t       i = (addr - io->xsk->base) / XSK_FRAME;
+
+    return (struct mn_desc *)(io->descs + i * io->desc_size);
+}
+
+/*
+ * Hand the kernel back the frames it has sent, and give it free ones
+ * to receive into.
+ */
+static void
+recycle(struct mn_io *io, struct list_head *pool)
+{
+    struct mn_xsk  *x = io->xsk;
+    struct mn_desc *d;
+    u_int64_t      *slot;
+    u32             prod, cons;
+
+    prod = __atomic_load_n(x->comp.producer, __ATOMIC_ACQUIRE);
+    for (; x->comp.head != prod; x->comp.head++) {
+	slot = (u_int64_t *)x->comp.ring + (x->comp.head & x->comp.mask);
+	list_add(&frame_desc(io, *slot)->list, pool);
+    }
+    __atomic_store_n(x->comp.consumer, x->comp.head, __ATOMIC_RELEASE);
+
+    cons = __atomic_load_n(x->fill.consumer, __ATOMIC_ACQUIRE);
+    while (x->fill.head - cons < XSK_FILL_SIZE && !list_empty(pool)) {
+	d = list_first_entry(pool, struct mn_desc, list);
+	list_del(&d->list);
+	slot = (u_int64_t *)x->fill.ring + (x->fill.head++ & x->fill.mask);
+	*slot = d->addr;
+    }
+    __atomic_store_n(x->fill.producer, x->fill.head, __ATOMIC_RELEASE);
+}
+
+/* [mn_xdp_recv] as mn_io_recv(), without copying */
+int
+mn_xdp_recv(struct mn_io *io, struct list_head *pool, struct list_head *got,
+	    int max)
+{
+    struct mn_xsk  *x = io->xsk;
+    struct xdp_desc *rd;
+    struct mn_desc *d;
+    struct iphdr   *ip;
+    u32             prod;
+    int             n = 0;
+
+    recycle(io, pool);
+    prod = __atomic_load_n(x->rx.producer, __ATOMIC_ACQUIRE);
+    for (; x->rx.head != prod && n < max; x->rx.head++) {
+	rd = (struct xdp_desc *)x->rx.ring + (x->rx.head & x->rx.mask);
+	d = frame_desc(io, rd->addr);
+	d->data = umem.area + rd->addr + ETH_HLEN;
+	d->len = rd->len - ETH_HLEN;
+	d->path = NULL;
+	ip = (struct iphdr *)d->data;
+	/* the program checked there is an IP header; trim ethernet padding */
+	if (ntohs(ip->tot_len) < d->len)
+	    d->len = ntohs(ip->tot_len);
+	if (d->len < sizeof(*ip)) {
+	    list_add(&d->list, pool);
+	    continue;
+	}
+	list_add_tail(&d->list, got);
+	io->rx++;
+	n++;
+    }
+    __atomic_store_n(x->rx.consumer, x->rx.head, __ATOMIC_RELEASE);
+    return n;
+}
+
+static unsigned int
+neigh_hash(in_addr_t ip)
+{
+    return (ntohl(ip) * 2654435761u) & (NEIGH_SIZE - 1);
+}
+
+/* reread the resolved entries on our nic from the kernel's ARP table */
+static void
+neigh_read(struct mn_xsk *x)
+{
+    char            line[256], ipstr[64], macstr[64], dev[64];
+    unsigned int    flags, m[ETH_ALEN], h;
+    struct in_addr  ip;
+    FILE           *f;
+    int             i;
+
+    f = fopen("/proc/net/arp", "r");
+    if (!f)
+	return;
+    memset(x->neigh, 0, sizeof(x->neigh));
+    while (fgets(line, sizeof(line), f)) {
+	if (sscanf(line, "%63s %*s %x %63s %*s %63s", ipstr, &flags, macstr,
+		   dev) != 4 || !(flags & 0x2) || strcmp(dev, x->ifname) ||
+	    !inet_aton(ipstr, &ip) ||
+	    sscanf(macstr, "%x:%x:%x:%x:%x:%x", &m[0], &m[1], &m[2], &m[3],
+		   &m[4], &m[5]) != ETH_ALEN)
+	    continue;
+	for (h = neigh_hash(ip.s_addr); x->neigh[h].ip;
+	     h = (h + 1) & (NEIGH_SIZE - 1));
+	x->neigh[h].ip = ip.s_addr;
+	for (i = 0; i < ETH_ALEN; ++i)
+	    x->neigh[h].mac[i] = m[i];
+    }
+    fclose(f);
+}
+
+static const unsigned char *
+neigh_lookup(struct mn_xsk *x, in_addr_t ip, int *missed)
+{
+    struct timespec ts;
+    u_int64_t       now;
+    unsigned int    h, i;
+
+    for (i = 0, h = neigh_hash(ip); i < NEIGH_SIZE && x->neigh[h].ip;
+	 ++i, h = (h + 1) & (NEIGH_SIZE - 1))
+	if (x->neigh[h].ip == ip)
+	    return x->neigh[h].mac;
+
+    /* reread at most once a batch and every NEIGH_REREAD_NS */
+    if (!*missed) {
+	*missed = 1;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	now = (u_int64_t)ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+	if (now - x->neigh_read >= NEIGH_REREAD_NS) {
+	    x->neigh_read = now;
+	    neigh_read(x);
+	    return neigh_lookup(x, ip, missed);
+	}
+    }
+    return NULL;
+}
+
+/*
+ * [mn_xdp_flush] Send the queued packets from their frames, which come
+ * back through the completion ring.  Those the kernel has no MAC for
+ * yet, or that find the TX ring full, go by the raw socket.
+ */
+void
+mn_xdp_flush(struct mn_io *io, struct list_head *pool)
+{
+    struct mn_xsk  *x = io->xsk;
+    const unsigned char *mac;
+    struct xdp_desc *td;
+    struct ethhdr  *eth;
+    struct mn_desc *d;
+    u32             cons;
+    int             i, nslow = 0, missed = 0, sent = 0;
+
+    cons = __atomic_load_n(x->tx.consumer, __ATOMIC_ACQUIRE);
+    for (i = 0; i < io->ntx; ++i) {
+	d = io->tx[i];
+	mac = neigh_lookup(x, ((struct iphdr *)d->data)->daddr, &missed);
+	if (!mac || x->tx.head - cons == XSK_TX_SIZE) {
+	    x->slow[nslow++] = d;
+	    continue;
+	}
+	eth = (struct ethhdr *)(d->data - ETH_HLEN);
+	memcpy(eth->h_dest, mac, ETH_ALEN);
+	memcpy(eth->h_source, x->mac, ETH_ALEN);
+	eth->h_proto = htons(ETH_P_IP);
+	td = (struct xdp_desc *)x->tx.ring + (x->tx.head++ & x->tx.mask);
+	td->addr = (unsigned char *)eth - umem.area;
+	td->len = d->len + ETH_HLEN;
+	td->options = 0;
+	sent++;
+    }
+    io->ntx = 0;
+    if (sent) {
+	__atomic_store_n(x->tx.producer, x->tx.head, __ATOMIC_RELEASE);
+	if (sendto(x->fd, NULL, 0, MSG_DONTWAIT, NULL, 0) < 0 &&
+	    errno != EAGAIN && errno != EBUSY && errno != ENOBUFS)
+	    io->tx_errs++;
+	io->tx_pkts += sent;
+    }
+    if (nslow) {
+	mn_io_sendraw(io, x->slow, nslow);
+	io->tx_slow += nslow;
+	for (i = 0; i < nslow; ++i)
+	    list_add(&x->slow[i]->list, pool);
+    }
+}
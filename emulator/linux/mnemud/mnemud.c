@@ -0,0 +1,386 @@
+/*
+ * modelnet  mnemud.c
+ *
+ *     userspace emulator daemon: the workers and their calendars
+ *
+ * Copyright (c) 2006
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in
+ *      the documentation and/or other materials provided with the
+ *      distribution.
+ *    * Neither the names of Duke University nor The University of
+ *      California, San Diego, nor the names of the authors or contributors
+ *      may be used to endorse or promote products derived from
+ *      this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE
+ * USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+
+/*
+ * mnemud emulates a model the way the module does, from userspace.
+ * Packets for 10/8 are captured (mn_io.c), looked up in the model
+ * (mn_modelfile.c), stepped through their hops with the same core the
+ * module builds in, and reinjected when they leave the last one.
+ *
+ * Each worker has its own capture queue, descriptor pool and packet
+ * calendar, and runs its calendar off the monotonic clock.  The model
+ * is shared, and a hop is locked while a packet passes it, so flows
+ * of any worker can meet on a hop.  A packet stays on the worker that
+ * captured it.  With -p workers own hops instead, and hand packets
+ * to each other; see mn_sched.c.
+ */
+
+#include "mnemud.h"
+
+#include <getopt.h>
+#include <sched.h>
+#include <time.h>
+#include <unistd.h>
+#include <netinet/ip.h>
+
+struct mnemud_config mnemud_cfg = {
+    .iface = "tun:mn0",
+    .workers = 1,
+    .pool = 65536,
+};
+
+static struct mn_model model;
+static u_int64_t start_ns;
+volatile sig_atomic_t mn_stop;
+
+static u_int64_t
+now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (u_int64_t)ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+unsigned long
+mn_now_tick(void)
+{
+    return (now_ns() - start_ns) / mn_tick_nsec;
+}
+
+static void
+free_desc(struct mn_worker *w, struct mn_desc *d)
+{
+    list_add(&d->list, &w->pool);
+}
+
+/*
+ * Move d on from the hop it is at, as of tick now: through every hop
+ * it can cross by now, then onto the calendar for the tick it gets to
+ * the next one, or out if there is none.
+ */
+static void
+step(struct mn_worker *w, struct mn_desc *d, unsigned long now)
+{
+    struct hop     *hop;
+    unsigned long   exit = now;
+    int             verdict;
+
+    while ((hop = *d->path)) {
+	mn_lock(&hop->lock);
+	verdict = mn_hop_admit(hop, now);
+	if (!verdict)
+	    exit = mn_hop_enqueue(hop, d->len, now) + hop->delay;
+	mn_unlock(&hop->lock);
+	if (verdict) {
+	    w->drops++;
+	    free_desc(w, d);
+	    return;
+	}
+	d->path++;
+	if (time_after(exit, now)) {
+	    mn_calendar_insert(&w->cal, &d->list, exit);
+	    return;
+	}
+    }
+    w->pkts++;
+    mn_io_send(&w->io, d, &w->pool);
+}
+
+/*
+ * [mn_arrive] The path of a freshly captured packet, or NULL when it
+ * is not to be emulated, and has been sent on or freed.
+ */
+struct hop    **
+mn_arrive(struct mn_worker *w, struct mn_desc *d)
+{
+    struct hop    **path;
+    struct iphdr   *ip = (struct iphdr *)d->data;
+
+    if ((ip->saddr & MODEL_MASK) != MODEL_SUBNET ||
+	(ip->daddr & MODEL_MASK) != MODEL_SUBNET) {
+	w->other++;
+	/* the kernel has its own copy of what AF_PACKET shows us */
+	if (w->io.type == MN_IO_PACKET)
+	    free_desc(w, d);
+	else
+	    mn_io_send(&w->io, d, &w->pool);
+	return NULL;
+    }
+
+    /*
+     * As emulate_path(): move the forcebit from the destination to the
+     * source.  One bit set and the same bit cleared leave the pseudo
+     * header sum, so the TCP/UDP checksum, as it was; the raw socket
+     * redoes the IP header checksum.
+     */
+    ip->saddr |= (ip->daddr & MODEL_FORCEBIT);
+    ip->daddr &= ~MODEL_FORCEBIT;
+
+    path = mn_model_lookup(&model, ip->saddr & ~MODEL_FORCEBIT, ip->daddr);
+    if (!path) {
+	/* as the module, let it through unemulated */
+	w->nopath++;
+	mn_io_send(&w->io, d, &w->pool);
+    }
+    return path;
+}
+
+/* run the calendar up to now */
+static void
+drain(struct mn_worker *w, unsigned long now)
+{
+    struct list_head due, *l, *n;
+
+    while (time_before_eq(w->cal.tick, now)) {
+	INIT_LIST_HEAD(&due);
+	list_splice_tail_init(mn_calendar_slot(&w->cal, w->cal.tick), &due);
+	list_for_each_safe(l, n, &due) {
+	    list_del(l);
+	    step(w, list_entry(l, struct mn_desc, list), w->cal.tick);
+	}
+	w->cal.tick++;
+    }
+}
+
+/* [mn_worker_pin] bind w to cpu w->id, with -c */
+void
+mn_worker_pin(struct mn_worker *w)
+{
+    cpu_set_t       cpus;
+
+    if (!mnemud_cfg.pin)
+	return;
+    CPU_ZERO(&cpus);
+    CPU_SET(w->id % CPU_SETSIZE, &cpus);
+    pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+}
+
+static void *
+worker_main(void *arg)
+{
+    struct mn_worker *w = arg;
+    struct list_head got, *l, *n;
+    struct mn_desc *d;
+    unsigned long   now;
+
+    mn_worker_pin(w);
+    while (!mn_stop) {
+	INIT_LIST_HEAD(&got);
+	mn_io_recv(&w->io, &w->pool, &got, MN_BATCH,
+		   mnemud_cfg.busy ? 0 : 1);
+	now = mn_now_tick();
+	/* what was due before these arrived goes first */
+	drain(w, now);
+	list_for_each_safe(l, n, &got) {
+	    list_del(l);
+	    d = list_entry(l, struct mn_desc, list);
+	    if ((d->path = mn_arrive(w, d)))
+		step(w, d, now);
+	}
+	mn_io_flush(&w->io, &w->pool);
+    }
+    return NULL;
+}
+
+static int
+worker_init(struct mn_worker *w, int id)
+{
+    struct list_head *l;
+    int             err;
+
+    memset(w, 0, sizeof(*w));
+    w->id = id;
+    INIT_LIST_HEAD(&w->pool);
+    err = mn_calendar_init(&w->cal, 0);
+    if (err)
+	return err;
+    err = mn_io_open(&w->io, mnemud_cfg.iface, id, mnemud_cfg.workers,
+		     mnemud_cfg.mark);
+    if (!err)
+	err = mn_io_pool(&w->io, &w->pool, mnemud_cfg.pool);
+    if (err)
+	return err;
+    list_for_each(l, &w->pool)
+	list_entry(l, struct mn_desc, list)->home = id;
+    return 0;
+}
+
+static void
+worker_uninit(struct mn_worker *w)
+{
+    mn_io_close(&w->io);
+    if (w->cal.slots)
+	mn_calendar_uninit(&w->cal);
+}
+
+static void
+stop(int sig)
+{
+    (void)sig;
+    mn_stop = 1;
+}
+
+static void
+usage(const char *prog)
+{
+    fprintf(stderr,
+	    "usage: %s [options] model route\n"
+	    "  -i IFACE   capture from tun:NAME, tap:NAME, packet:NIC, xdp:NIC\n"
+	    "             or xdpgeneric:NIC (%s)\n"
+	    "  -w N       worker threads, one capture queue each (%d)\n"
+	    "  -P N       packet descriptors per worker (%d)\n"
+	    "  -m MARK    SO_MARK reinjected packets, for policy routing\n"
+	    "  -B         busy poll rather than sleep when idle\n"
+	    "  -c         pin worker i to cpu i\n"
+	    "  -p         partition the hops among the workers by int_emul\n"
+	    "  -z HZ      calendar ticks per second (%u)\n"
+	    "  -s SEED    random seed of the hops (0)\n",
+	    prog, mnemud_cfg.iface, mnemud_cfg.workers, mnemud_cfg.pool,
+	    MN_DEFAULT_HZ);
+    exit(1);
+}
+
+int
+main(int argc, char **argv)
+{
+    struct mn_worker *workers;
+    u_int64_t       seed = 0;
+    int             c, i, err, *emul = NULL;
+    u_int64_t       pkts = 0, drops = 0, nopath = 0, other = 0, late = 0;
+    u_int64_t       rx = 0, nodesc = 0, txerrs = 0, slow = 0;
+
+    while ((c = getopt(argc, argv, "i:w:P:m:Bcpz:s:")) != -1) {
+	switch (c) {
+	case 'i':
+	    mnemud_cfg.iface = optarg;
+	    break;
+	case 'w':
+	    mnemud_cfg.workers = atoi(optarg);
+	    break;
+	case 'P':
+	    mnemud_cfg.pool = atoi(optarg);
+	    break;
+	case 'm':
+	    mnemud_cfg.mark = strtol(optarg, NULL, 0);
+	    break;
+	case 'B':
+	    mnemud_cfg.busy = 1;
+	    break;
+	case 'c':
+	    mnemud_cfg.pin = 1;
+	    break;
+	case 'p':
+	    mnemud_cfg.partition = 1;
+	    break;
+	case 'z':
+	    mn_hz = atoi(optarg);
+	    break;
+	case 's':
+	    seed = strtoull(optarg, NULL, 0);
+	    break;
+	default:
+	    usage(argv[0]);
+	}
+    }
+    if (argc - optind != 2 || mnemud_cfg.workers < 1 || mnemud_cfg.pool < 1)
+	usage(argv[0]);
+
+    err = mn_core_init();
+    if (!err)
+	err = mn_load_model(&model, argv[optind], argv[optind + 1], seed,
+			    mnemud_cfg.partition ? &emul : NULL);
+    if (err) {
+	fprintf(stderr, "mnemud: loading %s and %s: %s\n", argv[optind],
+		argv[optind + 1], strerror(-err));
+	return 1;
+    }
+    fprintf(stderr, "mnemud: %d hops, %d nodes, %u Hz\n",
+	    model.hopcount, model.nodecount, mn_hz);
+
+    workers = calloc(mnemud_cfg.workers, sizeof(*workers));
+    if (!workers)
+	return 1;
+    for (i = 0; i < mnemud_cfg.workers; ++i) {
+	err = worker_init(&workers[i], i);
+	if (err) {
+	    fprintf(stderr, "mnemud: worker %d on %s: %s\n", i,
+		    mnemud_cfg.iface, strerror(-err));
+	    return 1;
+	}
+    }
+    if (mnemud_cfg.partition &&
+	(err = mn_sched_init(workers, mnemud_cfg.workers, &model, emul))) {
+	fprintf(stderr, "mnemud: partitioning: %s\n", strerror(-err));
+	return 1;
+    }
+    free(emul);
+
+    signal(SIGINT, stop);
+    signal(SIGTERM, stop);
+    start_ns = now_ns();
+    for (i = 0; i < mnemud_cfg.workers; ++i)
+	pthread_create(&workers[i].thread, NULL, mnemud_cfg.partition ?
+		       mn_sched_main : worker_main, &workers[i]);
+    for (i = 0; i < mnemud_cfg.workers; ++i)
+	pthread_join(workers[i].thread, NULL);
+    if (mnemud_cfg.partition)
+	mn_sched_uninit(workers, mnemud_cfg.workers);
+    /* backwards: with AF_XDP worker 0 holds the UMEM of all */
+    for (i = mnemud_cfg.workers - 1; i >= 0; --i) {
+	pkts += workers[i].pkts;
+	drops += workers[i].drops;
+	nopath += workers[i].nopath;
+	other += workers[i].other;
+	late += workers[i].late;
+	rx += workers[i].io.rx;
+	nodesc += workers[i].io.rx_nodesc;
+	txerrs += workers[i].io.tx_errs;
+	slow += workers[i].io.tx_slow;
+	worker_uninit(&workers[i]);
+    }
+
+    printf("received %llu emulated %llu dropped %llu nopath %llu "
+	   "other %llu nodesc %llu txerrs %llu slow %llu late %llu\n",
+	   (unsigned long long)rx, (unsigned long long)pkts,
+	   (unsigned long long)drops, (unsigned long long)nopath,
+	   (unsigned long long)other, (unsigned long long)nodesc,
+	   (unsigned long long)txerrs, (unsigned long long)slow,
+	   (unsigned long long)late);
+    free(workers);
+    mn_model_uninit(&model);
+    return 0;
+}
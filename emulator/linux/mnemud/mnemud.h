@@ -0,0 +1,187 @@
+/*
+ * modelnet  mnemud.h
+ *
+ *     declarations shared by the parts of mnemud
+ *
+ * Copyright (c) 2006
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in
+ *      the documentation and/or other materials provided with the
+ *      distribution.
+ *    * Neither the names of Duke University nor The University of
+ *      California, San Diego, nor the names of the authors or contributors
+ *      may be used to endorse or promote products derived from
+ *      this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE
+ * USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+
+#ifndef _MNEMUD_H
+#define _MNEMUD_H
+
+#define _GNU_SOURCE             /* sendmmsg, cpu affinity */
+#include "mn_core.h"
+
+#include <signal.h>
+
+#define MODEL_SUBNET    htonl(0x0a000000)  /* 10.0.0.0/8 */
+#define MODEL_MASK      htonl(0xff000000)
+#define MODEL_FORCEBIT  htonl(0x00800000)
+#define MN_MTU          1500
+#define MN_BATCH        64      /* packets per read and per send */
+
+/*
+ * One packet in emulation.  Unlike the module's struct packet it holds
+ * the datagram itself, from the IP header on: in buf, a copy, as
+ * capture rings are handed back at once and packets stay in emulation
+ * for up to MN_CALENDAR_SECS; or with AF_XDP in the UMEM frame it
+ * arrived in, which is then not handed back until the packet leaves.
+ * See mn_io_pool().
+ */
+struct mn_desc {
+    struct list_head list;      /* on the free list or a calendar slot */
+    struct hop    **path;       /* next hop, NULL when done */
+    unsigned int    len;
+    int             home;       /* worker whose pool it is from */
+    unsigned long   ts;         /* handed to another worker: tick due */
+    int             msg;        /* and what for, MN_MSG_* */
+    unsigned char  *data;       /* buf, or in the UMEM */
+    u_int64_t       addr;       /* of the UMEM frame, AF_XDP */
+    unsigned char   buf[];      /* MN_MTU bytes unless AF_XDP */
+};
+
+/* what a worker reads from and writes to, see mn_io.c */
+struct mn_io {
+    int             type;
+#define MN_IO_TUN       1       /* IP packets on a tun device */
+#define MN_IO_TAP       2       /* ethernet frames on a tap device */
+#define MN_IO_PACKET    3       /* AF_PACKET TPACKET_V3 ring on a nic */
+#define MN_IO_XDP       4       /* AF_XDP socket on a nic queue */
+    int             fd;         /* capture */
+    int             txfd;       /* raw IP socket, reinjection */
+
+    /* TPACKET_V3 ring */
+    unsigned char  *ring;
+    size_t          ringlen;
+    unsigned int    block_size, block_nr, block;
+
+    /* AF_XDP, see mn_xdp.c */
+    struct mn_xsk  *xsk;
+
+    /* descriptors, see mn_io_pool() */
+    unsigned char  *descs;
+    size_t          desc_size;
+    int             ndescs;
+
+    /* pending sends, see mn_io_send() */
+    struct mn_desc *tx[MN_BATCH];
+    int             ntx;
+
+    /* stats */
+    u_int64_t       rx, tx_pkts;
+    u_int64_t       rx_nodesc;  /* dropped, no descriptor free */
+    u_int64_t       tx_errs;
+    u_int64_t       tx_slow;    /* AF_XDP, sent by the raw socket */
+};
+
+/*
+ * Single producer, single consumer ring of packets one worker hands
+ * another, see mn_sched.c.  The indices run free.
+ */
+#define MN_RING_SIZE    4096    /* a power of 2 */
+
+struct mn_ring {
+    struct mn_desc **descs;
+    unsigned int    head __attribute__((aligned(64)));  /* consumer's */
+    unsigned int    tail __attribute__((aligned(64)));  /* producer's */
+};
+
+#define MN_MSG_HOP      0       /* go on with the next hop at ts */
+#define MN_MSG_SEND     1       /* done, for the home worker to send */
+#define MN_MSG_FREE     2       /* dropped, for the home worker to free */
+
+struct mn_worker {
+    pthread_t       thread;
+    int             id;
+    struct mn_io    io;
+    struct mn_calendar cal;
+    struct list_head pool;      /* free descriptors */
+
+    /* partitioned scheduling, see mn_sched.c */
+    struct mn_ring *in;         /* in[i]: from worker i */
+    struct list_head *backlog;  /* backlog[i]: for worker i, ring full */
+    unsigned long   done __attribute__((aligned(64)));  /* ticks before
+                                 * this are run, and sent on */
+    unsigned long   seen;       /* ticks before this are captured */
+
+    u_int64_t       pkts __attribute__((aligned(64)));  /* emulated */
+    u_int64_t       drops;      /* by the model */
+    u_int64_t       nopath;     /* in 10/8 but not in the model */
+    u_int64_t       other;      /* not 10/8 to 10/8 */
+    u_int64_t       late;       /* handed over after its tick was run */
+};
+
+struct mnemud_config {
+    const char     *iface;      /* tun:NAME, packet:NIC, xdp:NIC, ... */
+    int             workers;
+    int             pool;       /* descriptors per worker */
+    int             mark;       /* SO_MARK of reinjected packets */
+    int             busy;       /* spin instead of sleeping */
+    int             pin;        /* bind worker i to cpu i */
+    int             partition;  /* hops owned by workers, mn_sched.c */
+};
+
+extern struct mnemud_config mnemud_cfg;
+extern volatile sig_atomic_t mn_stop;
+
+extern unsigned long mn_now_tick(void);
+extern void     mn_worker_pin(struct mn_worker *w);
+extern struct hop **mn_arrive(struct mn_worker *w, struct mn_desc *d);
+
+extern int      mn_sched_init(struct mn_worker *workers, int n,
+                              struct mn_model *m, const int *emul);
+extern void     mn_sched_uninit(struct mn_worker *workers, int n);
+extern void    *mn_sched_main(void *arg);
+
+extern int      mn_load_model(struct mn_model *m, const char *model,
+                              const char *route, u_int64_t seed, int **emul);
+
+extern int      mn_io_open(struct mn_io *io, const char *iface, int queue,
+                           int nqueues, int mark);
+extern void     mn_io_close(struct mn_io *io);
+extern int      mn_io_pool(struct mn_io *io, struct list_head *pool, int n);
+extern int      mn_io_recv(struct mn_io *io, struct list_head *pool,
+                           struct list_head *got, int max, int timeout_ms);
+extern void     mn_io_send(struct mn_io *io, struct mn_desc *d,
+                           struct list_head *pool);
+extern void     mn_io_flush(struct mn_io *io, struct list_head *pool);
+extern void     mn_io_sendraw(struct mn_io *io, struct mn_desc **d, int n);
+
+extern int      mn_xdp_open(struct mn_io *io, const char *iface, int queue,
+                            int nqueues, int generic);
+extern void     mn_xdp_close(struct mn_io *io);
+extern int      mn_xdp_pool(struct mn_io *io, struct list_head *pool, int n);
+extern int      mn_xdp_recv(struct mn_io *io, struct list_head *pool,
+                            struct list_head *got, int max);
+extern void     mn_xdp_flush(struct mn_io *io, struct list_head *pool);
+extern int      mn_xdp_fd(struct mn_io *io);
+
+#endif                          /* _MNEMUD_H */
@@ -0,0 +1,173 @@
+#!/bin/bash
+#
+# xdpbench.sh - packets per second through the emulator, by data path
+#
+# Builds a box-local testbed out of network namespaces: edge nodes A
+# (10.0.0.1) and B (10.0.0.5) and the emulator E on one bridge, A and B
+# routing 10/8 through E.  pktgen in A sends small UDP packets to B as
+# fast as it can, through a two node model whose hops neither delay nor
+# limit, and B's receive counter gives what each data path forwards:
+#
+#   module      linuxmodelnet.ko, netfilter hook and kernel forwarding
+#   packet      mnemud, AF_PACKET ring in, raw socket out
+#   xdpgeneric  mnemud, AF_XDP on generic XDP
+#   xdp         mnemud, AF_XDP on native XDP (veth has it, but only
+#               a real nic does zero-copy)
+#
+# usage: xdpbench.sh [-t secs] [-s pktsize] [-w workers] [mode ...]
+#
+# Needs root, pktgen (modprobe pktgen), and for the module mode the
+# module loaded and modelload on the PATH.  Without modes, runs them
+# all.  pktgen sends one flow on one queue, so -w > 1 only shows the
+# cost of the extra workers here; scaling wants a multiqueue nic and
+# many flows.
+
+MNEMUD=${MNEMUD:-$(dirname $0)/mnemud}
+SECS=10
+SIZE=64
+WORKERS=1
+
+while getopts "t:s:w:" opt; do
+    case $opt in
+	t) SECS=$OPTARG ;;
+	s) SIZE=$OPTARG ;;
+	w) WORKERS=$OPTARG ;;
+	*) echo "usage: $0 [-t secs] [-s pktsize] [-w workers] [mode ...]"
+	   exit 1 ;;
+    esac
+done
+shift $((OPTIND - 1))
+MODES=${@:-module packet xdpgeneric xdp}
+
+TMP=$(mktemp -d)
+trap 'cleanup; rm -rf $TMP' EXIT
+
+cat > $TMP/bench.model <<EOF
+<?xml version="1.0" encoding="ISO-8859-1"?>
+<model>
+  <emulators>
+    <emul hostname="$(hostname)" int_idx="0">
+      <host hostname="a">
+        <subnet int_emul="0" int_nodes="1" vnet="10.0.0.0/30">
+          <virtnode int_idx="0" int_vn="0" role="virtnode" vip="10.0.0.1"/>
+        </subnet>
+      </host>
+      <host hostname="b">
+        <subnet int_emul="0" int_nodes="1" vnet="10.0.0.4/30">
+          <virtnode int_idx="1" int_vn="1" role="virtnode" vip="10.0.0.5"/>
+        </subnet>
+      </host>
+    </emul>
+  </emulators>
+  <hops>
+    <hop int_dst="1" int_emul="0" int_idx="0" int_src="0" specs="open"/>
+    <hop int_dst="0" int_emul="0" int_idx="1" int_src="1" specs="open"/>
+  </hops>
+  <specs>
+    <open dbl_kbps="0" dbl_plr="0" int_delayms="0" int_qlen="10000"/>
+  </specs>
+</model>
+EOF
+cat > $TMP/bench.route <<EOF
+<?xml version="1.0" encoding="ISO-8859-1"?>
+<allpairs>
+  <path int_vndst="1" int_vnsrc="0" hops="0 " />
+  <path int_vndst="0" int_vnsrc="1" hops="1 " />
+</allpairs>
+EOF
+
+cleanup() {
+    [ -n "$PID" ] && kill -INT $PID 2>/dev/null && wait $PID
+    PID=
+    for n in A B E S; do ip netns del mnb$n 2>/dev/null; done
+}
+
+setup() {
+    for n in A B E S; do ip netns add mnb$n; done
+    ip -n mnbS link add br0 type bridge
+    ip -n mnbS link set br0 up
+    for n in A B E; do
+	ip link add ${n}0 netns mnb$n type veth peer name ${n}p netns mnbS
+	ip -n mnbS link set ${n}p master br0 up
+	ip -n mnb$n link set ${n}0 up
+	ip -n mnb$n link set lo up
+    done
+    ip -n mnbA addr add 10.0.0.1/32 dev A0
+    ip -n mnbA addr add 192.168.77.11/24 dev A0
+    ip -n mnbA route add 10.0.0.0/8 via 192.168.77.1 src 10.0.0.1
+    ip -n mnbB addr add 10.0.0.5/32 dev B0
+    ip -n mnbB addr add 192.168.77.15/24 dev B0
+    ip -n mnbB route add 10.0.0.0/8 via 192.168.77.1 src 10.0.0.5
+    ip -n mnbE addr add 192.168.77.1/24 dev E0
+    ip -n mnbE route add 10.0.0.0/8 dev E0
+    # the emulator needs B's MAC before the first packet
+    ip netns exec mnbA ping -c1 -W1 192.168.77.1 >/dev/null
+    ip netns exec mnbE ping -c1 -W1 -I 192.168.77.1 10.0.0.5 >/dev/null
+}
+
+pg() {
+    ip netns exec mnbA sh -c "echo '$2' > /proc/net/pktgen/$1" ||
+	echo "pktgen: $1: $2 failed" >&2
+}
+
+rx_packets() {
+    ip netns exec mnbB cat /sys/class/net/B0/statistics/rx_packets
+}
+
+run() {
+    local mode=$1 before after pgpid
+
+    cleanup
+    setup
+    case $mode in
+	module)
+	    ip netns exec mnbE sysctl -qw net.ipv4.ip_forward=1
+	    # A and B share a segment, keep them from going around E
+	    ip netns exec mnbE sysctl -qw net.ipv4.conf.all.send_redirects=0
+	    ip netns exec mnbE sysctl -qw net.ipv4.conf.E0.send_redirects=0
+	    ip netns exec mnbE modelload $TMP/bench.model $TMP/bench.route \
+		>/dev/null || return 1
+	    ;;
+	*)
+	    ip netns exec mnbE sysctl -qw net.ipv4.ip_forward=0
+	    ip netns exec mnbE $MNEMUD -w $WORKERS -i $mode:E0 \
+		$TMP/bench.model $TMP/bench.route 2>$TMP/mnemud.err &
+	    PID=$!
+	    sleep 1
+	    kill -0 $PID 2>/dev/null || { cat $TMP/mnemud.err; return 1; }
+	    ;;
+    esac
+
+    pg kpktgend_0 "rem_device_all"
+    pg kpktgend_0 "add_device A0"
+    pg A0 "count 0"
+    pg A0 "clone_skb 0"
+    pg A0 "pkt_size $SIZE"
+    pg A0 "delay 0"
+    pg A0 "dst 10.0.0.5"
+    pg A0 "src_min 10.0.0.1"
+    pg A0 "src_max 10.0.0.1"
+    pg A0 "dst_mac $(ip netns exec mnbE cat /sys/class/net/E0/address)"
+    pg A0 "udp_dst_min 9"
+    pg A0 "udp_dst_max 9"
+
+    ip netns exec mnbA sh -c "echo start > /proc/net/pktgen/pgctrl" &
+    pgpid=$!
+    sleep 1                     # let it get going
+    before=$(rx_packets)
+    sleep $SECS
+    after=$(rx_packets)
+    ip netns exec mnbA sh -c "echo stop > /proc/net/pktgen/pgctrl"
+    wait $pgpid
+
+    printf "%-12s %10d pps\n" $mode $(( (after - before) / SECS ))
+}
+
+[ -d /proc/net/pktgen ] || { echo "$0: needs pktgen, modprobe pktgen"; exit 1; }
+[ -x $MNEMUD ] || { echo "$0: no $MNEMUD, make it first"; exit 1; }
+
+printf "%-12s %10s     (%d byte packets, %d s, %d workers)\n" mode rate \
+    $SIZE $SECS $WORKERS
+for mode in $MODES; do
+    run $mode || echo "$mode: failed"
+done
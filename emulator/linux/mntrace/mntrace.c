@@ -0,0 +1,409 @@
+/*
+ * modelnet  mntrace.c
+ *
+ *     Collect packets captured on traced hops from the module's per-cpu
+ *     rings (/dev/mntrace) and write them as one pcapng file, one
+ *     interface per hop.
+ *
+ * Copyright (c) 2006
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in
+ *      the documentation and/or other materials provided with the
+ *      distribution.
+ *    * Neither the names of Duke University nor The University of
+ *      California, San Diego, nor the names of the authors or contributors
+ *      may be used to endorse or promote products derived from
+ *      this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE
+ * USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+/*
+ * Usage: mntrace [-d device] [-c count] [-s seconds] -w file.pcapng
+ *
+ * Each pass takes everything the rings hold, sorts it by timestamp
+ * and writes it out before handing the space back to the module, so
+ * the output is in time order except across passes, where a record
+ * from a slow cpu can trail by up to one pass (200ms).  Packets start
+ * at the IP header (LINKTYPE_RAW).  Drops by the hop are marked with a
+ * comment, and in the IP tos as before (1 loss rate, 2 full queue).
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <sys/mman.h>
+
+#include "mn_ring.h"
+
+#define LINKTYPE_RAW      101
+#define PCAPNG_SHB        0x0A0D0D0A
+#define PCAPNG_IDB        0x00000001
+#define PCAPNG_EPB        0x00000006
+#define PCAPNG_BOM        0x1A2B3C4D
+#define OPT_ENDOFOPT      0
+#define OPT_COMMENT       1
+#define IF_NAME           2
+#define IF_TSRESOL        9
+
+#define POLL_MS           200
+
+struct ring {
+    struct mn_ring_hdr *hdr;
+    unsigned char  *data;
+    uint64_t        drops0;     /* drops when we started */
+};
+
+struct pending {
+    uint64_t        tstamp;
+    uint64_t        seq;        /* keeps one cpu's records in order */
+    const struct mn_tcpdump_hdr *rec;
+};
+
+static struct ring *rings;
+static int      nr_rings;
+static FILE    *out;
+
+static int     *ifidx;          /* hop id -> pcapng interface, or -1 */
+static int      ifidx_len;
+static int      nr_ifs;
+
+static volatile sig_atomic_t done;
+
+static void
+usage(const char *prog)
+{
+    fprintf(stderr, "usage: %s [-d device] [-c count] [-s seconds] "
+	    "-w file.pcapng|-\n", prog);
+    exit(1);
+}
+
+static void
+stop(int sig)
+{
+    done = 1;
+}
+
+static void
+put32(uint32_t v)
+{
+    fwrite(&v, 4, 1, out);
+}
+
+static void
+put_option(uint16_t code, const void *val, uint16_t len)
+{
+    static const unsigned char zero[4];
+
+    fwrite(&code, 2, 1, out);
+    fwrite(&len, 2, 1, out);
+    fwrite(val, len, 1, out);
+    fwrite(zero, (4 - (len & 3)) & 3, 1, out);
+}
+
+#define OPTLEN(len) (4 + (((len) + 3) & ~3))
+
+static void
+write_shb(void)
+{
+    uint32_t len = 28;
+
+    put32(PCAPNG_SHB);
+    put32(len);
+    put32(PCAPNG_BOM);
+    put32(1);                   /* version 1.0 */
+    put32(0xffffffff);          /* section length unknown */
+    put32(0xffffffff);
+    put32(len);
+}
+
+/* one interface per hop, described the first time the hop shows up */
+static int
+hop_interface(uint32_t hop)
+{
+    char name[32];
+    unsigned char tsresol = 9;  /* nanoseconds */
+    uint32_t len;
+    int n;
+
+    if (hop >= (uint32_t)ifidx_len) {
+	int newlen = ifidx_len ? ifidx_len : 64;
+
+	while ((uint32_t)newlen <= hop)
+	    newlen *= 2;
+	ifidx = realloc(ifidx, newlen * sizeof(*ifidx));
+	if (!ifidx) {
+	    perror("realloc");
+	    exit(1);
+	}
+	for (n = ifidx_len; n < newlen; ++n)
+	    ifidx[n] = -1;
+	ifidx_len = newlen;
+    }
+    if (ifidx[hop] >= 0)
+	return ifidx[hop];
+
+    snprintf(name, sizeof(name), "hop%u", hop);
+    len = 20 + OPTLEN(strlen(name)) + OPTLEN(1) + 4;
+    put32(PCAPNG_IDB);
+    put32(len);
+    put32(LINKTYPE_RAW);        /* and 16 reserved bits */
+    put32(0);                   /* snaplen: none */
+    put_option(IF_NAME, name, strlen(name));
+    put_option(IF_TSRESOL, &tsresol, 1);
+    put32(OPT_ENDOFOPT);
+    put32(len);
+
+    return ifidx[hop] = nr_ifs++;
+}
+
+static void
+write_epb(const struct mn_tcpdump_hdr *rec)
+{
+    static const unsigned char zero[4];
+    const char *comment = NULL;
+    uint32_t len, iface, caplen = rec->captureLength;
+
+    iface = hop_interface(rec->linkId);
+
+    if (rec->flags & MN_REC_PLRDROP)
+	comment = "dropped by loss rate";
+    else if (rec->flags & MN_REC_QDROP)
+	comment = "dropped by full queue";
+
+    len = 32 + ((caplen + 3) & ~3);
+    if (comment)
+	len += OPTLEN(strlen(comment)) + 4;
+
+    put32(PCAPNG_EPB);
+    put32(len);
+    put32(iface);
+    put32(rec->tstamp >> 32);
+    put32(rec->tstamp & 0xffffffff);
+    put32(caplen);
+    put32(rec->packetLength);
+    fwrite(rec + 1, caplen, 1, out);
+    fwrite(zero, (4 - (caplen & 3)) & 3, 1, out);
+    if (comment) {
+	put_option(OPT_COMMENT, comment, strlen(comment));
+	put32(OPT_ENDOFOPT);
+    }
+    put32(len);
+}
+
+static int
+cmp_pending(const void *a, const void *b)
+{
+    const struct pending *pa = a, *pb = b;
+
+    if (pa->tstamp != pb->tstamp)
+	return pa->tstamp < pb->tstamp ? -1 : 1;
+    return pa->seq < pb->seq ? -1 : pa->seq > pb->seq;
+}
+
+/*
+ * Take everything the rings hold, write it in time order, give the
+ * space back.  Returns the number of packets written.
+ */
+static long
+drain(long limit)
+{
+    static struct pending *pend;
+    static long     pendlen;
+    uint64_t       *tails;
+    long            n = 0, i;
+    uint64_t        seq = 0;
+    int             r;
+
+    tails = calloc(nr_rings, sizeof(*tails));
+    if (!tails) {
+	perror("calloc");
+	exit(1);
+    }
+
+    for (r = 0; r < nr_rings; ++r) {
+	struct mn_ring_hdr *hdr = rings[r].hdr;
+	uint64_t head, pos, mask;
+
+	if (!hdr)
+	    continue;
+	mask = hdr->data_size - 1;
+	head = __atomic_load_n(&hdr->head, __ATOMIC_ACQUIRE);
+	for (pos = hdr->tail; pos < head;) {
+	    const struct mn_tcpdump_hdr *rec =
+		(const void *)(rings[r].data + (pos & mask));
+
+	    pos += rec->reclen;
+	    if (rec->type != MN_REC_PKT)
+		continue;
+	    if (n == pendlen) {
+		pendlen = pendlen ? 2 * pendlen : 4096;
+		pend = realloc(pend, pendlen * sizeof(*pend));
+		if (!pend) {
+		    perror("realloc");
+		    exit(1);
+		}
+	    }
+	    pend[n].tstamp = rec->tstamp;
+	    pend[n].seq = seq++;
+	    pend[n].rec = rec;
+	    ++n;
+	}
+	tails[r] = pos;
+    }
+
+    qsort(pend, n, sizeof(*pend), cmp_pending);
+    if (limit >= 0 && n > limit)
+	n = limit;
+    for (i = 0; i < n; ++i)
+	write_epb(pend[i].rec);
+    fflush(out);
+
+    /* records past the limit are dropped with the rest of the pass */
+    for (r = 0; r < nr_rings; ++r)
+	if (rings[r].hdr)
+	    __atomic_store_n(&rings[r].hdr->tail, tails[r], __ATOMIC_RELEASE);
+    free(tails);
+    return n;
+}
+
+static int
+map_rings(int fd)
+{
+    struct mn_ring_hdr *hdr;
+    long            pagesz = sysconf(_SC_PAGESIZE);
+    size_t          ringbytes;
+    int             r, found = 0;
+
+    hdr = mmap(NULL, pagesz, PROT_READ, MAP_SHARED, fd, 0);
+    if (hdr == MAP_FAILED) {
+	if (errno == ENXIO)
+	    fprintf(stderr, "mntrace: no capture rings yet, "
+		    "trace a hop first (hoptrace on <hop>)\n");
+	else
+	    perror("mntrace: mmap");
+	return -1;
+    }
+    if (hdr->magic != MN_RING_MAGIC || hdr->version != MN_RING_VERSION) {
+	fprintf(stderr, "mntrace: ring version %u, expected %u\n",
+		hdr->version, MN_RING_VERSION);
+	return -1;
+    }
+    ringbytes = hdr->data_offset + (size_t)hdr->data_size;
+    nr_rings = hdr->nr_rings;
+    munmap(hdr, pagesz);
+
+    rings = calloc(nr_rings, sizeof(*rings));
+    if (!rings) {
+	perror("calloc");
+	return -1;
+    }
+    for (r = 0; r < nr_rings; ++r) {
+	hdr = mmap(NULL, ringbytes, PROT_READ | PROT_WRITE, MAP_SHARED,
+		   fd, (off_t)r * ringbytes);
+	if (hdr == MAP_FAILED) {
+	    if (errno == ENXIO)
+		continue;       /* cpu not possible */
+	    perror("mntrace: mmap");
+	    return -1;
+	}
+	rings[r].hdr = hdr;
+	rings[r].data = (unsigned char *)hdr + hdr->data_offset;
+	rings[r].drops0 = hdr->drops;
+	++found;
+    }
+    return found;
+}
+
+int
+main(int argc, char **argv)
+{
+    const char     *dev = "/dev/" MN_RING_DEV;
+    const char     *file = NULL;
+    long            count = -1, total = 0;
+    int             seconds = 0;
+    uint64_t        drops = 0;
+    time_t          start;
+    struct pollfd   pfd;
+    int             c, r, fd;
+
+    while ((c = getopt(argc, argv, "d:c:s:w:")) != -1) {
+	switch (c) {
+	case 'd': dev = optarg; break;
+	case 'c': count = atol(optarg); break;
+	case 's': seconds = atoi(optarg); break;
+	case 'w': file = optarg; break;
+	default: usage(argv[0]);
+	}
+    }
+    if (!file || optind != argc)
+	usage(argv[0]);
+
+    fd = open(dev, O_RDWR);
+    if (fd < 0) {
+	fprintf(stderr, "mntrace: %s: %s\n", dev, strerror(errno));
+	return 1;
+    }
+    r = map_rings(fd);
+    if (r <= 0)
+	return 1;
+
+    out = strcmp(file, "-") ? fopen(file, "w") : stdout;
+    if (!out) {
+	fprintf(stderr, "mntrace: %s: %s\n", file, strerror(errno));
+	return 1;
+    }
+    write_shb();
+
+    signal(SIGINT, stop);
+    signal(SIGTERM, stop);
+    fprintf(stderr, "mntrace: collecting from %d rings\n", r);
+
+    start = time(NULL);
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+    while (!done) {
+	poll(&pfd, 1, POLL_MS);
+	total += drain(count < 0 ? -1 : count - total);
+	if (count >= 0 && total >= count)
+	    break;
+	if (seconds && time(NULL) - start >= seconds)
+	    break;
+    }
+    if (count < 0 || total < count)
+	total += drain(count < 0 ? -1 : count - total);
+
+    for (r = 0; r < nr_rings; ++r)
+	if (rings[r].hdr)
+	    drops += rings[r].hdr->drops - rings[r].drops0;
+    fprintf(stderr, "mntrace: %ld packets, %llu lost to full rings\n",
+	    total, (unsigned long long)drops);
+
+    if (out != stdout)
+	fclose(out);
+    return 0;
+}
@@ -41,10 +41,16 @@
 #include <linux/init.h>
 #include <linux/jiffies.h>
 #include <linux/random.h>
+#include <linux/math64.h>
+#include <linux/timex.h>
 
 #include <linux/vmalloc.h>
 #include <linux/workqueue.h>	/* We scheduale tasks here */
 #include <linux/sched.h>	/* We need to put ourselves to sleep  */
+#include <linux/kthread.h>
+#include <linux/cpumask.h>
+#include <linux/rculist.h>
+#include <linux/log2.h>
 
 
 /* #define _IP_VHL */
@@ -52,23 +58,63 @@
 #include <asm/irq.h>
 #include <asm/uaccess.h>
 
-#ifdef MN_TCPDUMP
-#include "mn_tcpdump.h"
-#endif
-
 #include "ip_modelnet.h"
 #include "mn_pathtable.h"
+#include "mn_tcpdump.h"
+#include "mn_flow.h"
+#include "mn_qdisc.h"
+#include "mn_replay.h"
 
+#define CREATE_TRACE_POINTS
+#include "mn_trace.h"
 
-/* keep hopclock from queueing itself */
+
+/* one workqueue is shared by the hopclocks of every namespace */
 #define MN_WORKQUEUE_NAME "mnwq"
-static int modelnet_die = 0;
 static void hopclock(struct work_struct *);
 static struct workqueue_struct *modelnet_workqueue;
-static DECLARE_DELAYED_WORK(hopclock_task, hopclock);
 
-/* better if calendar_tick were atomic_t, but it needs to be unsigned long */
-DEFINE_SPINLOCK(calendar_lock);
+/* index of our struct mn_net in each namespace's net_generic array */
+int mn_net_id;
+
+/*
+ * Calendar ticks per second, see mn_core.c.  HZ by default, so hopclock
+ * drains one tick per jiffy; at a higher rate the polling threads below
+ * release packets within microseconds of their due time, while hopclock
+ * alone releases them a jiffy's worth at a time.
+ */
+module_param(mn_hz, uint, 0444);
+MODULE_PARM_DESC(mn_hz, "calendar ticks per second (default HZ)");
+
+/*
+ * With poll_cpus set, a kernel thread bound to each of those cpus
+ * busy-polls the calendars in place of hopclock, the namespaces dealt
+ * out among the threads in turn.  Keep other work off those cpus with
+ * isolcpus=.  mn_poll_list is walked under RCU by the threads and
+ * changed under mn_poll_mutex.
+ */
+static char *poll_cpus = "";
+module_param(poll_cpus, charp, 0444);
+MODULE_PARM_DESC(poll_cpus, "cpus to busy-poll the calendar on, e.g. 2-3 (default none)");
+static struct task_struct **mn_pollers;
+static int mn_npollers;
+static int mn_poll_next;
+static LIST_HEAD(mn_poll_list);
+static DEFINE_MUTEX(mn_poll_mutex);
+
+/*
+ * Global budget for memory held in emulation, see MN_FREE_PKT.  A
+ * packet arriving while it is used up is dropped at once and counted
+ * in mn_qmem_drops, apart from the drops the model makes.  By default
+ * the budget is a quarter of RAM.
+ */
+struct percpu_counter mn_qmem;
+unsigned long mn_qmem_limit;
+static unsigned long qmem_mb;
+module_param(qmem_mb, ulong, 0444);
+MODULE_PARM_DESC(qmem_mb, "MB of packets held in emulation before dropping new ones (default RAM/4)");
+static unsigned long mn_qmem_peak;
+static struct percpu_counter mn_qmem_drops;
 
 
 /* Hopefully we are doing this right and this is the hook to
@@ -76,49 +122,20 @@ DEFINE_SPINLOCK(calendar_lock);
 int (*ip_rcv_finish_hook)(struct sk_buff *) = NULL;
 
 
-/* packet_calendar is a circular array of packet lists.  each element
- * lists the packets due to start new hops on that timeslice.   The elements
- * correspond to one clock tick (hz).   It was efficient to size it to a
- * power of 2 to enable masking of calendar_tick to determine the
- * corresponding element in packet_calendar.
- * Usually sized to cover one second of clock ticks.
+/* The packet calendar (struct mn_calendar, see mn_core.h) is a
+ * circular array of packet lists.  each element lists the packets due
+ * to start new hops on that timeslice.   The elements correspond to one
+ * calendar tick (mn_hz).
+ * Sized to cover MN_CALENDAR_SECS seconds of calendar ticks, or as much
+ * of that as 2^MN_CALENDAR_MAXBITS slots do at high mn_hz.
+ *
+ * Each namespace has its own calendar and calendar_lock in struct
+ * mn_net.  Better if calendar.tick were atomic_t, but it needs to be
+ * unsigned long.
  */
-static pktlist *packet_calendar;   /* the packet scheduling array */
-
-/* see ip_modelnet.h for #defines relating to calendar queue */
-
-unsigned long    calendar_tick = 0;
 
 /* stats and debug */
-struct mn_error g_error;
 u_int32_t       mn_debug_g;
-static int      pktcount[60];
-
-/* Random Number Generation */
-static int mti;   
-static u_int mt[MERS_N];
-
-#ifdef MODELNET_PROFILE
-/* 
-   get_hr_time() - reads the rdtsc (read time stamp counter or
-   something) register and returns the number of cpu ticks
- */
-
-unsigned long long get_hr_time( void ) 
-{
-    unsigned long long a;
-  
-    unsigned int vlo, vhi;
-    //asm volatile ("rdtsc":"=A" (a));
-  
-    asm volatile("rdtsc":"=a"(vlo),"=d"(vhi));
-    //a = vhi << 32 + vlo;
-    a = vhi;
-    a = a << 32 | vlo;
-    return a;
-}
-#endif
-
 
 /*
  * [forward_packet] called when emulation of all hops in path is complete
@@ -126,47 +143,39 @@ unsigned long long get_hr_time( void )
 static void forward_packet(struct packet *pkt)
 {
     struct  iphdr *ip;
+    struct mn_net *mnet = pkt->mnet;
     if (pkt->skb == NULL) 
     {
         /*
          * return remote packet home when cached
          */
-        /* XXX remote not implemented yet */
-        remote_hop(pkt, pkt->cachehost);    
+        remote_hop(pkt, pkt->cachehost);
         return;
     }
     
     ip = ip_hdr(pkt->skb);
+    trace_mn_forward(pkt);
+
+    if (pkt->flow.used)
+        mn_flow_forward(pkt);
+
+    /* end-to-end timing error, only packets from the calendar have one */
+    if (pkt->info.hop) {
+        mnet->mn.stats.pkt_toterr += pkt->info.wait_time;
+        mnet->mn.stats.pkt_toterrsq +=
+            (u_int64_t)pkt->info.wait_time * pkt->info.wait_time;
+        mn_hist_add(mnet->pkterr_hist, pkt->info.wait_time);
+    }
     ip_rcv_finish_hook(pkt->skb);
 
     /*
      * we lose this skb, IP output owns it now
      */
     pkt->skb = NULL;
-    pktcount[(jiffies / HZ) % (sizeof(pktcount) / sizeof(*pktcount))]++;
-}
-
-
-
-/*
- * [update_bwq] Update virtual bandwidth queue in hop.
- * Bring the length and head position of virtual bandwidth queue up to
- * the current time (calendar_tick).
- * *note* we don't keep track of bytedepth here, as we don't know
- * packet lengths.  We decrement that when the packet leaves the
- * queue+delay in emulate_nexthop.
- */
-static void update_bwq(struct hop *hop, unsigned long tick)
-{
-    while (hop->slotdepth && hop->exittick[hop->headslot]<tick) 
-    {
-	hop->exittick[hop->headslot] = 0;
-	hop->slotdepth--;
-	hop->bytedepth -= hop->slotlen[hop->headslot];
-	hop->slotlen[hop->headslot] = 0;
-	if (++hop->headslot == hop->qsize)
-	    hop->headslot = 0;
-    }
+    if (pkt->qmem)
+        mn_qmem_uncharge(pkt);
+    mnet->pktcount[(jiffies / HZ) %
+                   (sizeof(mnet->pktcount) / sizeof(*mnet->pktcount))]++;
 }
 
 
@@ -175,13 +184,12 @@ static void update_bwq(struct hop *hop, unsigned long tick)
  * [emulate_hop] Emulate the crossing of a single network link hop.
  * return ENOBUFS if hop drops pkt, 0 otherwise.
  *
- * Emulate link loss rate hop->plr [packet loss rate]
- * Emulate bandwidth queuing:
- *    - update virtual bw queue
- *    - drop packet when bw queue is full
- *    - calculate when packet will exit bw queue (tailexit)
- *    - put packet on tail of notional bw queue by
- *      updating slotdepth and exittick
+ * The hop model is mn_core.c's:
+ *    - mn_hop_admit() applies the link loss rate hop->plr and drops the
+ *      packet when the virtual bw queue is full
+ *    - mn_hop_enqueue() puts it on the tail of the bw queue and says
+ *      when it will leave (tailexit)
+ * around which this adds the queue discipline, tcpdump and stats.
  * Emulate link latency hop->delay
  * Insert pkt into calendar queue for time (tailexit + hop->delay)
  *
@@ -190,165 +198,74 @@ static void update_bwq(struct hop *hop, unsigned long tick)
 
 static int emulate_hop(struct packet *pkt, struct hop *hop, int needlock)
 {
-    int newslot;
-    unsigned long tailexit, curtick;
-  
-    /* This is tcpdump stuff */
-    int willDropPacket_plr = 0;
-    int willDropPacket_bw = 0;
-    long randomVal = random_bits();
+    unsigned long tailexit, curtick, start;
+    struct mn_net *mnet = pkt->mnet;
+    int verdict;
 
     if (needlock)
-        spin_lock_bh(&calendar_lock);
-    curtick = calendar_tick;
+        spin_lock_bh(&mnet->calendar_lock);
+    curtick = mnet->calendar.tick;
     if (needlock)
-        spin_unlock_bh(&calendar_lock);
+        spin_unlock_bh(&mnet->calendar_lock);
 
     spin_lock_bh(&hop->lock);
 
-    newslot = (hop->headslot + hop->slotdepth) % hop->qsize;
-
-    /* drop packets for link losses */
-    /* get_random_bytes returns a value between 0 and
-     * (2**32)-1, whereas random() on a bsd machine will return
-     * (2**31)-1 ... I zero out the top most bit just in case as it can
-     * do no harm.
-     */
-    if ((hop->plr && ((randomVal & 0x7fffffff) < hop->plr))) {
-	/* drop stats? */
-	willDropPacket_plr = 1;
-    }
+    /* pass saved calendar_tick value to avoid another lock/unlock */
+    verdict = mn_hop_admit(hop, curtick);
 
-    if (hop->KBps) {  /* bw delay of 0 means no bw limit */
-        /* pass saved calendar_tick value to avoid another lock/unlock */
-        update_bwq(hop, curtick);
-        /* drop packets for queue overflows */
-        if (hop->slotdepth >= hop->qsize) {
-            willDropPacket_bw = 1;
-            ++hop->qdrops;      /* stats */
-        }
+    /* FIFO hops have no qdisc, see mn_qdisc.c */
+    if (unlikely(hop->qdisc) && !verdict &&
+        mn_xtq_enqueue(hop, pkt, curtick)) {
+        verdict = MN_HOP_QDROP;
+        ++hop->qdrops;
+        mnet->mn.stats.pkt_reddrops++;
     }
 
-#ifdef MN_TCPDUMP
-    /* XXX needs lock */
-    handle_tcpdump(pkt, hop, willDropPacket_plr, willDropPacket_bw);
-#endif
+    if (mn_hop_traced(hop))
+        handle_tcpdump(pkt, hop, verdict & MN_HOP_PLRDROP,
+                       verdict & MN_HOP_QDROP);
 
     /* If we already calculated to drop the packet, do it now */
-    if (willDropPacket_plr || willDropPacket_bw) {
+    if (verdict) {
+        if (verdict & MN_HOP_PLRDROP)
+            trace_mn_hop_plr_drop(hop, pkt);
+        else
+            trace_mn_hop_queue_drop(hop, pkt);
         spin_unlock_bh(&hop->lock);
         return -ENOBUFS;
     }
 
 #if 0
     /* XXX needs to be locked or atomic, but it's not used anyway */
-    mn.stats.pkts_queued++;     /* stats */
+    mnet->mn.stats.pkts_queued++;     /* stats */
 #endif
-    ++hop->pkts;                /* stats */
-    hop->bytes += pkt->info.len;        /* stats */
-
-    /* if hop has queued packets, set tailexit to time the tail packet
-     * is scheduled to exit hop.
-     * if queue is empty, use the current time and reset fragment to 0 
-     */
-    if (hop->slotdepth) {
-        tailexit = hop->exittick[(hop->headslot + hop->slotdepth -1) % hop->qsize];
-    }
-    else {
-        tailexit = curtick;
-        hop->fragment=0;
-    }
-
-    /* for hops with bw limits, calculate with integer math how many
-     * ticks it will take to transmit the pkt(bwdelay).
-     * Use 'fragment' to store how many bytes went unused in the final tick.
-     * These bytes can be used by the next packet.  'fragment' is
-     * important for small packets on fast links.
-     */
-  
-    if (hop->KBps) {
-        u_int len = pkt->info.len;
-        u_int bwdelay = 0;
-        int fragused=0;
-
-        if (hop->fragment>len) {
-            hop->fragment -= len;
-            len = 0;
-        }
-        else {
-            if (hop->fragment) {
-                len -= hop->fragment;
-                fragused=1;
-                hop->fragment = 0;
-            }
-        }
-
-        /*
-         * For schedulers with relatively slow ticks, or
-         * fast links, we have the case where the bytespertick for
-         * a hop could be fairly close to the packet size. Since Linux
-         * does not support floating point operations in kernel, we are
-         * forced to use integer math which means calculating bwdelay
-         * will lead to a non-trivial remainder which isn't accounted for.
-         *
-         * To combat this, we can either:
-         * 1. Use an accumulator to add all the remainder values to and
-         * charge that when it becomes big enough, or
-         * 2. Randomly decide to charge a packet extra if the remainder
-         * is large enough. So if a packet is 150 bytes and the bytespertick
-         * is 100 bytes, we have a 50% chance of having a bwdelay of 2 ticks
-         * instead of 1 (150/100 in integer math). That means that for a
-         * large enough number of bytes, the amount we are charged is expected
-         * to be the correct amount.
-         */
-        if (len && hop->bytespertick>50) {
-            int remainder;
-            u_int randNum;
-
-            bwdelay = (len / hop->bytespertick) + fragused;	    
-            remainder = len % hop->bytespertick;
-
-            randNum = randomVal % hop->bytespertick;
-            if (randNum < remainder) {
-                bwdelay++;
-            }
-        } 
-        else {
-            bwdelay = ((u_int) len * (u_int)HZ) / (u_int) (1000*hop->KBps);
-        }
-
-        if (!bwdelay)
-            g_error.delayzero++;
-
-        tailexit += bwdelay;
-    }
-
-    /* add packet to virtual queue of this hop */
-    ++hop->slotdepth;
-    hop->slotlen[newslot] = pkt->info.len;
-    hop->bytedepth += pkt->info.len;
-    hop->exittick[newslot] = tailexit;
+    start = mn_hop_tail(hop, curtick);
+    tailexit = mn_hop_enqueue(hop, pkt->info.len, curtick);
+    if (hop->tpb && tailexit == start)
+        mnet->g_error.delayzero++;
+    pkt->qticks += tailexit - curtick;  /* per-flow stats */
 
 #ifdef UNIFIED_PKT_SCHEDULE
     /*
      * Only insert packet once for (bw + delay) ticks
      */
     pkt->state = Q_BW | Q_DELAY;
+    trace_mn_hop_enqueue(hop, pkt, curtick, tailexit, tailexit + hop->delay);
     tailexit += hop->delay;
 #else
     /* Do not add hop delay */
     pkt->state = Q_BW;
+    trace_mn_hop_enqueue(hop, pkt, curtick, tailexit, tailexit);
 #endif
 
     spin_unlock_bh(&hop->lock);
 
     if (needlock)
-        spin_lock_bh(&calendar_lock);
+        spin_lock_bh(&mnet->calendar_lock);
     /* put packet on packet_calendar, to be handled by hopclock() */
-    list_add_tail(&(pkt->list),
-        &packet_calendar[(tailexit & SCHEDMASK)].list);
+    mn_calendar_insert(&mnet->calendar, &pkt->list, tailexit);
     if (needlock)
-        spin_unlock_bh(&calendar_lock);
+        spin_unlock_bh(&mnet->calendar_lock);
 
     return 0;
 }
@@ -368,7 +285,8 @@ void emulate_nexthop(struct packet *pkt, int needlock)
     int ret;
     struct hop *curhop = *pkt->path;
 
-  /* XXX XTQ stuff not implemented */
+  /* Queue disciplines decide at enqueue, there is no XTQ dequeue
+   * here.  See mn_qdisc.c. */
 
   /* At this point we're in one of 3 states
    * 1.) first hop, pkt->state = 0
@@ -393,6 +311,8 @@ void emulate_nexthop(struct packet *pkt, int needlock)
 
     ret = curhop->emulator ? remote_hop(pkt, curhop->emulator) :
         emulate_hop(pkt, curhop, needlock);
+    if (ret > 0)
+        return;     /* payload cached at home, may be back already */
 
     /*
      * if it was a remote_hop, then this is a essentially a no-op
@@ -401,19 +321,22 @@ void emulate_nexthop(struct packet *pkt, int needlock)
     ++pkt->path;
     ++pkt->info.hop;
 
-    if (!(MC_PKT_HOME(pkt) && MC_PKT_PCACHED(pkt)) && (curhop->emulator)) {
+    if (curhop->emulator) {
         /*
-         * if home and cached, then we can't free this pkt, if remote and
-         * not home, then can free
+         * sent whole, or a digest away from home: can free
          */
         MN_FREE_PKT(pkt);
     } 
     else if (ret == -ENOBUFS) {
         /* Packet was dropped or forwarded, so free. */
+        if (pkt->flow.used)
+            mn_flow_drop(pkt);
         MN_FREE_PKT(pkt);
     }
 }
 
+static void mn_defer_arrival(struct packet *pkt);
+
 /*
  * emulate_path
  *   Lookup a path of hops and start
@@ -437,8 +360,8 @@ static int emulate_path(struct packet *pkt)
      */
     ip->daddr &= ~(MODEL_FORCEBIT);
 
-    pkt->path =
-	lookup_path(MODEL_FORCEOFF(ip->saddr), ip->daddr);
+    pkt->path = mn_model_lookup(&pkt->mnet->model,
+				MODEL_FORCEOFF(ip->saddr), ip->daddr);
 
     if (pkt->path == NULL) {
         return ENOENT;
@@ -449,60 +372,312 @@ static int emulate_path(struct packet *pkt)
     pkt->info.src = ip->saddr;
     pkt->info.dst = ip->daddr;
 
+    if (pkt->mnet->flowslots)
+        mn_flow_ingress(pkt);
+
+    if (pkt->mnet->deterministic) {
+        mn_defer_arrival(pkt);
+        return 0;
+    }
     emulate_nexthop(pkt, 1);
     return 0;
 }
 
 
 /*
- * hopclock - handle all pkts due to start new hops on each quantum
- * This is called from softclock() every hz.  'ticks' is advanced by
- * hardclock so we use calendar_tick which is advanced in this func.
+ * [dilated_now] Current calendar time.
  *
- * Dequeue every packet in list packet_calendar[calendar_tick&SCHEDMASK]
- * and sent it to emulate_nexthop().
+ * The calendar counts mn_hz ticks per second of ktime, or with a time
+ * dilation factor (tdf) above 1 one tick every tdf of those.  Hop
+ * delays and transmission times are kept in calendar ticks, so delays
+ * stretch and bandwidths shrink by tdf together and a dilated run
+ * reproduces the undilated dynamics at 1/tdf of the packet rate.  Edge
+ * hosts slow their clocks by the same factor through MN_TDF in
+ * libipaddr.
+ */
+static inline unsigned long dilated_now(struct mn_net *mnet)
+{
+    return mnet->dilate_tick +
+        (unsigned long)div64_u64(ktime_to_ns(ktime_get()) - mnet->dilate_ns,
+                                 mn_tick_nsec * mnet->tdf);
+}
+
+/*
+ * [mn_defer_arrival] In deterministic mode a packet is not emulated as
+ * it comes in, racing packets on other cpus for the hops.  It waits on
+ * mnet->ingress for the calendar to pass its arrival tick, and is then
+ * emulated by mn_replay_ingress() with the other arrivals of that tick
+ * in a fixed order.  This adds up to a tick of delay.
+ */
+static void mn_defer_arrival(struct packet *pkt)
+{
+    struct mn_net *mnet = pkt->mnet;
+
+    spin_lock_bh(&mnet->calendar_lock);
+    pkt->arrival = dilated_now(mnet);
+    if (time_before(pkt->arrival, mnet->calendar.tick))
+        pkt->arrival = mnet->calendar.tick;
+    list_add_tail(&pkt->list, &mnet->ingress);
+    spin_unlock_bh(&mnet->calendar_lock);
+}
+
+/*
+ * [mn_tick_ns] ktime (ns) at which calendar tick 'tick' begins.
+ */
+static inline s64 mn_tick_ns(struct mn_net *mnet, unsigned long tick)
+{
+    return mnet->dilate_ns +
+        (s64)(long)(tick - mnet->dilate_tick) * mnet->tdf * mn_tick_nsec;
+}
+
+
+/*
+ * mn_drain - handle all pkts due to start new hops up to now
+ * Called from hopclock every jiffy, or from a polling thread as soon
+ * as a tick is due.  calendar_tick is the next tick to handle and is
+ * advanced here.
  *
- * The hop_calendar schedules hops that need to maintain timeouts.
+ * Dequeue every packet in list packet_calendar[calendar_tick&calendar_mask]
+ * and sent it to emulate_nexthop().
  *
+ * The hop_calendar schedules hops that need to maintain timeouts; it
+ * only exists once a queue discipline has asked for one.
  */
-static void hopclock(struct work_struct *irrelevant)
+static void mn_drain(struct mn_net *mnet)
 {
     struct packet  *pkt;  
     struct list_head *pos, *q;
-
-#ifdef MN_TCPDUMP 
-    /* XXX needs lock */
-    /* modelnet tcpdump stuff.  If a second has gone by, then tell
-     * tcpdump to swap some buffers*/
-    tcpdump_tick_counter++;
-    if (tcpdump_tick_counter >= HZ) {
-	tcpdump_handle_inactivity();
-    }          
-#endif
+    struct list_head *packet_calendar = mnet->calendar.slots;
+    struct mn_clockstats *cs = &mnet->clock;
+    unsigned long   now, late;
+    u_int32_t       pkts = 0, hops = 0;
+    cycles_t        start;
 
     /* XXX should use per-slot locks */
-    spin_lock_bh(&calendar_lock);
-    while (time_is_before_jiffies(calendar_tick)) {
-	int slot = calendar_tick& SCHEDMASK;
-
-        while (!list_empty(&packet_calendar[slot].list)) {
-	    list_for_each_safe (pos, q, &(packet_calendar[slot].list)) {
+    spin_lock_bh(&mnet->calendar_lock);
+    start = get_cycles();
+    now = dilated_now(mnet);
+
+    /* how long the oldest due tick has been over, in ticks.  Polling
+     * keeps it at 0; hopclock at an mn_hz above HZ runs up to
+     * mn_hz/HZ - 1 ticks late by design. */
+    late = time_after(now, mnet->calendar.tick + 1) ?
+	now - mnet->calendar.tick - 1 : 0;
+    if (late) {
+	mnet->g_error.missed_ticks += late;
+	mnet->g_error.num_missed_ticks++;
+    }
+    mnet->g_error.last_hop_tick = now;
+
+    while (time_before(mnet->calendar.tick, now)) {
+	unsigned long slot = mnet->calendar.tick & mnet->calendar.mask;
+	u_int64_t err = 0;
+	s64 ns;
+
+	/* the arrivals due go first: a first hop that takes them less
+	 * than a tick puts them in this very slot */
+	if (unlikely(!list_empty(&mnet->ingress)))
+	    mn_replay_ingress(mnet, mnet->calendar.tick);
+
+	/* timing error of the packets due in this slot: how long after
+	 * the end of their tick we got to them */
+	if (!list_empty(&packet_calendar[slot])) {
+	    ns = ktime_to_ns(ktime_get()) -
+		mn_tick_ns(mnet, mnet->calendar.tick + 1);
+	    if (ns > 0)
+		err = div_u64(ns, NSEC_PER_USEC);
+	}
+
+        while (!list_empty(&packet_calendar[slot])) {
+	    list_for_each_safe (pos, q, &packet_calendar[slot]) {
 	        pkt = list_entry(pos, struct packet, list);
 	        list_del(pos);
-	        mn.stats.pkts_queued--;     /* stats */
+	        mnet->mn.stats.pkts_queued--;     /* stats */
+	        if (pkt->info.hop) {
+	            struct hop *hop = pkt->path[-1];
+
+	            trace_mn_hop_depart(hop, pkt);
+	            mn_err_add(&hop->err, err);
+	            mnet->mn.stats.hop_toterr += err;
+	            mnet->mn.stats.hop_toterrsq += err * err;
+	            pkt->info.wait_time += err;
+	        }
+	        ++pkts;
+	        if (*pkt->path)
+	            ++hops;
 	        emulate_nexthop(pkt, 0);
 	    }
         }
-	
-	++calendar_tick;
+
+	if (unlikely(mnet->hop_calendar))
+	    mn_hop_timers_run(mnet, mnet->calendar.tick);
+
+	++mnet->calendar.tick;
+	++cs->ticks;
+    }
+
+    /* what this run gathered for other cores goes now */
+    if (atomic_read(&mnet->mc_gathering))
+        mc_flush(mnet);
+    if (mnet->pcache)
+        mc_pcache_expire(mnet);
+
+    /* stats */
+    start = get_cycles() - start;
+    cs->runs++;
+    cs->pkts += pkts;
+    cs->hops += hops;
+    cs->cycles += start;
+    cs->max_cycles = max_t(u_int64_t, cs->max_cycles, start);
+    cs->max_late = max_t(u_int32_t, cs->max_late, late);
+    cs->max_pkts = max(cs->max_pkts, pkts);
+    cs->max_hops = max(cs->max_hops, hops);
+    mn_hist_add(cs->late, late);
+    mn_hist_add(cs->pkts_hist, pkts);
+    mn_hist_add(cs->hops_hist, hops);
+    mn_hist_add(cs->cycles_hist, start);
+    spin_unlock_bh(&mnet->calendar_lock);
+}
+
+/*
+ * hopclock - runs every jiffy, one per namespace with a model, each
+ * with its own calendar.  Drains the calendar unless a polling thread
+ * does.
+ */
+static void hopclock(struct work_struct *work)
+{
+    struct mn_net  *mnet = container_of(to_delayed_work(work),
+                                        struct mn_net, hopclock_task);
+
+    /* wake up capture collectors */
+    if (static_key_false(&mn_trace_key))
+	mn_trace_tick();
+
+    if (!mnet->polled)
+        mn_drain(mnet);
+
+    if (!mnet->die)
+	queue_delayed_work(modelnet_workqueue, &mnet->hopclock_task, 1);
+}
+
+/*
+ * mn_poll_thread - busy-poll the calendars of the namespaces dealt to
+ * polling thread 'arg', draining each as soon as a tick is due.  The
+ * unlocked look at the calendar is only a hint, mn_drain() checks
+ * again under the lock.
+ */
+static int mn_poll_thread(void *arg)
+{
+    int idx = (long)arg;
+    struct mn_net *mnet;
+
+    while (!kthread_should_stop()) {
+        rcu_read_lock();
+        list_for_each_entry_rcu(mnet, &mn_poll_list, poll_list)
+            if (mnet->poll_idx == idx &&
+                time_before(mnet->calendar.tick, dilated_now(mnet)))
+                mn_drain(mnet);
+        rcu_read_unlock();
+        cond_resched();
+        cpu_relax();
+    }
+    return 0;
+}
+
+static void mn_poll_stop(void)
+{
+    while (mn_npollers)
+        kthread_stop(mn_pollers[--mn_npollers]);
+    kfree(mn_pollers);
+    mn_pollers = NULL;
+}
+
+/*
+ * mn_poll_start - start a polling thread on each cpu of poll_cpus.
+ * Called before any namespace is loaded.
+ */
+static int __init mn_poll_start(void)
+{
+    struct task_struct *t;
+    cpumask_var_t   mask;
+    int             cpu, err = 0;
+
+    if (!*poll_cpus)
+        return 0;
+    if (!alloc_cpumask_var(&mask, GFP_KERNEL))
+        return -ENOMEM;
+    if (cpulist_parse(poll_cpus, mask) || cpumask_empty(mask) ||
+        !cpumask_subset(mask, cpu_online_mask)) {
+        printk("Modelnet: bad poll_cpus %s\n", poll_cpus);
+        err = -EINVAL;
+        goto out;
+    }
+
+    mn_pollers = kcalloc(cpumask_weight(mask), sizeof(*mn_pollers),
+                         GFP_KERNEL);
+    if (!mn_pollers) {
+        err = -ENOMEM;
+        goto out;
+    }
+    for_each_cpu(cpu, mask) {
+        t = kthread_create(mn_poll_thread, (void *)(long)mn_npollers,
+                           "mnpoll/%d", cpu);
+        if (IS_ERR(t)) {
+            err = PTR_ERR(t);
+            mn_poll_stop();
+            goto out;
+        }
+        kthread_bind(t, cpu);
+        mn_pollers[mn_npollers++] = t;
+        wake_up_process(t);
     }
-    spin_unlock_bh(&calendar_lock);
+    printk(KERN_INFO "Modelnet polling the calendar on cpus %s at %u Hz\n",
+           poll_cpus, mn_hz);
+ out:
+    free_cpumask_var(mask);
+    return err;
+}
+
+
 
-    if (!modelnet_die)
-	queue_delayed_work(modelnet_workqueue, &hopclock_task, 1);
+/*
+ * Would qmem more bytes take mn_qmem over the limit?  The cpus charge
+ * and uncharge in batches, so the quick read can be off either way by
+ * up to a batch per cpu, even below 0.  Within that of the limit, sum
+ * the cpus' counts.
+ */
+static int mn_qmem_over(unsigned int qmem)
+{
+    s64 limit = (s64)mn_qmem_limit;
+    s64 slack = (s64)MN_QMEM_BATCH * num_online_cpus();
+
+    if (percpu_counter_read_positive(&mn_qmem) + qmem + slack <= limit)
+        return 0;
+    return percpu_counter_sum_positive(&mn_qmem) + qmem > limit;
 }
 
+/*
+ * mn_qmem_charge - charge pkt, with its skb if it has one, to mn_qmem.
+ * With the budget used up it is not charged and -ENOBUFS returned, for
+ * the caller to drop it early rather than run the host out of memory;
+ * a drop the model did not make, counted apart.
+ */
+int mn_qmem_charge(struct packet *pkt)
+{
+    unsigned int qmem = (pkt->skb ? pkt->skb->truesize : 0) +
+        sizeof(struct packet);
 
+    if (mn_qmem_limit && mn_qmem_over(qmem)) {
+        percpu_counter_inc(&mn_qmem_drops);
+        pkt->mnet->mn.stats.pkts_refused++;
+        return -ENOBUFS;
+    }
+    pkt->qmem = qmem;
+    __percpu_counter_add(&mn_qmem, qmem, MN_QMEM_BATCH);
+    if (percpu_counter_read(&mn_qmem) > (s64)mn_qmem_peak)
+        mn_qmem_peak = percpu_counter_read(&mn_qmem);
+    return 0;
+}
 
 /*
  * filter_ipinput - catch incoming modelnet packets
@@ -512,6 +687,9 @@ static void hopclock(struct work_struct *irrelevant)
  * coming from a remote emulator via UDP port 'remote_port'
  *
  * Send new packets to emulate_path() and remote to remote_input()
+ *
+ * The hook is registered once for the whole host; the namespace of the
+ * receiving device picks which model emulates the packet.
  */
 static unsigned int filter_ipinput(unsigned int hooknum,
 				   struct sk_buff *skbuff,
@@ -524,12 +702,20 @@ static unsigned int filter_ipinput(unsigned int hooknum,
     unsigned int netfilterResult = NF_ACCEPT;
     int err = 0;
 
+    struct mn_net *mnet;
+
     if (!skbuff) return NF_ACCEPT;
     iph = ip_hdr(skbuff);
     if (!iph) return NF_ACCEPT;
 
     if (((iph->saddr & MODEL_MASK) == MODEL_SUBNET) 
 	&& ((iph->daddr & MODEL_MASK) == MODEL_SUBNET)) {
+
+        mnet = mn_pernet(dev_net(in ? in : skbuff->dev));
+        if (!mnet->model.hoptable) {
+            /* no model loaded in this namespace */
+            return NF_ACCEPT;
+        }
         
         /* XXX this should be locked, but it's hardly critical */
         if (ip_rcv_finish_hook == NULL) {
@@ -547,13 +733,24 @@ static unsigned int filter_ipinput(unsigned int hooknum,
         
 #if 0
         /* XXX this would be made atomic, if it was ever used anywhere... */
-        mn.stats.pkt_alloc++;
+        mnet->mn.stats.pkt_alloc++;
 #endif
         pkt->skb = skbuff;
+        pkt->mnet = mnet;
+        pkt->qmem = 0;
+        if (mn_qmem_charge(pkt)) {
+            pkt->skb = NULL;
+            MN_FREE_PKT(pkt);
+            return NF_DROP;
+        }
         pkt->info.len = skbuff->len;
 
         pkt->cachehost = 0;
         pkt->info.id = 0;
+        pkt->info.wait_time = 0;
+        pkt->info.ttl = mnet->mn.mc_ttl;
+        pkt->flow.used = 0;
+        pkt->qticks = 0;
     
         err = emulate_path(pkt); /* emulate_path returns 0 on success */
 
@@ -563,8 +760,10 @@ static unsigned int filter_ipinput(unsigned int hooknum,
             netfilterResult = NF_STOLEN;
         }
     } 
-    else {
-        /* No remote stuff */
+    else if (!ip_rcv_finish_hook) {
+        /* a core that only emulates remote hops (see mn_remote.c)
+         * sees no model packet here, but forwards the ones it ends */
+        ip_rcv_finish_hook = okfn;
     }
 
     if (netfilterResult == NF_ACCEPT) {
@@ -579,91 +778,140 @@ static unsigned int filter_ipinput(unsigned int hooknum,
 
 
 
-/* Random Number Generation Functions */
-void random_seed(u_int seed) {
-    /* re-seed generator */
-    mt[0]= seed;
-    for (mti=1; mti < MERS_N; mti++) {
-	mt[mti] = (1812433253UL * (mt[mti-1] ^ (mt[mti-1] >> 30)) + mti);
-    }
-}
-
-u_int random_bits(void) {
-    /* generate 32 random bits */
-    u_int y;
-  
-    if (mti >= MERS_N) {
-	// generate MERS_N words at one time
-	const u_int LOWER_MASK = (1LU << MERS_R) - 1; // lower MERS_R bits
-	const u_int UPPER_MASK = -1L  << MERS_R;      // upper (32 - MERS_R) bits
-	static const u_int mag01[2] = {0, MERS_A};
-    
-	int kk;
-	for (kk=0; kk < MERS_N-MERS_M; kk++) {    
-	    y = (mt[kk] & UPPER_MASK) | (mt[kk+1] & LOWER_MASK);
-	    mt[kk] = mt[kk+MERS_M] ^ (y >> 1) ^ mag01[y & 1];}
-
-	for (; kk < MERS_N-1; kk++) {    
-	    y = (mt[kk] & UPPER_MASK) | (mt[kk+1] & LOWER_MASK);
-	    mt[kk] = mt[kk+(MERS_M-MERS_N)] ^ (y >> 1) ^ mag01[y & 1];}      
-
-	y = (mt[MERS_N-1] & UPPER_MASK) | (mt[0] & LOWER_MASK);
-	mt[MERS_N-1] = mt[MERS_M-1] ^ (y >> 1) ^ mag01[y & 1];
-	mti = 0;}
-  
-    y = mt[mti++];
-  
-    // Tempering (May be omitted):
-    y ^=  y >> MERS_U;
-    y ^= (y << MERS_S) & MERS_B;
-    y ^= (y << MERS_T) & MERS_C;
-    y ^=  y >> MERS_L;
-    return y;
+/*
+ * modelnet_setup - what a namespace needs before it has a model: the
+ * locks, the defaults its sysctls show, its seed.  Nothing is
+ * allocated and no hopclock runs, so a namespace that never loads a
+ * model costs next to nothing.
+ */
+static void modelnet_setup(struct mn_net *mnet)
+{
+    memset(&mnet->g_error, 0, sizeof(struct mn_error));  
+    memset(&mnet->clock, 0, sizeof(mnet->clock));
+    mnet->clock.hz = mn_hz;
+
+    spin_lock_init(&mnet->calendar_lock);
+    mutex_init(&mnet->load_mutex);
+    mnet->tdf = 1;
+    mnet->dilate_tick = 0;
+    mnet->dilate_ns = ktime_to_ns(ktime_get());
+
+    /* a fresh seed per namespace until one is set, see mn_replay.c */
+    get_random_bytes(&mnet->seed, sizeof(mnet->seed));
+    mnet->vbase = 0;
+    mnet->deterministic = 0;
+    INIT_LIST_HEAD(&mnet->ingress);
+
+    mn_remote_setup(mnet);
+    INIT_DELAYED_WORK(&mnet->hopclock_task, hopclock);
 }
 
 /*
- * modelnet_modevent - install modelnet routines, allocate/free structs
+ * modelnet_load - set up the emulation state of one namespace
  *
- * install hopclock() into softclock with timeout().
- * install filter_ipinput() on the ipfw ip_dn_ip_ptr hook in ip_input().
+ * Allocates the namespace's packet calendar, nodetable and per-cpu
+ * tables and starts its hopclock.  Called by the sysctls that load a
+ * model (nodetable, nodecount, hoptable, pathentry) before they touch
+ * it; only the first call does anything.
  *
  * Linux version! - make sure modelnet_load is called BEFORE
  * interrupts are disabled
  */
 
-static
-int modelnet_load(void)
+int modelnet_load(struct mn_net *mnet)
 {
-    int i;
-    memset(&g_error, 0, sizeof(struct mn_error));  
-
-    mn_debug_g = 0;
-    calendar_tick = jiffies;
+    int err = 0;
 
-    packet_calendar = (pktlist *) 
-	vmalloc(sizeof(*packet_calendar) * SCHEDLEN);
-  
-    if (!packet_calendar) {
-        printk("Could not allocate packet calendar\n");
-        return ENOMEM;
+    mutex_lock(&mnet->load_mutex);
+    if (mnet->loaded)
+        goto out;
+
+    err = -ENOMEM;
+    if (mn_calendar_init(&mnet->calendar, 0))
+        goto out;
+    if (init_paths(mnet))
+        goto out_calendar;
+    if (mn_flow_init(mnet))
+        goto out_paths;
+    if (mn_remote_init(mnet))
+        goto out_flow;
+    err = 0;
+
+    /* calendar time starts now, at the tdf already set */
+    spin_lock_bh(&mnet->calendar_lock);
+    mnet->dilate_tick = mnet->calendar.tick;
+    mnet->dilate_ns = ktime_to_ns(ktime_get());
+    spin_unlock_bh(&mnet->calendar_lock);
+
+    mnet->die = 0;
+    queue_delayed_work(modelnet_workqueue, &mnet->hopclock_task, 1);
+
+    if (mn_npollers) {
+        mutex_lock(&mn_poll_mutex);
+        mnet->poll_idx = mn_poll_next++ % mn_npollers;
+        list_add_tail_rcu(&mnet->poll_list, &mn_poll_list);
+        mutex_unlock(&mn_poll_mutex);
+        mnet->polled = 1;
     }
-    for (i = 0; i < SCHEDLEN; ++i) {
-        INIT_LIST_HEAD(&(packet_calendar[i].list));
-    }
-  
-#ifdef MN_TCPDUMP
-    init_mn_tcpdump_buffers();
-#endif
-    printk(KERN_INFO "Modelnet installed.\n");
-    return 0;
+    mnet->loaded = 1;
+    goto out;
+
+ out_flow:
+    mn_flow_uninit(mnet);
+ out_paths:
+    mn_model_uninit(&mnet->model);
+ out_calendar:
+    mn_calendar_uninit(&mnet->calendar);
+ out:
+    mutex_unlock(&mnet->load_mutex);
+    return err;
 }
 
-static int modelnet_unload(void)
+/*
+ * modelnet_unload - the namespace is going away; free what
+ * modelnet_load set up, if it ever ran, and what the sysctls allocated
+ */
+static void modelnet_unload(struct mn_net *mnet)
 {
-    uninit_paths();
-    vfree(packet_calendar);
-    printk(KERN_INFO "Modelnet uninstalled.\n");
-    return 0;
+    struct packet  *pkt;
+    struct list_head *pos, *q;
+    int i;
+
+    if (mnet->loaded) {
+        /* keep hopclock from queueing itself */
+        mnet->die = 1;
+        cancel_delayed_work_sync(&mnet->hopclock_task);
+        if (mnet->polled) {
+            mutex_lock(&mn_poll_mutex);
+            list_del_rcu(&mnet->poll_list);
+            mutex_unlock(&mn_poll_mutex);
+            synchronize_rcu();
+            mnet->polled = 0;
+        }
+
+        /* packets still in flight belong to this namespace, drop them */
+        for (i = 0; i <= mnet->calendar.mask; ++i) {
+            list_for_each_safe (pos, q, &mnet->calendar.slots[i]) {
+                pkt = list_entry(pos, struct packet, list);
+                list_del(pos);
+                MN_FREE_PKT(pkt);
+            }
+        }
+        list_for_each_safe (pos, q, &mnet->ingress) {
+            pkt = list_entry(pos, struct packet, list);
+            list_del(pos);
+            MN_FREE_PKT(pkt);
+        }
+
+        uninit_paths(mnet);
+        mn_model_uninit(&mnet->model);
+        mn_hop_timers_uninit(mnet);
+        mn_flow_uninit(mnet);
+        mn_calendar_uninit(&mnet->calendar);
+        mnet->loaded = 0;
+    }
+    mn_replay_uninit(mnet);
+    mn_remote_uninit(mnet);
 }
 
 /* Linux stuff after here */
@@ -673,12 +921,224 @@ MODULE_LICENSE("GPL");
 
 #define MODELNET_CTL_ID 500
 
+/*
+ * proc_tdf - read or change the time dilation factor.  The calendar is
+ * rebased at the current calendar time so a change never makes it jump.
+ */
+static int proc_tdf(ctl_table *table, int write,
+                    void __user *buffer, size_t *lenp, loff_t *ppos)
+{
+    struct mn_net *mnet = table->extra1;
+    ctl_table tmp = *table;
+    int tdf = mnet->tdf;
+    unsigned long ticks;
+    int err;
+
+    tmp.data = &tdf;
+    err = proc_dointvec(&tmp, write, buffer, lenp, ppos);
+    if (err || !write)
+        return err;
+    if (tdf < 1) {
+        printk("proc_tdf: time dilation factor must be >= 1\n");
+        return -EINVAL;
+    }
+
+    /* move the origin up by whole ticks, keeping their phase */
+    spin_lock_bh(&mnet->calendar_lock);
+    ticks = dilated_now(mnet) - mnet->dilate_tick;
+    mnet->dilate_tick += ticks;
+    mnet->dilate_ns += (s64)ticks * mn_tick_nsec * mnet->tdf;
+    mnet->tdf = tdf;
+    spin_unlock_bh(&mnet->calendar_lock);
+    return 0;
+}
+
+/*
+ * proc_clockstats - read the hopclock instrumentation as one
+ * struct mn_clockstats; any write clears it along with g_error.
+ */
+static int proc_clockstats(ctl_table *table, int write,
+                           void __user *buffer, size_t *lenp, loff_t *ppos)
+{
+    struct mn_net *mnet = table->extra1;
+    struct mn_clockstats cs;
+
+    if (write) {
+        spin_lock_bh(&mnet->calendar_lock);
+        memset(&mnet->clock, 0, sizeof(mnet->clock));
+        mnet->clock.hz = mn_hz;
+        memset(&mnet->g_error, 0, sizeof(mnet->g_error));
+        spin_unlock_bh(&mnet->calendar_lock);
+        *ppos += *lenp;
+        return 0;
+    }
+
+    /* see proc_hopstats: one read returns everything */
+    if (*ppos) {
+        *lenp = 0;
+        return 0;
+    }
+    if (*lenp < sizeof(cs)) {
+        printk("clockstats: user buffer is too small\n");
+        return -EINVAL;
+    }
+
+    spin_lock_bh(&mnet->calendar_lock);
+    cs = mnet->clock;
+    spin_unlock_bh(&mnet->calendar_lock);
+
+    if (copy_to_user(buffer, &cs, sizeof(cs)))
+        return -EFAULT;
+    *lenp = sizeof(cs);
+    *ppos += sizeof(cs);
+    return 0;
+}
+
+/*
+ * proc_pkterr - read the end-to-end timing error of the packets
+ * forwarded so far as one struct mn_errstats; any write clears it and
+ * the timing error of every hop.
+ */
+static int proc_pkterr(ctl_table *table, int write,
+                       void __user *buffer, size_t *lenp, loff_t *ppos)
+{
+    struct mn_net *mnet = table->extra1;
+    struct mn_errstats es;
+    int i;
+
+    if (write) {
+        spin_lock_bh(&mnet->calendar_lock);
+        mnet->mn.stats.hop_toterr = mnet->mn.stats.hop_toterrsq = 0;
+        mnet->mn.stats.pkt_toterr = mnet->mn.stats.pkt_toterrsq = 0;
+        memset(mnet->pkterr_hist, 0, sizeof(mnet->pkterr_hist));
+        for (i = 0; i < mnet->model.hopcount; ++i)
+            memset(&mnet->model.hoptable[i].err, 0, sizeof(struct mn_errstats));
+        spin_unlock_bh(&mnet->calendar_lock);
+        *ppos += *lenp;
+        return 0;
+    }
+
+    /* see proc_hopstats: one read returns everything */
+    if (*ppos) {
+        *lenp = 0;
+        return 0;
+    }
+    if (*lenp < sizeof(es)) {
+        printk("pkterr: user buffer is too small\n");
+        return -EINVAL;
+    }
+
+    spin_lock_bh(&mnet->calendar_lock);
+    es.toterr = mnet->mn.stats.pkt_toterr;
+    es.toterrsq = mnet->mn.stats.pkt_toterrsq;
+    memcpy(es.hist, mnet->pkterr_hist, sizeof(es.hist));
+    spin_unlock_bh(&mnet->calendar_lock);
+
+    if (copy_to_user(buffer, &es, sizeof(es)))
+        return -EFAULT;
+    *lenp = sizeof(es);
+    *ppos += sizeof(es);
+    return 0;
+}
+
+/*
+ * proc_dointvec_range - proc_dointvec_minmax for the per-namespace
+ * table, whose extra1 is taken by the struct mn_net: the bounds are in
+ * the int pair extra2 points to.
+ */
+static int proc_dointvec_range(ctl_table *table, int write,
+                               void __user *buffer, size_t *lenp,
+                               loff_t *ppos)
+{
+    ctl_table tmp = *table;
+    int *range = table->extra2;
+
+    tmp.extra1 = &range[0];
+    tmp.extra2 = &range[1];
+    return proc_dointvec_minmax(&tmp, write, buffer, lenp, ppos);
+}
+
+/* what a digest carries, see struct mc_digest in mn_remote.c */
+static int mc_ttl_range[] = { 0, 127 };
+static int mc_expire_range[] = { 1, 65535 };
+
+/*
+ * proc_qmem - read the memory held in emulation (table->data NULL), the
+ * peak of it (writing resets the peak), or the early drops.
+ */
+static int proc_qmem(ctl_table *table, int write,
+                     void __user *buffer, size_t *lenp, loff_t *ppos)
+{
+    ctl_table tmp = *table;
+    unsigned long val;
+    int err;
+
+    if (table->data == &mn_qmem_drops)
+        val = percpu_counter_sum_positive(&mn_qmem_drops);
+    else if (table->data == &mn_qmem_peak)
+        val = mn_qmem_peak;
+    else
+        val = percpu_counter_sum_positive(&mn_qmem);
+
+    tmp.data = &val;
+    tmp.maxlen = sizeof(val);
+    err = proc_doulongvec_minmax(&tmp, write, buffer, lenp, ppos);
+    if (!err && write && table->data == &mn_qmem_peak)
+        mn_qmem_peak = percpu_counter_sum_positive(&mn_qmem);
+    return err;
+}
+
+/* /proc/sys/modelnet/qmem, host-wide like the budget */
+static ctl_table mn_qmem_table[] = {
+    {
+	.procname = "limit",
+	.data = &mn_qmem_limit,
+	.maxlen = sizeof(unsigned long),
+	.mode = 0644,
+	.child = NULL,
+	.proc_handler = &proc_doulongvec_minmax,
+    },
+    {
+	.procname = "current",
+	.data = NULL,
+	.maxlen = sizeof(unsigned long),
+	.mode = 0444, /* read only */
+	.child = NULL,
+	.proc_handler = &proc_qmem,
+    },
+    {
+	.procname = "peak",
+	.data = &mn_qmem_peak,
+	.maxlen = sizeof(unsigned long),
+	.mode = 0644, /* write resets */
+	.child = NULL,
+	.proc_handler = &proc_qmem,
+    },
+    {
+	.procname = "drops",
+	.data = &mn_qmem_drops,
+	.maxlen = sizeof(unsigned long),
+	.mode = 0444, /* read only */
+	.child = NULL,
+	.proc_handler = &proc_qmem,
+    },
+    {0}
+};
+
+/*
+ * Template for the per-namespace /proc/sys/modelnet table.  Each
+ * namespace registers its own copy with extra1 pointing at its
+ * struct mn_net.  A non-NULL .data here is an offset into struct mn_net
+ * that modelnet_net_init() turns into a real pointer.
+ */
+#define MN_NET_DATA(field) ((void *)offsetof(struct mn_net, field))
+
 static ctl_table modelnet_inner_table[] = { 
   
     /* Add hopcount (see mn_pathtable.h) */
     {
 	.procname = "hopcount",
-	.data = &hopcount,
+	.data = MN_NET_DATA(model.hopcount),
 	.maxlen = sizeof(int),
 	.mode = 0444, /* Read-only */
 	.child = NULL,
@@ -695,8 +1155,8 @@ static ctl_table modelnet_inner_table[] = {
     },
     {
 	.procname = "nodecount",
-	.data = &nodecount,
-	.maxlen = sizeof(nodecount),
+	.data = MN_NET_DATA(model.nodecount),
+	.maxlen = sizeof(int),
 	.mode = 0666, /* read/write */
 	.child = NULL,
 	.proc_handler = &proc_nodecount,
@@ -717,6 +1177,30 @@ static ctl_table modelnet_inner_table[] = {
 	.child = NULL,
 	.proc_handler = &proc_pathentry,
     },
+    {
+	.procname = "hopbg",
+	.data = NULL,
+	.maxlen = 0,
+	.mode = 0222, /* write only */
+	.child = NULL,
+	.proc_handler = &proc_hopbg,
+    },
+    {
+	.procname = "hopqdisc",
+	.data = NULL,
+	.maxlen = 0,
+	.mode = 0644,
+	.child = NULL,
+	.proc_handler = &proc_hopqdisc,
+    },
+    {
+	.procname = "tdf",
+	.data = NULL,
+	.maxlen = sizeof(int),
+	.mode = 0644,
+	.child = NULL,
+	.proc_handler = &proc_tdf,
+    },
     {
 	.procname = "hopstats",
 	.data = NULL,
@@ -725,57 +1209,268 @@ static ctl_table modelnet_inner_table[] = {
 	.child = NULL,
 	.proc_handler = &proc_hopstats,
     },  
-#ifdef MODELNET_PROFILE
     {
-	.procname = "profile_data",
-	.data = profile_string,
-	.maxlen = 4096,
+	.procname = "clockstats",
+	.data = NULL,
+	.maxlen = 0,
+	.mode = 0644, /* write clears */
+	.child = NULL,
+	.proc_handler = &proc_clockstats,
+    },
+    {
+	.procname = "hoperr",
+	.data = NULL,
+	.maxlen = 0,
 	.mode = 0444, /* read only */
 	.child = NULL,
-	.proc_handler = &proc_profiledata,
+	.proc_handler = &proc_hoperr,
     },
     {
-	.procname = "hz_samples",
-	.data = hz_samples,
-	.maxlen = NUM_HZ_SAMPLES * sizeof(unsigned int),
+	.procname = "pkterr",
+	.data = NULL,
+	.maxlen = 0,
+	.mode = 0644, /* write clears, hoperr too */
+	.child = NULL,
+	.proc_handler = &proc_pkterr,
+    },
+    {
+	.procname = "flowslots",
+	.data = NULL,
+	.maxlen = sizeof(int),
+	.mode = 0644,
+	.child = NULL,
+	.proc_handler = &proc_flowslots,
+    },
+    {
+	.procname = "flows",
+	.data = NULL,
+	.maxlen = 0,
+	.mode = 0444, /* reading evicts */
+	.child = NULL,
+	.proc_handler = &proc_flows,
+    },
+    {
+	.procname = "flowmisses",
+	.data = NULL,
+	.maxlen = sizeof(unsigned long),
 	.mode = 0444, /* read only */
 	.child = NULL,
-	.proc_handler = &proc_hzsamples,
+	.proc_handler = &proc_flowmisses,
+    },
+    {
+	.procname = "seed",
+	.data = NULL,
+	.maxlen = sizeof(unsigned long),
+	.mode = 0644,
+	.child = NULL,
+	.proc_handler = &proc_seed,
+    },
+    {
+	.procname = "deterministic",
+	.data = MN_NET_DATA(deterministic),
+	.maxlen = sizeof(int),
+	.mode = 0644,
+	.child = NULL,
+	.proc_handler = &proc_dointvec,
+    },
+    {
+	.procname = "arrivalslots",
+	.data = NULL,
+	.maxlen = sizeof(int),
+	.mode = 0644,
+	.child = NULL,
+	.proc_handler = &proc_arrivalslots,
+    },
+    {
+	.procname = "arrivals",
+	.data = NULL,
+	.maxlen = 0,
+	.mode = 0444, /* reading consumes */
+	.child = NULL,
+	.proc_handler = &proc_arrivals,
+    },
+    {
+	.procname = "arrivallost",
+	.data = MN_NET_DATA(arrivals_lost),
+	.maxlen = sizeof(unsigned long),
+	.mode = 0444, /* read only */
+	.child = NULL,
+	.proc_handler = &proc_doulongvec_minmax,
+    },
+    {
+	.procname = "mcttl",
+	.data = MN_NET_DATA(mn.mc_ttl),
+	.maxlen = sizeof(int),
+	.mode = 0644,
+	.child = NULL,
+	.proc_handler = &proc_dointvec_range,
+	.extra2 = mc_ttl_range,
+    },
+    {
+	.procname = "mcexpire",
+	.data = MN_NET_DATA(mn.mc_expire),
+	.maxlen = sizeof(int),
+	.mode = 0644,
+	.child = NULL,
+	.proc_handler = &proc_dointvec_range,
+	.extra2 = mc_expire_range,
+    },
+    {
+	.procname = "mcaggregate",
+	.data = MN_NET_DATA(mn.mc_aggregate),
+	.maxlen = sizeof(int),
+	.mode = 0644,
+	.child = NULL,
+	.proc_handler = &proc_dointvec,
+    },
+    {
+	.procname = "mcpcache",
+	.data = NULL,
+	.maxlen = sizeof(int),
+	.mode = 0644,
+	.child = NULL,
+	.proc_handler = &proc_mcpcache,
+    },
+    {
+	.procname = "mcether",
+	.data = MN_NET_DATA(mn.mc_ether),
+	.maxlen = sizeof(int),
+	.mode = 0644,
+	.child = NULL,
+	.proc_handler = &proc_dointvec,
+    },
+    {   /* mc_send, mc_recv, mc_exdrops, mc_ttldrops, mc_errs, mc_batches,
+	 * mc_frames */
+	.procname = "mcstats",
+	.data = MN_NET_DATA(mn.stats.mc_send),
+	.maxlen = 7 * sizeof(unsigned int),
+	.mode = 0444, /* read only */
+	.child = NULL,
+	.proc_handler = &proc_dointvec,
+    },
+    {   /* pcache_occupancy, pcache_expired, pcache_full */
+	.procname = "pcachestats",
+	.data = MN_NET_DATA(mn.stats.pcache_occupancy),
+	.maxlen = 3 * sizeof(u_int32_t),
+	.mode = 0444, /* read only */
+	.child = NULL,
+	.proc_handler = &proc_dointvec,
+    },
+    {
+	.procname = "hoptrace",
+	.data = NULL,
+	.maxlen = 0,
+	.mode = 0222, /* write only */
+	.child = NULL,
+	.proc_handler = &proc_hoptrace,
+    },
+    {
+	.procname = "hopcapture",
+	.data = NULL,
+	.maxlen = 0,
+	.mode = 0222, /* write only */
+	.child = NULL,
+	.proc_handler = &proc_hopcapture,
     },
-#endif
-#ifdef MN_TCPDUMP
     {
 	.procname = "tcpdump",
 	.data = 0,
 	.maxlen = 0,
-	.mode = 0,
+	.mode = 0555,
 	.child = mn_tcpdump_table,
     },
-#endif
-    {0}
-};
-
-static ctl_table modelnet_ctl_table[] = {
     {
-	.procname = "modelnet", 
+	.procname = "qmem",
 	.data = 0,
 	.maxlen = 0,
-	.mode = 0555, 
-	.child = modelnet_inner_table, 
-    }, 
+	.mode = 0555,
+	.child = mn_qmem_table,
+    },
     {0}
 };
 
-static struct ctl_table_header *my_table_header = NULL;
+static struct ctl_path modelnet_ctl_path[] = {
+    { .procname = "modelnet" },
+    { }
+};
+
+
+static struct nf_hook_ops nfho[] = {
+    {
+	.hook = filter_ipinput,
+	.owner = THIS_MODULE,
+	.pf = PF_INET,
+	.hooknum = NF_INET_PRE_ROUTING,
+	.priority = NF_IP_PRI_FIRST
+    },
+    {   /* packets of remote hops, reassembled, see mn_remote.c */
+	.hook = remote_input,
+	.owner = THIS_MODULE,
+	.pf = PF_INET,
+	.hooknum = NF_INET_LOCAL_IN,
+	.priority = NF_IP_PRI_FIRST
+    },
+};
+
+/* frames of remote hops, see mn_remote.c */
+static struct packet_type mc_ptype = {
+    .type = cpu_to_be16(ETH_P_MODELNET),
+    .func = mc_ether_input,
+};
+
+
+/*
+ * modelnet_net_init - a namespace appeared (or the module was loaded)
+ *
+ * Sets up what the namespace needs before it has a model and registers
+ * its private copy of the sysctl table.  The emulation state itself
+ * waits for a model, see modelnet_load().
+ */
+static int __net_init modelnet_net_init(struct net *net)
+{
+    struct mn_net *mnet = mn_pernet(net);
+    ctl_table *tbl;
+    int i;
+
+    mnet->net = net;
+
+    tbl = kmemdup(modelnet_inner_table, sizeof(modelnet_inner_table),
+                  GFP_KERNEL);
+    if (!tbl)
+        return -ENOMEM;
+    for (i = 0; tbl[i].procname; ++i) {
+        if (tbl[i].data)
+            tbl[i].data = (char *)mnet + (unsigned long)tbl[i].data;
+        tbl[i].extra1 = mnet;
+    }
+
+    modelnet_setup(mnet);
+
+    mnet->sysctl_table = tbl;
+    mnet->sysctl_header = register_net_sysctl_table(net, modelnet_ctl_path,
+                                                    tbl);
+    if (!mnet->sysctl_header) {
+        modelnet_unload(mnet);
+        kfree(tbl);
+        return -EPERM;
+    }
+    return 0;
+}
 
+static void __net_exit modelnet_net_exit(struct net *net)
+{
+    struct mn_net *mnet = mn_pernet(net);
+
+    unregister_net_sysctl_table(mnet->sysctl_header);
+    modelnet_unload(mnet);
+    kfree(mnet->sysctl_table);
+}
 
-static struct nf_hook_ops nfho = {
-    .hook = filter_ipinput,
-    .owner = THIS_MODULE,
-    .pf = PF_INET,
-    .hooknum = NF_INET_PRE_ROUTING,
-/*   .hooknum = NF_IP_LOCAL_IN, */
-    .priority = NF_IP_PRI_FIRST 
+static struct pernet_operations modelnet_net_ops = {
+    .init = modelnet_net_init,
+    .exit = modelnet_net_exit,
+    .id   = &mn_net_id,
+    .size = sizeof(struct mn_net),
 };
 
 
@@ -783,51 +1478,77 @@ static int __init modelnet_init(void)
 {
     int ret;
 
-    /* Seed our random number generator */
-    unsigned int randomVal;
-    get_random_bytes(&randomVal, 4);
-    random_seed(randomVal);
+    if ((ret = mn_core_init()))
+        return ret;
 
-    /* Register sysctl table */
-    if (!(my_table_header = register_sysctl_table(modelnet_ctl_table)))
-        return -EPERM;
-  
-    /* load modelnet */
-    if (modelnet_load()) {
-        printk ("Error loading Modelnet\n");
-        return -EPERM;
+    mn_qmem_limit = qmem_mb ? qmem_mb << 20 :
+        (totalram_pages << PAGE_SHIFT) / 4;
+    if ((ret = percpu_counter_init(&mn_qmem, 0)))
+        return ret;
+    if ((ret = percpu_counter_init(&mn_qmem_drops, 0))) {
+        percpu_counter_destroy(&mn_qmem);
+        return ret;
     }
-  
-    /* create work queue */
+
+    /* create work queue before any namespace starts its hopclock */
     modelnet_workqueue = create_workqueue(MN_WORKQUEUE_NAME);
-    queue_delayed_work(modelnet_workqueue, &hopclock_task, 1);
+    if (!modelnet_workqueue) {
+        ret = -ENOMEM;
+        goto out_qmem;
+    }
+
+    if ((ret = init_mn_tcpdump()))
+        goto out_wq;
+
+    /* namespaces join the polling threads as they load */
+    if ((ret = mn_poll_start()))
+        goto out_tcpdump;
+
+    /* load modelnet into every namespace, present and future */
+    if ((ret = register_pernet_subsys(&modelnet_net_ops)) < 0) {
+        printk ("Error loading Modelnet\n");
+        goto out_poll;
+    }
+    printk(KERN_INFO "Modelnet installed.\n");
 
     /* register netfilter hook */
-    if ((ret = nf_register_hook(&nfho)) < 0)
+    if ((ret = nf_register_hooks(nfho, ARRAY_SIZE(nfho))) < 0) {
         printk ("Modelnet unable to register with netfilter, check kernel config\n");
-    else
-        printk ("Modelnet registered with netfilter\n");
+        goto out_pernet;
+    }
+    printk ("Modelnet registered with netfilter\n");
+    dev_add_pack(&mc_ptype);
+    return 0;
 
+ out_pernet:
+    unregister_pernet_subsys(&modelnet_net_ops);
+ out_poll:
+    mn_poll_stop();
+ out_tcpdump:
+    uninit_mn_tcpdump();
+ out_wq:
+    destroy_workqueue(modelnet_workqueue);
+ out_qmem:
+    percpu_counter_destroy(&mn_qmem_drops);
+    percpu_counter_destroy(&mn_qmem);
     return ret;
 }
 
 static void __exit modelnet_cleanup(void)
 {
-    if (my_table_header)
-	unregister_sysctl_table(my_table_header);
-  
-    nf_unregister_hook(&nfho);
-  
-    /* keep intrp_routine from queueing itself */
-    modelnet_die = 1;		
+    dev_remove_pack(&mc_ptype);
+    nf_unregister_hooks(nfho, ARRAY_SIZE(nfho));
+
+    /* stops every hopclock and frees every namespace's model */
+    unregister_pernet_subsys(&modelnet_net_ops);
+    mn_poll_stop();
 
-    /* cancel hopclock */
-    cancel_delayed_work(&hopclock_task);	/* no "new ones" */
     flush_workqueue(modelnet_workqueue);	/* wait till all "old ones" finished */
     destroy_workqueue(modelnet_workqueue);
-  
-    /* unload modelnet */
-    modelnet_unload();
+    uninit_mn_tcpdump();
+    percpu_counter_destroy(&mn_qmem_drops);
+    percpu_counter_destroy(&mn_qmem);
+    printk(KERN_INFO "Modelnet uninstalled.\n");
 }
 
 module_init(modelnet_init);
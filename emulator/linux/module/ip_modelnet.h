@@ -36,44 +36,60 @@
 #ifndef _IP_MODELNET_H
 #define _IP_MODELNET_H
 
+#include <linux/bitops.h>
+#include <linux/math64.h>
+#include <linux/percpu_counter.h>
 #include <linux/spinlock.h>
+#include <linux/mutex.h>
+#include <linux/workqueue.h>
+#include <linux/sysctl.h>
+#include <linux/netdevice.h>
+#include <net/net_namespace.h>
+#include <net/netns/generic.h>
+
+#include "mn_core.h"
 
 #define MODEL_SUBNET htonl(0x0a000000)  /* 10.0.0.0/8 */
 #define MODEL_MASK   htonl(0xff000000)  /* 10.0.0.0/8 */
 #define MODEL_FORCEBIT htonl(0x00800000)
 #define MODEL_PORT 5347         /* udp port for remote hop service */
+#define ETH_P_MODELNET 0x88B5   /* ethertype of remote hop frames, IEEE
+                                 * local experimental */
 #define MN_MAX_CORES 32         /* pcache+aggregated xcore traffic */
 #define MN_MTU  1500            /* something reasonable */
-#define SCHEDBITS 14                /* power of two size of sched array */
-#define SCHEDLEN  (1<<SCHEDBITS)    /* number of slots in scheduling array */
-#define SCHEDMASK (SCHEDLEN-1)  
-
-
-/* Addition for Linux port.  Could not find this typedef in linux
- * code, so I just added it.  There is a similar typedef in bsd code :
-     src/sys/types.h:typedef   u_int32_t       in_addr_t;
-*/   
-typedef u_int32_t in_addr_t;
 
 
-/* Define whether or not to use tcpdump code */
-
 /* compile-time options */
 #define UNIFIED_PKT_SCHEDULE    /* queue bandwidth and delay together */
 
-/* XXX I cheaped out and packed the structs so 64-bit systems will work */
+/*
+ * Queue disciplines, see mn_qdisc.c.  The numbers are those of the
+ * FreeBSD module's mn_xtq.h; XCP is not available on Linux.
+ */
+#define XTQ_NOXTQ       0       /* droptail FIFO */
+#define XTQ_XCP         1
+#define XTQ_RED         2
+#define XTQ_CODEL       3
+#define XTQ_MAX         4
 
-struct sysctl_hop {
-    int             bandwidth;  /* bits/s */
-    int             delay;      /* ms */
-    int             plr;        /* pkt loss rate (2^31-1 means 100%) */
-    int             qsize;      /* queue size in slots */
-    in_addr_t       emulator;   /* ip of emulator hosting hop, or 0 */
-    int             xtq_type;      /* fifo, red, xcp */
-  
-#ifdef MN_TCPDUMP
-  int             traceLink;
-#endif
+#define XTQ_ECN         0x1     /* mark ECN capable packets, don't drop */
+#define XTQ_ADAPTIVE    0x2     /* RED: adapt max_p to keep avg mid-range */
+
+/*
+ * Queue discipline of one hop, written to and read from
+ * /proc/sys/modelnet/hopqdisc.  A param of 0 takes the default.
+ *   RED:   min_th, max_th (pkts), max_p (millionths), wlog (avg weight
+ *          is 2^-wlog)
+ *   CoDel: target, interval (usecs)
+ * drops and marks are only read back.
+ */
+struct sysctl_hopqdisc {
+    int             hopidx;
+    int             type;       /* XTQ_* */
+    int             flags;      /* XTQ_ECN, XTQ_ADAPTIVE */
+    int             param[4];
+    u_int32_t       drops;      /* early drops */
+    u_int32_t       marks;      /* ECN marks */
 } __attribute__((packed));
 
 
@@ -88,6 +104,77 @@ struct sysctl_hopmod {
     struct sysctl_hop hop;
 } __attribute__((packed));
 
+/*
+ * Fluid background traffic on one hop: rate bits/s while on, switching
+ * between on_ms on and off_ms off.  off_ms of 0 means always on, rate 0
+ * removes the background.
+ */
+struct sysctl_hopbg {
+    int             hopidx;
+    u_int64_t       rate;       /* bits/s */
+    int             on_ms;
+    int             off_ms;
+} __attribute__((packed));
+
+/* switch tracing of a running hop on or off */
+struct sysctl_hoptrace {
+    int             hopidx;
+    int             trace;
+} __attribute__((packed));
+
+/*
+ * Capture settings of a traced hop: only packets matching the 5-tuple
+ * (addresses and ports in net order, masks for addresses, 0 for any)
+ * are kept, 1 in sample of them, snaplen bytes each.
+ */
+struct sysctl_hopcapture {
+    int             hopidx;
+    in_addr_t       src, srcmask;
+    in_addr_t       dst, dstmask;
+    u_int16_t       sport, dport;
+    int             proto;      /* 0 for any */
+    int             sample;     /* keep 1 in sample, 0 or 1 for all */
+    int             snaplen;    /* 0 for tcpdump/capturelength */
+} __attribute__((packed));
+
+/*
+ * A flow is a 5-tuple; addresses and ports in net order.  used marks a
+ * key that was filled in (and a table slot that is taken).
+ */
+struct mn_flowkey {
+    in_addr_t       src, dst;
+    u_int16_t       sport, dport;
+    u_int8_t        proto;
+    u_int8_t        used;
+    u_int16_t       pad;
+} __attribute__((packed));
+
+/*
+ * One flow as read from /proc/sys/modelnet/flows.  Each cpu counts the
+ * packets it handled, so a flow can show up once per cpu.
+ */
+struct sysctl_flow {
+    struct mn_flowkey key;
+    u_int64_t       pkts, bytes;        /* arrived */
+    u_int64_t       fwd_pkts, fwd_bytes;        /* left the emulator */
+    u_int64_t       drops;              /* lost at a local hop */
+    u_int64_t       qdelay;     /* usecs spent in hop queues, summed
+                                 * over the forwarded pkts */
+} __attribute__((packed));
+
+/*
+ * One packet as it entered emulation in deterministic mode, read from
+ * /proc/sys/modelnet/arrivals in the order the packets were emulated.
+ * With the seed and the model this is all it takes to replay a run.
+ */
+struct sysctl_arrival {
+    u_int64_t       tick;       /* calendar ticks since the seed was set */
+    struct mn_flowkey key;
+    u_int16_t       ipid;       /* net order */
+    u_int16_t       len;
+    u_int32_t       pad;
+} __attribute__((packed));
+
 struct sysctl_hoptable {
     struct sysctl_hop *hops;
     int             hopcount;
@@ -103,13 +190,15 @@ struct sysctl_pathentry {
 /* #ifdef _KERNEL */
 
 /*
- * We exchange remote_packet structs between cores.
+ * The multi-core state of a packet.  Cores exchange it as a digest,
+ * struct mc_digest in mn_remote.c.
  */
 struct remote_packet {
-    unsigned long   id;         /* opaque handle to orig. packet */
-    unsigned long   expire;     /* expiration time (in ticks) */
+    unsigned long   id;         /* in the home core's payload cache, or 0 */
+    unsigned long   expire;     /* jiffies it must be home by */
     unsigned long   len;        /* length of packet (bytes) */
-    unsigned long   wait_time;  /* total accumulated wait time for pkt */
+    unsigned long   wait_time;  /* total accumulated timing error of
+                                 * pkt, usecs, see struct mn_errstats */
     in_addr_t       src;
     in_addr_t       dst;
     unsigned long   hop;        /* not real source route */
@@ -120,6 +209,7 @@ struct remote_packet {
 typedef struct packet {
     struct hop    **path;       /* source route of hops packet traverses */
     struct sk_buff  *skb;
+    struct mn_net  *mnet;       /* namespace emulating this packet */
     in_addr_t       cachehost;  /* address of core caching the packet or 0 */
   
     struct list_head list; 
@@ -129,6 +219,11 @@ typedef struct packet {
 #define Q_DELAY    0x2          /* queue for propagation delay */
     int             state;
     struct remote_packet info;  /* state passed to remote cores */
+    struct mn_flowkey flow;     /* see mn_flow.c, used=0 if not counted */
+    unsigned long   qticks;     /* ticks queued at hops so far */
+    unsigned int    qmem;       /* bytes charged to mn_qmem */
+    unsigned long   arrival;    /* tick it is due to enter, deterministic
+                                 * mode only */
 } *mn_pkt_t;
 
 /* B/c of how linux kernel lists work, the packet data object is both
@@ -137,41 +232,6 @@ typedef struct packet {
 
 typedef struct packet pktlist;
 
-struct hop {
-    spinlock_t      lock;
-    int             KBps;       /* kilobytes/s */
-    int             delay;      /* ms */
-    int             plr;        /* pkt loss rate (2^31-1 means 100% loss) */
-    int             qsize;      /* queue size in slots */
-    in_addr_t       emulator;   /* ip of remote emulator, or 0 */
-
-#ifdef MN_TCPDUMP
-  int             traceLink;    /* Do we do a tcpdump on this link */
-#endif
-
-    u_int           bytespertick;  /* only a hint. it is 0 for slow links */
-    int             id;
-	/* --- Standard FIFO queue --- */
-    int             slotdepth;  /* slots currently occupied by packets */
-    int             bytedepth;  /* total bytes queued */
-    int             headslot;   /* next slot to dequeue */
-    int             fragment;   /* available bytes in tick next pkt can use */
-    unsigned long  *exittick;   /* array holding the time each queued
-                                 * packet will exit the queue */
-    int            *slotlen;    /* array holding length of each queued packet */
-
-    int             pkts,
-                    bytes,
-                    qdrops;     /* stats */
-};
-
-typedef struct hop_scheduler {
-	void (*timeout) (struct hop *h);  /* call this */
-	struct hop *hop;                  /* with this */
-  /* TAILQ_ENTRY(hop_scheduler) list,free; */
-  struct list_head list;
-} *hop_scheduler_t;
-
 /*
  * We keep some historical statistics in the kernel.
  * XXX not all of these are used now.
@@ -195,14 +255,14 @@ struct mn_stats {
 
     unsigned int    hop_pkts;   /* recent pkt count */
     unsigned int    hop_bytes;  /* recent pkt byte count */
-    unsigned int    hop_toterr; /* recent pkt sum of errors */
-    unsigned int    hop_toterrsq;       /* recent pkt sum of squares of
+    u_int64_t       hop_toterr; /* sum of hop errors, usecs */
+    u_int64_t       hop_toterrsq;       /* sum of squares of hop
                                          * errors */
 
     unsigned int    pkt_pkts;   /* recent pkt count */
     unsigned int    pkt_bytes;  /* recent pkt byte count */
-    unsigned int    pkt_toterr; /* recent pkt sum of errors */
-    unsigned int    pkt_toterrsq;       /* recent pkt sum of squares of
+    u_int64_t       pkt_toterr; /* sum of end-to-end errors, usecs */
+    u_int64_t       pkt_toterrsq;       /* sum of squares of end-to-end
                                          * errors */
   unsigned int    hop_scheduled;  /* current # hops scheduled */
 
@@ -211,6 +271,8 @@ struct mn_stats {
     unsigned int    mc_exdrops; /* multi-core pkt expiration drops */
     unsigned int    mc_ttldrops;        /* multi-core pkt ttl drops */
     unsigned int    mc_errs;    /* multi-core pkt errors */
+    unsigned int    mc_batches; /* multi-core datagrams gathered */
+    unsigned int    mc_frames;  /* multi-core datagrams sent as frames */
 
     unsigned int    mbuf_alloc; /* XXX mbuf statistics */
     unsigned int    mbuf_free;  /* XXX not currently used */
@@ -218,7 +280,9 @@ struct mn_stats {
 
     unsigned int    pkt_alloc;  /* */
     unsigned int    pkt_free;   /* */
-    u_int32_t       pcache_occupancy;
+    u_int32_t       pcache_occupancy;   /* payloads cached at home */
+    u_int32_t       pcache_expired;     /* ... freed, digest not back */
+    u_int32_t       pcache_full;        /* pkts sent whole, no slot */
     u_int32_t       pkts_queued;        /* packets in the switch */
 };
 
@@ -235,6 +299,30 @@ struct mn_error {
 	u_int32_t       delayzero;     /* zero delays calculated */
 };
 
+/*
+ * What each run of hopclock cost, read from /proc/sys/modelnet/clockstats.
+ * late counts the calendar ticks a run found overdue beyond the one it
+ * was scheduled for: once hopclock is regularly late the emulator is
+ * saturated and delays are no longer faithful.  Cycles are get_cycles()
+ * units, spent draining the calendar.
+ */
+struct mn_clockstats {
+    u_int64_t       runs;       /* hopclock invocations */
+    u_int64_t       ticks;      /* calendar ticks drained */
+    u_int64_t       pkts;       /* packets taken off the calendar */
+    u_int64_t       hops;       /* ... of which went on to another hop */
+    u_int64_t       cycles;
+    u_int64_t       max_cycles; /* longest run */
+    u_int32_t       hz;         /* calendar ticks per second */
+    u_int32_t       max_late;   /* most ticks a run was behind */
+    u_int32_t       max_pkts;   /* most packets in one run */
+    u_int32_t       max_hops;
+    u_int32_t       late[MN_HIST_BUCKETS];      /* per run */
+    u_int32_t       pkts_hist[MN_HIST_BUCKETS];
+    u_int32_t       hops_hist[MN_HIST_BUCKETS];
+    u_int32_t       cycles_hist[MN_HIST_BUCKETS];
+};
+
 
 struct mn_config {
 	/*
@@ -246,13 +334,88 @@ struct mn_config {
 	u_int32_t       state; /* configured options */
 	unsigned long   ip_home;       /* ip addr (in net order) of this
 					* node */
-	int             mc_expire;     /* milliseconds to hold mc pkts */
-	int             mc_ttl;        /* time-to-live for mc pkts */
+	int             mc_expire;     /* ms a pkt may be away from home */
+	int             mc_ttl;        /* core crossings a pkt may make */
+	int             mc_aggregate;  /* bytes to gather per core, 0 off */
+	int             mc_ether;      /* cores on the link get frames */
 	u_int64_t       tick_count;    /* soft-tick count */
-	struct mn_pkt_head mc_pcache;  /* multi-core packet cache */
 	struct mn_stats stats;
 };
 
+/*
+ * Everything that makes up one running experiment lives here, one
+ * instance per network namespace.  The model (hops, routes), the packet
+ * calendar and the stats are private to the namespace, so independent
+ * models can run side by side on one emulator host.  The proc handlers
+ * find it through table->extra1, packets through pkt->mnet.
+ */
+struct mn_net {
+    struct net     *net;
+    int             loaded;     /* has a model, see modelnet_load() */
+    struct mutex    load_mutex;
+
+    /* topology, see mn_pathtable.c and mn_core.c */
+    struct mn_model model;
+
+    /* packet calendar, see ip_modelnet.c */
+    struct mn_calendar calendar;
+    struct list_head *hop_calendar;     /* hop timers, see mn_qdisc.c;
+                                         * NULL until a qdisc needs one */
+    spinlock_t      calendar_lock;
+    struct delayed_work hopclock_task;
+    int             die;        /* keep hopclock from queueing itself */
+    int             polled;     /* drained by a polling thread */
+    int             poll_idx;   /* ... this one */
+    struct list_head poll_list;
+
+    /* calendar time: mn_hz ticks per second of ktime, tdf times slower */
+    int             tdf;        /* time dilation factor, 1 = real time */
+    unsigned long   dilate_tick;     /* calendar time when tdf last changed */
+    s64             dilate_ns;       /* and ktime, see dilated_now() */
+
+    /* deterministic mode and the arrival log, see mn_replay.c */
+    unsigned long   seed;       /* of the hops' random streams */
+    unsigned long   vbase;      /* calendar tick the seed was set at */
+    int             deterministic;
+    struct list_head ingress;   /* arrivals not yet emulated */
+    struct sysctl_arrival *arrivals;    /* log, arrival_mask + 1 slots */
+    u_int32_t       arrival_mask;
+    u_int32_t       arrival_head, arrival_tail;
+    unsigned long   arrivals_lost;      /* to a full log */
+
+    /* datagrams to other cores being gathered, see mn_remote.c */
+    struct mc_aggtab __percpu *mc_agg;
+    atomic_t        mc_gathering;       /* datagrams in it */
+
+    /* payloads of packets away at other cores, by id, see mn_remote.c */
+    struct packet **pcache;     /* pcache_mask + 1 slots, NULL when off */
+    u_int32_t       pcache_mask;
+    u_int32_t       pcache_head, pcache_tail;   /* next id, oldest id */
+    spinlock_t      pcache_lock;
+
+    /* per-flow stats, see mn_flow.c */
+    struct mn_flowtab __percpu *flows;
+    int             flowslots;  /* per cpu, 0 when off */
+
+    /* stats and debug */
+    struct mn_config mn;
+    struct mn_error g_error;
+    struct mn_clockstats clock; /* under calendar_lock */
+    u_int32_t       pkterr_hist[MN_HIST_BUCKETS];  /* end to end, see
+                                 * mn.stats.pkt_toterr */
+    int             pktcount[60];
+
+    struct ctl_table_header *sysctl_header;
+    ctl_table      *sysctl_table;   /* private copy, extra1 points here */
+};
+
+extern int mn_net_id;
+
+static inline struct mn_net *mn_pernet(struct net *net)
+{
+    return net_generic(net, mn_net_id);
+}
+
 #define MC_HOP_LOCAL(hop)  (hop->emulator==0)
 
 #define MC_PKT_HOME(pkt)   (pkt->cachehost==0)
@@ -261,11 +424,29 @@ struct mn_config {
 
 #define MODEL_FORCEOFF(addr) ((addr)&(~MODEL_FORCEBIT))
 
+/*
+ * Memory held by packets in emulation, skb and struct packet, counted
+ * host-wide against mn_qmem_limit.  Packets are charged on arrival in
+ * filter_ipinput() and uncharged when forwarded or freed.  The counter
+ * is per cpu, so the total it reads may be off by MN_QMEM_BATCH bytes
+ * per cpu.
+ */
+extern struct percpu_counter mn_qmem;
+extern unsigned long mn_qmem_limit;     /* bytes, 0 for no limit */
+#define MN_QMEM_BATCH   (64 * 1024)
+
+static inline void mn_qmem_uncharge(struct packet *pkt)
+{
+    __percpu_counter_add(&mn_qmem, -(s64)pkt->qmem, MN_QMEM_BATCH);
+    pkt->qmem = 0;
+}
+
 #define MN_FREE_PKT(pkt)	{	\
+        if (pkt->qmem) mn_qmem_uncharge(pkt);	\
         if (pkt->skb) kfree_skb(pkt->skb);	\
 	pkt->skb = NULL; \
-        kfree(pkt);	\
-        mn.stats.pkt_free++;}
+        pkt->mnet->mn.stats.pkt_free++; \
+        kfree(pkt);}
 
 /*
  * silly helper for printing net-order ip addresses in 32bit ints
@@ -301,28 +482,31 @@ panic("assert failed \"%s\" %s line %d", XSTR(x), __FILE__, __LINE__);
 #endif
 #endif
 
-struct hop    **lookup_path(in_addr_t src, in_addr_t dst);
-void            uninit_paths(void);
-int             remote_hop(struct packet *, in_addr_t);
+int             mn_qmem_charge(struct packet *pkt);
+int             modelnet_load(struct mn_net *mnet);
+
+void            uninit_paths(struct mn_net *mnet);
 void            emulate_nexthop(struct packet *pkt, int needlock);
 
-extern struct mn_config mn;
-extern struct mn_error g_error;
-extern u_int32_t mn_debug_g;
+/* multi-core, see mn_remote.c */
+extern unsigned short remote_port;
+void            mn_remote_setup(struct mn_net *mnet);
+int             mn_remote_init(struct mn_net *mnet);
+void            mn_remote_uninit(struct mn_net *mnet);
+void            mc_flush(struct mn_net *mnet);
+void            mc_pcache_expire(struct mn_net *mnet);
+int             proc_mcpcache(ctl_table *table, int write,
+                              void __user *buffer, size_t *lenp,
+                              loff_t *ppos);
+int             remote_hop(struct packet *, in_addr_t);
+unsigned int    remote_input(unsigned int hooknum, struct sk_buff *skb,
+                             const struct net_device *in,
+                             const struct net_device *out,
+                             int (*okfn)(struct sk_buff *));
+int             mc_ether_input(struct sk_buff *skb, struct net_device *dev,
+                               struct packet_type *pt,
+                               struct net_device *orig_dev);
 
-/* Random Number Generation */
-#define MERS_N   624
-#define MERS_M   397
-#define MERS_R   31
-#define MERS_U   11
-#define MERS_S   7
-#define MERS_T   15
-#define MERS_L   18
-#define MERS_A   0x9908B0DF
-#define MERS_B   0x9D2C5680
-#define MERS_C   0xEFC60000
-
-extern void random_seed(u_int seed);
-extern u_int random_bits(void);     
+extern u_int32_t mn_debug_g;
 
 #endif                          /* _IP_MODELNET_H */
@@ -0,0 +1,588 @@
+/*
+ * modelnet  mn_core.c
+ *
+ *     the emulation core: hop model, packet calendar and route store
+ *
+ * Copyright (c) 2006
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in
+ *      the documentation and/or other materials provided with the
+ *      distribution.
+ *    * Neither the names of Duke University nor The University of
+ *      California, San Diego, nor the names of the authors or contributors
+ *      may be used to endorse or promote products derived from
+ *      this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE
+ * USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+/*
+ * Everything here is plain computation on the model.  It knows nothing
+ * of skbs, netfilter, sysctl or workqueues and reaches the platform only
+ * through mn_platform.h, so it builds unchanged into the module and
+ * into libmnemu (emulator/linux/libmnemu), where it can be run under
+ * perf, valgrind and the sanitizers.  Packets and their paths through
+ * the model are the caller's: emulate_hop() in ip_modelnet.c is the
+ * module's.
+ */
+
+#include "mn_core.h"
+
+/*
+ * Calendar ticks per second.  HZ by default in the module, where it is
+ * the mn_hz parameter; 1000 in libmnemu.  Must divide NSEC_PER_SEC.
+ */
+unsigned int mn_hz = MN_DEFAULT_HZ;
+u_int64_t mn_tick_nsec;
+unsigned long mn_calendar_len;
+
+/*
+ * [mn_core_init] Check mn_hz and derive the tick length and calendar
+ * size from it.  Once, before any model is loaded.
+ */
+int mn_core_init(void)
+{
+    if (!mn_hz || NSEC_PER_SEC % mn_hz) {
+        mn_log("Modelnet: mn_hz must divide %lu\n",
+               (unsigned long)NSEC_PER_SEC);
+        return -EINVAL;
+    }
+    mn_tick_nsec = NSEC_PER_SEC / mn_hz;
+    mn_calendar_len = roundup_pow_of_two(min_t(u_int64_t,
+        (u_int64_t)mn_hz * MN_CALENDAR_SECS, 1UL << MN_CALENDAR_MAXBITS));
+    return 0;
+}
+
+
+/*
+ * [update_bwq] Update virtual bandwidth queue in hop.
+ * Bring the length and head position of virtual bandwidth queue up to
+ * the current time (calendar_tick).
+ * *note* we don't keep track of bytedepth here, as we don't know
+ * packet lengths.  We decrement that when the packet leaves the
+ * queue+delay in emulate_nexthop.
+ * Also brings the on/off state of any background traffic up to date.
+ */
+static void update_bwq(struct hop *hop, unsigned long tick)
+{
+    if (hop->bg_off_ticks && !time_before(tick, hop->bg_toggle)) {
+        unsigned long period = hop->bg_on_ticks + hop->bg_off_ticks;
+
+        /* skip whole periods the hop sat idle through */
+        if (tick - hop->bg_toggle >= period)
+            hop->bg_toggle += ((tick - hop->bg_toggle) / period) * period;
+        while (!time_before(tick, hop->bg_toggle)) {
+            hop->bg_on = !hop->bg_on;
+            hop->bg_toggle += hop->bg_on ? hop->bg_on_ticks : hop->bg_off_ticks;
+        }
+    }
+
+    while (hop->slotdepth && hop->exittick[hop->headslot]<tick)
+    {
+	hop->exittick[hop->headslot] = 0;
+	hop->slotdepth--;
+	hop->bytedepth -= hop->slotlen[hop->headslot];
+	hop->slotlen[hop->headslot] = 0;
+	if (++hop->headslot == hop->qsize)
+	    hop->headslot = 0;
+    }
+}
+
+
+/*
+ * [tpb_div] floor(8 * mn_hz * 2^shift / bps): transmission time of one
+ * byte in calendar ticks, with shift fractional bits.  It is computed
+ * bit by bit with a long division, so it is exact to the last bit kept
+ * and needs no 128-bit arithmetic.  With fixed == 0 the shift grows
+ * until the result has MN_TPB_BITS significant bits or reaches
+ * MN_TPB_MAXSHIFT and is returned in *shift; otherwise *shift is used.
+ */
+#define MN_TPB_BITS  40
+#define MN_TPB_MAXSHIFT 62
+#define MN_MAX_BPS   (1ULL << 62)   /* keeps the remainder shift in range */
+
+static u_int64_t tpb_div(u_int64_t bps, u_int *shift, int fixed)
+{
+    u_int64_t q, r;
+    u_int s = 0;
+
+    if (bps > MN_MAX_BPS)
+        bps = MN_MAX_BPS;
+    q = div64_u64(8ULL * mn_hz, bps);
+    r = 8ULL * mn_hz - q * bps;
+    while (fixed ? s < *shift :
+           (s < MN_TPB_MAXSHIFT && q < (1ULL << (MN_TPB_BITS - 1)))) {
+        q <<= 1;
+        r <<= 1;
+        if (r >= bps) {
+            q |= 1;
+            r -= bps;
+        }
+        ++s;
+    }
+    *shift = s;
+    return q;
+}
+
+/*
+ * [hop_set_bandwidth] Set the link rate of a hop and precompute its
+ * transmission time per byte (tpb) for mn_hop_enqueue().  Even at
+ * 100 Gbit/s and mn_hz=1000 tpb keeps 28 significant bits, far below one
+ * tick of error per second.
+ */
+void hop_set_bandwidth(struct hop *hop, u_int64_t bps)
+{
+    hop->bps = bps;
+    hop->tpb = 0;
+    hop->tpb_shift = 0;
+    hop->tailfrac = 0;
+    if (bps)
+        hop->tpb = tpb_div(bps, &hop->tpb_shift, 0);
+}
+
+
+/*
+ * [hop_set_background] Load a hop with fluid background traffic.
+ *
+ * Background traffic of rate B on a link of rate C is never turned
+ * into packets.  While it is on, foreground packets are served at the
+ * left-over rate C - B (tpb_bg), and since a FIFO holds traffic in
+ * proportion to its arrival rate, the background is taken to hold
+ * B/(C - B) slots for every foreground packet queued (bg_ratio).  An
+ * empty queue holds no background: a fluid below the link rate never
+ * queues by itself.  The on/off process is a deterministic square wave
+ * advanced in update_bwq().
+ *
+ * B is limited to 15/16 of C so tpb_bg stays within 16 * tpb and the
+ * fixed-point product in mn_hop_enqueue() cannot overflow.
+ *
+ * Caller holds hop->lock.  Returns 0 or -EINVAL.
+ */
+#define MN_BG_MAXNUM 15
+#define MN_BG_MAXDEN 16
+
+int hop_set_background(struct hop *hop, u_int64_t bps,
+                       int on_ms, int off_ms, unsigned long now)
+{
+    u_int64_t b, c;
+
+    if (bps && (!hop->bps || on_ms < 0 || off_ms < 0 ||
+                div64_u64(hop->bps, MN_BG_MAXDEN) * MN_BG_MAXNUM < bps))
+        return -EINVAL;
+
+    hop->bg_bps = bps;
+    hop->bg_on = 0;
+    hop->tpb_bg = hop->tpb;
+    hop->bg_ratio = 0;
+    if (!bps)
+        return 0;
+
+    hop->tpb_bg = tpb_div(hop->bps - bps, &hop->tpb_shift, 1);
+    b = bps;
+    c = hop->bps - bps;
+    while (b >= (1ULL << 47)) {
+        b >>= 1;
+        c >>= 1;
+    }
+    hop->bg_ratio = div64_u64(b << 16, c);
+
+    hop->bg_on_ticks = max(1UL, mn_ms_to_ticks(on_ms));
+    hop->bg_off_ticks = off_ms ? max(1UL, mn_ms_to_ticks(off_ms)) : 0;
+    hop->bg_on = 1;
+    hop->bg_toggle = now + hop->bg_on_ticks;
+    return 0;
+}
+
+
+/*
+ * [mn_hop_init] Set up hop number id of a zeroed hoptable from its
+ * description.  Tracing and queue disciplines are the module's to add.
+ * Returns 0 or -ENOMEM; mn_hop_uninit() cleans up either way.
+ */
+int mn_hop_init(struct hop *hop, int id, const struct sysctl_hop *sh,
+                u_int64_t seed)
+{
+    mn_lock_init(&hop->lock);
+    hop_set_bandwidth(hop, sh->bandwidth);
+    hop->delay = mn_ms_to_ticks(sh->delay);
+    hop->plr = sh->plr;
+    hop->qsize = sh->qsize;
+    hop->emulator = sh->emulator;
+    hop->id = id;
+    mn_hop_rekey(hop, seed);
+
+    /*
+     * initialize bandwidth queue
+     */
+
+    /* usually pretty small, kmalloc should be ok */
+    hop->exittick = mn_alloc(hop->qsize * sizeof(*hop->exittick));
+    if (!hop->exittick) {
+      mn_log("hop->exittick alloc failed %lu\n",
+	     (unsigned long)(hop->qsize * sizeof(*hop->exittick)));
+      return -ENOMEM;
+    }
+    memset(hop->exittick, 0, hop->qsize * sizeof(*hop->exittick));
+    hop->slotdepth = 0;
+    hop->bytedepth = 0;
+    hop->headslot = 0;
+
+    hop->slotlen = mn_alloc(hop->qsize * sizeof(*hop->slotlen));
+    if (!hop->slotlen) {
+      mn_log("hop->slotlen alloc failed\n");
+      return -ENOMEM;
+    }
+    memset(hop->slotlen, 0, hop->qsize * sizeof(*hop->slotlen));
+    return 0;
+}
+
+void mn_hop_uninit(struct hop *hop)
+{
+    mn_free(hop->exittick);
+    mn_free(hop->slotlen);
+    hop->exittick = NULL;
+    hop->slotlen = NULL;
+}
+
+
+/*
+ * [mn_hop_admit] First half of crossing a hop: decide whether the hop
+ * loses the packet.
+ *
+ * Emulate link loss rate hop->plr [packet loss rate]
+ * Bring the virtual bw queue up to now and see if it is full, counting
+ * the slots background traffic holds while it is on.
+ *
+ * Returns 0, or MN_HOP_PLRDROP and/or MN_HOP_QDROP.  Queue drops are
+ * counted in hop->qdrops.  Caller holds hop->lock.
+ */
+int mn_hop_admit(struct hop *hop, unsigned long now)
+{
+    int verdict = 0;
+
+    /* mn_hop_random returns a value between 0 and
+     * (2**32)-1, whereas random() on a bsd machine will return
+     * (2**31)-1 ... I zero out the top most bit just in case as it can
+     * do no harm.
+     */
+    if (hop->plr && ((mn_hop_random(hop) & 0x7fffffff) < hop->plr))
+	verdict |= MN_HOP_PLRDROP;
+
+    if (hop->bps) {  /* bw of 0 means no bw limit */
+        update_bwq(hop, now);
+        if (hop->slotdepth +
+            (hop->bg_on ? (int)((hop->slotdepth * hop->bg_ratio) >> 16) : 0)
+            >= hop->qsize) {
+            verdict |= MN_HOP_QDROP;
+            ++hop->qdrops;      /* stats */
+        }
+    }
+    return verdict;
+}
+
+/*
+ * [mn_hop_enqueue] Second half: put an admitted packet of len bytes on
+ * the tail of the notional bw queue.
+ *
+ * If the hop has queued packets the packet starts when the tail packet
+ * is scheduled to exit the hop; if the queue is empty, the link is
+ * idle: start from now and drop any sub-tick remainder.
+ *
+ * For hops with bw limits, calculate how many ticks it will take to
+ * transmit the pkt (bwdelay) in fixed point: len * tpb is the
+ * transmission time in units of 2^-tpb_shift ticks.  The part that
+ * does not make a whole tick is carried in tailfrac to the next
+ * packet, so pacing is exact on average and deterministic, with no
+ * division per packet.  While background traffic is on, the packet
+ * gets only the capacity it leaves (tpb_bg).  len < 2^18 and
+ * tpb_bg <= 16 * tpb < 2^(MN_TPB_BITS + 4) keep the sum below 2^63.
+ *
+ * Returns the tick the packet leaves the queue; it is due at the next
+ * hop hop->delay ticks later.  Caller holds hop->lock.
+ */
+unsigned long mn_hop_enqueue(struct hop *hop, unsigned int len,
+                             unsigned long now)
+{
+    int newslot = (hop->headslot + hop->slotdepth) % hop->qsize;
+    unsigned long tailexit = mn_hop_tail(hop, now);
+
+    ++hop->pkts;                /* stats */
+    hop->bytes += len;          /* stats */
+
+    if (!hop->slotdepth)
+        hop->tailfrac = 0;
+
+    if (hop->tpb) {
+        u_int64_t t;
+
+        t = hop->tailfrac +
+            (u_int64_t)len * (hop->bg_on ? hop->tpb_bg : hop->tpb);
+        tailexit += (unsigned long)(t >> hop->tpb_shift);
+        hop->tailfrac = t & ((1ULL << hop->tpb_shift) - 1);
+    }
+
+    /* add packet to virtual queue of this hop */
+    ++hop->slotdepth;
+    hop->slotlen[newslot] = len;
+    hop->bytedepth += len;
+    hop->exittick[newslot] = tailexit;
+    return tailexit;
+}
+
+
+/*
+ * [mn_calendar_init] Allocate mn_calendar_len empty slots, starting at
+ * calendar tick tick.  Returns 0 or -ENOMEM.
+ */
+int mn_calendar_init(struct mn_calendar *cal, unsigned long tick)
+{
+    unsigned long i;
+
+    cal->slots = mn_valloc(sizeof(*cal->slots) * mn_calendar_len);
+    if (!cal->slots) {
+        mn_log("Could not allocate packet calendar\n");
+        return -ENOMEM;
+    }
+    for (i = 0; i < mn_calendar_len; ++i)
+        INIT_LIST_HEAD(&cal->slots[i]);
+    cal->mask = mn_calendar_len - 1;
+    cal->tick = tick;
+    return 0;
+}
+
+/* whatever is still on the calendar is the caller's to free first */
+void mn_calendar_uninit(struct mn_calendar *cal)
+{
+    mn_vfree(cal->slots);
+    cal->slots = NULL;
+}
+
+
+/**
+ * mn_model_lookup - this is unmodified from BSD version of modelnet
+ * (lookup_path there)
+ */
+struct hop **
+mn_model_lookup(struct mn_model *m, in_addr_t src, in_addr_t dst)
+{
+    int             srcid = m->nodetable[ntohl(src) & NODEMASK];
+    int             dstid = m->nodetable[ntohl(dst) & NODEMASK];
+    if (srcid == -1 || dstid == -1 || m->pathtable == NULL)
+    {
+      mn_log ("lookup_path: no path for %x -> %x .... %x -> %x\n",
+	      src, dst, ntohl(src) & NODEMASK, ntohl(dst) & NODEMASK);
+      mn_log ("lookup_path: srcid(%d), dstid(%d), pathtable(%lx)\n",
+	      srcid, dstid, (unsigned long)m->pathtable);
+      return NULL;
+    }
+    return m->pathtable[srcid][dstid];
+}
+
+
+/**
+ * mn_model_free_paths - this is more-or-less unmodified from BSD
+ * version of modelnet (free_path there)
+ */
+void
+mn_model_free_paths(struct mn_model *m)
+{
+  int             i, j;
+  struct hop  ****pathtable = m->pathtable;
+
+  if (pathtable && m->nodecount)
+  {
+    for (i = 0; i < m->nodecount; ++i)
+    {
+      if (!pathtable[i])
+	continue;
+      for (j = 0; j < m->nodecount; ++j)
+      {
+	if (pathtable[i][j])
+	{
+	  mn_free(pathtable[i][j]);
+	}
+      }
+      mn_free(pathtable[i]);
+    }
+    mn_free(pathtable);
+  }
+  m->pathtable = NULL;
+  m->nodecount = 0;
+}
+
+/* mn_model_free_hops - remove paths, but also remove each hop */
+void
+mn_model_free_hops(struct mn_model *m)
+{
+  int i;
+
+  mn_model_free_paths(m);
+  if (m->hoptable)
+  {
+    for (i = 0; i < m->hopcount; ++i)
+      mn_hop_uninit(m->hoptable + i);
+    mn_vfree(m->hoptable);
+  }
+  m->hoptable = NULL;
+  m->hopcount = 0;
+}
+
+/*
+ * mn_model_init - allocate the nodetable.  At 256KB it is too big to
+ * live inside the struct holding the model.
+ */
+int
+mn_model_init(struct mn_model *m)
+{
+  memset(m, 0, sizeof(*m));
+  m->nodetable = mn_valloc((NODEMASK + 1) * sizeof(*m->nodetable));
+  if (!m->nodetable)
+  {
+    mn_log("init_paths: nodetable alloc failed\n");
+    return -ENOMEM;
+  }
+  memset(m->nodetable, 0, (NODEMASK + 1) * sizeof(*m->nodetable));
+  return 0;
+}
+
+void
+mn_model_uninit(struct mn_model *m)
+{
+  mn_model_free_hops(m);
+  mn_vfree(m->nodetable);
+  m->nodetable = NULL;
+}
+
+/*
+ * mn_model_set_hops - replace the hops, and with them the paths, by
+ * count hops described in hops[].  Random streams are keyed by seed.
+ */
+int
+mn_model_set_hops(struct mn_model *m, const struct sysctl_hop *hops,
+		  int count, u_int64_t seed)
+{
+  int i, error;
+
+  mn_model_free_hops(m);
+
+  /* Switched to vmalloc as this was unstable for large topologies */
+  m->hoptable = mn_valloc(count * sizeof(*m->hoptable));
+  if (!m->hoptable)
+  {
+    mn_log("hoptable alloc failed. (%lu KB)\n",
+	   (unsigned long)(count * sizeof(*m->hoptable)/1024));
+    return -ENOMEM;
+  }
+  memset(m->hoptable, 0, count * sizeof(*m->hoptable));
+
+  m->hopcount = count;
+  for (i = 0; i < count; ++i)
+    if ((error = mn_hop_init(m->hoptable + i, i, hops + i, seed)))
+      return error;
+  return 0;
+}
+
+/*
+ * mn_model_set_nodecount - size the pathtable for count nodes, dropping
+ * all paths if the count changes.
+ */
+int
+mn_model_set_nodecount(struct mn_model *m, int count)
+{
+  int i;
+  struct hop ****pathtable;
+
+  if (count == m->nodecount && (m->pathtable || !count))
+    return 0;
+
+  mn_model_free_paths(m);
+  if (count <= 0)
+    return count ? -EINVAL : 0;
+
+  /* XXX - BSD version has M_WAITOK, but in the Linux kernel we have
+   * interrupts disabled so I think we have to do this kmalloc
+   * atomically.  This procedure is not in the critical path so I
+   * did not give it much thought
+   */
+  pathtable = mn_alloc(count * sizeof(struct hop **));
+  if (!pathtable)
+    return -ENOMEM;
+  memset(pathtable, 0, count * sizeof(struct hop **));
+  m->pathtable = pathtable;
+  m->nodecount = count;
+
+  for (i = 0; i < count; ++i)
+  {
+    pathtable[i] = mn_alloc(count * sizeof(struct hop *));
+    if (!pathtable[i])
+    {
+      mn_model_free_paths(m);
+      return -ENOMEM;
+    }
+    memset(pathtable[i], 0, count * sizeof(struct hop *));
+  }
+  return 0;
+}
+
+/*
+ * mn_model_set_path - set the path from node src to node dst to the
+ * pathlen hops (hoptable indices) in hops[].
+ */
+int
+mn_model_set_path(struct mn_model *m, int src, int dst,
+		  const int *hops, int pathlen)
+{
+  struct hop **path;
+  int i;
+
+  if (!m->pathtable || !m->hoptable)
+  {
+    mn_log("pathentry: Pathtable(%lx) or hoptable(%lx) is null\n",
+	   (unsigned long)m->pathtable, (unsigned long)m->hoptable);
+    return -EINVAL;
+  }
+
+  if (src < 0 || dst < 0 || src >= m->nodecount || dst >= m->nodecount ||
+      pathlen < 0)
+  {
+    mn_log("pathentry: ERROR nodecount issues\n");
+    return -EINVAL;
+  }
+  for (i = 0; i < pathlen; ++i)
+    if (hops[i] < 0 || hops[i] >= m->hopcount)
+    {
+      mn_log("pathentry: no hop %d\n", hops[i]);
+      return -EINVAL;
+    }
+
+  path = mn_alloc((pathlen + 1) * sizeof(struct hop *));
+  if (!path)
+  {
+    mn_log("path alloc failed\n");
+    return -ENOMEM;
+  }
+  for (i = 0; i < pathlen; ++i)
+    path[i] = m->hoptable + hops[i];
+  path[pathlen] = NULL;
+
+  mn_free(m->pathtable[src][dst]);
+  m->pathtable[src][dst] = path;
+  return 0;
+}
@@ -0,0 +1,282 @@
+/*
+ * modelnet  mn_core.h
+ *
+ *     the emulation core: hop model, packet calendar and route store,
+ *     shared by the module and libmnemu
+ *
+ * Copyright (c) 2006
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in
+ *      the documentation and/or other materials provided with the
+ *      distribution.
+ *    * Neither the names of Duke University nor The University of
+ *      California, San Diego, nor the names of the authors or contributors
+ *      may be used to endorse or promote products derived from
+ *      this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE
+ * USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#ifndef _MN_CORE_H
+#define _MN_CORE_H
+
+#include "mn_platform.h"
+
+#define MN_CALENDAR_SECS    16      /* delay the packet calendar covers */
+#define MN_CALENDAR_MAXBITS 22      /* but at most 2^22 slots */
+#define NODEMASK 0xffff
+
+/* XXX I cheaped out and packed the structs so 64-bit systems will work */
+
+struct sysctl_hop {
+    u_int64_t       bandwidth;  /* bits/s, 0 means unlimited */
+    int             delay;      /* ms */
+    int             plr;        /* pkt loss rate (2^31-1 means 100%) */
+    int             qsize;      /* queue size in slots */
+    in_addr_t       emulator;   /* ip of emulator hosting hop, or 0 */
+    int             xtq_type;      /* XTQ_*, queue discipline */
+    int             traceLink;  /* start with tracing on, see hoptrace */
+} __attribute__((packed));
+
+/*
+ * Log2 histograms: bucket 0 counts zeros, bucket i > 0 the values in
+ * [2^(i-1), 2^i), the last bucket everything above.
+ */
+#define MN_HIST_BUCKETS 32
+
+static inline void mn_hist_add(u_int32_t *hist, u_int64_t v)
+{
+    int b = fls64(v);
+
+    hist[b < MN_HIST_BUCKETS ? b : MN_HIST_BUCKETS - 1]++;
+}
+
+/*
+ * Emulation timing error: how long after its scheduled exit time a
+ * packet was actually handled, in microseconds.  Kept per hop and,
+ * summed over the hops of its path, per packet end to end.
+ */
+struct mn_errstats {
+    u_int64_t       toterr;     /* sum of errors */
+    u_int64_t       toterrsq;   /* sum of squares of errors */
+    u_int32_t       hist[MN_HIST_BUCKETS];  /* the count is their sum */
+};
+
+static inline void mn_err_add(struct mn_errstats *e, u_int64_t us)
+{
+    e->toterr += us;
+    e->toterrsq += us * us;
+    mn_hist_add(e->hist, us);
+}
+
+/* see struct sysctl_hopcapture, checked by handle_tcpdump() */
+struct mn_capture {
+    in_addr_t       src, srcmask;
+    in_addr_t       dst, dstmask;
+    u_int16_t       sport, dport;
+    u_int8_t        proto;
+    u_int32_t       sample;
+    u_int32_t       skip;       /* matching packets until the next sample */
+    u_int32_t       snaplen;
+};
+
+struct mn_qdisc_ops;
+
+struct hop {
+    mn_lock_t       lock;
+    u_int64_t       bps;        /* bits/s, 0 means no bw limit */
+    int             delay;      /* ticks */
+    int             plr;        /* pkt loss rate (2^31-1 means 100% loss) */
+    int             qsize;      /* queue size in slots */
+    in_addr_t       emulator;   /* ip of remote emulator, or 0 */
+    int             traceLink;  /* Do we do a tcpdump on this link */
+    struct mn_capture capture;  /* which packets, how much of them */
+
+    /*
+     * Transmission time per byte in calendar ticks, as a fixed-point
+     * number with tpb_shift fractional bits.  tpb_shift is chosen per
+     * hop to keep tpb precise from 1 kbit/s to 100 Gbit/s and beyond;
+     * see hop_set_bandwidth().
+     */
+    u_int64_t       tpb;
+    u_int           tpb_shift;
+    int             id;
+    u_int64_t       rng_key;    /* random stream, see mn_hop_random() */
+    u_int64_t       rng_ctr;
+	/* --- Standard FIFO queue --- */
+    int             slotdepth;  /* slots currently occupied by packets */
+    int             bytedepth;  /* total bytes queued */
+    int             headslot;   /* next slot to dequeue */
+    u_int64_t       tailfrac;   /* sub-tick part of the tail exit time,
+                                 * in units of 2^-tpb_shift ticks */
+    unsigned long  *exittick;   /* array holding the time each queued
+                                 * packet will exit the queue */
+    int            *slotlen;    /* array holding length of each queued packet */
+
+	/* --- Fluid background traffic, see hop_set_background() --- */
+    u_int64_t       bg_bps;     /* background rate while on, 0 for none */
+    u_int64_t       tpb_bg;     /* tpb of the capacity left while on */
+    u_int64_t       bg_ratio;   /* bg/fg share of a busy queue, 16.16 */
+    unsigned long   bg_on_ticks;
+    unsigned long   bg_off_ticks;  /* 0 means always on */
+    unsigned long   bg_toggle;  /* tick of the next on/off change */
+    int             bg_on;
+
+	/* --- Queue discipline, NULL for FIFO, see mn_qdisc.c --- */
+    const struct mn_qdisc_ops *qdisc;
+    void           *xtq;        /* its state */
+    struct hop_scheduler {
+	struct hop *hop;                  /* run hop->qdisc->timeout */
+	struct list_head list;            /* on mnet->hop_calendar */
+    }               timer;
+
+    int             pkts,
+                    bytes,
+                    qdrops;     /* stats, early drops included */
+    u_int32_t       aqmdrops;   /* early drops by the qdisc */
+    u_int32_t       marks;      /* ECN marks by the qdisc */
+    struct mn_errstats err;     /* timing error, under calendar_lock */
+};
+
+typedef struct hop_scheduler *hop_scheduler_t;
+
+/*
+ * The model: hops, the node index of every host address and the path
+ * between every pair of nodes, a NULL terminated array of hops.  Loaded
+ * once, read by every packet.
+ */
+struct mn_model {
+    struct hop     *hoptable;
+    int             hopcount;
+    int            *nodetable;  /* NODEMASK+1 entries */
+    int             nodecount;
+    struct hop  ****pathtable;
+};
+
+/*
+ * The packet calendar is a circular array of lists, one per calendar
+ * tick.  Each lists what is due to move on during that tick.  It is
+ * sized to a power of 2 so the slot is tick & mask.  Entries are bare
+ * list_heads; the module files struct packet on it, libmnemu users
+ * whatever they embed one in.  Not locked, that is the user's job.
+ */
+struct mn_calendar {
+    struct list_head *slots;    /* mask + 1 of them */
+    unsigned long   mask;
+    unsigned long   tick;       /* next tick to drain */
+};
+
+/*
+ * Calendar ticks per second, and ns per tick.  Hop delays, bandwidths
+ * and the calendar are all kept in these ticks.
+ */
+extern unsigned int mn_hz;
+extern u_int64_t mn_tick_nsec;
+extern unsigned long mn_calendar_len;   /* slots, a power of 2 */
+
+static inline unsigned long mn_ms_to_ticks(unsigned int ms)
+{
+    return (unsigned long)div_u64((u_int64_t)mn_hz * ms, MSEC_PER_SEC);
+}
+
+static inline u_int64_t mn_ticks_to_us(unsigned long ticks)
+{
+    return div_u64((u_int64_t)ticks * mn_tick_nsec, NSEC_PER_USEC);
+}
+
+/*
+ * Random numbers: every hop draws from its own counter-based stream,
+ * the SplitMix64 output function of key + n * golden ratio for the nth
+ * draw.  The key comes from the namespace's seed and the hop id, so a
+ * hop's draws depend only on the seed and on how many packets it has
+ * seen, not on what other hops or cpus are doing.  Draws are made
+ * under the hop lock.
+ */
+static inline u_int64_t mn_mix64(u_int64_t z)
+{
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+static inline void mn_hop_rekey(struct hop *hop, u_int64_t seed)
+{
+    hop->rng_key = mn_mix64(seed ^ mn_mix64(hop->id + 1));
+    hop->rng_ctr = 0;
+}
+
+static inline u_int32_t mn_hop_random(struct hop *hop)
+{
+    return mn_mix64(hop->rng_key +
+                    ++hop->rng_ctr * 0x9e3779b97f4a7c15ULL) >> 32;
+}
+
+/* tick the tail of the hop's queue leaves it, or now if it is empty */
+static inline unsigned long mn_hop_tail(struct hop *hop, unsigned long now)
+{
+    return hop->slotdepth ?
+	hop->exittick[(hop->headslot + hop->slotdepth - 1) % hop->qsize] : now;
+}
+
+static inline struct list_head *
+mn_calendar_slot(struct mn_calendar *cal, unsigned long tick)
+{
+    return &cal->slots[tick & cal->mask];
+}
+
+static inline void mn_calendar_insert(struct mn_calendar *cal,
+                                      struct list_head *entry,
+                                      unsigned long tick)
+{
+    list_add_tail(entry, mn_calendar_slot(cal, tick));
+}
+
+/* mn_hop_admit() verdicts, may be or'ed, same bits as MN_REC_*DROP */
+#define MN_HOP_PLRDROP  0x1     /* lost to the hop's loss rate */
+#define MN_HOP_QDROP    0x2     /* no room in the hop's queue */
+
+extern int      mn_core_init(void);
+extern void     hop_set_bandwidth(struct hop *hop, u_int64_t bps);
+extern int      hop_set_background(struct hop *hop, u_int64_t bps,
+                                   int on_ms, int off_ms, unsigned long now);
+extern int      mn_hop_init(struct hop *hop, int id,
+                            const struct sysctl_hop *sh, u_int64_t seed);
+extern void     mn_hop_uninit(struct hop *hop);
+extern int      mn_hop_admit(struct hop *hop, unsigned long now);
+extern unsigned long mn_hop_enqueue(struct hop *hop, unsigned int len,
+                                    unsigned long now);
+
+extern int      mn_calendar_init(struct mn_calendar *cal, unsigned long tick);
+extern void     mn_calendar_uninit(struct mn_calendar *cal);
+
+extern int      mn_model_init(struct mn_model *m);
+extern void     mn_model_uninit(struct mn_model *m);
+extern int      mn_model_set_hops(struct mn_model *m,
+                                  const struct sysctl_hop *hops, int count,
+                                  u_int64_t seed);
+extern void     mn_model_free_hops(struct mn_model *m);
+extern void     mn_model_free_paths(struct mn_model *m);
+extern int      mn_model_set_nodecount(struct mn_model *m, int count);
+extern int      mn_model_set_path(struct mn_model *m, int src, int dst,
+                                  const int *hops, int pathlen);
+extern struct hop **mn_model_lookup(struct mn_model *m,
+                                    in_addr_t src, in_addr_t dst);
+
+#endif                          /* _MN_CORE_H */
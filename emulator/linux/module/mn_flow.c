@@ -0,0 +1,434 @@
+/*
+ * modelnet mn_flow.c
+ *
+ *    per-flow statistics
+ *
+ * Copyright (c) 2006
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in
+ *      the documentation and/or other materials provided with the
+ *      distribution.
+ *    * Neither the names of Duke University nor The University of
+ *      California, San Diego, nor the names of the authors or contributors
+ *      may be used to endorse or promote products derived from
+ *      this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE
+ * USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ * 
+ */
+
+/*
+ * Per-flow counters, so an experiment can be analysed per connection
+ * without logging every packet.  Each cpu keeps a fixed-size open hash
+ * table of flows and counts the packets it handles: arrivals in
+ * emulate_path(), losses at local hops and departures in
+ * forward_packet().  Entries are only removed by reading
+ * /proc/sys/modelnet/flows, which hands them over and frees their
+ * slots; a flow that finds no free slot within MN_FLOW_PROBES is not
+ * counted but shows up in flowmisses.  The table is off until
+ * flowslots is set.
+ *
+ * The packet paths run with bottom halves off on their own cpu's
+ * table; the per-table lock is only ever contended by a reader or a
+ * resize.
+ */
+
+#include <linux/module.h>
+#include <linux/init.h>
+#include <linux/mutex.h>
+
+#include <linux/ip.h>
+#include <linux/in.h>
+#include <linux/skbuff.h>
+#include <linux/jhash.h>
+#include <linux/log2.h>
+
+#include <linux/vmalloc.h>
+#include <linux/percpu.h>
+#include <asm/uaccess.h>
+
+#include "ip_modelnet.h"
+#include "mn_flow.h"
+
+#define MN_FLOW_PROBES   8
+#define MN_FLOW_MAXSLOTS (1 << 20)
+
+struct mn_flowtab {
+    spinlock_t      lock;
+    struct sysctl_flow *slots;  /* mask + 1 of them, or NULL */
+    u_int32_t       mask;
+    u_int32_t       used;
+    u_int64_t       misses;     /* flows that found no slot */
+};
+
+static u32 mn_flow_seed;
+static DEFINE_MUTEX(mn_flow_mutex);    /* serializes resizes */
+
+
+/*
+ * [mn_flow_resize]
+ *
+ * Gives every cpu an empty table of slotcount slots.  Called with
+ * mn_flow_mutex held.
+ */
+
+static int mn_flow_resize(struct mn_net *mnet, int slotcount)
+{
+    struct sysctl_flow *slots, *old;
+    struct mn_flowtab *ft;
+    int cpu, err = 0;
+
+    for_each_possible_cpu(cpu) {
+	slots = NULL;
+	if (slotcount) {
+	    slots = vmalloc(slotcount * sizeof(*slots));
+	    if (!slots) {
+		err = -ENOMEM;
+		slotcount = 0;
+	    }
+	    else
+		memset(slots, 0, slotcount * sizeof(*slots));
+	}
+
+	ft = per_cpu_ptr(mnet->flows, cpu);
+	spin_lock_bh(&ft->lock);
+	old = ft->slots;
+	ft->slots = slots;
+	ft->mask = slotcount - 1;
+	ft->used = 0;
+	spin_unlock_bh(&ft->lock);
+	vfree(old);
+    }
+    mnet->flowslots = slotcount;
+    return err;
+}
+
+
+/*
+ * [mn_flow_init] / [mn_flow_uninit]
+ *
+ * Per-namespace setup, from modelnet_load() and modelnet_unload().
+ * Until a model is loaded there are no tables, only the flowslots
+ * asked for, which mn_flow_init() then makes.
+ */
+
+int mn_flow_init(struct mn_net *mnet)
+{
+    struct mn_flowtab __percpu *flows;
+    int cpu;
+
+    if (!mn_flow_seed)
+	get_random_bytes(&mn_flow_seed, sizeof(mn_flow_seed));
+
+    flows = alloc_percpu(struct mn_flowtab);
+    if (!flows)
+	return -ENOMEM;
+    for_each_possible_cpu(cpu)
+	spin_lock_init(&per_cpu_ptr(flows, cpu)->lock);
+
+    /* tables we cannot have leave flow stats off, as with the sysctl */
+    mutex_lock(&mn_flow_mutex);
+    mnet->flows = flows;
+    if (mnet->flowslots)
+	mn_flow_resize(mnet, mnet->flowslots);
+    mutex_unlock(&mn_flow_mutex);
+    return 0;
+}
+
+void mn_flow_uninit(struct mn_net *mnet)
+{
+    int cpu;
+
+    if (!mnet->flows)
+	return;
+    for_each_possible_cpu(cpu)
+	vfree(per_cpu_ptr(mnet->flows, cpu)->slots);
+    free_percpu(mnet->flows);
+    mnet->flows = NULL;
+}
+
+
+/*
+ * [mn_flow_lookup]
+ *
+ * Finds or claims the slot of a flow in this cpu's table.  Called
+ * with the table locked.  Returns NULL when there is no table or no
+ * free slot.  A slot freed by a read can cut a probe sequence short,
+ * so a flow may end up with two slots; readers add them up by key.
+ */
+
+static struct sysctl_flow *mn_flow_lookup(struct mn_flowtab *ft,
+					  struct mn_flowkey *key)
+{
+    struct sysctl_flow *f;
+    u32 h;
+    int i;
+
+    if (!ft->slots)
+	return NULL;
+
+    h = jhash_3words(key->src, key->dst,
+		     ((u32)key->sport << 16 | key->dport) ^ key->proto,
+		     mn_flow_seed);
+    for (i = 0; i < MN_FLOW_PROBES; ++i) {
+	f = ft->slots + ((h + i) & ft->mask);
+	if (!f->key.used) {
+	    memset(f, 0, sizeof(*f));
+	    f->key = *key;
+	    ++ft->used;
+	    return f;
+	}
+	if (!memcmp(&f->key, key, sizeof(*key)))
+	    return f;
+    }
+    ++ft->misses;
+    return NULL;
+}
+
+static inline struct mn_flowtab *mn_flow_lock(struct mn_net *mnet)
+{
+    struct mn_flowtab *ft = per_cpu_ptr(mnet->flows, smp_processor_id());
+
+    spin_lock(&ft->lock);
+    return ft;
+}
+
+
+/*
+ * [mn_flow_key]
+ *
+ * The 5-tuple of a packet entering emulation, ports 0 when it has
+ * none.  Also names packets in the arrival log, see mn_replay.c.
+ */
+
+void mn_flow_key(struct packet *pkt, struct mn_flowkey *key)
+{
+    struct iphdr *iph = ip_hdr(pkt->skb);
+
+    memset(key, 0, sizeof(*key));
+    key->src = MODEL_FORCEOFF(iph->saddr);
+    key->dst = iph->daddr;
+    key->proto = iph->protocol;
+    if ((iph->protocol == IPPROTO_TCP || iph->protocol == IPPROTO_UDP) &&
+	!(iph->frag_off & htons(IP_OFFSET))) {
+	__be16 _ports[2], *ports;
+
+	ports = skb_header_pointer(pkt->skb,
+				   skb_network_offset(pkt->skb) + iph->ihl * 4,
+				   sizeof(_ports), _ports);
+	if (ports) {
+	    key->sport = ports[0];
+	    key->dport = ports[1];
+	}
+    }
+    key->used = 1;
+}
+
+
+/*
+ * [mn_flow_ingress]
+ *
+ * A packet entered emulation: take its 5-tuple and count it.  Leaves
+ * pkt->flow.used 0 when flows are off or the table is full, so the
+ * packet is not counted further along either.
+ */
+
+void mn_flow_ingress(struct packet *pkt)
+{
+    struct mn_flowkey *key = &pkt->flow;
+    struct sysctl_flow *f;
+    struct mn_flowtab *ft;
+
+    mn_flow_key(pkt, key);
+
+    ft = mn_flow_lock(pkt->mnet);
+    f = mn_flow_lookup(ft, key);
+    if (f) {
+	++f->pkts;
+	f->bytes += pkt->info.len;
+    }
+    spin_unlock(&ft->lock);
+    if (!f)
+	key->used = 0;
+}
+
+
+/*
+ * [mn_flow_drop] A local hop dropped the packet.
+ */
+
+void mn_flow_drop(struct packet *pkt)
+{
+    struct sysctl_flow *f;
+    struct mn_flowtab *ft;
+
+    ft = mn_flow_lock(pkt->mnet);
+    f = mn_flow_lookup(ft, &pkt->flow);
+    if (f)
+	++f->drops;
+    spin_unlock(&ft->lock);
+}
+
+
+/*
+ * [mn_flow_forward]
+ *
+ * The packet made it through its path, with pkt->qticks calendar
+ * ticks spent in hop queues on the way.
+ */
+
+void mn_flow_forward(struct packet *pkt)
+{
+    struct sysctl_flow *f;
+    struct mn_flowtab *ft;
+
+    ft = mn_flow_lock(pkt->mnet);
+    f = mn_flow_lookup(ft, &pkt->flow);
+    if (f) {
+	++f->fwd_pkts;
+	f->fwd_bytes += pkt->info.len;
+	f->qdelay += mn_ticks_to_us(pkt->qticks);
+    }
+    spin_unlock(&ft->lock);
+}
+
+
+/*
+ * [proc_flowslots]
+ *
+ * Reads or sets the size of each cpu's flow table, rounded up to a
+ * power of 2; 0 turns flow stats off.  Resizing drops every flow
+ * counted so far, so read them first.
+ */
+
+int proc_flowslots(ctl_table *table, int write,
+		   void __user *buffer, size_t *lenp, loff_t *ppos)
+{
+    struct mn_net *mnet = table->extra1;
+    ctl_table tmp = *table;
+    int slotcount, err;
+
+    mutex_lock(&mn_flow_mutex);
+    slotcount = mnet->flowslots;
+    tmp.data = &slotcount;
+    err = proc_dointvec(&tmp, write, buffer, lenp, ppos);
+    if (err || !write)
+	goto out;
+
+    err = -EINVAL;
+    if (slotcount < 0 || slotcount > MN_FLOW_MAXSLOTS)
+	goto out;
+    if (slotcount)
+	slotcount = roundup_pow_of_two(slotcount);
+
+    /* no model yet, mn_flow_init() makes the tables */
+    err = 0;
+    if (!mnet->flows)
+	mnet->flowslots = slotcount;
+    else
+	err = mn_flow_resize(mnet, slotcount);
+
+ out:
+    mutex_unlock(&mn_flow_mutex);
+    return err;
+}
+
+
+/*
+ * [proc_flows]
+ *
+ * A read returns as many struct sysctl_flow records as fit in the
+ * buffer and frees their slots.  What does not fit stays for the next
+ * read; like hopstats, a file is read once per open.
+ */
+
+int proc_flows(ctl_table *table, int write,
+	       void __user *buffer, size_t *lenp, loff_t *ppos)
+{
+    struct mn_net *mnet = table->extra1;
+    struct sysctl_flow *buf, *f;
+    struct mn_flowtab *ft;
+    size_t max, n = 0;
+    int cpu;
+    u32 i;
+
+    if (write)
+	return -EINVAL;
+    if (*ppos || !mnet->flowslots || !mnet->flows) {
+	*lenp = 0;
+	return 0;
+    }
+
+    max = min_t(size_t, *lenp / sizeof(*buf),
+		(size_t)mnet->flowslots * num_possible_cpus());
+    if (!max) {
+	*lenp = 0;
+	return 0;
+    }
+    buf = vmalloc(max * sizeof(*buf));
+    if (!buf)
+	return -ENOMEM;
+
+    for_each_possible_cpu(cpu) {
+	ft = per_cpu_ptr(mnet->flows, cpu);
+	spin_lock_bh(&ft->lock);
+	for (i = 0; ft->slots && i <= ft->mask && n < max; ++i) {
+	    f = ft->slots + i;
+	    if (!f->key.used)
+		continue;
+	    buf[n++] = *f;
+	    f->key.used = 0;
+	    --ft->used;
+	}
+	spin_unlock_bh(&ft->lock);
+    }
+
+    if (n && copy_to_user(buffer, buf, n * sizeof(*buf))) {
+	vfree(buf);
+	return -EFAULT;
+    }
+    vfree(buf);
+    *lenp = n * sizeof(*buf);
+    *ppos += *lenp;
+    return 0;
+}
+
+
+/*
+ * [proc_flowmisses]
+ *
+ * Flows not counted for want of a free slot, summed over all cpus.
+ */
+
+int proc_flowmisses(ctl_table *table, int write,
+		    void __user *buffer, size_t *lenp, loff_t *ppos)
+{
+    struct mn_net *mnet = table->extra1;
+    ctl_table tmp = *table;
+    unsigned long misses = 0;
+    int cpu;
+
+    if (mnet->flows)
+	for_each_possible_cpu(cpu)
+	    misses += per_cpu_ptr(mnet->flows, cpu)->misses;
+
+    tmp.data = &misses;
+    tmp.maxlen = sizeof(misses);
+    return proc_doulongvec_minmax(&tmp, write, buffer, lenp, ppos);
+}
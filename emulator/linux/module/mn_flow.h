@@ -0,0 +1,53 @@
+/*
+ * modelnet mn_flow.h
+ *
+ *    per-flow statistics
+ *
+ * Copyright (c) 2006
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in
+ *      the documentation and/or other materials provided with the
+ *      distribution.
+ *    * Neither the names of Duke University nor The University of
+ *      California, San Diego, nor the names of the authors or contributors
+ *      may be used to endorse or promote products derived from
+ *      this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE
+ * USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ * 
+ */
+
+#ifndef __MN_FLOW_H
+#define __MN_FLOW_H
+
+#include "ip_modelnet.h"
+
+extern int mn_flow_init(struct mn_net *mnet);
+extern void mn_flow_uninit(struct mn_net *mnet);
+extern void mn_flow_key(struct packet *pkt, struct mn_flowkey *key);
+extern void mn_flow_ingress(struct packet *pkt);
+extern void mn_flow_drop(struct packet *pkt);
+extern void mn_flow_forward(struct packet *pkt);
+extern int proc_flowslots(ctl_table *table, int write,
+			  void __user *buffer, size_t *lenp, loff_t *ppos);
+extern int proc_flows(ctl_table *table, int write,
+		      void __user *buffer, size_t *lenp, loff_t *ppos);
+extern int proc_flowmisses(ctl_table *table, int write,
+			   void __user *buffer, size_t *lenp, loff_t *ppos);
+#endif
@@ -44,94 +44,46 @@
 #include "ip_modelnet.h"
 #include "mn_pathtable.h"
 #include "mn_tcpdump.h"
+#include "mn_qdisc.h"
 
-int      nodetable[NODEMASK + 1];
-int      hopcount = 0;
-static struct hop *hoptable = NULL;
-int nodecount  = 0;
-static struct hop ****pathtable = NULL;
-
-
-/** 
- * lookup_path - this is unmodified from BSD version of modelnet
- *
+/*
+ * The hoptable, nodetable and pathtable used to be globals here.  They
+ * now hang off the struct mn_net of the namespace that loaded them, as
+ * a struct mn_model; the model itself is kept by mn_core.c, this file
+ * only loads it from userspace.
  */
 
-struct hop    **
-lookup_path(in_addr_t src, in_addr_t dst) 
-{
-    int             srcid = nodetable[ntohl(src) & NODEMASK];
-    int             dstid = nodetable[ntohl(dst) & NODEMASK];
-    if (srcid == -1 || dstid == -1 || pathtable == NULL)
-    {
-      printk ("lookup_path: no path for %x -> %x .... %x -> %x\n",
-	      src, dst, ntohl(src) & NODEMASK, ntohl(dst) & NODEMASK);
-      printk ("lookup_path: srcid(%d), dstid(%d), pathtable(%lx)\n",
-	      srcid, dstid, (unsigned long)pathtable);
-      return NULL;
-    }
-    return pathtable[srcid][dstid];
-}
-
-
 
-/** 
- * free_path - this is more-or-less unmodified from BSD version
- * of modelnet
+/* uninit_paths[]
+ *
+ * remove paths, but also remove each hop, after taking off what the
+ * module hangs on hops (capture, queue discipline)
  */
-
-static void
-free_path(void)
+void
+uninit_paths(struct mn_net *mnet)
 {
-  int             i, j;
+  int i;
 
-  if (pathtable && nodecount) 
+  if (mnet->model.hoptable) 
   {
-    for (i = 0; i < nodecount; ++i)
+    for (i = 0; i < mnet->model.hopcount; ++i)
     {
-      for (j = 0; j < nodecount; ++j)
-      {
-	if (pathtable[i][j]) 
-	{
-	  kfree(pathtable[i][j]);    
-	}
-      }
+      mn_hop_set_trace(mnet->model.hoptable + i, 0);
+      mn_qdisc_release(mnet, mnet->model.hoptable + i);
     }
-    for (i = 0; i < nodecount; ++i)
-    {
-      kfree(pathtable[i]);
-    }
-    kfree(pathtable);
   }
-  pathtable = NULL;
-  nodecount = 0;
+  mn_model_free_hops(&mnet->model);
 }
 
 
-  
-/* uninit_paths[]
+/* init_paths
  *
- * remove paths, but also remove each hop.  This function is
- * more-or-less unmodified from BSD version of modlenet
+ * Allocate the per-namespace nodetable, see mn_model_init().
  */
-void
-uninit_paths(void)
+int
+init_paths(struct mn_net *mnet)
 {
-  int i;
-
-  free_path();
-  if (hoptable) 
-  {
-    for (i = 0; i < hopcount; ++i)
-    {
-      kfree(hoptable[i].exittick);
-      kfree(hoptable[i].slotlen);
-    }
-    
-    vfree(hoptable);
-  }
-  hoptable = NULL;
-  hopcount = 0;
+  return mn_model_init(&mnet->model);
 }
 
 
@@ -156,6 +108,9 @@ int
 proc_nodetable(ctl_table *table, int write,
 	       void __user *buffer, size_t *lenp, loff_t *ppos)
 {
+  struct mn_net *mnet = table->extra1;
+  int error;
+
   /* Make sure we are doing a valid write amount */
   if ( ((*ppos) + (*lenp)) > (4 *(NODEMASK+1)))
   {
@@ -172,8 +127,12 @@ proc_nodetable(ctl_table *table, int write,
     *lenp = 0; /* Read will keep calling until lenp = 0 */
     return -EINVAL;
   }
+
+  /* the first piece of a model sets up the namespace to emulate it */
+  if ((error = modelnet_load(mnet)))
+    return error;
   
-  if (copy_from_user( ((void*)nodetable)+(*ppos), buffer, *lenp ))
+  if (copy_from_user( ((void*)mnet->model.nodetable)+(*ppos), buffer, *lenp ))
   {
     printk("proc_nodetable: copy_from_user failed\n");
     return -EFAULT;
@@ -207,8 +166,10 @@ int
 proc_nodecount(ctl_table *table, int write,
 	       void __user *buffer, size_t *lenp, loff_t *ppos)
 {
-  int i;
-  int             oldcount = nodecount;
+  struct mn_net  *mnet = table->extra1;
+  int             count = mnet->model.nodecount;
+  ctl_table       tmp = *table;
+  int             error;
   
   /* Use linux's procedure for copying integers from user space
    * nodecount variable is treated as an int vec of size 1.  It is
@@ -216,56 +177,19 @@ proc_nodecount(ctl_table *table, int write,
    * represented as a string then does the conversion from string ->
    * integer
    */
-  proc_dointvec(table, write, buffer, lenp, ppos);
+  tmp.data = &count;
+  error = proc_dointvec(&tmp, write, buffer, lenp, ppos);
 
   /* If we are just doing a read, then return now.  proc_dointvec
    * would have taken care of copying to user space and the rest of
    * this function reallocates data structures
    */
-  if (!write)
-    return 0;
+  if (error || !write)
+    return error;
+  if ((error = modelnet_load(mnet)))
+    return error;
   
-  if (oldcount != nodecount) 
-  {
-
-    /* Had to change values around b/c we need old nodecount value in
-     * order to free the path.  However, proc_dointvec is set to
-     * override the nodecount variable.
-     */
-    int newcount = nodecount;
-    nodecount = oldcount;
-    
-    free_path();            /* free_path requires the old nodecount */
-    nodecount = newcount;
-    
-    /* XXX - BSD version has M_WAITOK, but in the Linux kernel we have
-     * interrupts disabled so I think we have to do this kmalloc
-     * atomically.  This procedure is not in the critical path so I
-     * did not give it much thought
-     */
-    pathtable = kmalloc(nodecount * sizeof(struct hop **),
-			GFP_ATOMIC);
-    if (!pathtable) 
-    {
-      free_path();
-      return -ENOMEM;
-    }
-
-    for (i = 0; i < nodecount; ++i) 
-    {
-      /* See comment above regarding M_WAITOK and interrupts */
-      pathtable[i] = kmalloc(nodecount * sizeof(struct hop *), GFP_ATOMIC);
-      if (!pathtable[i]) 
-      {
-        nodecount=i-1;
-        free_path();
-        return -ENOMEM;
-      }
-      memset(pathtable[i], 0, nodecount * sizeof(struct hop *));
-    }
-  }
-
-  return 0;
+  return mn_model_set_nodecount(&mnet->model, count);
 }
 
 
@@ -291,14 +215,11 @@ proc_hophandle(ctl_table *table, int write,
 {
   void __user *userHopsPtr;
   int error, i;
+  struct mn_net *mnet = table->extra1;
   
   struct sysctl_hoptable tab;
   struct sysctl_hop *hops;
   
-#ifdef MN_TCPDUMP
-  traceLinkCount = 0;
-#endif
-  
   /* hophandle should be set as write-only when registering in
    * ip_modelnet.c so this situation should not come up
    */
@@ -362,82 +283,106 @@ proc_hophandle(ctl_table *table, int write,
   if(copy_from_user(hops, userHopsPtr, tab.hopcount * sizeof(*hops)))
   {
     printk("Could not copy from user from usrHopsPtr\n");
+    vfree(hops);
     return -EFAULT;
   }
-  uninit_paths();
-
-  hoptable = vmalloc(tab.hopcount * sizeof(*hoptable));
-  if (!hoptable) 
+  if ((error = modelnet_load(mnet)))
   {
-    printk("hoptable alloc failed. (%lu KB)\n",
-	   (unsigned long)(tab.hopcount * sizeof(*hoptable)/1024));
-    return -ENOMEM;
+    vfree(hops);
+    return error;
   }
-  memset(hoptable, 0, tab.hopcount * sizeof(*hoptable));
+  uninit_paths(mnet);
 
-  hopcount = tab.hopcount;
-  for (i = 0; i < hopcount; ++i) 
+  error = mn_model_set_hops(&mnet->model, hops, tab.hopcount, mnet->seed);
+  for (i = 0; !error && i < mnet->model.hopcount; ++i) 
   {
-    struct hop     *hop = hoptable + i;
-
-    /* printk("Info about hop #%d, bandwidth(%d), delay(%d), plr(%d), qsize(%d), emulator(%d), xtq_type(%d)\n", i,hops[i].bandwidth, hops[i].delay, hops[i].plr, hops[i].qsize, hops[i].emulator, hops[i].xtq_type); */
-
-    spin_lock_init(&hop->lock);
-    hop->KBps = hops[i].bandwidth/8;
-    hop->delay = (HZ * hops[i].delay) / 1000;
-    hop->plr = hops[i].plr;
-    hop->qsize = hops[i].qsize;
-    hop->emulator = hops[i].emulator;
-    hop->bytespertick = hop->KBps*1000/HZ;
-    hop->id = i;
-#ifdef MN_TCPDUMP
-    hop->traceLink = hops[i].traceLink;
-    if(hop->traceLink) {      
-      ++traceLinkCount;
-      printk("Tracing link %d\n", i);
-    }
-#endif
+    struct hop     *hop = mnet->model.hoptable + i;
+
+    mn_hop_set_trace(hop, hops[i].traceLink);
 
-#if 0
-    printk("hoptable: idx(%d) bw(%d) delay(%d) plr(%d) qsize(%d), hz(%d)\n",
-	   hop->id,hop->KBps, hop->delay, hop->plr, hop->qsize, HZ);
-#endif
 #ifdef QCALC
-    if ((hop->qsize*1500)/hop->KBps > (1<<14)/hz )
-      printk("hop %d: max delay %dms may overrun calender period %dms\n", i,
-	     (hop->qsize*1500)/hop->KBps , (1<<14)/HZ );
+    if (hop->tpb &&
+	((1500 * hop->tpb) >> hop->tpb_shift) * hop->qsize + hop->delay >
+	mnet->calendar.mask)
+      printk("hop %d: max delay %llu ticks may overrun calender period %lu ticks\n",
+	     i, ((1500 * hop->tpb) >> hop->tpb_shift) * hop->qsize + hop->delay,
+	     mnet->calendar.mask + 1);
 #endif
-    
-    /*
-     * initialize bandwidth queue
-     */
-
-    /* usually pretty small, kmalloc should be ok */
-    hop->exittick = kmalloc(hop->qsize * sizeof(*hop->exittick),
-			    GFP_ATOMIC);
-    if (!hop->exittick) {
-      printk("hop->exittick alloc failed %lu\n", 
-	     (unsigned long)(hop->qsize * sizeof(*hop->exittick)));
-      return -ENOMEM;
-    }
-    memset(hop->exittick, 0, hop->qsize * sizeof(*hop->exittick));
-    hop->slotdepth = 0;
-    hop->bytedepth = 0;
-    hop->headslot = 0;
-    hop->fragment = 0;
 
-    hop->slotlen = kmalloc(hop->qsize * sizeof(*hop->slotlen), GFP_ATOMIC);
+    if (hops[i].xtq_type && mn_qdisc_install(mnet, hop, hops[i].xtq_type, NULL))
+      printk("hop %d: bad queue type %d, using FIFO\n", i, hops[i].xtq_type);
+  }
+  vfree(hops);
+
+  /* Return 0 on success */
+  return error;
+}
+
+/**
+ * proc_hopbg - load fluid background traffic onto hops.  Each write
+ * is one or more struct sysctl_hopbg records; see hop_set_background()
+ * for the model.  Write-only, like hoptable.
+ *
+ * @table: the sysctl table
+ * @write: %TRUE if this is a write to the sysctl file
+ * @buffer: the user buffer
+ * @lenp: the size of the user buffer
+ * @ppos: current offset into the file
+ *
+ * Returns 0 on success, -EINVAL for a bad hop index or a rate the hop
+ * cannot carry.
+ */
 
-    if (!hop->slotlen) 
+int
+proc_hopbg(ctl_table *table, int write,
+	   void __user *buffer, size_t *lenp, loff_t *ppos)
+{
+  struct mn_net  *mnet = table->extra1;
+  struct sysctl_hopbg bg;
+  struct hop     *hop;
+  size_t          done;
+  int             error;
+
+  if (!write)
+  {
+    printk("proc_hopbg: should be write-only\n");
+    *lenp = 0;
+    return -EINVAL;
+  }
+  if (*lenp % sizeof(bg))
+  {
+    printk("proc_hopbg: ERROR lenp(%d) not a multiple of %lu\n",
+	   (int)*lenp, (unsigned long)sizeof(bg));
+    return -EINVAL;
+  }
+
+  for (done = 0; done < *lenp; done += sizeof(bg))
+  {
+    if (copy_from_user(&bg, buffer + done, sizeof(bg)))
     {
-      printk("hop->slotlen alloc failed\n");
-      return -ENOMEM;
+      printk("proc_hopbg: copy_from_user failed\n");
+      return -EFAULT;
+    }
+    if (!mnet->model.hoptable || bg.hopidx < 0 || bg.hopidx >= mnet->model.hopcount)
+    {
+      printk("proc_hopbg: no hop %d\n", bg.hopidx);
+      return -EINVAL;
+    }
+
+    hop = mnet->model.hoptable + bg.hopidx;
+    spin_lock_bh(&hop->lock);
+    error = hop_set_background(hop, bg.rate, bg.on_ms, bg.off_ms,
+			       mnet->calendar.tick);
+    spin_unlock_bh(&hop->lock);
+    if (error)
+    {
+      printk("proc_hopbg: hop %d cannot carry %llu bits/s of background\n",
+	     bg.hopidx, (unsigned long long)bg.rate);
+      return error;
     }
-    memset(hop->slotlen, 0, hop->qsize * sizeof(*hop->slotlen));
   }
-  vfree(hops);
+  *ppos += *lenp;
 
-  /* Return 0 on success */
   return 0;
 }
 
@@ -464,6 +409,8 @@ proc_hopstats(ctl_table *table, int write,
 	      void __user *buffer, size_t *lenp, loff_t *ppos)
 {
   int             i;
+  struct mn_net  *mnet = table->extra1;
+  int             hopcount = mnet->model.hopcount;
   struct sysctl_hopstats *stattab;
 
   /* Sorta-Kinda-Hack - this check does exactly what is done in
@@ -494,9 +441,9 @@ proc_hopstats(ctl_table *table, int write,
 
   for (i = 0; i < hopcount; ++i) 
   {
-    stattab[i].pkts = hoptable[i].pkts;
-    stattab[i].bytes = hoptable[i].bytes;
-    stattab[i].qdrops = hoptable[i].qdrops;
+    stattab[i].pkts = mnet->model.hoptable[i].pkts;
+    stattab[i].bytes = mnet->model.hoptable[i].bytes;
+    stattab[i].qdrops = mnet->model.hoptable[i].qdrops;
   }
 
   if (copy_to_user(buffer, stattab, hopcount * sizeof(*stattab)))
@@ -514,6 +461,71 @@ proc_hopstats(ctl_table *table, int write,
 }
 
 
+/**
+ * proc_hoperr - read the timing error of every hop, one
+ * struct mn_errstats per hop in hop order.  Read like hopstats; clear
+ * it by writing to pkterr.
+ *   
+ * @table: the sysctl table
+ * @write: %TRUE if this is a write to the sysctl file
+ * @buffer: the user buffer
+ * @lenp: the size of the user buffer
+ * @ppos: current offset into the file
+ */
+
+int
+proc_hoperr(ctl_table *table, int write,
+	    void __user *buffer, size_t *lenp, loff_t *ppos)
+{
+  int             i;
+  struct mn_net  *mnet = table->extra1;
+  int             hopcount = mnet->model.hopcount;
+  struct mn_errstats *errtab;
+  size_t          len = hopcount * sizeof(*errtab);
+
+  /* see proc_hopstats; without a model there is nothing to read */
+  if ((*ppos && !write) || !hopcount) 
+  {
+    *lenp = 0;
+    return 0;
+  }
+
+  if (*lenp < len) 
+  {
+    printk ("hoperr: user buffer is too small\n");
+    return -EINVAL;
+  }
+
+  /* 144 bytes a hop, too much for kmalloc on big models */
+  errtab = vmalloc(len);
+  if (!errtab) 
+  {
+    printk("errtab alloc failed\n");
+    return -ENOMEM;
+  }
+
+  /* hopclock updates these under the calendar lock */
+  spin_lock_bh(&mnet->calendar_lock);
+  for (i = 0; i < hopcount; ++i) 
+    errtab[i] = mnet->model.hoptable[i].err;
+  spin_unlock_bh(&mnet->calendar_lock);
+
+  if (copy_to_user(buffer, errtab, len))
+  {
+    printk("proc_hoperr: error copying to user\n");
+    vfree(errtab);
+    return -EFAULT;
+  } 
+
+  *lenp = len;
+  *ppos += len;
+
+  vfree(errtab);
+
+  return 0;
+}
+
+
 
 /**
  * proc_pathentry
@@ -533,7 +545,8 @@ int
 proc_pathentry(ctl_table *table, int write,
 	       void __user *buffer, size_t *lenp, loff_t *ppos)
 {
-  int             error, i;
+  int             error;
+  struct mn_net  *mnet = table->extra1;
   struct sysctl_pathentry entry;
   int            *hops;
   void __user *userHopsPtr;
@@ -559,18 +572,13 @@ proc_pathentry(ctl_table *table, int write,
     return -EFAULT;
   }
     
-  if (!pathtable || !hoptable)
+  if (entry.pathlen < 0)
   {
-    printk("pathentry: Pathtable(%lx) or hoptable(%lx) is null\n",
-	   (unsigned long)pathtable, (unsigned long)hoptable);
-    return -EINVAL;
-  }
-
-  if (entry.src_node > nodecount || entry.dst_node > nodecount)
-  {
-    printk("pathentry: ERROR nodecount issues\n");
+    printk("pathentry: ERROR bad pathlen %d\n", entry.pathlen);
     return -EINVAL;
   }
+  if ((error = modelnet_load(mnet)))
+    return error;
 
   hops = kmalloc(entry.pathlen * sizeof(*hops), GFP_ATOMIC); 
   /* printk("(int)hops size: %lu\n", entry.pathlen * sizeof(*hops)); */
@@ -585,29 +593,12 @@ proc_pathentry(ctl_table *table, int write,
   if (error)
   {
     printk("proc_pathentry: Could not copy from userHopsPtr\n");
+    kfree(hops);
     return -EFAULT;
   }
     
-  pathtable[entry.src_node][entry.dst_node] = 
-    kmalloc((entry.pathlen + 1) * sizeof(struct hop *), GFP_ATOMIC);
-    
-  if (!pathtable[entry.src_node][entry.dst_node]) 
-  {
-    printk("path alloc failed\n");
-    return -ENOMEM;
-  }
-  memset(pathtable[entry.src_node][entry.dst_node], 0, 
-	 (entry.pathlen + 1) * sizeof(struct hop *));
-
-  for (i = 0; i < entry.pathlen; ++i) 
-  {
-/*     printk("Loaded entry from %d to %d, (%d)th hop\n", */
-/* 	   entry.src_node, entry.dst_node, i); */
-    pathtable[entry.src_node][entry.dst_node][i] = hoptable + hops[i];
-  }
-  pathtable[entry.src_node][entry.dst_node][entry.pathlen] = NULL;
-
+  error = mn_model_set_path(&mnet->model, entry.src_node, entry.dst_node,
+			    hops, entry.pathlen);
   kfree(hops);
-  return 0;
+  return error;
 }
-
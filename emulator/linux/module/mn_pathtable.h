@@ -36,21 +36,15 @@
 
 #ifndef __MN_PATHTABLE_H
 #define __MN_PATHTABLE_H
-#define NODEMASK 0xffff
 
-extern int hopcount;
-extern int nodetable[NODEMASK+1];
-
-extern spinlock_t topology_lock;
-
-extern void uninit_paths(void);
+extern int init_paths(struct mn_net *mnet);
+extern void uninit_paths(struct mn_net *mnet);
 
 extern int proc_nodecount(ctl_table *table, int write,
 			   void __user *buffer, size_t *lenp, loff_t *ppos);
 
 extern int proc_hophandle(ctl_table *table, int write,
 			  void __user *buffer, size_t *lenp, loff_t *ppos);
-extern int nodecount;
 
 extern int proc_pathentry(ctl_table *table, int write,
 			  void __user *buffer, size_t *lenp, loff_t *ppos);
@@ -58,9 +52,13 @@ extern int proc_pathentry(ctl_table *table, int write,
 extern int proc_nodetable(ctl_table *table, int write,
 			  void __user *buffer, size_t *lenp, loff_t *ppos);
 
+extern int proc_hopbg(ctl_table *table, int write,
+		      void __user *buffer, size_t *lenp, loff_t *ppos);
+
 extern int proc_hopstats(ctl_table *table, int write,
 			 void __user *buffer, size_t *lenp, loff_t *ppos);
 
-extern struct hop ** lookup_path(in_addr_t src, in_addr_t dst);
+extern int proc_hoperr(ctl_table *table, int write,
+		       void __user *buffer, size_t *lenp, loff_t *ppos);
 
 #endif
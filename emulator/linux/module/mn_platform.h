@@ -0,0 +1,231 @@
+/*
+ * modelnet  mn_platform.h
+ *
+ *     the little of the kernel the emulation core (mn_core.c) uses, so
+ *     the same core builds into the module and into libmnemu
+ *
+ * Copyright (c) 2006
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in
+ *      the documentation and/or other materials provided with the
+ *      distribution.
+ *    * Neither the names of Duke University nor The University of
+ *      California, San Diego, nor the names of the authors or contributors
+ *      may be used to endorse or promote products derived from
+ *      this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE
+ * USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#ifndef _MN_PLATFORM_H
+#define _MN_PLATFORM_H
+
+/*
+ * The core sticks to linux names (list_head, div_u64, time_before, ...)
+ * and wraps the calls whose kernel form carries context it cannot know
+ * in userspace (gfp flags, bottom halves) as mn_*.  In the kernel all
+ * of it is the real thing; in userspace the half below #else stands in.
+ */
+
+#ifdef __KERNEL__
+
+#include <linux/types.h>
+#include <linux/kernel.h>
+#include <linux/errno.h>
+#include <linux/string.h>
+#include <linux/bitops.h>
+#include <linux/log2.h>
+#include <linux/math64.h>
+#include <linux/list.h>
+#include <linux/jiffies.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+#include <linux/spinlock.h>
+#include <linux/byteorder/generic.h>
+
+/* Addition for Linux port.  Could not find this typedef in linux
+ * code, so I just added it.  There is a similar typedef in bsd code :
+     src/sys/types.h:typedef   u_int32_t       in_addr_t;
+*/
+typedef u_int32_t in_addr_t;
+
+#define MN_DEFAULT_HZ   HZ
+
+/* hops are locked from softirq and process context */
+typedef spinlock_t mn_lock_t;
+#define mn_lock_init(l)         spin_lock_init(l)
+#define mn_lock(l)              spin_lock_bh(l)
+#define mn_unlock(l)            spin_unlock_bh(l)
+
+/* the model is loaded from proc handlers, which may sleep */
+#define mn_alloc(n)             kmalloc(n, GFP_KERNEL)
+#define mn_free(p)              kfree(p)
+#define mn_valloc(n)            vmalloc(n)      /* big tables */
+#define mn_vfree(p)             vfree(p)
+
+#define mn_log                  printk
+
+#else                           /* userspace, libmnemu */
+
+#ifndef _DEFAULT_SOURCE
+#define _DEFAULT_SOURCE         /* u_int64_t and friends */
+#endif
+#include <sys/types.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <stddef.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+
+typedef uint8_t  u8;
+typedef uint16_t u16;
+typedef uint32_t u32;
+typedef uint64_t u64;
+typedef int64_t  s64;
+
+#define MN_DEFAULT_HZ   1000
+
+#define NSEC_PER_SEC    1000000000L
+#define NSEC_PER_USEC   1000L
+#define MSEC_PER_SEC    1000L
+
+#define likely(x)       __builtin_expect(!!(x), 1)
+#define unlikely(x)     __builtin_expect(!!(x), 0)
+
+#ifndef max
+#define max(a, b)       ((a) > (b) ? (a) : (b))
+#define min(a, b)       ((a) < (b) ? (a) : (b))
+#endif
+#define max_t(t, a, b)  ((t)(a) > (t)(b) ? (t)(a) : (t)(b))
+#define min_t(t, a, b)  ((t)(a) < (t)(b) ? (t)(a) : (t)(b))
+
+#define time_after(a, b)        ((long)((b) - (a)) < 0)
+#define time_before(a, b)       time_after(b, a)
+#define time_after_eq(a, b)     ((long)((a) - (b)) >= 0)
+#define time_before_eq(a, b)    time_after_eq(b, a)
+
+static inline u64 div_u64(u64 a, u32 b) { return a / b; }
+static inline u64 div64_u64(u64 a, u64 b) { return a / b; }
+
+static inline int fls64(u64 x)
+{
+    return x ? 64 - __builtin_clzll(x) : 0;
+}
+
+static inline unsigned long roundup_pow_of_two(unsigned long n)
+{
+    return n <= 1 ? 1 : 1UL << (8 * sizeof(long) - __builtin_clzl(n - 1));
+}
+
+/* just enough of linux/list.h */
+struct list_head {
+    struct list_head *next, *prev;
+};
+
+#define LIST_HEAD_INIT(name)    { &(name), &(name) }
+#define LIST_HEAD(name)         struct list_head name = LIST_HEAD_INIT(name)
+
+static inline void INIT_LIST_HEAD(struct list_head *l)
+{
+    l->next = l->prev = l;
+}
+
+static inline void __list_add(struct list_head *e, struct list_head *prev,
+                              struct list_head *next)
+{
+    next->prev = e;
+    e->next = next;
+    e->prev = prev;
+    prev->next = e;
+}
+
+static inline void list_add(struct list_head *e, struct list_head *h)
+{
+    __list_add(e, h, h->next);
+}
+
+static inline void list_add_tail(struct list_head *e, struct list_head *h)
+{
+    __list_add(e, h->prev, h);
+}
+
+static inline void list_del(struct list_head *e)
+{
+    e->next->prev = e->prev;
+    e->prev->next = e->next;
+    e->next = e->prev = NULL;
+}
+
+static inline void list_del_init(struct list_head *e)
+{
+    e->next->prev = e->prev;
+    e->prev->next = e->next;
+    INIT_LIST_HEAD(e);
+}
+
+static inline int list_empty(const struct list_head *h)
+{
+    return h->next == h;
+}
+
+static inline void list_splice_tail_init(struct list_head *l,
+                                         struct list_head *h)
+{
+    if (!list_empty(l)) {
+        l->next->prev = h->prev;
+        h->prev->next = l->next;
+        l->prev->next = h;
+        h->prev = l->prev;
+        INIT_LIST_HEAD(l);
+    }
+}
+
+#define container_of(p, type, member) \
+    ((type *)((char *)(p) - offsetof(type, member)))
+#define list_entry(p, type, member)     container_of(p, type, member)
+#define list_first_entry(h, type, member) list_entry((h)->next, type, member)
+#define list_for_each(pos, h) \
+    for (pos = (h)->next; pos != (h); pos = pos->next)
+#define list_for_each_safe(pos, n, h) \
+    for (pos = (h)->next, n = pos->next; pos != (h); pos = n, n = pos->next)
+
+/*
+ * Each hop is touched by one packet at a time and held for a few dozen
+ * instructions, so a spinning lock, as in the kernel.
+ */
+typedef pthread_spinlock_t mn_lock_t;
+#define mn_lock_init(l)         pthread_spin_init(l, PTHREAD_PROCESS_PRIVATE)
+#define mn_lock(l)              pthread_spin_lock(l)
+#define mn_unlock(l)            pthread_spin_unlock(l)
+
+#define mn_alloc(n)             malloc(n)
+#define mn_free(p)              free(p)
+#define mn_valloc(n)            malloc(n)
+#define mn_vfree(p)             free(p)
+
+#define mn_log(...)             fprintf(stderr, __VA_ARGS__)
+
+#endif                          /* __KERNEL__ */
+
+#endif                          /* _MN_PLATFORM_H */
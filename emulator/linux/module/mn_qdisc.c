@@ -0,0 +1,586 @@
+/*
+ * modelnet mn_qdisc.c
+ *
+ *    per-hop queue disciplines and the hop timer calendar
+ *
+ * Copyright (c) 2006
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in
+ *      the documentation and/or other materials provided with the
+ *      distribution.
+ *    * Neither the names of Duke University nor The University of
+ *      California, San Diego, nor the names of the authors or contributors
+ *      may be used to endorse or promote products derived from
+ *      this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE
+ * USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ * 
+ */
+
+/*
+ * Queue disciplines other than droptail, chosen per hop by xtq_type in
+ * the hoptable or through /proc/sys/modelnet/hopqdisc.  This replaces
+ * the FreeBSD module's mn_xtq.c; XCP was not carried over.
+ *
+ * A hop's queue is virtual: a packet's exit tick is fixed when it is
+ * enqueued, so every discipline here decides at enqueue.  For CoDel,
+ * which judges packets by their sojourn time as they leave, that is
+ * exact all the same: the time a packet will wait is known on arrival,
+ * and FIFO packets leave in the order they came, so running the
+ * control law on the exit ticks makes the decisions the real dequeue
+ * would.  A packet dropped then never uses the link, as if the real
+ * queue had skipped it.
+ *
+ * FIFO hops have hop->qdisc NULL and pay for nothing here but one
+ * test in emulate_hop().  Disciplines that need periodic work get
+ * timeouts from the hop calendar, a second calendar next to the packet
+ * calendar that is only allocated once such a discipline is installed.
+ */
+
+#include <linux/module.h>
+#include <linux/init.h>
+#include <linux/netfilter.h>
+
+#include <linux/ip.h>
+#include <linux/skbuff.h>
+#include <linux/err.h>
+#include <linux/math64.h>
+#include <net/inet_ecn.h>
+
+#include <linux/vmalloc.h>
+#include <asm/uaccess.h>
+
+#include "ip_modelnet.h"
+#include "mn_qdisc.h"
+
+static unsigned long mn_us_to_ticks(u_int32_t us)
+{
+    unsigned long t = (unsigned long)div_u64((u_int64_t)mn_hz * us +
+					     USEC_PER_SEC - 1, USEC_PER_SEC);
+    return t ? t : 1;
+}
+
+
+/*
+ * RED, Floyd and Jacobson 1993, counted in packets.  avg is kept with
+ * MN_RED_SHIFT fractional bits.  With XTQ_ADAPTIVE max_p is tuned
+ * every MN_RED_PERIOD_MS to keep avg in the middle fifth of
+ * [min_th, max_th], Floyd, Gummadi and Shenker 2001.
+ */
+#define MN_RED_SHIFT     16
+#define MN_RED_MAXTH     (1 << 20)
+#define MN_RED_PERIOD_MS 500
+#define MN_RED_P01       0x028f5c29U    /* 0.01 in 2^-32 units */
+
+struct mn_red {
+    u_int32_t       qmin, qmax;         /* thresholds, pkts */
+    u_int32_t       maxp;               /* 2^-32 units */
+    u_int           wlog;               /* avg weight is 2^-wlog */
+    int             flags;
+    u_int32_t       count;              /* pkts since the last mark */
+    u_int64_t       avg;
+    unsigned long   idle;               /* tick the queue runs empty */
+};
+
+static void *red_alloc(struct hop *hop, const struct sysctl_hopqdisc *q)
+{
+    struct mn_red *r;
+    u_int64_t maxp;
+
+    r = kzalloc(sizeof(*r), GFP_KERNEL);
+    if (!r)
+	return ERR_PTR(-ENOMEM);
+    r->qmax = q && q->param[1] ? q->param[1] : max(hop->qsize / 2, 3);
+    r->qmin = q && q->param[0] ? q->param[0] : max(r->qmax / 3, 1U);
+    maxp = q && q->param[2] ? (u_int32_t)q->param[2] : 100000;
+    r->wlog = q && q->param[3] ? q->param[3] : 9;
+    r->flags = q ? q->flags : 0;
+    if (r->qmin >= r->qmax || r->qmax > MN_RED_MAXTH ||
+	maxp > 1000000 || r->wlog > 24) {
+	kfree(r);
+	return ERR_PTR(-EINVAL);
+    }
+    r->maxp = maxp == 1000000 ? 0xffffffffU :
+	(u_int32_t)div_u64(maxp << 32, 1000000);
+    return r;
+}
+
+/* RED and CoDel keep their state in a single kmalloc'ed block */
+static void xtq_free(void *xtq)
+{
+    kfree(xtq);
+}
+
+/*
+ * [red_idle] the queue sat empty for 'ticks', in which m packets of
+ * len bytes could have been sent: avg *= (1 - 2^-wlog)^m, taken as
+ * avg >> (m / (2^wlog ln 2)).
+ */
+static void red_idle(struct mn_red *r, struct hop *hop, unsigned long ticks,
+		     int len)
+{
+    u_int s = min(hop->tpb_shift, 20U);
+    u_int64_t d, m;
+
+    if (!hop->tpb || ticks >= (1UL << 20)) {
+	r->avg = 0;
+	return;
+    }
+    /* ticks to send one packet, with s fractional bits */
+    d = ((u_int64_t)len * hop->tpb) >> (hop->tpb_shift - s);
+    m = d ? div64_u64((u_int64_t)ticks << s, d) : ~0ULL;
+    m = min_t(u_int64_t, m, 1ULL << 40);
+    m = (m * 369) >> (8 + r->wlog);     /* 369 / 256 = 1 / ln 2 */
+    r->avg = m < 64 ? r->avg >> m : 0;
+}
+
+static int red_enqueue(struct hop *hop, struct packet *pkt,
+		       unsigned long now, unsigned long start)
+{
+    struct mn_red *r = hop->xtq;
+    u_int64_t qmin = (u_int64_t)r->qmin << MN_RED_SHIFT;
+    u_int64_t pb, pa, frac;
+    int verdict = XTQ_PASS;
+
+    if (hop->slotdepth || !time_after(now, r->idle))
+	r->avg += (((u_int64_t)hop->slotdepth << MN_RED_SHIFT) >> r->wlog) -
+	    (r->avg >> r->wlog);
+    else
+	red_idle(r, hop, now - r->idle, pkt->info.len);
+
+    if (r->avg < qmin) {
+	r->count = 0;
+	goto pass;
+    }
+    if (r->avg >= (u_int64_t)r->qmax << MN_RED_SHIFT)
+	goto mark;
+
+    /* pb = max_p (avg - min_th) / (max_th - min_th), then spread the
+     * marks out evenly: pa = pb / (1 - count pb) */
+    frac = div64_u64((r->avg - qmin) << 16,
+		     (u_int64_t)(r->qmax - r->qmin) << MN_RED_SHIFT);
+    pb = ((u_int64_t)r->maxp * frac) >> 16;
+    if ((u_int64_t)r->count * pb >= (1ULL << 32))
+	goto mark;
+    pa = div64_u64(pb << 32, (1ULL << 32) - r->count * pb);
+    if (mn_hop_random(hop) < pa)
+	goto mark;
+    ++r->count;
+    goto pass;
+
+mark:
+    r->count = 0;
+    if (!(r->flags & XTQ_ECN))
+	return XTQ_DROP;
+    verdict = XTQ_MARK;
+pass:
+    r->idle = start + (((u_int64_t)pkt->info.len * hop->tpb) >> hop->tpb_shift);
+    return verdict;
+}
+
+static unsigned long red_timeout(struct hop *hop, unsigned long now)
+{
+    struct mn_red *r = hop->xtq;
+    u_int64_t span = (u_int64_t)(r->qmax - r->qmin) << MN_RED_SHIFT;
+    u_int64_t lo = ((u_int64_t)r->qmin << MN_RED_SHIFT) + span * 2 / 5;
+    u_int64_t hi = lo + span / 5;
+    unsigned long period = mn_ms_to_ticks(MN_RED_PERIOD_MS);
+
+    if (r->avg > hi && r->maxp <= 0x80000000U)
+	r->maxp += min(r->maxp / 4, MN_RED_P01);
+    else if (r->avg < lo && r->maxp >= MN_RED_P01)
+	r->maxp = (u_int32_t)div_u64((u_int64_t)r->maxp * 9, 10);
+    return period ? period : 1;
+}
+
+static void red_dump(struct hop *hop, struct sysctl_hopqdisc *q)
+{
+    struct mn_red *r = hop->xtq;
+
+    q->type = XTQ_RED;
+    q->flags = r->flags;
+    q->param[0] = r->qmin;
+    q->param[1] = r->qmax;
+    q->param[2] = (int)(((u_int64_t)r->maxp * 1000000 + (1ULL << 31)) >> 32);
+    q->param[3] = r->wlog;
+}
+
+
+/*
+ * CoDel, RFC 8289.  All times are calendar ticks, so target and
+ * interval are rounded up to whole ticks; raise mn_hz for the usual
+ * 5ms target to mean much.
+ */
+#define MN_CODEL_MTU     1500
+
+struct mn_codel {
+    unsigned long   target, interval;   /* ticks */
+    u_int32_t       target_us, interval_us;
+    int             flags;
+    int             above;              /* sojourn over target since
+					 * first_above - interval */
+    unsigned long   first_above;
+    int             dropping;
+    unsigned long   drop_next;
+    u_int32_t       count, lastcount;
+};
+
+static void *codel_alloc(struct hop *hop, const struct sysctl_hopqdisc *q)
+{
+    struct mn_codel *c;
+
+    c = kzalloc(sizeof(*c), GFP_KERNEL);
+    if (!c)
+	return ERR_PTR(-ENOMEM);
+    c->target_us = q && q->param[0] > 0 ? q->param[0] : 5000;
+    c->interval_us = q && q->param[1] > 0 ? q->param[1] : 100000;
+    c->target = mn_us_to_ticks(c->target_us);
+    c->interval = mn_us_to_ticks(c->interval_us);
+    c->flags = q ? q->flags : 0;
+    return c;
+}
+
+/* t + interval / sqrt(count) */
+static unsigned long codel_control_law(struct mn_codel *c, unsigned long t)
+{
+    unsigned long n = min(c->count, 65535U);
+
+    return t + (unsigned long)div_u64((u_int64_t)c->interval << 8,
+				      int_sqrt(n << 16));
+}
+
+static int codel_enqueue(struct hop *hop, struct packet *pkt,
+			 unsigned long now, unsigned long start)
+{
+    struct mn_codel *c = hop->xtq;
+    int verdict = c->flags & XTQ_ECN ? XTQ_MARK : XTQ_DROP;
+    int ok = 0;
+    u_int32_t delta;
+
+    /* start is when the packet leaves the queue, having waited
+     * start - now */
+    if (start - now < c->target || hop->bytedepth <= MN_CODEL_MTU)
+	c->above = 0;
+    else if (!c->above) {
+	c->above = 1;
+	c->first_above = start + c->interval;
+    }
+    else if (!time_before(start, c->first_above))
+	ok = 1;
+
+    if (c->dropping) {
+	if (!ok) {
+	    c->dropping = 0;
+	    return XTQ_PASS;
+	}
+	if (time_before(start, c->drop_next))
+	    return XTQ_PASS;
+	++c->count;
+	c->drop_next = codel_control_law(c, c->drop_next);
+	return verdict;
+    }
+    if (!ok)
+	return XTQ_PASS;
+
+    /* start dropping, faster if we were dropping not long ago */
+    c->dropping = 1;
+    delta = c->count - c->lastcount;
+    c->count = delta > 1 &&
+	time_before(start, c->drop_next + 16 * c->interval) ? delta : 1;
+    c->drop_next = codel_control_law(c, start);
+    c->lastcount = c->count;
+    return verdict;
+}
+
+static void codel_dump(struct hop *hop, struct sysctl_hopqdisc *q)
+{
+    struct mn_codel *c = hop->xtq;
+
+    q->type = XTQ_CODEL;
+    q->flags = c->flags;
+    q->param[0] = c->target_us;
+    q->param[1] = c->interval_us;
+}
+
+
+static const struct mn_qdisc_ops mn_red_ops = {
+    .type = XTQ_RED,
+    .name = "RED",
+    .alloc = red_alloc,
+    .free = xtq_free,
+    .enqueue = red_enqueue,
+    .dump = red_dump,
+};
+
+static const struct mn_qdisc_ops mn_ared_ops = {
+    .type = XTQ_RED,
+    .name = "adaptive RED",
+    .alloc = red_alloc,
+    .free = xtq_free,
+    .enqueue = red_enqueue,
+    .timeout = red_timeout,
+    .dump = red_dump,
+};
+
+static const struct mn_qdisc_ops mn_codel_ops = {
+    .type = XTQ_CODEL,
+    .name = "CoDel",
+    .alloc = codel_alloc,
+    .free = xtq_free,
+    .enqueue = codel_enqueue,
+    .dump = codel_dump,
+};
+
+/* by xtq_type, NULL for FIFO and what is not supported */
+static const struct mn_qdisc_ops *mn_qdiscs[XTQ_MAX] = {
+    [XTQ_RED] = &mn_red_ops,
+    [XTQ_CODEL] = &mn_codel_ops,
+};
+
+
+/*
+ * [mn_xtq_mark] set CE on a packet a qdisc marked.  Returns -1 when it
+ * can't: the packet is not ECN capable, or only its header is here.
+ */
+int mn_xtq_mark(struct packet *pkt)
+{
+    struct sk_buff *skb = pkt->skb;
+
+    if (!skb || !INET_ECN_is_capable(ip_hdr(skb)->tos))
+	return -1;
+    if (!skb_make_writable(skb, skb_network_offset(skb) + sizeof(struct iphdr)))
+	return -1;
+    IP_ECN_set_ce(ip_hdr(skb));
+    return 0;
+}
+
+
+/*
+ * The hop calendar: one list of hop timers per packet calendar slot,
+ * run by mn_drain() as it passes each tick.  A hop has at most one
+ * timer pending, struct hop's timer, under the calendar lock.
+ */
+static int mn_hop_timers_init(struct mn_net *mnet)
+{
+    struct list_head *cal;
+    unsigned long i;
+
+    if (mnet->hop_calendar)
+	return 0;
+    cal = vmalloc(sizeof(*cal) * (mnet->calendar.mask + 1));
+    if (!cal)
+	return -ENOMEM;
+    for (i = 0; i <= mnet->calendar.mask; ++i)
+	INIT_LIST_HEAD(&cal[i]);
+
+    spin_lock_bh(&mnet->calendar_lock);
+    if (!mnet->hop_calendar) {
+	mnet->hop_calendar = cal;
+	cal = NULL;
+    }
+    spin_unlock_bh(&mnet->calendar_lock);
+    vfree(cal);
+    return 0;
+}
+
+void mn_hop_timers_uninit(struct mn_net *mnet)
+{
+    vfree(mnet->hop_calendar);
+    mnet->hop_calendar = NULL;
+}
+
+/* with the calendar lock held; timers wrap around after one calendar */
+static void mn_hop_schedule(struct mn_net *mnet, struct hop *hop,
+			    unsigned long tick, unsigned long ticks)
+{
+    if (ticks > mnet->calendar.mask)
+	ticks = mnet->calendar.mask;
+    list_move_tail(&hop->timer.list,
+		   &mnet->hop_calendar[(tick + ticks) & mnet->calendar.mask]);
+}
+
+/*
+ * [mn_hop_timers_run] run the hop timers due at tick, from mn_drain()
+ * with the calendar lock held.
+ */
+void mn_hop_timers_run(struct mn_net *mnet, unsigned long tick)
+{
+    struct list_head *slot = &mnet->hop_calendar[tick & mnet->calendar.mask];
+    struct hop_scheduler *hs;
+    struct hop *hop;
+    unsigned long next;
+
+    while (!list_empty(slot)) {
+	hs = list_first_entry(slot, struct hop_scheduler, list);
+	hop = hs->hop;
+	list_del_init(&hs->list);
+
+	spin_lock(&hop->lock);
+	next = hop->qdisc->timeout(hop, tick);
+	if (next)
+	    mn_hop_schedule(mnet, hop, tick, next);
+	spin_unlock(&hop->lock);
+    }
+}
+
+
+/*
+ * [mn_qdisc_install] give hop the discipline 'type', set up from q or
+ * with defaults if q is NULL.  The old one, if any, is released.
+ * Types that are not supported leave a FIFO, as the FreeBSD module
+ * did.  Process context only.
+ */
+int mn_qdisc_install(struct mn_net *mnet, struct hop *hop, int type,
+		     const struct sysctl_hopqdisc *q)
+{
+    const struct mn_qdisc_ops *ops, *oldops;
+    void *xtq = NULL, *oldxtq;
+    int err;
+
+    if (type < 0 || type >= XTQ_MAX)
+	return -EINVAL;
+    ops = mn_qdiscs[type];
+    if (ops == &mn_red_ops && q && (q->flags & XTQ_ADAPTIVE))
+	ops = &mn_ared_ops;
+    if (type != XTQ_NOXTQ && !ops)
+	printk("hop %d: queue type %d not supported, using FIFO\n",
+	       hop->id, type);
+
+    if (ops) {
+	xtq = ops->alloc(hop, q);
+	if (IS_ERR(xtq))
+	    return PTR_ERR(xtq);
+	if (ops->timeout && (err = mn_hop_timers_init(mnet))) {
+	    ops->free(xtq);
+	    return err;
+	}
+    }
+
+    spin_lock_bh(&mnet->calendar_lock);
+    spin_lock(&hop->lock);
+    oldops = hop->qdisc;
+    oldxtq = hop->xtq;
+    if (oldops)
+	list_del_init(&hop->timer.list);
+    else {
+	INIT_LIST_HEAD(&hop->timer.list);
+	hop->timer.hop = hop;
+    }
+    hop->qdisc = ops;
+    hop->xtq = xtq;
+    if (ops && ops->timeout)
+	mn_hop_schedule(mnet, hop, mnet->calendar.tick, 1);
+    spin_unlock(&hop->lock);
+    spin_unlock_bh(&mnet->calendar_lock);
+
+    if (oldops)
+	oldops->free(oldxtq);
+    return 0;
+}
+
+/* [mn_qdisc_release] back to FIFO, from uninit_paths() */
+void mn_qdisc_release(struct mn_net *mnet, struct hop *hop)
+{
+    if (hop->qdisc)
+	mn_qdisc_install(mnet, hop, XTQ_NOXTQ, NULL);
+}
+
+
+/**
+ * proc_hopqdisc - set or read the queue disciplines of hops.  A write
+ * is one or more struct sysctl_hopqdisc records.  A read returns one
+ * record per hop, in hop order, type XTQ_NOXTQ for FIFO hops; read it
+ * like hopstats.
+ *
+ * @table: the sysctl table
+ * @write: %TRUE if this is a write to the sysctl file
+ * @buffer: the user buffer
+ * @lenp: the size of the user buffer
+ * @ppos: current offset into the file
+ *
+ * Returns 0 on success, -EINVAL for a bad hop index, type or params.
+ */
+
+int proc_hopqdisc(ctl_table *table, int write,
+		  void __user *buffer, size_t *lenp, loff_t *ppos)
+{
+    struct mn_net *mnet = table->extra1;
+    struct sysctl_hopqdisc q, *qtab;
+    struct hop *hop;
+    size_t done, len;
+    int i, err;
+
+    if (write) {
+	if (*lenp % sizeof(q)) {
+	    printk("proc_hopqdisc: ERROR lenp(%d) not a multiple of %lu\n",
+		   (int)*lenp, (unsigned long)sizeof(q));
+	    return -EINVAL;
+	}
+	for (done = 0; done < *lenp; done += sizeof(q)) {
+	    if (copy_from_user(&q, buffer + done, sizeof(q)))
+		return -EFAULT;
+	    if (!mnet->model.hoptable || q.hopidx < 0 || q.hopidx >= mnet->model.hopcount) {
+		printk("proc_hopqdisc: no hop %d\n", q.hopidx);
+		return -EINVAL;
+	    }
+	    err = mn_qdisc_install(mnet, mnet->model.hoptable + q.hopidx, q.type, &q);
+	    if (err) {
+		printk("proc_hopqdisc: hop %d: bad queue type %d or params\n",
+		       q.hopidx, q.type);
+		return err;
+	    }
+	}
+	*ppos += *lenp;
+	return 0;
+    }
+
+    /* see proc_hopstats */
+    if (*ppos) {
+	*lenp = 0;
+	return 0;
+    }
+    len = mnet->model.hopcount * sizeof(q);
+    if (*lenp < len) {
+	printk("hopqdisc: user buffer is too small\n");
+	return -EINVAL;
+    }
+    qtab = vmalloc(len);
+    if (!qtab && len)
+	return -ENOMEM;
+
+    for (i = 0; i < mnet->model.hopcount; ++i) {
+	hop = mnet->model.hoptable + i;
+	memset(qtab + i, 0, sizeof(q));
+	qtab[i].hopidx = i;
+	spin_lock_bh(&hop->lock);
+	if (hop->qdisc)
+	    hop->qdisc->dump(hop, qtab + i);
+	qtab[i].drops = hop->aqmdrops;
+	qtab[i].marks = hop->marks;
+	spin_unlock_bh(&hop->lock);
+    }
+
+    err = copy_to_user(buffer, qtab, len) ? -EFAULT : 0;
+    vfree(qtab);
+    if (err)
+	return err;
+    *lenp = len;
+    *ppos += len;
+    return 0;
+}
@@ -0,0 +1,103 @@
+/*
+ * modelnet mn_qdisc.h
+ *
+ *    per-hop queue disciplines and the hop timer calendar
+ *
+ * Copyright (c) 2006
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in
+ *      the documentation and/or other materials provided with the
+ *      distribution.
+ *    * Neither the names of Duke University nor The University of
+ *      California, San Diego, nor the names of the authors or contributors
+ *      may be used to endorse or promote products derived from
+ *      this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE
+ * USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ * 
+ */
+
+#ifndef __MN_QDISC_H
+#define __MN_QDISC_H
+
+#include "ip_modelnet.h"
+
+/* verdicts of mn_qdisc_ops.enqueue */
+#define XTQ_PASS        0
+#define XTQ_DROP        1
+#define XTQ_MARK        2       /* set CE, or drop if not ECN capable */
+
+/*
+ * A queue discipline.  Hops with the plain droptail FIFO have no ops
+ * at all; see mn_xtq_enqueue().
+ *
+ * alloc:   new state for hop from q (q NULL: all defaults), in process
+ *          context.  Returns an ERR_PTR on failure.
+ * free:    releases what alloc returned.
+ * enqueue: decides the fate of pkt arriving at tick now, under the hop
+ *          lock.  The FIFO bookkeeping is up to date; start is the tick
+ *          the packet would begin to be sent.
+ * timeout: called from the calendar under the calendar lock with the
+ *          hop locked; returns the ticks until the next call, 0 for no
+ *          more.  A discipline with a timeout is first called one tick
+ *          after it is installed.
+ * dump:    fills in type, flags and params of q.
+ */
+struct mn_qdisc_ops {
+    int             type;
+    const char     *name;
+    void         *(*alloc) (struct hop *hop, const struct sysctl_hopqdisc *q);
+    void          (*free) (void *xtq);
+    int           (*enqueue) (struct hop *hop, struct packet *pkt,
+			      unsigned long now, unsigned long start);
+    unsigned long (*timeout) (struct hop *hop, unsigned long now);
+    void          (*dump) (struct hop *hop, struct sysctl_hopqdisc *q);
+};
+
+extern int mn_xtq_mark(struct packet *pkt);
+
+/*
+ * [mn_xtq_enqueue] the part of emulate_hop() only hops with a qdisc
+ * run.  Returns -ENOBUFS when the packet is to be dropped.
+ */
+static inline int mn_xtq_enqueue(struct hop *hop, struct packet *pkt,
+				 unsigned long now)
+{
+    switch (hop->qdisc->enqueue(hop, pkt, now, mn_hop_tail(hop, now))) {
+    case XTQ_MARK:
+	if (!mn_xtq_mark(pkt)) {
+	    ++hop->marks;
+	    return 0;
+	}
+	/* not ECN capable, fall through */
+    case XTQ_DROP:
+	++hop->aqmdrops;
+	return -ENOBUFS;
+    }
+    return 0;
+}
+
+extern int mn_qdisc_install(struct mn_net *mnet, struct hop *hop, int type,
+			    const struct sysctl_hopqdisc *q);
+extern void mn_qdisc_release(struct mn_net *mnet, struct hop *hop);
+extern void mn_hop_timers_run(struct mn_net *mnet, unsigned long tick);
+extern void mn_hop_timers_uninit(struct mn_net *mnet);
+extern int proc_hopqdisc(ctl_table *table, int write,
+			 void __user *buffer, size_t *lenp, loff_t *ppos);
+#endif
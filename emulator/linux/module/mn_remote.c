@@ -36,8 +36,19 @@
 #include <linux/module.h>
 #include <linux/netfilter_ipv4.h>
 #include <linux/ip.h>
+#include <linux/udp.h>
 #include <linux/init.h>
 #include <linux/jiffies.h>
+#include <linux/hash.h>
+#include <linux/log2.h>
+#include <linux/percpu.h>
+#include <linux/vmalloc.h>
+#include <linux/netdevice.h>
+#include <linux/if_arp.h>
+#include <net/ip.h>
+#include <net/route.h>
+#include <net/checksum.h>
+#include <net/neighbour.h>
 
 /* #define _IP_VHL */
 #include <asm/system.h>
@@ -46,17 +57,936 @@
 
 #include "ip_modelnet.h"
 
+/*
+ * Multi-core emulation: a model too big for one emulator is spread over
+ * several, each hosting some of the hops.  modelload gives a hop that
+ * another emulator (core) hosts that core's address in hop->emulator.
+ * A packet that comes to such a hop is tunnelled there, its digest, a
+ * struct mc_digest made from its remote_packet, ahead of the whole IP
+ * packet in a UDP datagram to remote_port; the core takes it in at
+ * remote_input(), looks up the path again and goes on from the same
+ * hop.  Whichever core emulates the last hop forwards the packet to
+ * its edge node.
+ *
+ * The core a packet entered is its home; the packet is home again when
+ * its path comes back to a hop of the first hop's core.  A packet is
+ * dropped after mcttl core crossings, counted in mc_ttldrops, and one
+ * that comes home mcexpire ms or more after it last left, counted in
+ * mc_exdrops.  The digest carries the ms it has left, so the cores'
+ * clocks need not agree; the time on the wire is not counted.
+ *
+ * With mcaggregate set, the packets bound for a core are gathered in
+ * one datagram of up to that many bytes, see mc_aggregate(), so the
+ * cost of a crossing is shared.  The datagram holds one record per
+ * packet, its digest and then the packet.  A datagram over the MTU
+ * goes as IP fragments, cut by the nic where it offloads UDP
+ * fragmentation; UDP GSO, which would cut it into whole datagrams, is
+ * not in the kernels this builds on.
+ *
+ * With mcether set, a datagram for a core on the same ethernet goes
+ * instead as a frame of ethertype ETH_P_MODELNET straight to the core's
+ * MAC, see mc_ether_output(), and is taken in by mc_ether_input()
+ * ahead of the IP stack, which neither side then goes through.  Frames
+ * are not fragmented: a datagram over the MTU, one for a core behind a
+ * router or whose MAC is not yet known goes by UDP as before.  So
+ * mcaggregate wants to be at most the MTU, and whole packets only fit
+ * with jumbo frames; with mcpcache, digests always do.
+ *
+ * With mcpcache set, the payload stays at home, in a cache of that many
+ * slots, and only the digest goes from core to core; the last core
+ * sends it home, where mc_input() takes the payload back out by the
+ * digest's id and forwards it.  Crossings then cost by the packet, not
+ * the byte.  A payload whose digest is not back by its expiry, as when
+ * a remote hop dropped it, is freed by mc_pcache_expire(), counted in
+ * pcache_expired.  The cache holds packets in the order they left, in
+ * slots indexed by id; when the next slot is still taken the packet
+ * goes whole, counted in pcache_full.
+ */
+
+#define MCORE_EXPIRE    1000    /* ms */
+#define MCORE_TTL       40      /* 10 inter-core hops */
+
+unsigned short remote_port = MODEL_PORT;
+module_param(remote_port, ushort, 0444);
+MODULE_PARM_DESC(remote_port, "udp port of the remote hop service (default 5347)");
+
+#define MC_HDRLEN (sizeof(struct iphdr) + sizeof(struct udphdr))
+#define MC_MAXAGG (0xffff - MC_HDRLEN)  /* most a datagram holds */
+
+#define MC_PCACHE_MAXSLOTS (1 << 20)
+
+/*
+ * On the wire a datagram is an mc_batch and then count records, each
+ * an mc_digest followed, with MC_DIG_PAYLOAD, by the len bytes of the
+ * packet.  Both are little endian but for the addresses, and the same
+ * size on every architecture, so cores of any kind work together as
+ * long as they agree on MC_WIRE_VERSION.  Records are not aligned, they
+ * are copied in and out.
+ */
+#define MC_WIRE_VERSION 1
+
+struct mc_batch {
+    u8              version;
+    u8              flags;      /* none yet */
+    __le16          count;      /* records in the datagram */
+    __be32          core;       /* sender */
+};
+
+struct mc_digest {
+    __le32          id;         /* in the home core's cache, 0 if not */
+    __le32          wait_time;  /* usecs */
+    __be32          src;
+    __be32          dst;
+    __le16          len;
+    __le16          hop;
+    __le16          expire;     /* ms left to get home in */
+    s8              ttl;
+    u8              flags;
+#define MC_DIG_PAYLOAD  0x1     /* the packet follows */
+};
+
+#define MC_BATCHLEN     sizeof(struct mc_batch)
+#define MC_DIGLEN       sizeof(struct mc_digest)
+
+/*
+ * Datagrams being gathered, one per destination core, on each cpu of
+ * each namespace.  A core's slot is found by hashing its address; with
+ * more cores than slots, one bumps the other's datagram out early.
+ * Filled where remote hops are emulated, with bottom halves off, and
+ * emptied by mc_flush() from any cpu, so each table has a lock.
+ */
+struct mc_agg {
+    in_addr_t       core;
+    struct sk_buff *skb;        /* records so far, NULL when empty */
+};
+
+struct mc_aggtab {
+    spinlock_t      lock;
+    struct mc_agg   slot[MN_MAX_CORES];
+};
+
+/*
+ * [mn_remote_setup] multi-core defaults of a namespace, before a model
+ */
+void mn_remote_setup(struct mn_net *mnet)
+{
+    BUILD_BUG_ON(MC_DIGLEN != 24 || MC_BATCHLEN != 8);
+
+    mnet->mn.mc_ttl = MCORE_TTL;
+    mnet->mn.mc_expire = MCORE_EXPIRE;
+    mnet->mn.mc_aggregate = 0;
+    mnet->mn.mc_ether = 0;
+    atomic_set(&mnet->mc_gathering, 0);
+    spin_lock_init(&mnet->pcache_lock);
+    mnet->pcache = NULL;
+    mnet->mc_agg = NULL;
+}
+
+/*
+ * [mn_remote_init] the aggregation tables, once a model is loaded
+ */
+int mn_remote_init(struct mn_net *mnet)
+{
+    int cpu;
+
+    mnet->mc_agg = alloc_percpu(struct mc_aggtab);
+    if (!mnet->mc_agg)
+        return -ENOMEM;
+    for_each_possible_cpu(cpu)
+        spin_lock_init(&per_cpu_ptr(mnet->mc_agg, cpu)->lock);
+    return 0;
+}
+
+static void mc_pcache_free(struct packet **cache, u_int32_t mask);
+
+/*
+ * [mn_remote_uninit] drop what was still being gathered or cached
+ */
+void mn_remote_uninit(struct mn_net *mnet)
+{
+    struct mc_aggtab *tab;
+    int cpu, i;
+
+    if (mnet->mc_agg) {
+        for_each_possible_cpu(cpu) {
+            tab = per_cpu_ptr(mnet->mc_agg, cpu);
+            for (i = 0; i < MN_MAX_CORES; ++i)
+                if (tab->slot[i].skb)
+                    kfree_skb(tab->slot[i].skb);
+        }
+        free_percpu(mnet->mc_agg);
+        mnet->mc_agg = NULL;
+    }
+    mc_pcache_free(mnet->pcache, mnet->pcache_mask);
+    mnet->pcache = NULL;
+}
+
+/* ids go 1, 2, ... round to 1 again, 0 is a packet not cached */
+static inline u_int32_t mc_nextid(u_int32_t id)
+{
+    return id + 1 ? id + 1 : 1;
+}
+
+/*
+ * [mc_pcache] Keep pkt, leaving home, in the cache under a fresh id.
+ * Returns 1 if it was cached, 0 to send it whole.
+ */
+static int mc_pcache(struct packet *pkt)
+{
+    struct mn_net *mnet = pkt->mnet;
+    struct packet **slot;
+    int cached = 0;
+
+    spin_lock(&mnet->pcache_lock);
+    if (mnet->pcache) {
+        slot = &mnet->pcache[mnet->pcache_head & mnet->pcache_mask];
+        if (*slot) {
+            /* the ids came round to a packet still away */
+            mnet->mn.stats.pcache_full++;
+        } else {
+            pkt->info.id = mnet->pcache_head;
+            mnet->pcache_head = mc_nextid(mnet->pcache_head);
+            *slot = pkt;
+            mnet->mn.stats.pcache_occupancy++;
+            cached = 1;
+        }
+    }
+    spin_unlock(&mnet->pcache_lock);
+    return cached;
+}
+
+/*
+ * [mc_uncache] Take the packet with id out of the cache.  Returns it,
+ * or NULL if it is not there, expired and freed or the cache resized
+ * since it left.
+ */
+static struct packet *mc_uncache(struct mn_net *mnet, unsigned long id)
+{
+    struct packet **slot, *pkt = NULL;
 
-struct mn_config mn;
+    spin_lock(&mnet->pcache_lock);
+    if (mnet->pcache) {
+        slot = &mnet->pcache[id & mnet->pcache_mask];
+        if (*slot && (*slot)->info.id == id) {
+            pkt = *slot;
+            *slot = NULL;
+            pkt->info.id = 0;
+            mnet->mn.stats.pcache_occupancy--;
+        }
+    }
+    spin_unlock(&mnet->pcache_lock);
+    return pkt;
+}
+
+/*
+ * [mc_pcache_expire] Free the payloads whose digests are not back by
+ * their expiry.  They left in id order, with the same mcexpire unless
+ * it was changed, so stops at the first one still waiting.  Called from the calendar.
+ */
+void mc_pcache_expire(struct mn_net *mnet)
+{
+    struct packet **slot, *pkt;
+
+    spin_lock(&mnet->pcache_lock);
+    while (mnet->pcache && mnet->pcache_tail != mnet->pcache_head) {
+        slot = &mnet->pcache[mnet->pcache_tail & mnet->pcache_mask];
+        pkt = *slot;
+        if (pkt) {
+            if (time_before(jiffies, pkt->info.expire))
+                break;
+            *slot = NULL;
+            mnet->mn.stats.pcache_occupancy--;
+            mnet->mn.stats.pcache_expired++;
+            MN_FREE_PKT(pkt);
+        }
+        mnet->pcache_tail = mc_nextid(mnet->pcache_tail);
+    }
+    spin_unlock(&mnet->pcache_lock);
+}
+
+/* free a cache no longer in use, and what it held */
+static void mc_pcache_free(struct packet **cache, u_int32_t mask)
+{
+    u_int32_t i;
+
+    if (!cache)
+        return;
+    for (i = 0; i <= mask; ++i)
+        if (cache[i])
+            MN_FREE_PKT(cache[i]);
+    vfree(cache);
+}
+
+/*
+ * [proc_mcpcache]
+ *
+ * Reads or sets the slots of the payload cache, rounded up to a power
+ * of 2; 0 turns it off.  Resizing drops the payloads that are away,
+ * their digests are counted in mc_errs when they come back.
+ */
+int proc_mcpcache(ctl_table *table, int write,
+                  void __user *buffer, size_t *lenp, loff_t *ppos)
+{
+    struct mn_net *mnet = table->extra1;
+    ctl_table tmp = *table;
+    struct packet **cache = NULL, **old;
+    u_int32_t oldmask;
+    int slots, err;
+
+    slots = mnet->pcache ? mnet->pcache_mask + 1 : 0;
+    tmp.data = &slots;
+    err = proc_dointvec(&tmp, write, buffer, lenp, ppos);
+    if (err || !write)
+        return err;
+
+    if (slots < 0 || slots > MC_PCACHE_MAXSLOTS)
+        return -EINVAL;
+    if (slots) {
+        slots = roundup_pow_of_two(slots);
+        cache = vzalloc(slots * sizeof(*cache));
+        if (!cache)
+            return -ENOMEM;
+    }
+
+    spin_lock_bh(&mnet->pcache_lock);
+    old = mnet->pcache;
+    oldmask = mnet->pcache_mask;
+    mnet->pcache = cache;
+    mnet->pcache_mask = slots - 1;
+    mnet->pcache_head = mnet->pcache_tail = 1;
+    mnet->mn.stats.pcache_occupancy = 0;
+    if (cache)
+        mnet->mn.state |= MN_PCACHE;
+    else
+        mnet->mn.state &= ~MN_PCACHE;
+    spin_unlock_bh(&mnet->pcache_lock);
+    mc_pcache_free(old, oldmask);
+    return 0;
+}
+
+/*
+ * [udp_validate]
+ *
+ * Validates UDP length and checksum of the datagram in skb, whose IP
+ * header is ihl bytes, and trims skb to the UDP length.
+ * returns: 1 -> good, 0 -> bad
+ */
+static int udp_validate(struct sk_buff *skb, int ihl)
+{
+    struct iphdr *iph = ip_hdr(skb);
+    struct udphdr *uh = (struct udphdr *)(skb->data + ihl);
+    unsigned int len = ntohs(uh->len);
+
+    if (len < sizeof(struct udphdr) || ihl + len > skb->len) {
+        printk("udp_validate: bad udp length\n");
+        return 0;
+    }
+    if (pskb_trim_rcsum(skb, ihl + len))
+        return 0;
+
+    iph = ip_hdr(skb);
+    uh = (struct udphdr *)(skb->data + ihl);
+    if (uh->check && skb->ip_summed != CHECKSUM_UNNECESSARY &&
+        csum_tcpudp_magic(iph->saddr, iph->daddr, len, IPPROTO_UDP,
+                          skb_checksum(skb, ihl, len, 0))) {
+        printk("udp_validate: failed, bad checksum\n");
+        return 0;
+    }
+    return 1;
+}
+
+/*
+ * [mc_encode] Write the digest of info at 'to', flagged as followed by
+ * the packet if payload.
+ */
+static void mc_encode(const struct remote_packet *info, int payload,
+                      void *to)
+{
+    struct mc_digest d;
+    long left = (long)(info->expire - jiffies);
+
+    d.id = cpu_to_le32(info->id);
+    d.wait_time = cpu_to_le32(min_t(unsigned long, info->wait_time,
+                                    0xffffffff));
+    d.src = info->src;
+    d.dst = info->dst;
+    d.len = cpu_to_le16(info->len);
+    d.hop = cpu_to_le16(info->hop);
+    d.expire = cpu_to_le16(left > 0 ?
+                           min_t(unsigned int, jiffies_to_msecs(left),
+                                 0xffff) : 0);
+    d.ttl = info->ttl;
+    d.flags = payload ? MC_DIG_PAYLOAD : 0;
+    memcpy(to, &d, sizeof(d));
+}
+
+/*
+ * [mc_decode] Read the digest at 'from' into info.  Returns whether the
+ * packet follows it.
+ */
+static int mc_decode(const void *from, struct remote_packet *info)
+{
+    struct mc_digest d;
+
+    memcpy(&d, from, sizeof(d));
+    info->id = le32_to_cpu(d.id);
+    info->expire = jiffies + msecs_to_jiffies(le16_to_cpu(d.expire));
+    info->len = le16_to_cpu(d.len);
+    info->wait_time = le32_to_cpu(d.wait_time);
+    info->src = d.src;
+    info->dst = d.dst;
+    info->hop = le16_to_cpu(d.hop);
+    info->ttl = d.ttl;
+    return d.flags & MC_DIG_PAYLOAD;
+}
+
+/* the header of a datagram of count records, mc_output() fills in core */
+static void mc_batch_init(void *to, unsigned int count)
+{
+    struct mc_batch b = {
+        .version = MC_WIRE_VERSION,
+        .count = cpu_to_le16(count),
+    };
+
+    memcpy(to, &b, sizeof(b));
+}
+
+/*
+ * [mc_ether_output] Send skb, the datagram, to core owner_ip as an
+ * ETH_P_MODELNET frame, no IP or UDP header, to the core's MAC.  rt is
+ * the route to the core.  Returns 1, and leaves skb and rt to the
+ * caller, if the core is not on the link of an ethernet, its address
+ * is not resolved (UDP resolves it) or skb does not fit a frame.  Else
+ * consumes both and returns 0 or -errno.
+ */
+static int mc_ether_output(struct mn_net *mnet, struct sk_buff *skb,
+                           struct rtable *rt, in_addr_t owner_ip)
+{
+    struct net_device *dev = rt->dst.dev;
+    struct neighbour *neigh;
+    char ha[MAX_ADDR_LEN];
+    int err;
+
+    if (rt->rt_gateway != owner_ip || dev->type != ARPHRD_ETHER ||
+        skb->len > dev->mtu)
+        return 1;
+    rcu_read_lock();
+    neigh = dst_get_neighbour_noref(&rt->dst);
+    if (!neigh || !(neigh->nud_state & NUD_VALID)) {
+        rcu_read_unlock();
+        return 1;
+    }
+    neigh_ha_snapshot(ha, neigh, dev);
+    rcu_read_unlock();
+
+    nf_reset(skb);
+    skb_dst_drop(skb);
+    ip_rt_put(rt);
+    skb->dev = dev;
+    skb->protocol = htons(ETH_P_MODELNET);
+    skb->ip_summed = CHECKSUM_NONE;
+    skb_reset_network_header(skb);
+    if (dev_hard_header(skb, dev, ETH_P_MODELNET, ha, NULL, skb->len) < 0) {
+        mnet->mn.stats.mc_errs++;
+        kfree_skb(skb);
+        return -EINVAL;
+    }
+    mnet->mn.stats.mc_frames++;
+    err = dev_queue_xmit(skb);
+    if (err) {
+        mnet->mn.stats.mc_errs++;
+        err = net_xmit_errno(err);
+    }
+    return err;
+}
+
+/*
+ * [mc_output] Send skb, whose data is the UDP payload, an mc_batch
+ * and its records, to core owner_ip.  With mcether set, as a frame if
+ * the core is on the link.  Consumes skb.  Returns 0 or -errno.
+ */
+static int mc_output(struct mn_net *mnet, struct sk_buff *skb,
+                     in_addr_t owner_ip)
+{
+    struct rtable *rt;
+    struct flowi4 fl4;
+    struct iphdr *iph;
+    struct udphdr *uh;
+    unsigned int len;
+    int err;
+
+    memset(&fl4, 0, sizeof(fl4));
+    fl4.daddr = owner_ip;
+    fl4.flowi4_proto = IPPROTO_UDP;
+    rt = ip_route_output_key(mnet->net, &fl4);
+    if (IS_ERR(rt)) {
+        err = PTR_ERR(rt);
+        goto error;
+    }
+    if (skb_cow_head(skb, MC_HDRLEN + LL_RESERVED_SPACE(rt->dst.dev))) {
+        ip_rt_put(rt);
+        err = -ENOMEM;
+        goto error;
+    }
+
+    ((struct mc_batch *)skb->data)->core = fl4.saddr;
+    if (mnet->mn.mc_ether) {
+        err = mc_ether_output(mnet, skb, rt, owner_ip);
+        if (err <= 0)
+            return err;
+    }
+
+    nf_reset(skb);
+    skb_dst_drop(skb);
+    skb_dst_set(skb, &rt->dst);
+    skb->ip_summed = CHECKSUM_NONE;
+    skb->protocol = htons(ETH_P_IP);
+
+    len = skb->len + sizeof(struct udphdr);
+    uh = (struct udphdr *)skb_push(skb, sizeof(struct udphdr));
+    skb_reset_transport_header(skb);
+    uh->source = uh->dest = htons(remote_port);
+    uh->len = htons(len);
+    uh->check = 0;
+
+    iph = (struct iphdr *)skb_push(skb, sizeof(struct iphdr));
+    skb_reset_network_header(skb);
+    iph->version = 4;
+    iph->ihl = sizeof(struct iphdr) >> 2;
+    iph->tos = 0;
+    iph->frag_off = 0;          /* may be fragmented, it is over MTU */
+    iph->ttl = ip4_dst_hoplimit(&rt->dst);
+    iph->protocol = IPPROTO_UDP;
+    iph->saddr = fl4.saddr;
+    iph->daddr = fl4.daddr;
+    ip_select_ident(iph, &rt->dst, NULL);
+
+    uh->check = csum_tcpudp_magic(iph->saddr, iph->daddr, len, IPPROTO_UDP,
+                                  skb_checksum(skb, sizeof(struct iphdr),
+                                               len, 0));
+    if (!uh->check)
+        uh->check = CSUM_MANGLED_0;
+
+    /* sets tot_len and the header checksum */
+    err = ip_local_out(skb);
+    if (err) {
+        mnet->mn.stats.mc_errs++;
+        err = net_xmit_errno(err);
+    }
+    return err;
+
+ error:
+    mnet->mn.stats.mc_errs++;
+    kfree_skb(skb);
+    return err;
+}
+
+/* send what the slot gathered */
+static void mc_agg_send(struct mn_net *mnet, struct mc_agg *a)
+{
+    mnet->mn.stats.mc_batches++;
+    atomic_dec(&mnet->mc_gathering);
+    mc_output(mnet, a->skb, a->core);
+    a->skb = NULL;
+}
+
+/*
+ * [mc_flush] Send every datagram being gathered, on all cpus.  Called
+ * at the end of each run of the calendar, so no packet waits for
+ * company longer than a tick.
+ */
+void mc_flush(struct mn_net *mnet)
+{
+    struct mc_aggtab *tab;
+    int cpu, i;
+
+    for_each_possible_cpu(cpu) {
+        tab = per_cpu_ptr(mnet->mc_agg, cpu);
+        spin_lock(&tab->lock);
+        for (i = 0; i < MN_MAX_CORES; ++i)
+            if (tab->slot[i].skb)
+                mc_agg_send(mnet, &tab->slot[i]);
+        spin_unlock(&tab->lock);
+    }
+}
+
+/*
+ * [mc_aggregate] Add pkt's record to the datagram for core owner_ip on
+ * this cpu, sending that first if the record would take it over
+ * mcaggregate bytes.  The record is copied, pkt is left to the caller;
+ * a cached packet's record is its digest alone.
+ * Returns -ENOBUFS if the record does not fit in any datagram or there
+ * is no memory for one, to send pkt on its own.
+ */
+static int mc_aggregate(struct packet *pkt, in_addr_t owner_ip)
+{
+    struct mn_net *mnet = pkt->mnet;
+    struct mc_aggtab *tab;
+    struct mc_agg *a;
+    unsigned int limit, len, payload, h, n;
+
+    limit = min_t(unsigned int, mnet->mn.mc_aggregate, MC_MAXAGG);
+    payload = MC_PKT_PCACHED(pkt) ? 0 : pkt->skb->len;
+    len = MC_DIGLEN + payload;
+    if (MC_BATCHLEN + len > limit)
+        return -ENOBUFS;
+
+    tab = this_cpu_ptr(mnet->mc_agg);
+    spin_lock(&tab->lock);
+
+    /* the core's slot or a free one after it, else bump the first */
+    h = hash_32(ntohl(owner_ip), ilog2(MN_MAX_CORES));
+    for (n = 0; n < MN_MAX_CORES; ++n) {
+        a = &tab->slot[(h + n) & (MN_MAX_CORES - 1)];
+        if (!a->skb || a->core == owner_ip)
+            break;
+    }
+    if (n == MN_MAX_CORES) {
+        a = &tab->slot[h];
+        mc_agg_send(mnet, a);
+    }
+
+    if (a->skb && a->skb->len + len > limit)
+        mc_agg_send(mnet, a);
+    if (!a->skb) {
+        a->skb = alloc_skb(LL_MAX_HEADER + MC_HDRLEN + limit, GFP_ATOMIC);
+        if (!a->skb) {
+            spin_unlock(&tab->lock);
+            return -ENOBUFS;
+        }
+        skb_reserve(a->skb, LL_MAX_HEADER + MC_HDRLEN);
+        mc_batch_init(skb_put(a->skb, MC_BATCHLEN), 0);
+        a->core = owner_ip;
+        atomic_inc(&mnet->mc_gathering);
+    }
+    le16_add_cpu(&((struct mc_batch *)a->skb->data)->count, 1);
+    mc_encode(&pkt->info, payload, skb_put(a->skb, MC_DIGLEN));
+    if (payload)
+        skb_copy_bits(pkt->skb, 0, skb_put(a->skb, payload), payload);
+    mnet->mn.stats.mc_send++;
+
+    spin_unlock(&tab->lock);
+    return 0;
+}
 
 /*
  * [remote_hop] Tunnel packet to another modelnet core.  Either hop to
  * another core for emulation or sending to home core.  All we care about
  * is owner_ip.
+ *
+ * Leaving home, the packet is stamped with its expiry and, with the
+ * cache on, cached there and only its digest sent; pkt then belongs to
+ * the cache, and the caller must not touch it again.  Otherwise, sent
+ * on its own, the packet's skb goes with it and pkt->skb is NULL on
+ * return; gathered, it is copied.  Either way the caller frees pkt.
+ * Returns 1 if pkt went to the cache, else 0 or -errno.
+ */
+int remote_hop(struct packet *pkt, in_addr_t owner_ip)
+{
+    struct mn_net *mnet = pkt->mnet;
+    struct sk_buff *skb = pkt->skb;
+    int cached = 0, err;
+
+    /*
+     * hop should never be zero
+     */
+    if (pkt->info.hop == 0) {
+        printk("remote_hop: trying to forward packet with hop==0, dropping.\n");
+        err = -EINVAL;
+        goto error;
+    }
+
+    if (MC_PKT_HOME(pkt)) {
+        pkt->info.expire = jiffies + msecs_to_jiffies(mnet->mn.mc_expire);
+        if (mnet->pcache)
+            cached = mc_pcache(pkt);
+    }
+    if (MC_PKT_PCACHED(pkt)) {
+        if (mnet->mn.mc_aggregate > 0 && !mc_aggregate(pkt, owner_ip))
+            return cached;
+
+        /* the digest goes alone */
+        skb = alloc_skb(LL_MAX_HEADER + MC_HDRLEN + MC_BATCHLEN + MC_DIGLEN,
+                        GFP_ATOMIC);
+        if (!skb) {
+            err = -ENOMEM;
+            goto error;
+        }
+        skb_reserve(skb, LL_MAX_HEADER + MC_HDRLEN);
+        mc_batch_init(skb_put(skb, MC_BATCHLEN), 1);
+        mc_encode(&pkt->info, 0, skb_put(skb, MC_DIGLEN));
+        mnet->mn.stats.mc_send++;
+        err = mc_output(mnet, skb, owner_ip);
+        if (err && cached)
+            mc_uncache(mnet, pkt->info.id);
+        return err ? err : cached;
+    }
+
+    if (!skb) {
+        printk("remote_hop: packet without payload, dropping.\n");
+        err = -EINVAL;
+        goto error;
+    }
+    if (skb_is_gso(skb)) {
+        /* would be segmented as if it were still TCP */
+        if (net_ratelimit())
+            printk("remote_hop: GRO packet, turn off gro on the emulator's nics\n");
+        err = -EINVAL;
+        goto error;
+    }
+
+    if (mnet->mn.mc_aggregate > 0 && !mc_aggregate(pkt, owner_ip))
+        return 0;
+
+    /* the packet becomes the payload of one of our own */
+    if (skb_cow_head(skb, MC_BATCHLEN + MC_DIGLEN)) {
+        err = -ENOMEM;
+        goto error;
+    }
+    mc_encode(&pkt->info, 1, skb_push(skb, MC_DIGLEN));
+    mc_batch_init(skb_push(skb, MC_BATCHLEN), 1);
+    pkt->skb = NULL;
+    mnet->mn.stats.mc_send++;
+    return mc_output(mnet, skb, owner_ip);
+
+ error:
+    if (cached)
+        mc_uncache(mnet, pkt->info.id);
+    mnet->mn.stats.mc_errs++;
+    return err;
+}
+
+/*
+ * [mc_input] Go on with the emulation of the packet in skb, its data
+ * the IP header, which came with info.  Consumes skb.  A digest comes
+ * without skb: away from home it goes on as a packet without payload,
+ * at home it is reunited with its payload.
+ */
+static void mc_input(struct mn_net *mnet, struct sk_buff *skb,
+                     struct remote_packet *info)
+{
+    struct packet  *pkt;
+    struct hop    **path;
+    struct iphdr   *iph;
+    unsigned long   i;
+    int             home;
+
+    if (skb) {
+        if (!pskb_may_pull(skb, sizeof(struct iphdr)))
+            goto error;
+        skb_reset_network_header(skb);
+        iph = ip_hdr(skb);
+        if (iph->version != 4 || ntohs(iph->tot_len) != skb->len ||
+            info->len != skb->len) {
+            printk("remote_input: garbled packet, %pI4 -> %pI4\n",
+                   &info->src, &info->dst);
+            goto error;
+        }
+        skb_set_transport_header(skb, iph->ihl << 2);
+        nf_reset(skb);
+        skb_dst_drop(skb);
+        skb->ip_summed = CHECKSUM_NONE;
+    } else if (!info->id)
+        goto error;
+
+    if (info->ttl-- <= 0) {
+        mnet->mn.stats.mc_ttldrops++;
+        kfree_skb(skb);
+        return;
+    }
+
+    /*
+     * XXX lookup_path happens for each new core in path
+     */
+    path = mn_model_lookup(&mnet->model, MODEL_FORCEOFF(info->src),
+                           info->dst);
+    for (i = 0; path && i < info->hop; ++i)
+        if (!path[i])
+            path = NULL;
+    home = path && info->hop && !path[0]->emulator;
+    /* a digest comes home at the end of its path too */
+    if (!path || !info->hop || (!path[info->hop] && !(home && info->id))) {
+        printk("remote_input: no hop %lu on path %pI4 -> %pI4\n",
+               info->hop, &info->src, &info->dst);
+        goto error;
+    }
+
+    if (home && info->id) {
+        pkt = mc_uncache(mnet, info->id);
+        if (!pkt)
+            goto error;
+        if (time_after_eq(jiffies, pkt->info.expire)) {
+            mnet->mn.stats.mc_exdrops++;
+            MN_FREE_PKT(pkt);
+            return;
+        }
+        pkt->info.hop = info->hop;
+        pkt->info.wait_time = info->wait_time;
+        pkt->info.ttl = info->ttl;
+        pkt->path = path + info->hop;
+        pkt->state = 0;
+        emulate_nexthop(pkt, 1);
+        return;
+    }
+
+    /* back home, after too long? */
+    if (home && time_after_eq(jiffies, info->expire)) {
+        mnet->mn.stats.mc_exdrops++;
+        kfree_skb(skb);
+        return;
+    }
+
+    pkt = kmalloc(sizeof(struct packet), GFP_ATOMIC);
+    if (!pkt)
+        goto error;
+    pkt->skb = skb;
+    pkt->mnet = mnet;
+    pkt->info = *info;
+    pkt->cachehost = path[0]->emulator;
+    pkt->path = path + info->hop;
+    pkt->state = 0;
+    pkt->flow.used = 0;
+    pkt->qticks = 0;
+    pkt->qmem = 0;
+    if (mn_qmem_charge(pkt)) {
+        MN_FREE_PKT(pkt);
+        return;
+    }
+
+    emulate_nexthop(pkt, 1);
+    return;
+
+ error:
+    mnet->mn.stats.mc_errs++;
+    kfree_skb(skb);
+}
+
+/*
+ * [mc_receive] Go on with the emulation of each packet in the
+ * datagram in skb, its data the mc_batch, however it came.  Consumes
+ * skb.
+ */
+static void mc_receive(struct mn_net *mnet, struct sk_buff *skb)
+{
+    struct remote_packet info;
+    struct mc_batch batch;
+    struct sk_buff *one;
+    unsigned int    count;
+    int             payload;
+
+    if (!pskb_may_pull(skb, MC_BATCHLEN))
+        goto error;
+    memcpy(&batch, skb->data, MC_BATCHLEN);
+    if (batch.version != MC_WIRE_VERSION) {
+        if (net_ratelimit())
+            printk("remote_input: wire version %u from %pI4, ours is %u\n",
+                   batch.version, &batch.core, MC_WIRE_VERSION);
+        goto error;
+    }
+    __skb_pull(skb, MC_BATCHLEN);
+
+    /* one record per packet, the last one keeps skb */
+    for (count = le16_to_cpu(batch.count); count; --count) {
+        if (!pskb_may_pull(skb, MC_DIGLEN))
+            goto error;
+        payload = mc_decode(skb->data, &info);
+        __skb_pull(skb, MC_DIGLEN);
+        mnet->mn.stats.mc_recv++;
+        if (!payload) {
+            /* a digest, its payload is at home */
+            mc_input(mnet, NULL, &info);
+            continue;
+        }
+        if (info.len > skb->len)
+            goto error;
+
+        if (count == 1) {
+            /* a short frame comes padded */
+            if (pskb_trim(skb, info.len))
+                goto error;
+            skb->protocol = htons(ETH_P_IP);
+            mc_input(mnet, skb, &info);
+            return;
+        }
+        one = alloc_skb(LL_MAX_HEADER + info.len, GFP_ATOMIC);
+        if (!one)
+            goto error;
+        skb_reserve(one, LL_MAX_HEADER);
+        skb_copy_bits(skb, 0, skb_put(one, info.len), info.len);
+        one->dev = skb->dev;
+        one->protocol = htons(ETH_P_IP);
+        one->pkt_type = PACKET_HOST;
+        if (!pskb_pull(skb, info.len)) {
+            kfree_skb(one);
+            goto error;
+        }
+        mc_input(mnet, one, &info);
+    }
+    kfree_skb(skb);
+    return;
+
+ error:
+    mnet->mn.stats.mc_errs++;
+    kfree_skb(skb);
+}
+
+/*
+ * [remote_input] Packets from peer, netfilter hook at LOCAL_IN, where
+ * the datagram is reassembled.  Takes UDP to remote_port on a
+ * namespace with a model, and goes on with the emulation of each
+ * packet inside it.
  */
-int
-remote_hop(struct packet * pkt, in_addr_t owner_ip)
+unsigned int remote_input(unsigned int hooknum,
+                          struct sk_buff *skb,
+                          const struct net_device *in,
+                          const struct net_device *out,
+                          int (*okfn)(struct sk_buff *))
 {
-    printk ("Remote hop is not implemented in this release\n");
-    return -1;
+    struct mn_net  *mnet;
+    struct iphdr   *iph = ip_hdr(skb);
+    struct udphdr  *uh;
+    int             ihl = iph->ihl << 2;
+
+    if (iph->protocol != IPPROTO_UDP)
+        return NF_ACCEPT;
+    mnet = mn_pernet(dev_net(in ? in : skb->dev));
+    if (!mnet->model.hoptable)
+        return NF_ACCEPT;
+    if (!pskb_may_pull(skb, ihl + sizeof(struct udphdr)))
+        return NF_ACCEPT;
+    uh = (struct udphdr *)(skb->data + ihl);
+    if (uh->dest != htons(remote_port))
+        return NF_ACCEPT;
+
+    if (!udp_validate(skb, ihl)) {
+        mnet->mn.stats.mc_errs++;
+        kfree_skb(skb);
+        return NF_STOLEN;
+    }
+    __skb_pull(skb, ihl + sizeof(struct udphdr));
+    mc_receive(mnet, skb);
+    return NF_STOLEN;
+}
+
+/*
+ * [mc_ether_input] Frames from peer, packet_type handler for
+ * ETH_P_MODELNET, ahead of the IP stack.  Takes those sent to us on a
+ * namespace with a model.
+ */
+int mc_ether_input(struct sk_buff *skb, struct net_device *dev,
+                   struct packet_type *pt, struct net_device *orig_dev)
+{
+    struct mn_net *mnet = mn_pernet(dev_net(dev));
+
+    if (skb->pkt_type != PACKET_HOST || !mnet->model.hoptable)
+        goto drop;
+    skb = skb_share_check(skb, GFP_ATOMIC);
+    if (!skb)
+        return NET_RX_DROP;
+    mc_receive(mnet, skb);
+    return NET_RX_SUCCESS;
+
+ drop:
+    kfree_skb(skb);
+    return NET_RX_DROP;
 }
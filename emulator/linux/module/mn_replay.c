@@ -0,0 +1,268 @@
+/*
+ * modelnet mn_replay.c
+ *
+ *    deterministic mode and the arrival log
+ *
+ * Copyright (c) 2006
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in
+ *      the documentation and/or other materials provided with the
+ *      distribution.
+ *    * Neither the names of Duke University nor The University of
+ *      California, San Diego, nor the names of the authors or contributors
+ *      may be used to endorse or promote products derived from
+ *      this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE
+ * USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ * 
+ */
+
+/*
+ * Deterministic mode, so a run can be repeated exactly, e.g. to bisect
+ * a change in the application under test.
+ *
+ * What a local hop does with a packet depends on the tick it arrives,
+ * the hop's state and the hop's random stream (mn_hop_random()).  The
+ * streams depend only on the seed.  What is left is the arrivals: when
+ * packets come in and, within a tick, in which order they reach each
+ * hop.  Normally packets are emulated on whatever cpu receives them,
+ * so that order is a race.  With deterministic set, emulate_path()
+ * instead parks a packet on mnet->ingress with its arrival tick, and
+ * mn_drain() emulates each tick's arrivals here, before draining that
+ * tick's slot, under the calendar lock and sorted by 5-tuple, IP id
+ * and length.  Every decision on a
+ * local hop is then a function of the model, the seed and the
+ * arrivals.  Setting the seed restarts the streams and the virtual
+ * time base, vbase.
+ *
+ * The arrival log records those arrivals, tick relative to vbase, in
+ * the order they were emulated.  With the model and the seed it is
+ * what a replay needs.  Hops on other emulators are not covered.
+ */
+
+#include <linux/module.h>
+#include <linux/init.h>
+
+#include <linux/ip.h>
+#include <linux/skbuff.h>
+#include <linux/list_sort.h>
+#include <linux/log2.h>
+
+#include <linux/vmalloc.h>
+#include <asm/uaccess.h>
+
+#include "ip_modelnet.h"
+#include "mn_flow.h"
+#include "mn_replay.h"
+
+static void mn_arrival_fill(struct packet *pkt, struct sysctl_arrival *rec,
+			    unsigned long tick)
+{
+    memset(rec, 0, sizeof(*rec));
+    rec->tick = tick;
+    mn_flow_key(pkt, &rec->key);
+    rec->ipid = ip_hdr(pkt->skb)->id;
+    rec->len = pkt->info.len;
+}
+
+/* the order arrivals of one tick are emulated in */
+static int mn_arrival_cmp(void *priv, struct list_head *a, struct list_head *b)
+{
+    struct sysctl_arrival ra, rb;
+
+    mn_arrival_fill(list_entry(a, struct packet, list), &ra, 0);
+    mn_arrival_fill(list_entry(b, struct packet, list), &rb, 0);
+    return memcmp(&ra.key, &rb.key, offsetof(struct sysctl_arrival, pad) -
+		  offsetof(struct sysctl_arrival, key));
+}
+
+
+/*
+ * [mn_replay_ingress]
+ *
+ * Emulate the arrivals due at tick, logging them.  Called from
+ * mn_drain() with the calendar lock held.
+ */
+
+void mn_replay_ingress(struct mn_net *mnet, unsigned long tick)
+{
+    struct list_head *pos, *q;
+    struct packet *pkt;
+    LIST_HEAD(due);
+
+    list_for_each_safe (pos, q, &mnet->ingress) {
+	pkt = list_entry(pos, struct packet, list);
+	if (!time_after(pkt->arrival, tick))
+	    list_move_tail(pos, &due);
+    }
+    list_sort(NULL, &due, mn_arrival_cmp);
+
+    list_for_each_safe (pos, q, &due) {
+	pkt = list_entry(pos, struct packet, list);
+	list_del(pos);
+	if (mnet->arrivals) {
+	    if (mnet->arrival_head - mnet->arrival_tail > mnet->arrival_mask)
+		++mnet->arrivals_lost;
+	    else
+		mn_arrival_fill(pkt, mnet->arrivals +
+				(mnet->arrival_head++ & mnet->arrival_mask),
+				tick - mnet->vbase);
+	}
+	emulate_nexthop(pkt, 0);
+    }
+}
+
+void mn_replay_uninit(struct mn_net *mnet)
+{
+    vfree(mnet->arrivals);
+    mnet->arrivals = NULL;
+}
+
+
+/*
+ * [proc_seed]
+ *
+ * Reads or sets the seed of the hops' random streams.  Setting it
+ * restarts every stream and the background on/off cycles, empties the
+ * arrival log and makes the current tick virtual time 0.  Set it with
+ * the model loaded and before any traffic.
+ */
+
+int proc_seed(ctl_table *table, int write,
+	      void __user *buffer, size_t *lenp, loff_t *ppos)
+{
+    struct mn_net *mnet = table->extra1;
+    ctl_table tmp = *table;
+    unsigned long seed = mnet->seed;
+    struct hop *hop;
+    int i, err;
+
+    tmp.data = &seed;
+    err = proc_doulongvec_minmax(&tmp, write, buffer, lenp, ppos);
+    if (err || !write)
+	return err;
+
+    spin_lock_bh(&mnet->calendar_lock);
+    mnet->seed = seed;
+    mnet->vbase = mnet->calendar.tick;
+    mnet->arrival_head = mnet->arrival_tail = 0;
+    mnet->arrivals_lost = 0;
+    for (i = 0; i < mnet->model.hopcount; ++i) {
+	hop = mnet->model.hoptable + i;
+	spin_lock(&hop->lock);
+	mn_hop_rekey(hop, seed);
+	if (hop->bg_bps) {
+	    hop->bg_on = 1;
+	    hop->bg_toggle = mnet->vbase + hop->bg_on_ticks;
+	}
+	spin_unlock(&hop->lock);
+    }
+    spin_unlock_bh(&mnet->calendar_lock);
+    return 0;
+}
+
+
+/*
+ * [proc_arrivalslots]
+ *
+ * Reads or sets the size of the arrival log, rounded up to a power of
+ * 2; 0 turns it off.  Resizing empties it.
+ */
+
+int proc_arrivalslots(ctl_table *table, int write,
+		      void __user *buffer, size_t *lenp, loff_t *ppos)
+{
+    struct mn_net *mnet = table->extra1;
+    ctl_table tmp = *table;
+    struct sysctl_arrival *log = NULL, *old;
+    int slots, err;
+
+    slots = mnet->arrivals ? mnet->arrival_mask + 1 : 0;
+    tmp.data = &slots;
+    err = proc_dointvec(&tmp, write, buffer, lenp, ppos);
+    if (err || !write)
+	return err;
+
+    if (slots < 0 || slots > MN_ARRIVAL_MAXSLOTS)
+	return -EINVAL;
+    if (slots) {
+	slots = roundup_pow_of_two(slots);
+	log = vmalloc(slots * sizeof(*log));
+	if (!log)
+	    return -ENOMEM;
+    }
+
+    spin_lock_bh(&mnet->calendar_lock);
+    old = mnet->arrivals;
+    mnet->arrivals = log;
+    mnet->arrival_mask = slots - 1;
+    mnet->arrival_head = mnet->arrival_tail = 0;
+    mnet->arrivals_lost = 0;
+    spin_unlock_bh(&mnet->calendar_lock);
+    vfree(old);
+    return 0;
+}
+
+
+/*
+ * [proc_arrivals]
+ *
+ * Hands over as many logged arrivals as fit in the read, oldest first,
+ * and frees their slots.  Read until it returns nothing.
+ */
+
+int proc_arrivals(ctl_table *table, int write,
+		  void __user *buffer, size_t *lenp, loff_t *ppos)
+{
+    struct mn_net *mnet = table->extra1;
+    struct sysctl_arrival *buf;
+    size_t max, n = 0;
+
+    if (write)
+	return -EINVAL;
+    if (*ppos || !mnet->arrivals) {
+	*lenp = 0;
+	return 0;
+    }
+
+    max = min_t(size_t, *lenp / sizeof(*buf),
+		(size_t)mnet->arrival_mask + 1);
+    if (!max) {
+	*lenp = 0;
+	return 0;
+    }
+    buf = vmalloc(max * sizeof(*buf));
+    if (!buf)
+	return -ENOMEM;
+
+    spin_lock_bh(&mnet->calendar_lock);
+    while (n < max && mnet->arrivals &&
+	   mnet->arrival_tail != mnet->arrival_head)
+	buf[n++] = mnet->arrivals[mnet->arrival_tail++ & mnet->arrival_mask];
+    spin_unlock_bh(&mnet->calendar_lock);
+
+    if (n && copy_to_user(buffer, buf, n * sizeof(*buf))) {
+	vfree(buf);
+	return -EFAULT;
+    }
+    vfree(buf);
+    *lenp = n * sizeof(*buf);
+    *ppos += *lenp;
+    return 0;
+}
@@ -0,0 +1,104 @@
+/*
+ * modelnet  mn_ring.h
+ *
+ *     layout of the per-cpu packet capture rings shared between the
+ *     module (mn_tcpdump.c) and the mntrace collector
+ *
+ * Copyright (c) 2006
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in
+ *      the documentation and/or other materials provided with the
+ *      distribution.
+ *    * Neither the names of Duke University nor The University of
+ *      California, San Diego, nor the names of the authors or contributors
+ *      may be used to endorse or promote products derived from
+ *      this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE
+ * USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+/*
+ * Every cpu has its own ring, so capture needs no lock: only code
+ * running on that cpu with bottom halves off writes it, and a single
+ * collector reads it.  /dev/mntrace maps the rings one after the other,
+ * ring i at offset i * (data_offset + data_size); cpus that are not
+ * possible have no ring and fail with ENXIO.  Each mapping starts
+ * with a struct mn_ring_hdr; records follow at data_offset.
+ *
+ * head and tail count bytes since the ring was created.  The kernel
+ * writes a record, then advances head; the collector reads records up
+ * to head, then advances tail.  Everything but tail is written by the
+ * kernel only for the collector to read; the kernel keeps its own copy
+ * and ignores a tail that is ahead of head or more than a ring behind
+ * it, dropping records until the collector fixes it.  A record never
+ * wraps: when it does not fit before the end of the ring the kernel
+ * fills the rest with a MN_REC_PAD record and starts again at the
+ * beginning.  When the ring is full the record is dropped and counted
+ * in drops.
+ */
+
+#ifndef _MN_RING_H
+#define _MN_RING_H
+
+#include <linux/types.h>
+
+#define MN_RING_MAGIC    0x6d6e7472     /* "mntr" */
+#define MN_RING_VERSION  1
+#define MN_RING_DEV      "mntrace"      /* /dev/mntrace */
+
+struct mn_ring_hdr {
+    __u32           magic;
+    __u32           version;
+    __u32           cpu;
+    __u32           data_offset;    /* records start here, page aligned */
+    __u32           data_size;      /* bytes of records, power of 2 */
+    __u32           nr_rings;       /* rings mapped, some may be absent */
+    __u64           head __attribute__((aligned(64)));  /* kernel */
+    __u64           drops;          /* records lost to a full ring */
+    __u64           tail __attribute__((aligned(64)));  /* collector */
+};
+
+#define MN_REC_PKT       1
+#define MN_REC_PAD       2      /* skip to the start of the ring */
+
+#define MN_REC_PLRDROP   0x1    /* dropped by the hop's loss rate */
+#define MN_REC_QDROP     0x2    /* dropped by the hop's full queue */
+
+/*
+ * One captured packet, followed by captureLength bytes starting at the
+ * IP header.  reclen covers both, rounded up to MN_REC_ALIGN.
+ */
+struct mn_tcpdump_hdr {
+    __u32           reclen;
+    __u16           type;
+    __u16           flags;
+    __u64           tstamp;         /* ns since the epoch */
+    __u32           linkId;         /* hop id */
+    __u32           packetLength;
+    __u32           captureLength;
+    __u32           pad;
+};
+
+#define MN_REC_ALIGN     8
+#define MN_REC_LEN(caplen) \
+    ((sizeof(struct mn_tcpdump_hdr) + (caplen) + MN_REC_ALIGN - 1) & \
+     ~(MN_REC_ALIGN - 1))
+
+#endif                          /* _MN_RING_H */
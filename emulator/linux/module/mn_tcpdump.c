@@ -33,219 +33,473 @@
  * 
  */
 
-#ifdef MN_TCPDUMP
-
 #include <linux/module.h>
 #include <linux/init.h>
+#include <linux/mutex.h>
 
 #include <linux/netfilter_ipv4.h>
 #include <linux/ip.h>
+#include <linux/in.h>
+#include <linux/skbuff.h>
 
 #include <linux/vmalloc.h>
+#include <linux/mm.h>
+#include <linux/fs.h>
+#include <linux/poll.h>
+#include <linux/miscdevice.h>
+#include <linux/percpu.h>
 
 #include "ip_modelnet.h"
 #include "mn_tcpdump.h"
-
-/* Used eventually push out buffer when not much data is flowing */
-unsigned int tcpdump_tick_counter=0;
+#include "mn_ring.h"
 
 int traceLinkCount = 0;
 
-static unsigned char *tempPtr = NULL;
-static unsigned char * tcpdump_holdbuf = NULL;
-static unsigned char * tcpdump_storebuf = NULL;
-static unsigned int tcpdump_holdbuf_len=0;
-static unsigned int tcpdump_storebuf_len=0;
-
-static int tcpdump_dropcount = 0;
-static unsigned int tcpdump_capturelength = 50;
-
-static DECLARE_WAIT_QUEUE_HEAD(tcpdump_wait_queue);
+/*
+ * Tracing is switched per hop at run time, so there is no separate
+ * MN_TCPDUMP build any more.  mn_trace_key counts the traced hops;
+ * while it is zero the check in emulate_hop() is a patched-out jump.
+ * mn_trace_mutex keeps traceLink, the key and traceLinkCount in step,
+ * and guards creation of the rings.
+ */
+struct static_key mn_trace_key = STATIC_KEY_INIT_FALSE;
+static DEFINE_MUTEX(mn_trace_mutex);
 
-#define MN_TCPDUMP_CTL_ID 600
+/*
+ * Captured packets go to per-cpu rings (see mn_ring.h) that a
+ * collector such as mntrace maps through /dev/mntrace.  The rings are
+ * only created when the first hop is traced and live until unload.
+ */
+static unsigned int ring_kb = 1024;
+module_param(ring_kb, uint, 0444);
+MODULE_PARM_DESC(ring_kb, "KB of capture ring per cpu (rounded up to a power of 2)");
 
-#define ROTATE_TCPDUMP_BUFFERS() \
-tempPtr = tcpdump_holdbuf; \
-tcpdump_holdbuf = tcpdump_storebuf; \
-tcpdump_holdbuf_len = tcpdump_storebuf_len; \
-tcpdump_storebuf = tempPtr; \
-tcpdump_storebuf_len = 0;
+/*
+ * The header page is writable by the collector, so the kernel keeps
+ * its own copy of everything it relies on and only publishes it there;
+ * tail is the one field it reads back.
+ */
+struct mn_ring {
+    struct mn_ring_hdr *hdr;
+    u64             head;
+    u64             drops;
+};
 
+static DEFINE_PER_CPU(struct mn_ring, mn_ring);
+static unsigned long mn_ring_bytes;     /* one ring: header page + data */
+static unsigned long mn_ring_size;      /* its data, a power of 2 */
+static int mn_rings_ready;
+static DECLARE_WAIT_QUEUE_HEAD(mn_ring_wait);
 
-struct mn_tcpdump_hdr 
-{
-  struct timeval tv;
-  unsigned int linkId;
-  unsigned int	packetLength;
-  unsigned int captureLength;
-};
+static unsigned int tcpdump_capturelength = 50;
 
-static int proc_read_dumps(ctl_table *table, int write,
-			   void __user *buffer, size_t *lenp, loff_t *ppos);
+static int proc_dropcount(ctl_table *table, int write,
+			  void __user *buffer, size_t *lenp, loff_t *ppos);
 
 ctl_table mn_tcpdump_table[] = {
     {
-	.ctl_name = MN_TCPDUMP_CTL_ID,
 	.procname = "dropcount", /* kernel-esque naming */
-	.data = &tcpdump_dropcount,
+	.data = NULL,
 	.maxlen = sizeof(int),
 	.mode = 0444, /* read-only */
 	.child = NULL,
-	.proc_handler = &proc_dointvec,
-	.strategy = &sysctl_intvec,
+	.proc_handler = &proc_dropcount,
     },
     {
-	.ctl_name = MN_TCPDUMP_CTL_ID+1,
 	.procname = "capturelength",/* kernel-esque naming */
 	.data = &tcpdump_capturelength,
 	.maxlen = sizeof(unsigned int),
 	.mode = 0666, /* read-write */
 	.child = NULL,
 	.proc_handler = &proc_dointvec,
-	.strategy = &sysctl_intvec,
     },
     {
-	.ctl_name = MN_TCPDUMP_CTL_ID+2,
 	.procname = "tracelinkcount",/* kernel-esque naming */
 	.data = &traceLinkCount,
 	.maxlen = sizeof(unsigned int),
 	.mode = 0444, /* read only */
 	.child = NULL,
 	.proc_handler = &proc_dointvec,
-	.strategy = &sysctl_intvec,
-    },
-    {
-	.ctl_name = MN_TCPDUMP_CTL_ID+3,
-	.procname = "dumps",
-	.data = NULL,
-	.maxlen = 0,
-	.mode = 0444,
-	.child = NULL,
-	.proc_handler = &proc_read_dumps,
-	.strategy = NULL,
     },
     {0}
 };
 
 
-inline void tcpdump_handle_inactivity( void ) 
+/*
+ * [proc_dropcount]
+ *
+ * Packets lost because a ring was full, summed over all cpus.
+ */
+
+static int proc_dropcount(ctl_table *table, int write,
+			  void __user *buffer, size_t *lenp, loff_t *ppos)
 {
-    tcpdump_tick_counter = 0;
-    if ((tcpdump_holdbuf_len == 0) && (tcpdump_storebuf_len != 0)) {
-	ROTATE_TCPDUMP_BUFFERS();
-	wake_up(&tcpdump_wait_queue);
-    }    
+    ctl_table tmp = *table;
+    int cpu, drops = 0;
+
+    if (mn_rings_ready)
+	for_each_possible_cpu(cpu)
+	    drops += per_cpu(mn_ring, cpu).drops;
+
+    tmp.data = &drops;
+    return proc_dointvec(&tmp, write, buffer, lenp, ppos);
 }
 
+
 /*
- * [proc_read_dumps]
+ * [mn_ring_free]
  *
- * @table:
- * @write:
- * @filep:
- * @buffer:
- * @lenp:
- * @ppos: 
- * 
- * handler for proc file system when user does a read on
- * /proc/sys/modelnet/tcpdump/dumps.  Copies data from the hold buf to
- * user space.  If the entire buffer is finished, it resets ppos to
- * the beginning of file.  A user program reading that proc file will
- * never reach an EOF, rather it will just block waiting for more data
+ * Frees the capture rings.  Only at unload, when nothing can map them.
  */
 
-static int proc_read_dumps(ctl_table *table, int write,
-			   void __user *buffer, size_t *lenp, loff_t *ppos)
+static void mn_ring_free( void )
 {
-    unsigned long bytes_not_copied, bytes_copied;
-    unsigned int copy_amount=0;
+    int cpu;
 
-    if (write) {
-	printk("Should not write\n");
-	*lenp = 0;
-	return -EINVAL;
-    }
-    
-    if ((*ppos >= tcpdump_holdbuf_len) &&
-	tcpdump_holdbuf_len) 
-    {
-	*lenp = 0;
-	return 0;
+    for_each_possible_cpu(cpu) {
+	vfree(per_cpu(mn_ring, cpu).hdr);
+	per_cpu(mn_ring, cpu).hdr = NULL;
     }
+    mn_rings_ready = 0;
+}
 
-    /* XXX - how to determine if wait_event_interruptible returned b/c
-     * of an interrupt or b/c of data.  This current implementation
-     * will behave correctly unless we have >1 consumer of
-     * tcpdump_holdbuf, which means more than 1 program is reading
-     * from the proc file system ...*/
 
-    wait_event_interruptible(tcpdump_wait_queue, 
-			     (tcpdump_holdbuf_len != 0));
+/*
+ * [mn_ring_alloc]
+ *
+ * Creates a ring for every possible cpu.  Called with mn_trace_mutex
+ * held.  Without rings, traced hops still fire tracepoints but capture
+ * nothing.
+ */
 
-    
-    if (tcpdump_holdbuf_len == 0) {
-	printk ("We returned from wait_event but nothin in queue\n");
-	return -EINVAL;
+static int mn_ring_alloc( void )
+{
+    struct mn_ring_hdr *ring;
+    unsigned long data_size = PAGE_SIZE;
+    int cpu;
+
+    while (data_size < ring_kb * 1024UL)
+	data_size <<= 1;
+    mn_ring_size = data_size;
+    mn_ring_bytes = PAGE_SIZE + data_size;
+
+    for_each_possible_cpu(cpu) {
+	/* vmalloc_user zeroes the ring and lets us map it */
+	ring = vmalloc_user(mn_ring_bytes);
+	if (!ring) {
+	    printk("mn_ring_alloc: no memory for %lu KB capture rings\n",
+		   mn_ring_bytes / 1024);
+	    mn_ring_free();
+	    return -ENOMEM;
+	}
+	ring->magic = MN_RING_MAGIC;
+	ring->version = MN_RING_VERSION;
+	ring->cpu = cpu;
+	ring->data_offset = PAGE_SIZE;
+	ring->data_size = data_size;
+	ring->nr_rings = nr_cpu_ids;
+	per_cpu(mn_ring, cpu).hdr = ring;
+	per_cpu(mn_ring, cpu).head = 0;
+	per_cpu(mn_ring, cpu).drops = 0;
     }
+    mn_rings_ready = 1;
+    return 0;
+}
 
-    copy_amount = min(tcpdump_holdbuf_len-((unsigned int)*ppos), 
-					   (unsigned int)(*lenp));
 
-    bytes_not_copied = copy_to_user(buffer,
-				    tcpdump_holdbuf + (*ppos),
-				    copy_amount);
-    bytes_copied = copy_amount - bytes_not_copied;
-    
-/*     printk("cpyamt: %d, bytes_copied: %d, holdbuf_len:%d, lenp:%d, ppos:%d\n", */
-/* 	   copy_amount, bytes_copied, tcpdump_holdbuf_len, *lenp, *ppos); */
+/*
+ * [mn_ring_mmap]
+ *
+ * Maps ring i at offset i * mn_ring_bytes of /dev/mntrace, read-write
+ * so the collector can advance tail.
+ */
 
-    *ppos += bytes_copied;
-    *lenp = bytes_copied;
+static int mn_ring_mmap(struct file *file, struct vm_area_struct *vma)
+{
+    unsigned long pages, cpu;
+    int err = -ENXIO;
+
+    mutex_lock(&mn_trace_mutex);
+    if (!mn_rings_ready)
+	goto out;
+    pages = mn_ring_bytes >> PAGE_SHIFT;
+    cpu = vma->vm_pgoff / pages;
+    err = -EINVAL;
+    if (vma->vm_pgoff % pages || vma->vm_end - vma->vm_start > mn_ring_bytes)
+	goto out;
+    err = -ENXIO;
+    if (cpu >= nr_cpu_ids || !cpu_possible(cpu))
+	goto out;
+    err = remap_vmalloc_range(vma, per_cpu(mn_ring, cpu).hdr, 0);
+out:
+    mutex_unlock(&mn_trace_mutex);
+    return err;
+}
 
-    /* If the client reads to the end of the buffer, then we know this
-     * buffer is done with 
-     */
 
-    if (*ppos >= tcpdump_holdbuf_len) {
-	local_bh_disable(); tcpdump_holdbuf_len = 0; local_bh_enable();
-	*ppos = 0; /* Reset file position to 0, user will never reach
-		      EOF */
-    }
+/*
+ * [mn_ring_poll]
+ *
+ * Readable when some ring holds records.
+ */
+
+static unsigned int mn_ring_poll(struct file *file, poll_table *wait)
+{
+    struct mn_ring *ring;
+    int cpu;
 
+    poll_wait(file, &mn_ring_wait, wait);
+    if (!mn_rings_ready)
+	return 0;
+    for_each_possible_cpu(cpu) {
+	ring = &per_cpu(mn_ring, cpu);
+	if (ACCESS_ONCE(ring->head) != ACCESS_ONCE(ring->hdr->tail))
+	    return POLLIN | POLLRDNORM;
+    }
     return 0;
 }
 
 
+/*
+ * [mn_trace_tick]
+ *
+ * Called by hopclock while any hop is traced, so capture itself never
+ * has to wake anybody.
+ */
+
+void mn_trace_tick( void )
+{
+    if (waitqueue_active(&mn_ring_wait))
+	wake_up_interruptible(&mn_ring_wait);
+}
+
+
+static const struct file_operations mn_ring_fops = {
+    .owner = THIS_MODULE,
+    .mmap = mn_ring_mmap,
+    .poll = mn_ring_poll,
+};
+
+static struct miscdevice mn_ring_dev = {
+    .minor = MISC_DYNAMIC_MINOR,
+    .name = MN_RING_DEV,
+    .fops = &mn_ring_fops,
+};
+
+
 /* 
- * [init_mn_tcpdump_buffers]
+ * [init_mn_tcpdump]
  * 
- * Initializes the buffers used for tcpdump.
+ * Registers /dev/mntrace.  The rings themselves come later.
  */
 
-int init_mn_tcpdump_buffers( void )
+int init_mn_tcpdump( void )
 {
-    if (tcpdump_holdbuf != NULL)
-	kfree(tcpdump_holdbuf);
-    if (tcpdump_storebuf != NULL)
-	kfree(tcpdump_storebuf);
-
-    tcpdump_holdbuf = (unsigned char *) vmalloc(TCPDUMP_BUF_SIZE);
-    if (!tcpdump_holdbuf)
-	return ENOMEM;
-    
-    tcpdump_storebuf = (unsigned char *) vmalloc(TCPDUMP_BUF_SIZE);
-    if (!tcpdump_storebuf)
-	return ENOMEM;
-    
-    tcpdump_dropcount = 0;
-    tcpdump_storebuf_len = 0;
-    tcpdump_holdbuf_len = 0;
-    
-    tcpdump_tick_counter = 0;
+    int err = misc_register(&mn_ring_dev);
+
+    if (err)
+	printk("init_mn_tcpdump: cannot register /dev/%s\n", MN_RING_DEV);
+    return err;
+}
+
+
+/*
+ * [uninit_mn_tcpdump]
+ *
+ * Unregisters /dev/mntrace and frees the rings.  No hop may be traced
+ * any more.
+ */
+
+void uninit_mn_tcpdump( void )
+{
+    misc_deregister(&mn_ring_dev);
+    mn_ring_free();
+}
+
+
+/*
+ * [mn_hop_set_trace]
+ *
+ * @hop: the hop
+ * @on: trace it or not
+ *
+ * Turns tracing of a hop on or off, keeping mn_trace_key counting the
+ * traced hops, and creates the capture rings the first time a hop is
+ * traced.  May sleep; hops must be untraced before they are freed.
+ */
+
+void mn_hop_set_trace(struct hop *hop, int on)
+{
+    mutex_lock(&mn_trace_mutex);
+    on = !!on;
+    if (on != hop->traceLink) {
+	if (on && !mn_rings_ready)
+	    mn_ring_alloc();
+	hop->traceLink = on;
+	if (on) {
+	    static_key_slow_inc(&mn_trace_key);
+	    ++traceLinkCount;
+	    printk("Tracing link %d\n", hop->id);
+	} else {
+	    static_key_slow_dec(&mn_trace_key);
+	    --traceLinkCount;
+	}
+    }
+    mutex_unlock(&mn_trace_mutex);
+}
+
+
+/*
+ * [proc_hoptrace]
+ *
+ * @table: the sysctl table, extra1 is the namespace
+ * @write:
+ * @buffer:
+ * @lenp:
+ * @ppos:
+ *
+ * handler for writes to /proc/sys/modelnet/hoptrace: one or more
+ * struct sysctl_hoptrace records switching tracing of a hop on or
+ * off on a running emulator.
+ */
+
+int proc_hoptrace(ctl_table *table, int write,
+		  void __user *buffer, size_t *lenp, loff_t *ppos)
+{
+    struct mn_net *mnet = table->extra1;
+    struct sysctl_hoptrace rec;
+    size_t done;
+
+    if (!write) {
+	printk("proc_hoptrace: should be write-only\n");
+	*lenp = 0;
+	return -EINVAL;
+    }
+    if (*lenp % sizeof(rec))
+	return -EINVAL;
+
+    for (done = 0; done < *lenp; done += sizeof(rec)) {
+	if (copy_from_user(&rec, buffer + done, sizeof(rec)))
+	    return -EFAULT;
+	if (!mnet->model.hoptable || rec.hopidx < 0 ||
+	    rec.hopidx >= mnet->model.hopcount) {
+	    printk("proc_hoptrace: no hop %d\n", rec.hopidx);
+	    return -EINVAL;
+	}
+	mn_hop_set_trace(mnet->model.hoptable + rec.hopidx, rec.trace);
+    }
+    *ppos += *lenp;
+    return 0;
+}
+
+
+/*
+ * [proc_hopcapture]
+ *
+ * @table: the sysctl table, extra1 is the namespace
+ * @write:
+ * @buffer:
+ * @lenp:
+ * @ppos:
+ *
+ * handler for writes to /proc/sys/modelnet/hopcapture: one or more
+ * struct sysctl_hopcapture records choosing which packets of a hop
+ * are captured and how much of each.  An all-zero record (but for
+ * hopidx) captures everything again.
+ */
+
+int proc_hopcapture(ctl_table *table, int write,
+		    void __user *buffer, size_t *lenp, loff_t *ppos)
+{
+    struct mn_net *mnet = table->extra1;
+    struct sysctl_hopcapture rec;
+    struct mn_capture cap;
+    struct hop *hop;
+    size_t done;
+
+    if (!write) {
+	printk("proc_hopcapture: should be write-only\n");
+	*lenp = 0;
+	return -EINVAL;
+    }
+    if (*lenp % sizeof(rec))
+	return -EINVAL;
+
+    for (done = 0; done < *lenp; done += sizeof(rec)) {
+	if (copy_from_user(&rec, buffer + done, sizeof(rec)))
+	    return -EFAULT;
+	if (!mnet->model.hoptable || rec.hopidx < 0 ||
+	    rec.hopidx >= mnet->model.hopcount) {
+	    printk("proc_hopcapture: no hop %d\n", rec.hopidx);
+	    return -EINVAL;
+	}
+	if (rec.proto < 0 || rec.proto > 255 ||
+	    rec.sample < 0 || rec.snaplen < 0)
+	    return -EINVAL;
+
+	memset(&cap, 0, sizeof(cap));
+	cap.srcmask = rec.srcmask;
+	cap.src = rec.src & rec.srcmask;
+	cap.dstmask = rec.dstmask;
+	cap.dst = rec.dst & rec.dstmask;
+	cap.sport = rec.sport;
+	cap.dport = rec.dport;
+	cap.proto = rec.proto;
+	cap.sample = rec.sample;
+	cap.snaplen = rec.snaplen;
+
+	hop = mnet->model.hoptable + rec.hopidx;
+	spin_lock_bh(&hop->lock);
+	hop->capture = cap;
+	spin_unlock_bh(&hop->lock);
+    }
+    *ppos += *lenp;
     return 0;
 }
 
 
+/*
+ * [mn_capture_match]
+ *
+ * Does the hop's filter keep this packet, and is it the one in
+ * cap->sample that gets sampled?  Called with the hop locked.
+ */
+
+static int mn_capture_match(struct mn_capture *cap, struct sk_buff *skb)
+{
+    struct iphdr *iph = ip_hdr(skb);
+
+    if ((MODEL_FORCEOFF(iph->saddr) & cap->srcmask) != cap->src ||
+	(MODEL_FORCEOFF(iph->daddr) & cap->dstmask) != cap->dst)
+	return 0;
+    if (cap->proto && iph->protocol != cap->proto)
+	return 0;
+    if (cap->sport || cap->dport) {
+	__be16 _ports[2], *ports;
+
+	if ((iph->protocol != IPPROTO_TCP && iph->protocol != IPPROTO_UDP) ||
+	    (iph->frag_off & htons(IP_OFFSET)))
+	    return 0;
+	ports = skb_header_pointer(skb, skb_network_offset(skb) + iph->ihl * 4,
+				   sizeof(_ports), _ports);
+	if (!ports ||
+	    (cap->sport && ports[0] != cap->sport) ||
+	    (cap->dport && ports[1] != cap->dport))
+	    return 0;
+    }
+
+    /* 1-in-N, counted down so the hot path has no division */
+    if (cap->sample > 1) {
+	if (cap->skip) {
+	    --cap->skip;
+	    return 0;
+	}
+	cap->skip = cap->sample - 1;
+    }
+    return 1;
+}
+
+
 /*
  * [handle_tcpdump]
  *
@@ -254,87 +508,111 @@ int init_mn_tcpdump_buffers( void )
  * @willdrop_plr: whether or not the packet will be dropped due to plr
  * @willdrop_bw: wtherh or not the pkt will be dropped due to bandwidth
  * 
- * Handles when we need to dump a link.  This is only called from
- * emulate_hop, but for readability purposes I put it in here (this
- * the inline-ness).  Returns 0 on success
+ * Appends the packet to this cpu's ring if the hop's capture filter
+ * and sampling keep it.  Only called from emulate_hop, with the hop
+ * locked and bottom halves off, so nothing else writes the ring
+ * meanwhile.  Returns 0 on success, ENOBUFS when the ring is full.
  *
  */
 
-inline int handle_tcpdump(struct packet *pkt, struct hop *hop, 
-			  int willdrop_plr, int willdrop_bw)
+int handle_tcpdump(struct packet *pkt, struct hop *hop, 
+		   int willdrop_plr, int willdrop_bw)
 {
-    unsigned int packetLen;
-    struct mn_tcpdump_hdr *mn_hdr;
+    struct mn_ring *ring;
+    struct mn_tcpdump_hdr *rec;
     struct iphdr *iph;
+    unsigned char *data;
+    unsigned int packetLen, caplen, snaplen, need, off, pad = 0;
+    u64 head, tail;
 
     if (!hop->traceLink) {
 	return 0;
     }
 
-    /* Not done this case - multi-core */
-    if (pkt->skb == NULL) {
-	printk("skb is NULL\n");
+    /* a digest, its payload is cached at home, see mn_remote.c */
+    if (pkt->skb == NULL)
+	return 0;
+
+    ring = &per_cpu(mn_ring, smp_processor_id());
+    if (!ring->hdr || !mn_capture_match(&hop->capture, pkt->skb))
 	return 0;
-    }    
 
     packetLen = pkt->skb->len;
-    if ( (tcpdump_storebuf_len + packetLen + 
-	  sizeof(struct mn_tcpdump_hdr)) >= TCPDUMP_BUF_SIZE) 
-    {
-	if (tcpdump_holdbuf_len == 0) {
-	    tcpdump_tick_counter = 0;
-	    ROTATE_TCPDUMP_BUFFERS();
-	    wake_up(&tcpdump_wait_queue);
-	} else {
-	    ++tcpdump_dropcount;
-	    return 0;
-	}
+    caplen = packetLen;
+    snaplen = hop->capture.snaplen ? hop->capture.snaplen :
+	tcpdump_capturelength;
+    if (snaplen && snaplen < caplen)
+	caplen = snaplen;
+    need = MN_REC_LEN(caplen);
+    if (need > mn_ring_size / 2)
+	goto drop;
+
+    /*
+     * Read tail before we write over what the collector gave back.  A
+     * tail behind head by more than the ring, or ahead of it, is bogus:
+     * trust none of the ring until the collector puts it right.
+     */
+    head = ring->head;
+    tail = ACCESS_ONCE(ring->hdr->tail);
+    smp_mb();
+    if (head - tail > mn_ring_size)
+	goto drop;
+
+    off = head & (mn_ring_size - 1);
+    if (off + need > mn_ring_size)
+	pad = mn_ring_size - off;
+    if (head + pad + need - tail > mn_ring_size)
+	goto drop;
+
+    data = (unsigned char *)ring->hdr + PAGE_SIZE;
+    if (pad) {
+	rec = (struct mn_tcpdump_hdr *)(data + off);
+	rec->reclen = pad;
+	rec->type = MN_REC_PAD;
+	head += pad;
+	off = 0;
     }
 
-    /* Copy in the modelnet header */
-    memset( tcpdump_storebuf + tcpdump_storebuf_len, 0, 
-	    sizeof(struct mn_tcpdump_hdr));
-
-    mn_hdr = (struct mn_tcpdump_hdr *) (tcpdump_storebuf + 
-					tcpdump_storebuf_len);
-    /* XXX get micro time */
-    /* getmicrotime(&(mn_hdr.tv)); */
-    do_gettimeofday(&(mn_hdr->tv));
-    /* memcpy(&(mn_hdr->tv), &pkt->skb->stamp, sizeof(struct timeval)); */
-    mn_hdr->linkId = hop->id;
-    mn_hdr->packetLength = packetLen;
-    
-    if (tcpdump_capturelength == 0)
-	mn_hdr->captureLength = packetLen;
-    else
-	mn_hdr->captureLength = min(packetLen, 
-				    tcpdump_capturelength);
-    tcpdump_storebuf_len += sizeof(struct mn_tcpdump_hdr);
-    
-    
+    rec = (struct mn_tcpdump_hdr *)(data + off);
+    rec->reclen = need;
+    rec->type = MN_REC_PKT;
+    rec->flags = willdrop_plr ? MN_REC_PLRDROP :
+	willdrop_bw ? MN_REC_QDROP : 0;
+    rec->tstamp = ktime_to_ns(ktime_get_real());
+    rec->linkId = hop->id;
+    rec->packetLength = packetLen;
+    rec->captureLength = caplen;
+    rec->pad = 0;
+
     /* Copy in the actual packet data (starting at IP) */
-    if (memcpy(tcpdump_storebuf + tcpdump_storebuf_len,
-	       (unsigned char *)ip_hdr(pkt->skb),
-	       mn_hdr->captureLength) == NULL)
+    if (skb_copy_bits(pkt->skb, skb_network_offset(pkt->skb), rec + 1, caplen))
     {
 	printk ("Error with mn_tcpdump copy\n");
 	return ENOBUFS;
     }
-    iph = (struct iphdr *) (tcpdump_storebuf + tcpdump_storebuf_len);
-    tcpdump_storebuf_len += mn_hdr->captureLength;
-    
-    /* Modelnet fixes - requested by Chip */
-    iph->saddr = iph->saddr & 0xFFFF7FFF;
-    iph->daddr = iph->daddr & 0xFFFF7FFF;
-    
-    if (willdrop_plr)
-	iph->tos = 1;
-    else if(willdrop_bw)
-	iph->tos = 2;
-    else
-	iph->tos = 0;
-    
+
+    if (caplen >= sizeof(*iph)) {
+	iph = (struct iphdr *)(rec + 1);
+
+	/* Modelnet fixes - requested by Chip */
+	iph->saddr = MODEL_FORCEOFF(iph->saddr);
+	iph->daddr = MODEL_FORCEOFF(iph->daddr);
+
+	if (willdrop_plr)
+	    iph->tos = 1;
+	else if(willdrop_bw)
+	    iph->tos = 2;
+	else
+	    iph->tos = 0;
+    }
+
+    /* publish the record */
+    ring->head = head + need;
+    smp_wmb();
+    ring->hdr->head = ring->head;
     return 0;	 
-}
 
-#endif
+ drop:
+    ring->hdr->drops = ++ring->drops;
+    return ENOBUFS;
+}
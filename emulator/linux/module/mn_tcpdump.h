@@ -36,23 +36,32 @@
 #ifndef __MN_TCPDUMP_H
 #define __MN_TCPDUMP_H
 
+#include <linux/jump_label.h>
 #include "ip_modelnet.h"
 
-#define TCPDUMP_BUF_SIZE 524288
-
 extern ctl_table mn_tcpdump_table[];
 extern int traceLinkCount;
-extern unsigned int tcpdump_tick_counter;
 
-/* extern unsigned char * tcpdump_holdbuf; */
-/* extern unsigned char * tcpdump_storebuf; */
-/* extern unsigned int tcpdump_holdbuf_len; */
-/* extern unsigned int tcpdump_storebuf_len; */
-/* extern int tcpdump_dropcount; */
-/* extern int tcpdump_capturelength; */
+/* true while any hop in any namespace is traced */
+extern struct static_key mn_trace_key;
 
-extern int init_mn_tcpdump_buffers( void );
+extern int init_mn_tcpdump( void );
+extern void uninit_mn_tcpdump( void );
 extern int handle_tcpdump(struct packet *pkt, struct hop *hop,
 				 int willdrop_plr, int willdrop_bw);
-extern void tcpdump_handle_inactivity( void );
+extern void mn_trace_tick( void );
+extern void mn_hop_set_trace(struct hop *hop, int on);
+extern int proc_hoptrace(ctl_table *table, int write,
+			 void __user *buffer, size_t *lenp, loff_t *ppos);
+extern int proc_hopcapture(ctl_table *table, int write,
+			   void __user *buffer, size_t *lenp, loff_t *ppos);
+
+/*
+ * Is this hop traced?  The static key patches the test out of
+ * emulate_hop() entirely while no hop is traced.
+ */
+static inline int mn_hop_traced(struct hop *hop)
+{
+    return static_key_false(&mn_trace_key) && hop->traceLink;
+}
 #endif
@@ -0,0 +1,169 @@
+/*
+ * modelnet  mn_trace.h
+ *
+ *     tracepoints for packets crossing emulated hops
+ *
+ * Copyright (c) 2006
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in
+ *      the documentation and/or other materials provided with the
+ *      distribution.
+ *    * Neither the names of Duke University nor The University of
+ *      California, San Diego, nor the names of the authors or contributors
+ *      may be used to endorse or promote products derived from
+ *      this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE
+ * USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+/*
+ * The events show up under /sys/kernel/debug/tracing/events/modelnet and
+ * cost nothing until they are enabled there.  To follow one hop, filter
+ * on its id:
+ *
+ *   echo 'hop == 12' > events/modelnet/filter
+ *   echo 1 > events/modelnet/enable
+ *
+ * ip_modelnet.c defines CREATE_TRACE_POINTS before including this file.
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM modelnet
+
+#if !defined(_MN_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _MN_TRACE_H
+
+#include <linux/tracepoint.h>
+#include "ip_modelnet.h"
+
+/* a packet at a hop, with the state of the hop's queue */
+DECLARE_EVENT_CLASS(mn_hop_class,
+
+    TP_PROTO(const struct hop *hop, const struct packet *pkt),
+
+    TP_ARGS(hop, pkt),
+
+    TP_STRUCT__entry(
+	__field(int,		hop)
+	__field(unsigned int,	len)
+	__field(int,		slotdepth)
+	__field(int,		bytedepth)
+	__field(int,		qsize)
+    ),
+
+    TP_fast_assign(
+	__entry->hop = hop->id;
+	__entry->len = pkt->info.len;
+	__entry->slotdepth = hop->slotdepth;
+	__entry->bytedepth = hop->bytedepth;
+	__entry->qsize = hop->qsize;
+    ),
+
+    TP_printk("hop=%d len=%u slots=%d/%d bytes=%d",
+	      __entry->hop, __entry->len, __entry->slotdepth,
+	      __entry->qsize, __entry->bytedepth)
+);
+
+/* dropped by the hop's loss rate */
+DEFINE_EVENT(mn_hop_class, mn_hop_plr_drop,
+    TP_PROTO(const struct hop *hop, const struct packet *pkt),
+    TP_ARGS(hop, pkt)
+);
+
+/* dropped because the hop's queue was full */
+DEFINE_EVENT(mn_hop_class, mn_hop_queue_drop,
+    TP_PROTO(const struct hop *hop, const struct packet *pkt),
+    TP_ARGS(hop, pkt)
+);
+
+/* done with the hop's bandwidth and delay, taken off the calendar */
+DEFINE_EVENT(mn_hop_class, mn_hop_depart,
+    TP_PROTO(const struct hop *hop, const struct packet *pkt),
+    TP_ARGS(hop, pkt)
+);
+
+/* queued at a hop; exits the bw queue at exittick, the hop at due */
+TRACE_EVENT(mn_hop_enqueue,
+
+    TP_PROTO(const struct hop *hop, const struct packet *pkt,
+	     unsigned long now, unsigned long exittick, unsigned long due),
+
+    TP_ARGS(hop, pkt, now, exittick, due),
+
+    TP_STRUCT__entry(
+	__field(int,		hop)
+	__field(unsigned int,	len)
+	__field(int,		slotdepth)
+	__field(int,		bytedepth)
+	__field(unsigned long,	now)
+	__field(unsigned long,	exittick)
+	__field(unsigned long,	due)
+    ),
+
+    TP_fast_assign(
+	__entry->hop = hop->id;
+	__entry->len = pkt->info.len;
+	__entry->slotdepth = hop->slotdepth;
+	__entry->bytedepth = hop->bytedepth;
+	__entry->now = now;
+	__entry->exittick = exittick;
+	__entry->due = due;
+    ),
+
+    TP_printk("hop=%d len=%u slots=%d bytes=%d tick=%lu exit=%lu due=%lu",
+	      __entry->hop, __entry->len, __entry->slotdepth,
+	      __entry->bytedepth, __entry->now, __entry->exittick,
+	      __entry->due)
+);
+
+/* all hops emulated, handed back to IP */
+TRACE_EVENT(mn_forward,
+
+    TP_PROTO(const struct packet *pkt),
+
+    TP_ARGS(pkt),
+
+    TP_STRUCT__entry(
+	__field(u32,		saddr)
+	__field(u32,		daddr)
+	__field(unsigned int,	len)
+	__field(unsigned int,	hops)
+    ),
+
+    TP_fast_assign(
+	__entry->saddr = ntohl(pkt->info.src);
+	__entry->daddr = ntohl(pkt->info.dst);
+	__entry->len = pkt->info.len;
+	__entry->hops = pkt->info.hop;
+    ),
+
+    TP_printk("%u.%u.%u.%u -> %u.%u.%u.%u len=%u hops=%u",
+	      IP_ADDR_QUAD_H(__entry->saddr), IP_ADDR_QUAD_H(__entry->daddr),
+	      __entry->len, __entry->hops)
+);
+
+#endif /* _MN_TRACE_H */
+
+/* this part must be outside the include guard */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE mn_trace
+#include <trace/define_trace.h>